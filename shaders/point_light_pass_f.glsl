@@ -1,7 +1,8 @@
-uniform samplerCubeShadow cubemap;
+uniform samplerCubeArrayShadow cubemap;
 uniform float inv_max_light_dst;
-uniform vec3 light_pos;
-uniform vec3 light_color;
+uniform vec3 light_pos[ BATCH_SIZE ];
+uniform vec3 light_color[ BATCH_SIZE ];
+uniform int light_count;
 
 in vec3 f_pos;
 in vec3 f_normal;
@@ -10,15 +11,26 @@ out vec4 color;
 
 void main()
 {
-	vec3 vec_to_light= light_pos - f_pos;
-	float vec_to_light_len = length(vec_to_light);
-	vec3 normalized_vec_to_light= vec_to_light / vec_to_light_len;
+	vec3 normal= normalize(f_normal);
 
-	float angle_scaler= max( 0.0, dot( normalized_vec_to_light, normalize(f_normal) ) );
+	vec3 light= vec3( 0.0, 0.0, 0.0 );
+	for( int i= 0; i < light_count; i++ )
+	{
+		vec3 vec_to_light= light_pos[i] - f_pos;
+		float vec_to_light_len = length(vec_to_light);
+		vec3 normalized_vec_to_light= vec_to_light / vec_to_light_len;
 
-	float shadow_factor= texture( cubemap, vec4( normalized_vec_to_light, (vec_to_light_len-0.1)*inv_max_light_dst ) );
-	
-	color= vec4(
-		light_color * ( (shadow_factor * angle_scaler) / (vec_to_light_len * vec_to_light_len) ),
-		1.0 );
+		float angle_scaler= max( 0.0, dot( normalized_vec_to_light, normal ) );
+
+		float shadow_factor=
+			texture(
+				cubemap,
+				vec4( normalized_vec_to_light, float(i) ),
+				(vec_to_light_len-0.1)*inv_max_light_dst );
+
+		light+= light_color[i] * ( (shadow_factor * angle_scaler) / (vec_to_light_len * vec_to_light_len) );
+	}
+
+	// Alpha is same, as for separate pass for each light.
+	color= vec4( light, float(light_count) );
 }
@@ -1,8 +1,9 @@
 layout( triangles, invocations= 6 ) in;
-layout( triangle_strip, max_vertices = 3 ) out;
+layout( triangle_strip, max_vertices = 3 * BATCH_SIZE ) out;
 
-uniform mat4 view_matrices[6];
-uniform int cubemap_side_count= 6;
+// Six matrices for each light of batch.
+uniform mat4 view_matrices[ 6 * BATCH_SIZE ];
+uniform int light_count;
 
 in vec3 g_pos[];
 in vec3 g_lightmap_coord[];
@@ -16,26 +17,18 @@ out float f_texture_array;
 
 void main()
 {
-	int i= gl_InvocationID;
-
-	gl_Layer= i;
-	gl_Position= f_pos= view_matrices[i] * gl_in[0].gl_Position;
-	f_lightmap_coord= g_lightmap_coord[0];
-	f_tex_coord= g_tex_coord[0];
-	f_texture_array= g_texture_array[0];
-	EmitVertex();
-
-	gl_Position= f_pos= view_matrices[i] * gl_in[1].gl_Position;
-	f_lightmap_coord= g_lightmap_coord[1];
-	f_tex_coord= g_tex_coord[1];
-	f_texture_array= g_texture_array[1];
-	EmitVertex();
-
-	gl_Position= f_pos= view_matrices[i] * gl_in[2].gl_Position;
-	f_lightmap_coord= g_lightmap_coord[2];
-	f_tex_coord= g_tex_coord[2];
-	f_texture_array= g_texture_array[2];
-	EmitVertex();
-
-	EndPrimitive();
+	for( int light= 0; light < light_count; light++ )
+	{
+		int layer= light * 6 + gl_InvocationID;
+		for( int v= 0; v < 3; v++ )
+		{
+			gl_Layer= layer;
+			gl_Position= f_pos= view_matrices[layer] * gl_in[v].gl_Position;
+			f_lightmap_coord= g_lightmap_coord[v];
+			f_tex_coord= g_tex_coord[v];
+			f_texture_array= g_texture_array[v];
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
 }
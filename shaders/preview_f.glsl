@@ -1,7 +1,7 @@
 uniform sampler2DArray lightmap;
 uniform sampler2DArray secondary_lightmap;
 uniform sampler2DArray lightmap_test;
-uniform samplerCubeShadow cubemap;
+uniform samplerCubeArrayShadow cubemap;
 
 uniform float brightness;
 uniform float primary_lightmap_scaler;
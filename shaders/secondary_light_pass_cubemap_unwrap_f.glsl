@@ -1,13 +1,14 @@
-uniform samplerCube cubemap;
+uniform samplerCubeArray cubemap;
 uniform samplerCube cubemap_multiplier;
 
 in vec3 f_coord; // Cubemap vector
+flat in int f_cube;
 
 out vec4 color;
 
 void main()
 {
 	color=
-		texture( cubemap, -f_coord ) *
+		texture( cubemap, vec4( -f_coord, float(f_cube) ) ) *
 		texture( cubemap_multiplier, f_coord ).xxxx;
 }
@@ -0,0 +1,26 @@
+layout( triangles ) in;
+layout( triangle_strip, max_vertices = 3 * BATCH_SIZE ) out;
+
+uniform int cube_count;
+
+in vec3 g_coord[];
+
+out vec3 f_coord;
+flat out int f_cube;
+
+void main()
+{
+	// Unwrap each hemicube of batch into separate layer.
+	for( int cube= 0; cube < cube_count; cube++ )
+	{
+		for( int v= 0; v < 3; v++ )
+		{
+			gl_Layer= cube;
+			gl_Position= gl_in[v].gl_Position;
+			f_coord= g_coord[v];
+			f_cube= cube;
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
+}
@@ -1,7 +1,10 @@
 layout( triangles, invocations= 6 ) in;
-layout( triangle_strip, max_vertices = 3 ) out;
+layout( triangle_strip, max_vertices = 3 * BATCH_SIZE ) out;
 
-uniform mat4 view_matrices[6];
+// Six matrices for each hemicube of batch.
+uniform mat4 view_matrices[ 6 * BATCH_SIZE ];
+uniform vec4 clip_planes[ BATCH_SIZE ];
+uniform int cube_count;
 
 in vec3 g_tex_coord[];
 in float g_texture_array[];
@@ -13,29 +16,27 @@ out vec3 f_lightmap_coord;
 
 void main()
 {
-	int i= gl_InvocationID;
-	gl_Layer= i;
-
-	gl_Position= view_matrices[i] * gl_in[0].gl_Position;
-	gl_ClipDistance[0]= gl_in[0].gl_ClipDistance[0];
-	f_tex_coord= g_tex_coord[0];
-	f_texture_array= g_texture_array[0];
-	f_lightmap_coord= g_lightmap_coord[0];
-	EmitVertex();
-
-	gl_Position= view_matrices[i] * gl_in[1].gl_Position;
-	gl_ClipDistance[0]= gl_in[1].gl_ClipDistance[0];
-	f_tex_coord= g_tex_coord[1];
-	f_texture_array= g_texture_array[1];
-	f_lightmap_coord= g_lightmap_coord[1];
-	EmitVertex();
-
-	gl_Position= view_matrices[i] * gl_in[2].gl_Position;
-	gl_ClipDistance[0]= gl_in[2].gl_ClipDistance[0];
-	f_tex_coord= g_tex_coord[2];
-	f_texture_array= g_texture_array[2];
-	f_lightmap_coord= g_lightmap_coord[2];
-	EmitVertex();
-
-	EndPrimitive();
+	for( int cube= 0; cube < cube_count; cube++ )
+	{
+		float clip_distances[3];
+		for( int v= 0; v < 3; v++ )
+			clip_distances[v]= dot( gl_in[v].gl_Position, clip_planes[cube] );
+
+		// Triangle is completely behind hemicube base.
+		if( clip_distances[0] < 0.0 && clip_distances[1] < 0.0 && clip_distances[2] < 0.0 )
+			continue;
+
+		int layer= cube * 6 + gl_InvocationID;
+		for( int v= 0; v < 3; v++ )
+		{
+			gl_Layer= layer;
+			gl_Position= view_matrices[layer] * gl_in[v].gl_Position;
+			gl_ClipDistance[0]= clip_distances[v];
+			f_tex_coord= g_tex_coord[v];
+			f_texture_array= g_texture_array[v];
+			f_lightmap_coord= g_lightmap_coord[v];
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
 }
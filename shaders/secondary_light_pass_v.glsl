@@ -1,4 +1,5 @@
-uniform vec4 clip_plane;
+// Scale of lightmap coordinates for sampling of secondary lightmaps.
+uniform vec2 lightmap_coord_scale;
 
 in vec3 pos;
 in vec2 tex_coord;
@@ -17,9 +18,8 @@ void main()
 	g_tex_coord= vec3( tex_coord, float(tex_maps.y) + eps );
 	g_texture_array= float(tex_maps.x) + eps;
 
-	g_lightmap_coord= vec3( lightmap_coord, float(tex_maps.z) + eps );
+	g_lightmap_coord= vec3( lightmap_coord * lightmap_coord_scale, float(tex_maps.z) + eps );
 
-	vec4 pos4= vec4( pos, 1.0 );
-	gl_ClipDistance[0]= dot(pos4, clip_plane );
-	gl_Position= pos4;
+	// Hemicubes clipping is performed in geometry shader.
+	gl_Position= vec4( pos, 1.0 );
 }
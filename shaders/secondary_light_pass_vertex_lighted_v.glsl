@@ -1,6 +1,5 @@
 uniform sampler2DArray lightmap;
-
-uniform vec4 clip_plane;
+uniform vec2 lightmap_coord_scale;
 
 in vec3 pos;
 in vec2 tex_coord;
@@ -19,10 +18,9 @@ void main()
 	g_tex_coord= vec3( tex_coord, float(tex_maps.y) + eps );
 	g_texture_array= float(tex_maps.x) + eps;
 
-	vec3 lightmap_coord_3d= vec3( lightmap_coord, float(tex_maps.z) + eps );
+	vec3 lightmap_coord_3d= vec3( lightmap_coord * lightmap_coord_scale, float(tex_maps.z) + eps );
 	g_light= texture( lightmap, lightmap_coord_3d ).xyz;
 
-	vec4 pos4= vec4( pos, 1.0 );
-	gl_ClipDistance[0]= dot(pos4, clip_plane );
-	gl_Position= pos4;
+	// Hemicubes clipping is performed in geometry shader.
+	gl_Position= vec4( pos, 1.0 );
 }
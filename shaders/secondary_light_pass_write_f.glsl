@@ -1,15 +1,17 @@
-uniform sampler2D tex;
+uniform sampler2DArray tex;
 uniform int mip;
 uniform float normalizer;
 
+flat in int f_cube;
+
 out vec4 color;
 
 void main()
 {
 	color=
 	(
-		texelFetch( tex, ivec2( 0, 0 ), mip ) + // z+
-		texelFetch( tex, ivec2( 1, 0 ), mip ) + // x+ and x-
-		texelFetch( tex, ivec2( 2, 0 ), mip )   // y+ and y-
+		texelFetch( tex, ivec3( 0, 0, f_cube ), mip ) + // z+
+		texelFetch( tex, ivec3( 1, 0, f_cube ), mip ) + // x+ and x-
+		texelFetch( tex, ivec3( 2, 0, f_cube ), mip )   // y+ and y-
 	) * normalizer / 3.0;
 }
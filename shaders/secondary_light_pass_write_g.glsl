@@ -1,14 +1,24 @@
 layout( points, invocations= 1 ) in;
-layout( points, max_vertices = 1 ) out;
+layout( triangle_strip, max_vertices = 4 ) out;
 
-in vec3 g_coord[];
+in vec4 g_rect[];
+in float g_layer[];
+flat in int g_cube[];
+
+flat out int f_cube;
 
 void main()
 {
-	gl_Layer= int(g_coord[0].z);
-
-	gl_Position= vec4( g_coord[0].xy, 1.0, 1.0 );
+	// Quad, covering block of texels.
+	vec4 rect= g_rect[0];
+	vec2 corners[4]= vec2[4]( rect.xy, rect.zy, rect.xw, rect.zw );
 
-	EmitVertex();
+	for( int i= 0; i < 4; i++ )
+	{
+		gl_Layer= int(g_layer[0]);
+		gl_Position= vec4( corners[i], 1.0, 1.0 );
+		f_cube= g_cube[0];
+		EmitVertex();
+	}
 	EndPrimitive();
 }
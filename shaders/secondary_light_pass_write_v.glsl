@@ -1,8 +1,19 @@
-uniform vec3 tex_coord;
+// Target texel for each hemicube of batch.
+uniform vec3 tex_coords[ BATCH_SIZE ];
+// Size of block of texels, written by each hemicube of batch.
+uniform vec2 blocks_sizes[ BATCH_SIZE ];
+uniform vec2 inv_tex_size;
 
-out vec3 g_coord;
+out vec4 g_rect;
+out float g_layer;
+flat out int g_cube;
 
 void main()
 {
-	g_coord= vec3( tex_coord.xy * 2.0 - vec2( 1.0, 1.0 ), tex_coord.z );
+	vec3 tex_coord= tex_coords[ gl_VertexID ];
+	vec2 rect_min= tex_coord.xy - 0.5 * inv_tex_size;
+	vec2 rect_max= rect_min + blocks_sizes[ gl_VertexID ] * inv_tex_size;
+	g_rect= vec4( rect_min, rect_max ) * 2.0 - vec4( 1.0, 1.0, 1.0, 1.0 );
+	g_layer= tex_coord.z;
+	g_cube= gl_VertexID;
 }
@@ -0,0 +1,428 @@
+#include <algorithm>
+#include <numeric>
+
+#include "atlas_packer.hpp"
+
+namespace
+{
+
+// Rows of rectangles, sorted by height. Each row height is height of first rectangle in it.
+class ShelfPacker final
+{
+public:
+	explicit ShelfPacker( const unsigned int* const layer_size )
+	{
+		layer_size_[0]= layer_size[0];
+		layer_size_[1]= layer_size[1];
+	}
+
+	void Place( const unsigned int* const size, plb_AtlasRect& out_rect )
+	{
+		// Rectangle does not fit even into empty layer. Place it into own layer, without opening of extra empty layer.
+		if( size[0] > layer_size_[0] || size[1] > layer_size_[1] )
+		{
+			if( row_x_ != 0u || row_y_ != 0u || row_height_ != 0u )
+				NextLayer();
+
+			out_rect.pos[0]= out_rect.pos[1]= 0u;
+			out_rect.layer= layer_;
+			out_rect.rotated= false;
+
+			NextLayer();
+			return;
+		}
+
+		if( row_x_ + size[0] > layer_size_[0] )
+		{
+			row_x_= 0u;
+			row_y_+= row_height_;
+			row_height_= 0u;
+		}
+		if( row_y_ + size[1] > layer_size_[1] )
+			NextLayer();
+
+		out_rect.pos[0]= row_x_;
+		out_rect.pos[1]= row_y_;
+		out_rect.layer= layer_;
+		out_rect.rotated= false;
+
+		row_x_+= size[0];
+		row_height_= std::max( row_height_, size[1] );
+	}
+
+private:
+	void NextLayer()
+	{
+		layer_++;
+		row_x_= row_y_= row_height_= 0u;
+	}
+
+private:
+	unsigned int layer_size_[2];
+	unsigned int layer_= 0u;
+	unsigned int row_x_= 0u;
+	unsigned int row_y_= 0u;
+	unsigned int row_height_= 0u;
+};
+
+// Bottom-left skyline packer. Each layer is described by upper contour of placed rectangles.
+class SkylinePacker final
+{
+public:
+	SkylinePacker( const unsigned int* const layer_size, const bool allow_rotation )
+		: allow_rotation_(allow_rotation)
+	{
+		layer_size_[0]= layer_size[0];
+		layer_size_[1]= layer_size[1];
+	}
+
+	void Place( const unsigned int* const size, plb_AtlasRect& out_rect )
+	{
+		// Place into first layer, where rectangle fits.
+		for( unsigned int layer= 0u; ; layer++ )
+		{
+			if( layer == layers_.size() )
+			{
+				layers_.emplace_back();
+				layers_.back().push_back( Segment{ 0u, 0u, layer_size_[0] } );
+			}
+
+			unsigned int best_top= ~0u, best_segment= 0u, best_y= 0u;
+			bool best_rotated= false;
+			for( unsigned int r= 0u; r < ( allow_rotation_ ? 2u : 1u ); r++ )
+			{
+				const unsigned int w= size[r], h= size[r ^ 1u];
+				for( unsigned int s= 0u; s < layers_[layer].size(); s++ )
+				{
+					unsigned int y;
+					if( !GetPlacementY( layers_[layer], s, w, h, y ) )
+						continue;
+
+					if( y + h < best_top )
+					{
+						best_top= y + h;
+						best_segment= s;
+						best_y= y;
+						best_rotated= r != 0u;
+					}
+				}
+			}
+
+			if( best_top == ~0u )
+			{
+				// Rectangle does not fit even into empty layer.
+				if( layers_[layer].size() == 1u && layers_[layer].front().y == 0u )
+				{
+					out_rect.pos[0]= out_rect.pos[1]= 0u;
+					out_rect.layer= layer;
+					out_rect.rotated= false;
+					layers_[layer].front().y= layer_size_[1];
+					return;
+				}
+				continue;
+			}
+
+			const unsigned int w= best_rotated ? size[1] : size[0];
+			Skyline& skyline= layers_[layer];
+			const unsigned int x= skyline[ best_segment ].x;
+
+			out_rect.pos[0]= x;
+			out_rect.pos[1]= best_y;
+			out_rect.layer= layer;
+			out_rect.rotated= best_rotated;
+
+			// Replace covered segments with new one.
+			Skyline new_skyline;
+			new_skyline.reserve( skyline.size() + 2u );
+			for( const Segment& segment : skyline )
+				if( segment.x < x )
+					new_skyline.push_back( Segment{ segment.x, segment.y, std::min( segment.width, x - segment.x ) } );
+
+			new_skyline.push_back( Segment{ x, best_top, w } );
+
+			for( const Segment& segment : skyline )
+			{
+				const unsigned int segment_end= segment.x + segment.width;
+				if( segment_end > x + w )
+				{
+					const unsigned int start= std::max( segment.x, x + w );
+					new_skyline.push_back( Segment{ start, segment.y, segment_end - start } );
+				}
+			}
+
+			// Merge neighbor segments with same height.
+			skyline.clear();
+			for( const Segment& segment : new_skyline )
+			{
+				if( !skyline.empty() && skyline.back().y == segment.y )
+					skyline.back().width+= segment.width;
+				else
+					skyline.push_back( segment );
+			}
+			return;
+		}
+	}
+
+private:
+	struct Segment
+	{
+		unsigned int x;
+		unsigned int y;
+		unsigned int width;
+	};
+
+	typedef std::vector<Segment> Skyline;
+
+private:
+	bool GetPlacementY(
+		const Skyline& skyline,
+		const unsigned int first_segment,
+		const unsigned int w, const unsigned int h,
+		unsigned int& out_y ) const
+	{
+		const unsigned int x= skyline[ first_segment ].x;
+		if( x + w > layer_size_[0] )
+			return false;
+
+		// Rectangle lies on highest segment under it.
+		out_y= 0u;
+		for( unsigned int s= first_segment; s < skyline.size() && skyline[s].x < x + w; s++ )
+			out_y= std::max( out_y, skyline[s].y );
+
+		return out_y + h <= layer_size_[1];
+	}
+
+private:
+	const bool allow_rotation_;
+	unsigned int layer_size_[2];
+	std::vector<Skyline> layers_;
+};
+
+// MaxRects packer with "best short side fit" heuristic.
+// Each layer contains list of maximal free rectangles.
+class MaxRectsPacker final
+{
+public:
+	MaxRectsPacker( const unsigned int* const layer_size, const bool allow_rotation )
+		: allow_rotation_(allow_rotation)
+	{
+		layer_size_[0]= layer_size[0];
+		layer_size_[1]= layer_size[1];
+	}
+
+	void Place( const unsigned int* const size, plb_AtlasRect& out_rect )
+	{
+		for( unsigned int layer= 0u; ; layer++ )
+		{
+			if( layer == layers_.size() )
+			{
+				layers_.emplace_back();
+				layers_.back().push_back( FreeRect{ { 0u, 0u }, { layer_size_[0], layer_size_[1] } } );
+			}
+
+			FreeRects& free_rects= layers_[layer];
+
+			unsigned int best_short_side= ~0u, best_long_side= ~0u;
+			unsigned int best_free_rect= 0u;
+			bool best_rotated= false;
+			for( unsigned int f= 0u; f < free_rects.size(); f++ )
+			for( unsigned int r= 0u; r < ( allow_rotation_ ? 2u : 1u ); r++ )
+			{
+				const unsigned int w= size[r], h= size[r ^ 1u];
+				const FreeRect& free_rect= free_rects[f];
+				if( w > free_rect.size[0] || h > free_rect.size[1] )
+					continue;
+
+				const unsigned int leftover_x= free_rect.size[0] - w;
+				const unsigned int leftover_y= free_rect.size[1] - h;
+				const unsigned int short_side= std::min( leftover_x, leftover_y );
+				const unsigned int long_side= std::max( leftover_x, leftover_y );
+				if( short_side < best_short_side || ( short_side == best_short_side && long_side < best_long_side ) )
+				{
+					best_short_side= short_side;
+					best_long_side= long_side;
+					best_free_rect= f;
+					best_rotated= r != 0u;
+				}
+			}
+
+			if( best_short_side == ~0u )
+			{
+				// Rectangle does not fit even into empty layer.
+				if( free_rects.size() == 1u &&
+					free_rects.front().size[0] == layer_size_[0] && free_rects.front().size[1] == layer_size_[1] )
+				{
+					out_rect.pos[0]= out_rect.pos[1]= 0u;
+					out_rect.layer= layer;
+					out_rect.rotated= false;
+					free_rects.clear();
+					return;
+				}
+				continue;
+			}
+
+			const FreeRect placed
+			{
+				{ free_rects[ best_free_rect ].pos[0], free_rects[ best_free_rect ].pos[1] },
+				{ best_rotated ? size[1] : size[0], best_rotated ? size[0] : size[1] },
+			};
+
+			out_rect.pos[0]= placed.pos[0];
+			out_rect.pos[1]= placed.pos[1];
+			out_rect.layer= layer;
+			out_rect.rotated= best_rotated;
+
+			SplitFreeRects( free_rects, placed );
+			return;
+		}
+	}
+
+private:
+	struct FreeRect
+	{
+		unsigned int pos[2];
+		unsigned int size[2];
+	};
+
+	typedef std::vector<FreeRect> FreeRects;
+
+private:
+	static void SplitFreeRects( FreeRects& free_rects, const FreeRect& placed )
+	{
+		FreeRects new_rects;
+		for( unsigned int f= 0u; f < free_rects.size(); )
+		{
+			const FreeRect free_rect= free_rects[f];
+			if( placed.pos[0] >= free_rect.pos[0] + free_rect.size[0] ||
+				placed.pos[0] + placed.size[0] <= free_rect.pos[0] ||
+				placed.pos[1] >= free_rect.pos[1] + free_rect.size[1] ||
+				placed.pos[1] + placed.size[1] <= free_rect.pos[1] )
+			{
+				f++;
+				continue;
+			}
+
+			// Split intersected free rectangle into up to 4 maximal rectangles around placed rectangle.
+			for( unsigned int j= 0u; j < 2u; j++ )
+			{
+				if( placed.pos[j] > free_rect.pos[j] )
+				{
+					FreeRect r= free_rect;
+					r.size[j]= placed.pos[j] - free_rect.pos[j];
+					new_rects.push_back(r);
+				}
+				if( placed.pos[j] + placed.size[j] < free_rect.pos[j] + free_rect.size[j] )
+				{
+					FreeRect r= free_rect;
+					r.pos[j]= placed.pos[j] + placed.size[j];
+					r.size[j]= free_rect.pos[j] + free_rect.size[j] - r.pos[j];
+					new_rects.push_back(r);
+				}
+			}
+
+			free_rects[f]= free_rects.back();
+			free_rects.pop_back();
+		}
+
+		// Remove new rectangles, contained inside other rectangles.
+		const auto contains=
+		[]( const FreeRect& a, const FreeRect& b ) -> bool
+		{
+			return
+				b.pos[0] >= a.pos[0] && b.pos[0] + b.size[0] <= a.pos[0] + a.size[0] &&
+				b.pos[1] >= a.pos[1] && b.pos[1] + b.size[1] <= a.pos[1] + a.size[1];
+		};
+
+		for( unsigned int i= 0u; i < new_rects.size(); i++ )
+		{
+			bool contained= false;
+			for( const FreeRect& free_rect : free_rects )
+				if( contains( free_rect, new_rects[i] ) )
+					contained= true;
+			for( unsigned int j= 0u; j < new_rects.size() && !contained; j++ )
+			{
+				// For equal rectangles keep first.
+				if( j != i && contains( new_rects[j], new_rects[i] ) &&
+					( !contains( new_rects[i], new_rects[j] ) || j < i ) )
+					contained= true;
+			}
+
+			if( !contained )
+				free_rects.push_back( new_rects[i] );
+		}
+	}
+
+private:
+	const bool allow_rotation_;
+	unsigned int layer_size_[2];
+	std::vector<FreeRects> layers_;
+};
+
+} // namespace
+
+unsigned int plbPackAtlasRects(
+	const plb_Config::LightmapsAtlasPacker packer,
+	const unsigned int* const layer_size,
+	const bool allow_rotation,
+	plb_AtlasRects& rects )
+{
+	// Place big rectangles first.
+	std::vector<unsigned int> order( rects.size() );
+	std::iota( order.begin(), order.end(), 0u );
+
+	if( packer == plb_Config::LightmapsAtlasPacker::Shelf )
+		std::stable_sort(
+			order.begin(), order.end(),
+			[&]( const unsigned int a, const unsigned int b )
+			{
+				return rects[a].size[1] > rects[b].size[1];
+			} );
+	else
+		std::stable_sort(
+			order.begin(), order.end(),
+			[&]( const unsigned int a, const unsigned int b )
+			{
+				const unsigned int max_a= std::max( rects[a].size[0], rects[a].size[1] );
+				const unsigned int max_b= std::max( rects[b].size[0], rects[b].size[1] );
+				if( max_a != max_b )
+					return max_a > max_b;
+				return std::min( rects[a].size[0], rects[a].size[1] ) > std::min( rects[b].size[0], rects[b].size[1] );
+			} );
+
+	ShelfPacker shelf_packer( layer_size );
+	SkylinePacker skyline_packer( layer_size, allow_rotation );
+	MaxRectsPacker max_rects_packer( layer_size, allow_rotation );
+
+	unsigned int layer_count= 1u;
+	for( const unsigned int index : order )
+	{
+		plb_AtlasRect& rect= rects[index];
+		switch( packer )
+		{
+		case plb_Config::LightmapsAtlasPacker::Shelf: shelf_packer.Place( rect.size, rect ); break;
+		case plb_Config::LightmapsAtlasPacker::Skyline: skyline_packer.Place( rect.size, rect ); break;
+		case plb_Config::LightmapsAtlasPacker::MaxRects: max_rects_packer.Place( rect.size, rect ); break;
+		};
+
+		layer_count= std::max( layer_count, rect.layer + 1u );
+	}
+
+	return layer_count;
+}
+
+std::vector<float> plbGetAtlasLayersOccupancy(
+	const unsigned int* const layer_size,
+	const unsigned int layer_count,
+	const plb_AtlasRects& rects )
+{
+	std::vector<float> occupancy( layer_count, 0.0f );
+	for( const plb_AtlasRect& rect : rects )
+		if( rect.layer < layer_count )
+			occupancy[ rect.layer ]+= float(rect.size[0]) * float(rect.size[1]);
+
+	const float inv_layer_area= 1.0f / ( float(layer_size[0]) * float(layer_size[1]) );
+	for( float& o : occupancy )
+		o= std::min( o * inv_layer_area, 1.0f );
+
+	return occupancy;
+}
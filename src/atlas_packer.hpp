@@ -0,0 +1,32 @@
+#pragma once
+#include <vector>
+
+#include "formats.hpp"
+
+// Rectangle for placement into layers of atlas.
+struct plb_AtlasRect
+{
+	unsigned int size[2]; // Input size.
+
+	// Result position, layer and orientation. Rotated rectangle has swapped sizes.
+	unsigned int pos[2];
+	unsigned int layer;
+	bool rotated;
+};
+
+typedef std::vector<plb_AtlasRect> plb_AtlasRects;
+
+// Places rectangles into layers with given size. Rectangles, bigger, than layer, are placed into own layers.
+// Rectangles may be rotated only if "allow_rotation" is true.
+// Returns number of layers.
+unsigned int plbPackAtlasRects(
+	plb_Config::LightmapsAtlasPacker packer,
+	const unsigned int* layer_size,
+	bool allow_rotation,
+	plb_AtlasRects& rects );
+
+// Returns part of area of each layer, covered by rectangles.
+std::vector<float> plbGetAtlasLayersOccupancy(
+	const unsigned int* layer_size,
+	unsigned int layer_count,
+	const plb_AtlasRects& rects );
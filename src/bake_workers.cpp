@@ -0,0 +1,244 @@
+#include <cstring>
+#include <iostream>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "bake_workers.hpp"
+
+plb_WorkerProcess::plb_WorkerProcess()
+{
+}
+
+plb_WorkerProcess::~plb_WorkerProcess()
+{
+	Finish();
+}
+
+#ifdef _WIN32
+
+bool plb_WorkerProcess::Start( const std::vector<std::string>& args )
+{
+	(void)args;
+	std::cout << "Worker processes are not supported on this platform" << std::endl;
+	return false;
+}
+
+bool plb_WorkerProcess::Finish()
+{
+	return false;
+}
+
+FILE* plbInitWorkerStreams()
+{
+	std::cout.rdbuf( std::cerr.rdbuf() );
+	return stdout;
+}
+
+#else
+
+bool plb_WorkerProcess::Start( const std::vector<std::string>& args )
+{
+	if( args.empty() || pid_ != -1 )
+		return false;
+
+	// Write into pipe of finished worker must return error, instead of termination of coordinator.
+	std::signal( SIGPIPE, SIG_IGN );
+
+	int input_pipe[2];
+	int output_pipe[2];
+	if( pipe( input_pipe ) != 0 )
+	{
+		std::cout << "Can not create pipe" << std::endl;
+		return false;
+	}
+	if( pipe( output_pipe ) != 0 )
+	{
+		std::cout << "Can not create pipe" << std::endl;
+		close( input_pipe[0] );
+		close( input_pipe[1] );
+		return false;
+	}
+
+	// Prepare arguments before fork, child process only calls exec.
+	std::vector<char*> argv;
+	for( const std::string& arg : args )
+		argv.push_back( const_cast<char*>( arg.c_str() ) );
+	argv.push_back( nullptr );
+
+	std::cout.flush();
+	std::fflush( stdout );
+
+	const pid_t pid= fork();
+	if( pid == 0 )
+	{
+		dup2( input_pipe[0], STDIN_FILENO );
+		dup2( output_pipe[1], STDOUT_FILENO );
+		close( input_pipe[0] );
+		close( input_pipe[1] );
+		close( output_pipe[0] );
+		close( output_pipe[1] );
+
+		execvp( argv[0], argv.data() );
+		_exit( 127 );
+	}
+
+	close( input_pipe[0] );
+	close( output_pipe[1] );
+
+	if( pid < 0 )
+	{
+		std::cout << "Can not start worker process" << std::endl;
+		close( input_pipe[1] );
+		close( output_pipe[0] );
+		return false;
+	}
+
+	pid_= pid;
+	input_= fdopen( input_pipe[1], "wb" );
+	output_= fdopen( output_pipe[0], "rb" );
+	return input_ != nullptr && output_ != nullptr;
+}
+
+bool plb_WorkerProcess::Finish()
+{
+	if( input_ != nullptr )
+	{
+		std::fclose( input_ );
+		input_= nullptr;
+	}
+	if( output_ != nullptr )
+	{
+		std::fclose( output_ );
+		output_= nullptr;
+	}
+
+	if( pid_ == -1 )
+		return false;
+
+	int status= 0;
+	const pid_t pid= waitpid( pid_, &status, 0 );
+	pid_= -1;
+
+	return pid != -1 && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+FILE* plbInitWorkerStreams()
+{
+	std::cout.flush();
+	std::fflush( stdout );
+
+	// Standard output is pipe to coordinator. Move it to other descriptor and replace with standard error,
+	// so, text output can not corrupt messages.
+	const int output_fd= dup( STDOUT_FILENO );
+	if( output_fd == -1 )
+	{
+		std::cerr << "Can not duplicate worker output" << std::endl;
+		return nullptr;
+	}
+	if( dup2( STDERR_FILENO, STDOUT_FILENO ) == -1 )
+	{
+		std::cerr << "Can not redirect worker output" << std::endl;
+		close( output_fd );
+		return nullptr;
+	}
+
+	FILE* const output= fdopen( output_fd, "wb" );
+	if( output == nullptr )
+	{
+		std::cerr << "Can not open worker output" << std::endl;
+		close( output_fd );
+	}
+	return output;
+}
+
+#endif
+
+static bool WriteMessage( FILE* const f, const plb_WorkerMessageType type, const void* const data, const uint32_t size, const size_t item_size )
+{
+	plb_WorkerMessageHeader header;
+	std::memset( &header, 0, sizeof(header) );
+	std::strncpy( header.id, PLB_WORKER_MESSAGE_ID, sizeof(header.id) );
+	header.type= type;
+	header.size= size;
+
+	const size_t data_size= size * item_size;
+	const bool ok=
+		std::fwrite( &header, 1, sizeof(header), f ) == sizeof(header) &&
+		( data_size == 0u || std::fwrite( data, 1, data_size, f ) == data_size ) &&
+		std::fflush( f ) == 0;
+
+	if( !ok )
+		std::cout << "Error, writing worker message" << std::endl;
+	return ok;
+}
+
+static bool ReadMessageHeader( FILE* const f, const plb_WorkerMessageType type, const uint32_t max_size, uint32_t& out_size )
+{
+	plb_WorkerMessageHeader header;
+	if( std::fread( &header, 1, sizeof(header), f ) != sizeof(header) )
+	{
+		std::cout << "Error, reading worker message" << std::endl;
+		return false;
+	}
+
+	if( std::strncmp( header.id, PLB_WORKER_MESSAGE_ID, sizeof(header.id) ) != 0 ||
+		header.type != type ||
+		header.size > max_size )
+	{
+		std::cout << "Invalid worker message" << std::endl;
+		return false;
+	}
+
+	out_size= header.size;
+	return true;
+}
+
+static bool ReadMessageData( FILE* const f, void* const data, const size_t data_size )
+{
+	if( data_size > 0u && std::fread( data, 1, data_size, f ) != data_size )
+	{
+		std::cout << "Error, reading worker message" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool plbWriteWorkerTexels( FILE* const f, const plb_WorkerMessageType type, const plb_WorkerTexels& texels )
+{
+	return WriteMessage( f, type, texels.data(), texels.size(), sizeof(plb_WorkerTexel) );
+}
+
+bool plbReadWorkerTexels( FILE* const f, const plb_WorkerMessageType type, const uint32_t max_texel_count, plb_WorkerTexels& out_texels )
+{
+	uint32_t size= 0u;
+	if( !ReadMessageHeader( f, type, max_texel_count, size ) )
+		return false;
+
+	out_texels.resize( size );
+	return ReadMessageData( f, out_texels.data(), size * sizeof(plb_WorkerTexel) );
+}
+
+bool plbWriteWorkerAtlas( FILE* const f, const std::vector<float>& atlas_data )
+{
+	return WriteMessage( f, plb_WorkerMessageType::PrimaryLightAtlas, atlas_data.data(), atlas_data.size(), sizeof(float) );
+}
+
+bool plbReadWorkerAtlas( FILE* const f, std::vector<float>& out_atlas_data )
+{
+	uint32_t size= 0u;
+	if( !ReadMessageHeader( f, plb_WorkerMessageType::PrimaryLightAtlas, out_atlas_data.size(), size ) )
+		return false;
+
+	if( size != out_atlas_data.size() )
+	{
+		std::cout << "Invalid worker message" << std::endl;
+		return false;
+	}
+
+	return ReadMessageData( f, out_atlas_data.data(), size * sizeof(float) );
+}
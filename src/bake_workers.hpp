@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Distributed build. Coordinator process starts worker processes of same program with same options.
+// Each worker loads level, calculates light for own shard of texels via CPU backend
+// and sends it to coordinator. Coordinator merges light of all shards into atlases.
+// Data is exchanged via pipes, connected to standard input and output of workers.
+//
+// Protocol:
+//   worker -> coordinator: PrimaryLightTexels - light of primary texels of shard, before dilation
+//   coordinator -> worker: PrimaryLightAtlas - whole primary atlas after dilation, source of secondary light
+//   worker -> coordinator: SecondaryLightTexels - light of secondary texels of shard
+// Each message is plb_WorkerMessageHeader and "size" items.
+
+#define PLB_WORKER_MESSAGE_ID "PLBWORKR"
+
+enum class plb_WorkerMessageType : uint32_t
+{
+	PrimaryLightTexels,
+	PrimaryLightAtlas, // Items are floats.
+	SecondaryLightTexels,
+};
+
+struct plb_WorkerMessageHeader
+{
+	char id[8];
+	plb_WorkerMessageType type;
+	uint32_t size;
+};
+
+struct plb_WorkerTexel
+{
+	uint32_t texel_index; // Index of texel in atlas.
+	float light[4];
+};
+
+typedef std::vector<plb_WorkerTexel> plb_WorkerTexels;
+
+// Worker process, started by coordinator.
+class plb_WorkerProcess final
+{
+public:
+	plb_WorkerProcess();
+	~plb_WorkerProcess();
+
+	plb_WorkerProcess( const plb_WorkerProcess& )= delete;
+	plb_WorkerProcess& operator=( const plb_WorkerProcess& )= delete;
+
+	// Starts program with given arguments (first argument is path to program).
+	// Standard input and output of process are connected to pipes. Returns false on error.
+	bool Start( const std::vector<std::string>& args );
+
+	// Pipe for writing into standard input of worker.
+	FILE* GetInput() const;
+	// Pipe for reading from standard output of worker.
+	FILE* GetOutput() const;
+
+	// Closes pipes and waits for exit of process. Returns true, if process exited successfully.
+	bool Finish();
+
+private:
+	int pid_= -1;
+	FILE* input_= nullptr;
+	FILE* output_= nullptr;
+};
+
+inline FILE* plb_WorkerProcess::GetInput() const
+{
+	return input_;
+}
+
+inline FILE* plb_WorkerProcess::GetOutput() const
+{
+	return output_;
+}
+
+// Prepares standard input and output of worker for binary messages.
+// Returns stream for messages to coordinator or null on error.
+// Any text output of worker (both C++ and C streams) is redirected into standard error stream.
+FILE* plbInitWorkerStreams();
+
+// Messages functions return false on error, unexpected message type or size.
+bool plbWriteWorkerTexels( FILE* f, plb_WorkerMessageType type, const plb_WorkerTexels& texels );
+bool plbReadWorkerTexels( FILE* f, plb_WorkerMessageType type, uint32_t max_texel_count, plb_WorkerTexels& out_texels );
+
+bool plbWriteWorkerAtlas( FILE* f, const std::vector<float>& atlas_data );
+// Size of atlas must be equal to size of out_atlas_data.
+bool plbReadWorkerAtlas( FILE* f, std::vector<float>& out_atlas_data );
@@ -0,0 +1,1152 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bbox.hpp>
+#include <vec.hpp>
+
+#include "atlas_packer.hpp"
+#include "cpu_lightmaps_builder.hpp"
+#include "curves.hpp"
+#include "formats.hpp"
+#include "lightmaps_denoiser.hpp"
+#include "lightmaps_dilation.hpp"
+#include "lightmaps_layout.hpp"
+#include "math_utils.hpp"
+#include "parallel_for.hpp"
+#include "rasterizer.hpp"
+#include "textures_manager.hpp"
+#include "tracer.hpp"
+
+#define VEC3_CPY(dst,src) (dst)[0]= (src)[0]; (dst)[1]= (src)[1]; (dst)[2]= (src)[2];
+
+// Benchmark of hot paths of lightmaps builder on procedurally generated levels.
+// Needs neither OpenGL context, nor game data, nor loader libraries.
+// Each stage is repeated several times, minimal and mean time are reported.
+// Results are printed as table and written into JSON file.
+
+// Parameters of generated level.
+struct SceneParams
+{
+	const char* name;
+	bool enclosed; // Closed room without sky, else - open terrain.
+	unsigned int terrain_cells; // Terrain cells per side. Each cell consists of two triangle polygons.
+	float cell_size;
+	float texel_size; // Size of primary lightmap texel in world units.
+	float height; // Height of walls for enclosed level.
+	unsigned int boxes;
+	unsigned int curves;
+	unsigned int models;
+	unsigned int point_lights;
+	unsigned int cone_lights;
+	unsigned int directional_lights;
+};
+
+static const SceneParams g_scenes[]=
+{
+	{ "room"        , true ,   8u,  64.0f,  4.0f, 256.0f,    4u,   2u,   2u,   4u,  1u, 0u },
+	{ "building"    , true ,  32u,  64.0f,  8.0f, 384.0f,   64u,  16u,  16u,  32u,  8u, 0u },
+	{ "outdoor"     , false,  64u, 128.0f, 16.0f,   0.0f,  256u,  48u,  32u,  64u, 16u, 1u },
+	{ "huge_outdoor", false, 160u, 128.0f, 16.0f,   0.0f, 2000u, 200u, 128u, 256u, 32u, 2u },
+};
+
+// Scene, used by default. Huge scene needs a lot of time and memory, so, it runs only if requested.
+static const unsigned int g_default_scenes_count= 3u;
+
+static const unsigned int g_material_count= 4u;
+static const unsigned int g_luminous_material= g_material_count - 1u;
+static const unsigned int g_textures_size= 64u;
+
+static const unsigned int g_tracer_queries= 1u << 17u;
+static const unsigned int g_denoise_iterations= 3u;
+
+struct Options
+{
+	std::vector<const SceneParams*> scenes;
+	const char* output_path= "lightmaps_benchmark.json";
+	unsigned int repeat= 3u;
+	unsigned int threads= 0u;
+	unsigned int secondary_rays= 64u;
+	uint32_t seed= 1u;
+};
+
+struct StageResult
+{
+	std::string scene;
+	std::string stage;
+	unsigned int iterations;
+	double min_ms;
+	double mean_ms;
+	uint64_t items;
+	const char* items_name;
+};
+
+struct SceneStats
+{
+	std::string scene;
+	unsigned int polygons;
+	unsigned int curves;
+	unsigned int model_triangles;
+	unsigned int lights;
+	unsigned int atlas_layers;
+	unsigned int primary_texels;
+	unsigned int secondary_texels;
+};
+
+// Simple xorshift generator - sequences must be same for all compilers and platforms.
+class Random final
+{
+public:
+	explicit Random( const uint32_t seed ) : state_( seed == 0u ? 1u : seed ) {}
+
+	// Returns value in range [0; 1).
+	float Next()
+	{
+		state_^= state_ << 13u;
+		state_^= state_ >> 17u;
+		state_^= state_ << 5u;
+		return float( state_ >> 8u ) / float( 1u << 24u );
+	}
+
+	float Range( const float min, const float max )
+	{
+		return min + ( max - min ) * Next();
+	}
+
+	unsigned int Index( const unsigned int count )
+	{
+		return std::min( static_cast<unsigned int>( Next() * float(count) ), count - 1u );
+	}
+
+private:
+	uint32_t state_;
+};
+
+// Prevents removal of results of benchmarked code.
+static uint64_t g_sink= 0u;
+
+static void FatalError( const char* const message )
+{
+	std::cout << message << std::endl;
+	exit(-1);
+}
+
+static void PrintUsage()
+{
+	std::cout << "Usage: lightmaps_builder_benchmark [options]" << std::endl;
+	std::cout << "  -scene <name>  - run benchmark for scene. May be repeated. \"all\" - run all scenes." << std::endl;
+	std::cout << "                   Scenes:";
+	for( const SceneParams& scene : g_scenes )
+		std::cout << " " << scene.name;
+	std::cout << ". Default - all scenes, except last." << std::endl;
+	std::cout << "  -out <file>    - JSON results file. Default - \"lightmaps_benchmark.json\"." << std::endl;
+	std::cout << "  -repeat <n>    - number of runs of each stage. Default - 3." << std::endl;
+	std::cout << "  -threads <n>   - threads of multithreaded stages. 0 - all hardware threads. Tracer queries are single-threaded." << std::endl;
+	std::cout << "  -rays <n>      - hemisphere rays per texel of secondary light pass. Default - 64." << std::endl;
+	std::cout << "  -seed <n>      - seed of levels generation." << std::endl;
+}
+
+static void ParseArguments( const int argc, const char* const* const argv, Options& options )
+{
+	#define EXPECT_ARG if( i == argc - 1 ) FatalError( "Expected argument value" );
+
+	for( int i= 1; i < argc; ++i )
+	{
+		const char* const val= i == argc - 1 ? "" : argv[i+1];
+		if( std::strcmp( argv[i], "-scene" ) == 0 )
+		{
+			EXPECT_ARG
+			if( std::strcmp( val, "all" ) == 0 )
+			{
+				for( const SceneParams& scene : g_scenes )
+					options.scenes.push_back( &scene );
+			}
+			else
+			{
+				const SceneParams* found_scene= nullptr;
+				for( const SceneParams& scene : g_scenes )
+					if( std::strcmp( val, scene.name ) == 0 )
+						found_scene= &scene;
+				if( found_scene == nullptr )
+					FatalError( "unknown scene" );
+				options.scenes.push_back( found_scene );
+			}
+		}
+		else if( std::strcmp( argv[i], "-out" ) == 0 )
+		{
+			EXPECT_ARG
+			options.output_path= val;
+		}
+		else if( std::strcmp( argv[i], "-repeat" ) == 0 )
+		{
+			EXPECT_ARG
+			options.repeat= std::max( 1, std::atoi( val ) );
+		}
+		else if( std::strcmp( argv[i], "-threads" ) == 0 )
+		{
+			EXPECT_ARG
+			options.threads= std::max( 0, std::atoi( val ) );
+		}
+		else if( std::strcmp( argv[i], "-rays" ) == 0 )
+		{
+			EXPECT_ARG
+			options.secondary_rays= std::max( 1, std::atoi( val ) );
+		}
+		else if( std::strcmp( argv[i], "-seed" ) == 0 )
+		{
+			EXPECT_ARG
+			options.seed= static_cast<uint32_t>( std::strtoul( val, nullptr, 10 ) );
+		}
+		else if( std::strcmp( argv[i], "-help" ) == 0 || std::strcmp( argv[i], "--help" ) == 0 )
+		{
+			PrintUsage();
+			exit(0);
+		}
+		else
+		{
+			PrintUsage();
+			FatalError( ( "unknown option: " + std::string( argv[i] ) ).c_str() );
+		}
+		i++;
+	}
+
+	#undef EXPECT_ARG
+
+	if( options.scenes.empty() )
+		for( unsigned int i= 0u; i < g_default_scenes_count; i++ )
+			options.scenes.push_back( &g_scenes[i] );
+}
+
+/*
+Level generation.
+*/
+
+static float GetTerrainHeight( const SceneParams& params, const float x, const float y )
+{
+	if( params.enclosed )
+		return 0.0f;
+
+	const float terrain_size= float(params.terrain_cells) * params.cell_size;
+	const float k= plb_Constants::two_pi / terrain_size;
+	return
+		params.cell_size * 2.0f * (
+			0.7f * std::sin( x * k * 3.0f ) * std::cos( y * k * 2.0f ) +
+			0.3f * std::sin( ( x + y ) * k * 7.0f ) );
+}
+
+static m_Vec3 GetRandomDirection( Random& random )
+{
+	const float z= random.Range( -1.0f, 1.0f );
+	const float phi= random.Range( 0.0f, plb_Constants::two_pi );
+	const float r= std::sqrt( std::max( 0.0f, 1.0f - z * z ) );
+	return m_Vec3( r * std::cos(phi), r * std::sin(phi), z );
+}
+
+// Adds convex polygon. Lightmap basis is built in plane of polygon, lightmap position is in corner of polygon projection.
+static void AddPolygon(
+	plb_LevelData& level_data,
+	const SceneParams& params,
+	const m_Vec3* const vertices,
+	const unsigned int vertex_count,
+	const unsigned int material_id )
+{
+	m_Vec3 normal= mVec3Cross( vertices[1] - vertices[0], vertices[2] - vertices[0] );
+	normal.Normalize();
+
+	// Axis of lightmap, which is most perpendicular to normal.
+	const m_Vec3 axis=
+		std::abs( normal.z ) > 0.7f
+			? m_Vec3( 1.0f, 0.0f, 0.0f )
+			: m_Vec3( 0.0f, 0.0f, 1.0f );
+	m_Vec3 u_dir= plbProjectVectorToPlane( axis, normal );
+	u_dir.Normalize();
+	const m_Vec3 v_dir= mVec3Cross( normal, u_dir );
+
+	float min_uv[2]= { plb_Constants::max_float, plb_Constants::max_float };
+	float max_uv[2]= { plb_Constants::min_float, plb_Constants::min_float };
+	for( unsigned int v= 0u; v < vertex_count; v++ )
+	{
+		const float uv[2]= { vertices[v] * u_dir, vertices[v] * v_dir };
+		for( unsigned int j= 0u; j < 2u; j++ )
+		{
+			min_uv[j]= std::min( min_uv[j], uv[j] );
+			max_uv[j]= std::max( max_uv[j], uv[j] );
+		}
+	}
+
+	plb_Polygon polygon;
+	std::memset( &polygon, 0, sizeof(plb_Polygon) );
+
+	const m_Vec3 basis[2]= { u_dir * params.texel_size, v_dir * params.texel_size };
+	VEC3_CPY( polygon.lightmap_basis[0], basis[0].ToArr() );
+	VEC3_CPY( polygon.lightmap_basis[1], basis[1].ToArr() );
+
+	const m_Vec3 lightmap_pos=
+		u_dir * min_uv[0] + v_dir * min_uv[1] +
+		normal * ( vertices[0] * normal );
+	VEC3_CPY( polygon.lightmap_pos, lightmap_pos.ToArr() );
+	VEC3_CPY( polygon.normal, normal.ToArr() );
+
+	polygon.material_id= material_id;
+	polygon.first_vertex_number= level_data.vertices.size();
+	polygon.vertex_count= vertex_count;
+	polygon.first_index= level_data.polygons_indeces.size();
+	polygon.index_count= ( vertex_count - 2u ) * 3u;
+
+	for( unsigned int v= 0u; v < vertex_count; v++ )
+	{
+		plb_Vertex vertex;
+		std::memset( &vertex, 0, sizeof(plb_Vertex) );
+		VEC3_CPY( vertex.pos, vertices[v].ToArr() );
+		vertex.tex_coord[0]= ( vertices[v] * u_dir ) / float(g_textures_size);
+		vertex.tex_coord[1]= ( vertices[v] * v_dir ) / float(g_textures_size);
+		level_data.vertices.push_back( vertex );
+	}
+	for( unsigned int v= 2u; v < vertex_count; v++ )
+	{
+		level_data.polygons_indeces.push_back( polygon.first_vertex_number );
+		level_data.polygons_indeces.push_back( polygon.first_vertex_number + v - 1u );
+		level_data.polygons_indeces.push_back( polygon.first_vertex_number + v );
+	}
+
+	level_data.polygons.push_back( polygon );
+}
+
+// Adds rectangle with given center and half-sizes. Normal is cross( u, v ).
+static void AddQuad(
+	plb_LevelData& level_data,
+	const SceneParams& params,
+	const m_Vec3& center, const m_Vec3& u, const m_Vec3& v,
+	const unsigned int material_id )
+{
+	const m_Vec3 vertices[4]=
+	{
+		center - u - v,
+		center + u - v,
+		center + u + v,
+		center - u + v,
+	};
+	AddPolygon( level_data, params, vertices, 4u, material_id );
+}
+
+static void GenTerrain( plb_LevelData& level_data, const SceneParams& params, Random& random )
+{
+	const unsigned int n= params.terrain_cells;
+	for( unsigned int y= 0u; y < n; y++ )
+	for( unsigned int x= 0u; x < n; x++ )
+	{
+		m_Vec3 corners[4];
+		for( unsigned int i= 0u; i < 4u; i++ )
+		{
+			const float cx= float( x + ( ( i == 1u || i == 2u ) ? 1u : 0u ) ) * params.cell_size;
+			const float cy= float( y + ( i >= 2u ? 1u : 0u ) ) * params.cell_size;
+			corners[i]= m_Vec3( cx, cy, GetTerrainHeight( params, cx, cy ) );
+		}
+
+		const unsigned int material_id= random.Index( g_luminous_material );
+		const m_Vec3 triangle0[3]= { corners[0], corners[1], corners[2] };
+		const m_Vec3 triangle1[3]= { corners[0], corners[2], corners[3] };
+		AddPolygon( level_data, params, triangle0, 3u, material_id );
+		AddPolygon( level_data, params, triangle1, 3u, material_id );
+	}
+
+	if( !params.enclosed )
+		return;
+
+	// Walls and ceiling, facing inside.
+	const float size= float(n) * params.cell_size;
+	const float half_size= 0.5f * size;
+	const float half_height= 0.5f * params.height;
+	AddQuad( level_data, params, m_Vec3( half_size, half_size, params.height ), m_Vec3( 0.0f, half_size, 0.0f ), m_Vec3( half_size, 0.0f, 0.0f ), 0u );
+	AddQuad( level_data, params, m_Vec3( 0.0f, half_size, half_height ), m_Vec3( 0.0f, half_size, 0.0f ), m_Vec3( 0.0f, 0.0f, half_height ), 1u );
+	AddQuad( level_data, params, m_Vec3( size, half_size, half_height ), m_Vec3( 0.0f, 0.0f, half_height ), m_Vec3( 0.0f, half_size, 0.0f ), 1u );
+	AddQuad( level_data, params, m_Vec3( half_size, 0.0f, half_height ), m_Vec3( 0.0f, 0.0f, half_height ), m_Vec3( half_size, 0.0f, 0.0f ), 2u );
+	AddQuad( level_data, params, m_Vec3( half_size, size, half_height ), m_Vec3( half_size, 0.0f, 0.0f ), m_Vec3( 0.0f, 0.0f, half_height ), 2u );
+}
+
+// Boxes without bottom side, standing on terrain.
+static void GenBoxes( plb_LevelData& level_data, const SceneParams& params, Random& random )
+{
+	const float size= float(params.terrain_cells) * params.cell_size;
+	for( unsigned int i= 0u; i < params.boxes; i++ )
+	{
+		const float half_size[2]=
+		{
+			random.Range( 0.25f, 1.25f ) * params.cell_size,
+			random.Range( 0.25f, 1.25f ) * params.cell_size,
+		};
+		float height= random.Range( 0.5f, 4.0f ) * params.cell_size;
+		if( params.enclosed )
+			height= std::min( height, params.height * 0.75f );
+
+		const float x= random.Range( half_size[0], size - half_size[0] );
+		const float y= random.Range( half_size[1], size - half_size[1] );
+		// Sink box into terrain.
+		const float z= GetTerrainHeight( params, x, y ) - params.cell_size * 0.25f;
+
+		const m_Vec3 hx( half_size[0], 0.0f, 0.0f );
+		const m_Vec3 hy( 0.0f, half_size[1], 0.0f );
+		const m_Vec3 hz( 0.0f, 0.0f, 0.5f * height );
+		const m_Vec3 center( x, y, z + 0.5f * height );
+		const unsigned int material_id= random.Index( g_luminous_material );
+
+		AddQuad( level_data, params, center + hz, hx, hy, material_id );
+		AddQuad( level_data, params, center + hx, hy, hz, material_id );
+		AddQuad( level_data, params, center - hx, hz, hy, material_id );
+		AddQuad( level_data, params, center + hy, hz, hx, material_id );
+		AddQuad( level_data, params, center - hy, hx, hz, material_id );
+	}
+}
+
+// Arches - round half-pipes of two quadratic patches.
+static void GenCurves( plb_LevelData& level_data, const SceneParams& params, Random& random )
+{
+	const float size= float(params.terrain_cells) * params.cell_size;
+
+	for( unsigned int i= 0u; i < params.curves; i++ )
+	{
+		const float radius= random.Range( 0.5f, 1.5f ) * params.cell_size;
+		const float half_length= random.Range( 0.5f, 1.5f ) * params.cell_size;
+		const bool along_x= random.Next() < 0.5f;
+
+		const float x= random.Range( radius + half_length, size - radius - half_length );
+		const float y= random.Range( radius + half_length, size - radius - half_length );
+		const float z= GetTerrainHeight( params, x, y );
+
+		const m_Vec3 center( x, y, z );
+		const m_Vec3 across= along_x ? m_Vec3( 0.0f, radius, 0.0f ) : m_Vec3( radius, 0.0f, 0.0f );
+		const m_Vec3 along= along_x ? m_Vec3( half_length, 0.0f, 0.0f ) : m_Vec3( 0.0f, half_length, 0.0f );
+		const m_Vec3 up( 0.0f, 0.0f, radius );
+
+		// Control points of arc - quarter of circle per patch.
+		const m_Vec3 arc[5]= { -across, -across + up, up, across + up, across };
+
+		plb_CurvedSurface curve;
+		std::memset( &curve, 0, sizeof(plb_CurvedSurface) );
+		curve.grid_size[0]= 5u;
+		curve.grid_size[1]= 3u;
+		curve.first_vertex_number= level_data.curved_surfaces_vertices.size();
+		curve.material_id= random.Index( g_luminous_material );
+
+		m_BBox3 bbox( plb_Constants::max_vec, plb_Constants::min_vec );
+		for( unsigned int v= 0u; v < curve.grid_size[1]; v++ )
+		for( unsigned int u= 0u; u < curve.grid_size[0]; u++ )
+		{
+			const m_Vec3 pos= center + arc[u] + along * ( float(v) - 1.0f );
+			bbox+= pos;
+
+			plb_Vertex vertex;
+			std::memset( &vertex, 0, sizeof(plb_Vertex) );
+			VEC3_CPY( vertex.pos, pos.ToArr() );
+			// Normalized lightmap coordinates, like in loaded levels.
+			vertex.lightmap_coord[0]= float(u) / float( curve.grid_size[0] - 1u );
+			vertex.lightmap_coord[1]= float(v) / float( curve.grid_size[1] - 1u );
+			vertex.tex_coord[0]= vertex.lightmap_coord[0];
+			vertex.tex_coord[1]= vertex.lightmap_coord[1];
+			level_data.curved_surfaces_vertices.push_back( vertex );
+		}
+		VEC3_CPY( curve.bb_min, bbox.min.ToArr() );
+		VEC3_CPY( curve.bb_max, bbox.max.ToArr() );
+
+		// Size in texels, like in loaded levels.
+		const float lengths[2]= { plb_Constants::pi * radius, 2.0f * half_length };
+		for( unsigned int j= 0u; j < 2u; j++ )
+		{
+			const unsigned int texels= static_cast<unsigned int>( std::ceil( lengths[j] / params.texel_size ) );
+			curve.lightmap_data.size[j]= static_cast<unsigned short>( std::max( texels, 1u ) );
+		}
+
+		level_data.curved_surfaces.push_back( curve );
+	}
+}
+
+// Small boxes of triangles with vertex normals, like items of level.
+static void GenModels( plb_LevelData& level_data, const SceneParams& params, Random& random )
+{
+	const float size= float(params.terrain_cells) * params.cell_size;
+
+	for( unsigned int i= 0u; i < params.models; i++ )
+	{
+		const float half_size= random.Range( 4.0f, 16.0f );
+		const float x= random.Range( half_size, size - half_size );
+		const float y= random.Range( half_size, size - half_size );
+		const m_Vec3 center( x, y, GetTerrainHeight( params, x, y ) + random.Range( 16.0f, 64.0f ) );
+
+		plb_LevelModel model;
+		model.first_vertex_number= level_data.models_vertices.size();
+		model.first_index= level_data.models_indeces.size();
+		model.vertex_count= 24u;
+		model.index_count= 36u;
+		model.flags= 0u;
+		model.material_id= g_luminous_material;
+
+		const m_Vec3 axes[3]=
+		{
+			m_Vec3( half_size, 0.0f, 0.0f ),
+			m_Vec3( 0.0f, half_size, 0.0f ),
+			m_Vec3( 0.0f, 0.0f, half_size ),
+		};
+
+		for( unsigned int side= 0u; side < 6u; side++ )
+		{
+			const float sign= ( side & 1u ) == 0u ? 1.0f : -1.0f;
+			const m_Vec3 normal= axes[ side / 2u ] * ( sign / half_size );
+			const m_Vec3 u= axes[ ( side / 2u + 1u ) % 3u ] * sign;
+			const m_Vec3 v= axes[ ( side / 2u + 2u ) % 3u ];
+			const m_Vec3 face_center= center + normal * half_size;
+
+			// Tracer calculates normals of model triangles as cross( v2 - v1, v1 - v0 ).
+			const m_Vec3 corners[4]=
+			{
+				face_center - u - v,
+				face_center - u + v,
+				face_center + u + v,
+				face_center + u - v,
+			};
+
+			const unsigned int first_vertex= level_data.models_vertices.size();
+			for( const m_Vec3& corner : corners )
+			{
+				plb_Vertex vertex;
+				std::memset( &vertex, 0, sizeof(plb_Vertex) );
+				VEC3_CPY( vertex.pos, corner.ToArr() );
+				level_data.models_vertices.push_back( vertex );
+
+				plb_Normal n;
+				for( unsigned int j= 0u; j < 3u; j++ )
+					n.xyz[j]= static_cast<char>( normal.ToArr()[j] * 127.0f );
+				n.reserved= 0;
+				level_data.models_normals.push_back( n );
+			}
+
+			const unsigned int indeces[6]= { 0u, 1u, 2u, 0u, 2u, 3u };
+			for( const unsigned int index : indeces )
+				level_data.models_indeces.push_back( first_vertex + index );
+		}
+
+		level_data.models.push_back( model );
+	}
+}
+
+static void GenLights( plb_LevelData& level_data, const SceneParams& params, Random& random )
+{
+	const float size= float(params.terrain_cells) * params.cell_size;
+	// Keep light radius proportional to level scale.
+	const float intensity_scale= ( params.cell_size / 64.0f ) * ( params.cell_size / 64.0f );
+
+	const auto gen_point_light=
+	[&]( plb_PointLight& light )
+	{
+		const float x= random.Range( 0.0f, size );
+		const float y= random.Range( 0.0f, size );
+		float z= GetTerrainHeight( params, x, y ) + random.Range( 0.5f, 3.0f ) * params.cell_size;
+		if( params.enclosed )
+			z= std::min( z, params.height - 8.0f );
+
+		light.pos[0]= x;
+		light.pos[1]= y;
+		light.pos[2]= z;
+		light.intensity= random.Range( 200.0f, 800.0f ) * intensity_scale;
+		for( unsigned int j= 0u; j < 3u; j++ )
+			light.color[j]= static_cast<unsigned char>( random.Range( 128.0f, 255.0f ) );
+		light.reserved= 0;
+	};
+
+	level_data.point_lights.resize( params.point_lights );
+	for( plb_PointLight& light : level_data.point_lights )
+		gen_point_light( light );
+
+	level_data.cone_lights.resize( params.cone_lights );
+	for( plb_ConeLight& light : level_data.cone_lights )
+	{
+		gen_point_light( light );
+		light.intensity*= 4.0f;
+
+		m_Vec3 direction= GetRandomDirection( random );
+		direction.z= -1.0f - std::abs( direction.z );
+		direction.Normalize();
+		VEC3_CPY( light.direction, direction.ToArr() );
+		light.angle= random.Range( 0.3f, 0.7f );
+	}
+
+	level_data.directional_lights.resize( params.directional_lights );
+	for( plb_DirectionalLight& light : level_data.directional_lights )
+	{
+		m_Vec3 direction= GetRandomDirection( random );
+		direction.z= 0.5f + std::abs( direction.z );
+		direction.Normalize();
+		VEC3_CPY( light.direction, direction.ToArr() );
+		light.intensity= random.Range( 0.5f, 2.0f );
+		for( unsigned int j= 0u; j < 3u; j++ )
+			light.color[j]= static_cast<unsigned char>( random.Range( 192.0f, 255.0f ) );
+		light.reserved= 0;
+	}
+}
+
+// Checkers of different colors. Last material is luminous.
+static void GenMaterials( plb_LevelData& level_data )
+{
+	static const unsigned char colors[ g_material_count ][3]=
+	{
+		{ 180, 170, 160 }, { 120, 140, 110 }, { 150, 100,  80 }, { 255, 230, 180 },
+	};
+
+	for( unsigned int i= 0u; i < g_material_count; i++ )
+	{
+		plb_BuildInImage image;
+		image.name= "benchmark_texture_" + std::to_string(i);
+		image.size[0]= image.size[1]= g_textures_size;
+		image.data_rgba.resize( 4u * g_textures_size * g_textures_size );
+		for( unsigned int y= 0u; y < g_textures_size; y++ )
+		for( unsigned int x= 0u; x < g_textures_size; x++ )
+		{
+			const bool dark= ( ( x / 8u ) ^ ( y / 8u ) ) & 1u;
+			unsigned char* const texel= image.data_rgba.data() + 4u * ( x + y * g_textures_size );
+			for( unsigned int j= 0u; j < 3u; j++ )
+				texel[j]= static_cast<unsigned char>( dark ? colors[i][j] * 3u / 4u : colors[i][j] );
+			texel[3]= 255;
+		}
+
+		plb_ImageInfo image_info;
+		image_info.texture_array_id= 0u;
+		image_info.texture_layer_id= 0u;
+		image_info.size_log2[0]= image_info.size_log2[1]= 0u;
+		image_info.original_size[0]= image_info.original_size[1]= 0u;
+		image_info.file_name= image.name;
+
+		plb_Material material;
+		material.albedo_texture_file_name= image.name;
+		material.albedo_texture_number= i;
+		material.light_texture_number= i;
+		if( i == g_luminous_material )
+		{
+			material.light_texture_file_name= image.name;
+			material.luminosity= 2.0f;
+		}
+
+		level_data.build_in_images.push_back( std::move(image) );
+		level_data.textures.push_back( image_info );
+		level_data.materials.push_back( material );
+	}
+}
+
+static void GenLevel( const SceneParams& params, const uint32_t seed, plb_LevelData& out_level_data )
+{
+	out_level_data= plb_LevelData();
+
+	Random random( seed );
+	GenMaterials( out_level_data );
+	GenTerrain( out_level_data, params, random );
+	GenBoxes( out_level_data, params, random );
+	GenCurves( out_level_data, params, random );
+	GenModels( out_level_data, params, random );
+	GenLights( out_level_data, params, random );
+}
+
+/*
+Benchmark running.
+*/
+
+class BenchmarkRunner final
+{
+public:
+	BenchmarkRunner( const Options& options, std::vector<StageResult>& results )
+		: options_( options ), results_( results )
+	{}
+
+	void SetScene( const char* const scene_name ) { scene_name_= scene_name; }
+
+	// Runs function "repeat" times. Function returns number of processed items.
+	void Run( const char* const stage, const char* const items_name, const std::function<uint64_t()>& func )
+	{
+		double total_ms= 0.0, min_ms= 0.0;
+		uint64_t items= 0u;
+		for( unsigned int i= 0u; i < options_.repeat; i++ )
+		{
+			const auto start_time= std::chrono::steady_clock::now();
+			items= func();
+			const auto end_time= std::chrono::steady_clock::now();
+
+			const double time_ms= std::chrono::duration<double, std::milli>( end_time - start_time ).count();
+			total_ms+= time_ms;
+			min_ms= i == 0u ? time_ms : std::min( min_ms, time_ms );
+		}
+
+		StageResult result;
+		result.scene= scene_name_;
+		result.stage= stage;
+		result.iterations= options_.repeat;
+		result.min_ms= min_ms;
+		result.mean_ms= total_ms / double(options_.repeat);
+		result.items= items;
+		result.items_name= items_name;
+		results_.push_back( result );
+
+		std::cout << "[" << scene_name_ << "] " << stage << ": " << min_ms << " ms" << std::endl;
+	}
+
+private:
+	const Options& options_;
+	std::vector<StageResult>& results_;
+	std::string scene_name_;
+};
+
+static void BenchmarkTracer( BenchmarkRunner& runner, const plb_LevelData& level_data, const plb_Tracer& tracer, const uint32_t seed )
+{
+	m_BBox3 bbox( plb_Constants::max_vec, plb_Constants::min_vec );
+	for( const plb_Vertex& v : level_data.vertices )
+		bbox+= m_Vec3( v.pos );
+	const m_Vec3 bbox_size= bbox.max - bbox.min;
+	const float diagonal= bbox_size.Length();
+
+	// Short segments for shadow tests, long rays for secondary light gathering.
+	Random random( seed );
+	std::vector<m_Vec3> from( g_tracer_queries ), to_short( g_tracer_queries ), to_long( g_tracer_queries );
+	for( unsigned int i= 0u; i < g_tracer_queries; i++ )
+	{
+		from[i]= bbox.min + m_Vec3( bbox_size.x * random.Next(), bbox_size.y * random.Next(), bbox_size.z * random.Next() );
+		const m_Vec3 dir= GetRandomDirection( random );
+		to_short[i]= from[i] + dir * ( random.Range( 0.01f, 0.25f ) * diagonal );
+		to_long[i]= from[i] + dir * diagonal;
+	}
+
+	runner.Run(
+		"tracer_occluded", "segments",
+		[&]() -> uint64_t
+		{
+			for( unsigned int i= 0u; i < g_tracer_queries; i++ )
+				g_sink+= tracer.Occluded( from[i], to_short[i] ) ? 1u : 0u;
+			return g_tracer_queries;
+		} );
+
+	runner.Run(
+		"tracer_occluded_packet", "segments",
+		[&]() -> uint64_t
+		{
+			bool occluded[ plb_Tracer::c_max_packet_size ];
+			for( unsigned int i= 0u; i < g_tracer_queries; i+= plb_Tracer::c_max_packet_size )
+			{
+				const unsigned int count= std::min( plb_Tracer::c_max_packet_size, g_tracer_queries - i );
+				tracer.OccludedPacket( from.data() + i, to_short.data() + i, count, occluded );
+				for( unsigned int j= 0u; j < count; j++ )
+					g_sink+= occluded[j] ? 1u : 0u;
+			}
+			return g_tracer_queries;
+		} );
+
+	runner.Run(
+		"tracer_closest", "rays",
+		[&]() -> uint64_t
+		{
+			plb_Tracer::TraceResult result;
+			for( unsigned int i= 0u; i < g_tracer_queries; i++ )
+				g_sink+= tracer.TraceClosest( from[i], to_long[i], result, true ) ? result.surface_index : 0u;
+			return g_tracer_queries;
+		} );
+}
+
+// Fills triangles of polygons in lightmap space, like rasterization of surfaces in lightmaps builder.
+static void BenchmarkRasterizer( BenchmarkRunner& runner, const plb_LevelData& level_data )
+{
+	typedef plb_Rasterizer<float> Rasterizer;
+
+	std::vector<float> buffer_data;
+	std::vector<m_Vec2> lightmap_coords;
+
+	runner.Run(
+		"rasterizer_fill", "triangles",
+		[&]() -> uint64_t
+		{
+			uint64_t triangles= 0u;
+			for( const plb_Polygon& polygon : level_data.polygons )
+			{
+				Rasterizer::Buffer buffer;
+				buffer.size[0]= polygon.lightmap_data.size[0];
+				buffer.size[1]= polygon.lightmap_data.size[1];
+				buffer_data.resize( buffer.size[0] * buffer.size[1] );
+				std::fill( buffer_data.begin(), buffer_data.end(), 0.0f );
+				buffer.data= buffer_data.data();
+
+				const m_Vec3 basis[2]= { m_Vec3( polygon.lightmap_basis[0] ), m_Vec3( polygon.lightmap_basis[1] ) };
+				lightmap_coords.resize( polygon.vertex_count );
+				for( unsigned int v= 0u; v < polygon.vertex_count; v++ )
+				{
+					const m_Vec3 rel_pos=
+						m_Vec3( level_data.vertices[ polygon.first_vertex_number + v ].pos ) - m_Vec3( polygon.lightmap_pos );
+					lightmap_coords[v]=
+						m_Vec2(
+							( rel_pos * basis[0] ) / basis[0].SquareLength(),
+							( rel_pos * basis[1] ) / basis[1].SquareLength() );
+				}
+
+				Rasterizer rasterizer( buffer );
+				const float attributes[3]= { 1.0f, 1.0f, 1.0f };
+				for( unsigned int i= 0u; i < polygon.index_count; i+= 3u )
+				{
+					const m_Vec2 vertices[3]=
+					{
+						lightmap_coords[ level_data.polygons_indeces[ polygon.first_index + i + 0u ] - polygon.first_vertex_number ],
+						lightmap_coords[ level_data.polygons_indeces[ polygon.first_index + i + 1u ] - polygon.first_vertex_number ],
+						lightmap_coords[ level_data.polygons_indeces[ polygon.first_index + i + 2u ] - polygon.first_vertex_number ],
+					};
+					rasterizer.DrawTriangle( vertices, attributes );
+					triangles++;
+				}
+
+				g_sink+= static_cast<uint64_t>( buffer_data[ buffer_data.size() / 2u ] );
+			}
+			return triangles;
+		} );
+}
+
+static void BenchmarkAtlasPacking( BenchmarkRunner& runner, const plb_AtlasRects& rects, const unsigned int* const layer_size )
+{
+	const struct
+	{
+		const char* stage;
+		plb_Config::LightmapsAtlasPacker packer;
+	} packers[]=
+	{
+		{ "atlas_packing_shelf", plb_Config::LightmapsAtlasPacker::Shelf },
+		{ "atlas_packing_skyline", plb_Config::LightmapsAtlasPacker::Skyline },
+		{ "atlas_packing_maxrects", plb_Config::LightmapsAtlasPacker::MaxRects },
+	};
+
+	for( const auto& packer : packers )
+	{
+		runner.Run(
+			packer.stage, "rects",
+			[&]() -> uint64_t
+			{
+				plb_AtlasRects rects_copy= rects;
+				g_sink+= plbPackAtlasRects(
+					packer.packer,
+					layer_size,
+					packer.packer != plb_Config::LightmapsAtlasPacker::Shelf,
+					rects_copy );
+				return rects_copy.size();
+			} );
+	}
+}
+
+static void BenchmarkCpuLighting(
+	BenchmarkRunner& runner,
+	plb_LevelData& level_data,
+	const plb_Config& config,
+	const plb_Tracer& tracer,
+	const unsigned int layer_count,
+	SceneStats& stats )
+{
+	const unsigned int scaler= config.secondary_lightmap_scaler;
+
+	// Includes search of neighbor geometry for correction of samples, like in lightmaps builder.
+	std::vector<plb_Tracer::LineSegments> polygons_segments;
+	plb_CpuLightmapsBuilder::LightTexels primary_texels, secondary_texels;
+	runner.Run(
+		"light_texels_preparation", "texels",
+		[&]() -> uint64_t
+		{
+			primary_texels.clear();
+			secondary_texels.clear();
+			plbGetPolygonsNeighborsSegments( level_data, config, tracer, polygons_segments );
+			plbPreparePrimaryLightTexels( level_data, config, polygons_segments, nullptr, primary_texels );
+			plbPrepareSecondaryLightTexels( level_data, config, polygons_segments, nullptr, secondary_texels );
+			return primary_texels.size() + secondary_texels.size();
+		} );
+
+	stats.primary_texels= primary_texels.size();
+	stats.secondary_texels= secondary_texels.size();
+
+	// CPU backend needs only average colors of textures, so, textures manager works without OpenGL.
+	const plb_TexturesManager textures_manager( config, level_data.textures, level_data.build_in_images );
+
+	const unsigned int atlas_size[3]= { config.lightmaps_atlas_size[0], config.lightmaps_atlas_size[1], layer_count };
+	const unsigned int secondary_atlas_size[2]= { atlas_size[0] / scaler, atlas_size[1] / scaler };
+
+	plb_CpuLightmapsBuilder cpu_builder(
+		level_data, config, tracer, textures_manager,
+		atlas_size, secondary_atlas_size );
+
+	runner.Run(
+		"cpu_primary_texels_sorting", "texels",
+		[&]() -> uint64_t
+		{
+			cpu_builder.SetPrimaryLightTexels( primary_texels );
+			return primary_texels.size();
+		} );
+
+	if( !level_data.point_lights.empty() )
+		runner.Run(
+			"cpu_point_lights", "lights",
+			[&]() -> uint64_t
+			{
+				for( const plb_PointLight& light : level_data.point_lights )
+					cpu_builder.PointLightPass( m_Vec3( light.pos ), plbGetPointLightColor( light ) );
+				return level_data.point_lights.size();
+			} );
+
+	if( !level_data.cone_lights.empty() )
+		runner.Run(
+			"cpu_cone_lights", "lights",
+			[&]() -> uint64_t
+			{
+				for( const plb_ConeLight& light : level_data.cone_lights )
+					cpu_builder.ConeLightPass( light );
+				return level_data.cone_lights.size();
+			} );
+
+	if( !level_data.directional_lights.empty() )
+		runner.Run(
+			"cpu_directional_lights", "lights",
+			[&]() -> uint64_t
+			{
+				for( const plb_DirectionalLight& light : level_data.directional_lights )
+					cpu_builder.DirectionalLightPass( light );
+				return level_data.directional_lights.size();
+			} );
+
+	runner.Run(
+		"cpu_secondary_light", "texels",
+		[&]() -> uint64_t
+		{
+			cpu_builder.SecondaryLightPass( secondary_texels, 0u, nullptr, []( unsigned int ){} );
+			return secondary_texels.size();
+		} );
+
+	const unsigned int thread_count= plbGetThreadCount( config.cpu_threads );
+
+	plb_LightmapRects primary_rects, secondary_rects;
+	plbGetLightmapsRects( level_data, 1u, primary_rects );
+	plbGetLightmapsRects( level_data, scaler, secondary_rects );
+
+	runner.Run(
+		"lightmaps_dilation", "texels",
+		[&]() -> uint64_t
+		{
+			cpu_builder.ForEachAtlasLayer(
+				false,
+				[&]( float* const layer_data, const unsigned int* const layer_size, const unsigned int layer )
+				{
+					plbDilateLightmapsLayer(
+						layer_data, layer_size, layer,
+						primary_rects,
+						config.lightmaps_dilation_passes,
+						thread_count );
+				} );
+			return uint64_t(atlas_size[0]) * atlas_size[1] * atlas_size[2];
+		} );
+
+	const unsigned int layer_texels= secondary_atlas_size[0] * secondary_atlas_size[1];
+	std::vector<m_Vec3> positions( layer_texels * layer_count, m_Vec3( 0.0f, 0.0f, 0.0f ) );
+	std::vector<m_Vec3> normals( positions.size(), m_Vec3( 0.0f, 0.0f, 0.0f ) );
+	for( const plb_CpuLightmapsBuilder::LightTexel& texel : secondary_texels )
+	{
+		positions[ texel.texel_index ]= texel.pos;
+		normals[ texel.texel_index ]= texel.normal;
+	}
+
+	runner.Run(
+		"lightmaps_denoising", "texels",
+		[&]() -> uint64_t
+		{
+			cpu_builder.ForEachAtlasLayer(
+				true,
+				[&]( float* const layer_data, const unsigned int* const layer_size, const unsigned int layer )
+				{
+					plbDenoiseLightmapsLayer(
+						layer_data, layer_size, layer,
+						secondary_rects,
+						positions.data() + layer_texels * layer,
+						normals.data() + layer_texels * layer,
+						g_denoise_iterations,
+						config.secondary_light_denoise_strength,
+						thread_count );
+				} );
+			return uint64_t(layer_texels) * layer_count;
+		} );
+}
+
+static void BenchmarkScene(
+	const SceneParams& params,
+	const Options& options,
+	std::vector<StageResult>& results,
+	std::vector<SceneStats>& scenes_stats )
+{
+	std::cout << "Scene \"" << params.name << "\"" << std::endl;
+
+	plb_Config config;
+	config.backend= plb_Config::Backend::CPU;
+	config.cpu_threads= options.threads;
+	config.cpu_secondary_light_pass_rays= options.secondary_rays;
+	config.min_textures_size_log2= config.max_textures_size_log2= 6u;
+	// Lightmap basises of generated level are already in texels of primary lightmaps.
+	config.lightmap_scale_to_original= 1u;
+
+	BenchmarkRunner runner( options, results );
+	runner.SetScene( params.name );
+
+	plb_LevelData level_data;
+	runner.Run(
+		"level_generation", "surfaces",
+		[&]() -> uint64_t
+		{
+			GenLevel( params, options.seed, level_data );
+			return level_data.polygons.size() + level_data.curved_surfaces.size() + level_data.models.size();
+		} );
+
+	SceneStats stats;
+	stats.scene= params.name;
+	stats.polygons= level_data.polygons.size();
+	stats.curves= level_data.curved_surfaces.size();
+	stats.model_triangles= level_data.models_indeces.size() / 3u;
+	stats.lights=
+		level_data.point_lights.size() + level_data.cone_lights.size() + level_data.directional_lights.size();
+
+	runner.Run(
+		"curves_tessellation", "triangles",
+		[&]() -> uint64_t
+		{
+			plb_Vertices vertices;
+			std::vector<unsigned int> indeces;
+			plb_Normals normals;
+			GenCurvesMeshes( level_data.curved_surfaces, level_data.curved_surfaces_vertices, vertices, indeces, normals );
+			return indeces.size() / 3u;
+		} );
+
+	// Lightmaps layout, same as in lightmaps builder.
+	plbCalculateLightmapsSizes( level_data, config );
+
+	unsigned int layer_size_in_texels[2];
+	plbGetLightmapsAtlasLayerSize( config, layer_size_in_texels );
+	plb_AtlasRects atlas_rects;
+	plbGetLightmapsAtlasRects( level_data, config, atlas_rects );
+	BenchmarkAtlasPacking( runner, atlas_rects, layer_size_in_texels );
+
+	plb_SurfaceLightmapData stub_lightmap;
+	const unsigned int layer_count= plbPlaceLightmaps( level_data, config, atlas_rects, stub_lightmap );
+	stats.atlas_layers= layer_count;
+
+	std::unique_ptr<plb_Tracer> tracer;
+	runner.Run(
+		"tracer_build", "surfaces",
+		[&]() -> uint64_t
+		{
+			tracer.reset();
+			tracer.reset( new plb_Tracer( level_data, plbGetThreadCount( options.threads ) ) );
+			return level_data.polygons.size() + level_data.curved_surfaces.size() + level_data.models.size();
+		} );
+
+	BenchmarkTracer( runner, level_data, *tracer, options.seed );
+	BenchmarkRasterizer( runner, level_data );
+	BenchmarkCpuLighting( runner, level_data, config, *tracer, layer_count, stats );
+
+	scenes_stats.push_back( stats );
+}
+
+static bool WriteResults(
+	const char* const file_name,
+	const Options& options,
+	const std::vector<StageResult>& results,
+	const std::vector<SceneStats>& scenes_stats )
+{
+	std::ofstream file( file_name );
+	if( !file.is_open() )
+	{
+		std::cout << "Can not open results file \"" << file_name << "\"" << std::endl;
+		return false;
+	}
+
+	file << std::fixed << std::setprecision(3);
+	file << "{\n";
+	file << "\"threads\":" << plbGetThreadCount( options.threads ) << ",\n";
+	file << "\"repeat\":" << options.repeat << ",\n";
+	file << "\"secondary_rays\":" << options.secondary_rays << ",\n";
+	file << "\"seed\":" << options.seed << ",\n";
+
+	file << "\"scenes\":[\n";
+	for( const SceneStats& stats : scenes_stats )
+	{
+		file << "{\"name\":\"" << stats.scene << "\"" <<
+			",\"polygons\":" << stats.polygons <<
+			",\"curves\":" << stats.curves <<
+			",\"model_triangles\":" << stats.model_triangles <<
+			",\"lights\":" << stats.lights <<
+			",\"atlas_layers\":" << stats.atlas_layers <<
+			",\"primary_texels\":" << stats.primary_texels <<
+			",\"secondary_texels\":" << stats.secondary_texels << "}" <<
+			( &stats == &scenes_stats.back() ? "\n" : ",\n" );
+	}
+	file << "],\n";
+
+	file << "\"results\":[\n";
+	for( const StageResult& result : results )
+	{
+		const double items_per_second= double(result.items) / std::max( result.min_ms / 1000.0, 1.0e-9 );
+		file << "{\"scene\":\"" << result.scene << "\",\"stage\":\"" << result.stage << "\"" <<
+			",\"iterations\":" << result.iterations <<
+			",\"min_ms\":" << result.min_ms <<
+			",\"mean_ms\":" << result.mean_ms <<
+			",\"items\":" << result.items <<
+			",\"items_name\":\"" << result.items_name << "\"" <<
+			",\"items_per_second\":" << items_per_second << "}" <<
+			( &result == &results.back() ? "\n" : ",\n" );
+	}
+	file << "]\n";
+	file << "}\n";
+
+	if( file.fail() )
+	{
+		std::cout << "Can not write results file \"" << file_name << "\"" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+static void PrintResults( const std::vector<StageResult>& results )
+{
+	const std::ios_base::fmtflags cout_flags= std::cout.flags();
+	const std::streamsize cout_precision= std::cout.precision();
+
+	std::cout << std::endl;
+	std::cout << std::left << std::setw(14) << "scene" << std::setw(28) << "stage" << std::right <<
+		std::setw(12) << "min ms" << std::setw(12) << "mean ms" << std::setw(16) << "items/s" << std::endl;
+
+	for( const StageResult& result : results )
+	{
+		const double items_per_second= double(result.items) / std::max( result.min_ms / 1000.0, 1.0e-9 );
+		std::cout << std::left << std::setw(14) << result.scene << std::setw(28) << result.stage << std::right <<
+			std::fixed << std::setprecision(2) <<
+			std::setw(12) << result.min_ms << std::setw(12) << result.mean_ms <<
+			std::setprecision(0) << std::setw(16) << items_per_second << " " << result.items_name << std::endl;
+	}
+
+	std::cout.flags( cout_flags );
+	std::cout.precision( cout_precision );
+}
+
+int main( int argc, char* argv[] )
+{
+	Options options;
+	ParseArguments( argc, argv, options );
+
+	std::vector<StageResult> results;
+	std::vector<SceneStats> scenes_stats;
+	for( const SceneParams* const scene : options.scenes )
+		BenchmarkScene( *scene, options, results, scenes_stats );
+
+	PrintResults( results );
+	std::cout << "Checksum: " << g_sink << std::endl;
+
+	return WriteResults( options.output_path, options, results, scenes_stats ) ? 0 : -1;
+}
@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cmath>
+
+#include "math_utils.hpp"
+
+#include "boxes_grid.hpp"
+
+// Maximum number of cells along each axis.
+static const unsigned int g_max_grid_size= 64u;
+// Average number of boxes per cell, which is used for selection of cell size.
+static const float g_boxes_per_cell= 4.0f;
+// Boxes, intersecting more cells, are not placed into cells.
+static const unsigned int g_max_box_cells= 64u;
+
+static bool BoxIsValid( const m_BBox3& box )
+{
+	return box.min.x <= box.max.x && box.min.y <= box.max.y && box.min.z <= box.max.z;
+}
+
+static bool BoxesIntersect( const m_BBox3& box0, const m_BBox3& box1 )
+{
+	for( unsigned int i= 0; i < 3; i++ )
+	{
+		if(
+			box0.max.ToArr()[i] < box1.min.ToArr()[i] ||
+			box1.max.ToArr()[i] < box0.min.ToArr()[i] )
+			return false;
+	}
+
+	return true;
+}
+
+plb_BoxesGrid::plb_BoxesGrid( const std::vector<m_BBox3>& boxes )
+	: boxes_( boxes )
+{
+	m_Vec3 bb_min= plb_Constants::max_vec;
+	m_Vec3 bb_max= plb_Constants::min_vec;
+	unsigned int valid_box_count= 0u;
+	for( const m_BBox3& box : boxes_ )
+	{
+		if( !BoxIsValid( box ) )
+			continue;
+
+		valid_box_count++;
+		for( unsigned int j= 0; j < 3; j++ )
+		{
+			bb_min.ToArr()[j]= std::min( bb_min.ToArr()[j], box.min.ToArr()[j] );
+			bb_max.ToArr()[j]= std::max( bb_max.ToArr()[j], box.max.ToArr()[j] );
+		}
+	}
+
+	if( valid_box_count == 0u )
+		bb_min= bb_max= m_Vec3( 0.0f, 0.0f, 0.0f );
+
+	// Boxes are mostly boxes of surfaces, so, use area of bounding box sides for estimation of cell size.
+	const m_Vec3 extent= bb_max - bb_min;
+	const float max_extent= std::max( extent.x, std::max( extent.y, extent.z ) );
+	const float area= extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+	float cell_size=
+		std::max(
+			std::sqrt( area * g_boxes_per_cell / std::max( float(valid_box_count), 1.0f ) ),
+			max_extent / float(g_max_grid_size) );
+	cell_size= std::max( cell_size, 1.0f / 64.0f );
+	inv_cell_size_= 1.0f / cell_size;
+
+	grid_min_= bb_min;
+	for( unsigned int j= 0; j < 3; j++ )
+		size_[j]=
+			std::min(
+				static_cast<unsigned int>( extent.ToArr()[j] * inv_cell_size_ ) + 1u,
+				g_max_grid_size );
+
+	const unsigned int cell_count= size_[0] * size_[1] * size_[2];
+	cells_offsets_.resize( cell_count + 1u, 0u );
+
+	// Two passes - count boxes of cells, then fill cells.
+	for( unsigned int pass= 0u; pass < 2u; pass++ )
+	{
+		std::vector<unsigned int> cells_fill;
+		if( pass == 1u )
+		{
+			for( unsigned int c= 0; c < cell_count; c++ )
+				cells_offsets_[ c + 1u ]+= cells_offsets_[c];
+			cells_boxes_.resize( cells_offsets_.back() );
+			cells_fill.assign( cells_offsets_.begin(), cells_offsets_.end() - 1 );
+		}
+
+		for( unsigned int i= 0u; i < boxes_.size(); i++ )
+		{
+			unsigned int cells_min[3], cells_max[3];
+			if( !BoxIsValid( boxes_[i] ) || !GetCellsRange( boxes_[i], cells_min, cells_max ) )
+				continue;
+
+			const unsigned int box_cell_count=
+				( cells_max[0] - cells_min[0] + 1u ) *
+				( cells_max[1] - cells_min[1] + 1u ) *
+				( cells_max[2] - cells_min[2] + 1u );
+			if( box_cell_count > g_max_box_cells )
+			{
+				if( pass == 1u )
+					large_boxes_.push_back( i );
+				continue;
+			}
+
+			for( unsigned int z= cells_min[2]; z <= cells_max[2]; z++ )
+			for( unsigned int y= cells_min[1]; y <= cells_max[1]; y++ )
+			for( unsigned int x= cells_min[0]; x <= cells_max[0]; x++ )
+			{
+				const unsigned int cell= x + ( y + z * size_[1] ) * size_[0];
+				if( pass == 0u )
+					cells_offsets_[ cell + 1u ]++;
+				else
+				{
+					cells_boxes_[ cells_fill[cell] ]= i;
+					cells_fill[cell]++;
+				}
+			}
+		}
+	}
+}
+
+plb_BoxesGrid::~plb_BoxesGrid()
+{
+}
+
+void plb_BoxesGrid::GetBoxesInBox( const m_BBox3& box, std::vector<unsigned int>& out_boxes ) const
+{
+	for( const unsigned int i : large_boxes_ )
+	{
+		if( BoxesIntersect( boxes_[i], box ) )
+			out_boxes.push_back(i);
+	}
+
+	unsigned int cells_min[3], cells_max[3];
+	if( !BoxIsValid( box ) || !GetCellsRange( box, cells_min, cells_max ) )
+		return;
+
+	for( unsigned int z= cells_min[2]; z <= cells_max[2]; z++ )
+	for( unsigned int y= cells_min[1]; y <= cells_max[1]; y++ )
+	for( unsigned int x= cells_min[0]; x <= cells_max[0]; x++ )
+	{
+		const unsigned int cell= x + ( y + z * size_[1] ) * size_[0];
+		for( unsigned int b= cells_offsets_[cell]; b < cells_offsets_[ cell + 1u ]; b++ )
+		{
+			const unsigned int i= cells_boxes_[b];
+			if( BoxesIntersect( boxes_[i], box ) )
+				out_boxes.push_back(i);
+		}
+	}
+}
+
+bool plb_BoxesGrid::GetCellsRange( const m_BBox3& box, unsigned int* const out_min, unsigned int* const out_max ) const
+{
+	for( unsigned int j= 0; j < 3; j++ )
+	{
+		// Calculate in float space, because box may be huge.
+		const float min_cell= ( box.min.ToArr()[j] - grid_min_.ToArr()[j] ) * inv_cell_size_;
+		const float max_cell= ( box.max.ToArr()[j] - grid_min_.ToArr()[j] ) * inv_cell_size_;
+		if( max_cell < 0.0f || min_cell >= float(size_[j]) )
+			return false;
+
+		out_min[j]= static_cast<unsigned int>( std::max( 0.0f, min_cell ) );
+		out_max[j]= static_cast<unsigned int>( std::min( max_cell, float( size_[j] - 1u ) ) );
+	}
+
+	return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+
+#include <bbox.hpp>
+
+// Uniform grid of bounding boxes, for fast search of boxes, intersecting given box.
+// Each box is placed into all cells, which it intersects. Very large boxes are stored in separate list.
+// Inverted boxes (with min greater, than max) are never found.
+class plb_BoxesGrid final
+{
+public:
+	explicit plb_BoxesGrid( const std::vector<m_BBox3>& boxes );
+	~plb_BoxesGrid();
+
+	// Adds to out_boxes indeces of boxes, which intersect given box (touching boxes intersect too).
+	// Index of box may be added more, than once.
+	void GetBoxesInBox( const m_BBox3& box, std::vector<unsigned int>& out_boxes ) const;
+
+private:
+	// Returns false, if box does not intersect grid.
+	bool GetCellsRange( const m_BBox3& box, unsigned int* out_min, unsigned int* out_max ) const;
+
+private:
+	std::vector<m_BBox3> boxes_;
+
+	m_Vec3 grid_min_;
+	float inv_cell_size_;
+	unsigned int size_[3];
+
+	// Boxes of each cell are in range [ cells_offsets_[c]; cells_offsets_[c + 1] ) of cells_boxes_.
+	std::vector<unsigned int> cells_offsets_;
+	std::vector<unsigned int> cells_boxes_;
+
+	// Boxes, which intersect too many cells.
+	std::vector<unsigned int> large_boxes_;
+};
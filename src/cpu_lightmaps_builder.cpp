@@ -0,0 +1,584 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include <bbox.hpp>
+
+#include "math_utils.hpp"
+#include "parallel_for.hpp"
+#include "profiler.hpp"
+
+#include "cpu_lightmaps_builder.hpp"
+
+// Shift of shadow rays start from surface, for prevention of self-shadowing.
+static const float g_shadow_ray_offset= 1.0f / 256.0f;
+// Shift of shadow rays end from light source.
+static const float g_light_pos_offset= 1.0f / 64.0f;
+
+static const float g_surface_sample_light_min_length= 1.0f / 1024.0f;
+
+static float RadicalInverse( unsigned int i )
+{
+	i= ( i << 16u ) | ( i >> 16u );
+	i= ( ( i & 0x55555555u ) << 1u ) | ( ( i & 0xAAAAAAAAu ) >> 1u );
+	i= ( ( i & 0x33333333u ) << 2u ) | ( ( i & 0xCCCCCCCCu ) >> 2u );
+	i= ( ( i & 0x0F0F0F0Fu ) << 4u ) | ( ( i & 0xF0F0F0F0u ) >> 4u );
+	i= ( ( i & 0x00FF00FFu ) << 8u ) | ( ( i & 0xFF00FF00u ) >> 8u );
+	return float(i) * ( 1.0f / 4294967296.0f );
+}
+
+static void GetNormalBasis( const m_Vec3& normal, m_Vec3& out_tangent, m_Vec3& out_binormal )
+{
+	const m_Vec3 axis=
+		std::abs( normal.x ) < 0.8f
+			? m_Vec3( 1.0f, 0.0f, 0.0f )
+			: m_Vec3( 0.0f, 1.0f, 0.0f );
+
+	out_tangent= mVec3Cross( normal, axis );
+	out_tangent.Normalize();
+	out_binormal= mVec3Cross( normal, out_tangent );
+}
+
+static float SmoothStep( const float edge0, const float edge1, const float x )
+{
+	const float t= std::min( std::max( ( x - edge0 ) / ( edge1 - edge0 ), 0.0f ), 1.0f );
+	return t * t * ( 3.0f - 2.0f * t );
+}
+
+plb_CpuLightmapsBuilder::plb_CpuLightmapsBuilder(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const plb_Tracer& tracer,
+	const plb_TexturesManager& textures_manager,
+	const unsigned int* const atlas_size,
+	const unsigned int* const secondary_atlas_size )
+	: level_data_( level_data )
+	, config_( config )
+	, tracer_( tracer )
+	, threads_count_( plbGetThreadCount( config.cpu_threads ) )
+{
+	std::cout << "CPU lightmaps builder threads: " << threads_count_ << std::endl;
+
+	for( unsigned int i= 0; i < 3; i++ )
+		primary_atlas_.size[i]= atlas_size[i];
+	primary_atlas_.data.resize( 4u * atlas_size[0] * atlas_size[1] * atlas_size[2], 0.0f );
+
+	secondary_atlas_.size[0]= secondary_atlas_size[0];
+	secondary_atlas_.size[1]= secondary_atlas_size[1];
+	secondary_atlas_.size[2]= atlas_size[2];
+	secondary_atlas_.data.resize(
+		4u * secondary_atlas_.size[0] * secondary_atlas_.size[1] * secondary_atlas_.size[2],
+		0.0f );
+
+	// Level size, needed for directional lights and secondary rays.
+	m_BBox3 bounding_box( plb_Constants::max_vec, plb_Constants::min_vec );
+	for( const plb_Vertex& v : level_data_.vertices )
+		bounding_box+= m_Vec3( v.pos );
+	for( const plb_Vertex& v : level_data_.curved_surfaces_vertices )
+		bounding_box+= m_Vec3( v.pos );
+	for( const plb_Vertex& v : level_data_.models_vertices )
+		bounding_box+= m_Vec3( v.pos );
+	level_diagonal_length_= std::max( 1.0f, ( bounding_box.max - bounding_box.min ).Length() );
+
+	// Materials colors
+	materials_colors_.resize( level_data_.materials.size() );
+	for( const plb_Material& material : level_data_.materials )
+	{
+		MaterialColors& colors= materials_colors_[ &material - level_data_.materials.data() ];
+
+		unsigned char color[4];
+		const plb_ImageInfo& albedo_texture= level_data_.textures[ material.albedo_texture_number ];
+		textures_manager.GetTextureAverageColor(
+			albedo_texture.texture_array_id,
+			albedo_texture.texture_layer_id,
+			color );
+		colors.albedo= m_Vec3( float(color[0]), float(color[1]), float(color[2]) ) / 255.0f;
+
+		// Bright luminous surfaces already splitted into surface sample lights.
+		if( material.luminosity > 0.0f && !material.split_to_point_lights )
+		{
+			const plb_ImageInfo& light_texture= level_data_.textures[ material.light_texture_number ];
+			textures_manager.GetTextureAverageColor(
+				light_texture.texture_array_id,
+				light_texture.texture_layer_id,
+				color );
+			colors.emission=
+				m_Vec3( float(color[0]), float(color[1]), float(color[2]) ) *
+				( material.luminosity / 255.0f );
+		}
+		else
+			colors.emission= m_Vec3( 0.0f, 0.0f, 0.0f );
+	}
+
+	// Hammersley points, mapped to cosine-weighted hemisphere.
+	const unsigned int ray_count= std::max( 1u, config_.cpu_secondary_light_pass_rays );
+	hemisphere_directions_.resize( ray_count );
+	for( unsigned int i= 0; i < ray_count; i++ )
+	{
+		const float u= ( float(i) + 0.5f ) / float(ray_count);
+		const float phi= plb_Constants::two_pi * RadicalInverse(i);
+		const float r= std::sqrt(u);
+
+		hemisphere_directions_[i]=
+			m_Vec3(
+				r * std::cos(phi),
+				r * std::sin(phi),
+				std::sqrt( std::max( 0.0f, 1.0f - u ) ) );
+	}
+}
+
+plb_CpuLightmapsBuilder::~plb_CpuLightmapsBuilder()
+{
+}
+
+void plb_CpuLightmapsBuilder::SetPrimaryLightTexels( LightTexels texels )
+{
+	std::vector<m_Vec3> texels_positions( texels.size() );
+	for( unsigned int i= 0; i < texels.size(); i++ )
+		texels_positions[i]= texels[i].pos;
+
+	primary_texels_grid_.reset( new plb_LightTexelsGrid( texels_positions ) );
+
+	const std::vector<unsigned int>& texels_order= primary_texels_grid_->GetTexelsOrder();
+	primary_texels_.resize( texels.size() );
+	for( unsigned int i= 0; i < texels.size(); i++ )
+		primary_texels_[i]= texels[ texels_order[i] ];
+
+	// Texels with same atlas index may be processed by different threads.
+	std::vector<unsigned char> atlas_texels_count( primary_atlas_.data.size() / 4u, 0u );
+	for( const LightTexel& texel : primary_texels_ )
+	{
+		unsigned char& count= atlas_texels_count[ texel.texel_index ];
+		count= static_cast<unsigned char>( std::min( count + 1, 2 ) );
+	}
+
+	primary_texels_shared_.resize( primary_texels_.size() );
+	for( unsigned int i= 0; i < primary_texels_.size(); i++ )
+		primary_texels_shared_[i]= atlas_texels_count[ primary_texels_[i].texel_index ] > 1u;
+}
+
+void plb_CpuLightmapsBuilder::PointLightPass( const m_Vec3& light_pos, const m_Vec3& light_color )
+{
+	PrimaryLightPass(
+		GetPrimaryTexelsNearLight( light_pos, light_color ),
+		[&]( const LightTexel& texel, m_Vec3& out_light, m_Vec3& out_light_pos ) -> bool
+		{
+			const m_Vec3 vec_to_light= light_pos - texel.pos;
+			const float vec_to_light_square_length= vec_to_light.SquareLength();
+			const float vec_to_light_length= std::sqrt( vec_to_light_square_length );
+
+			const float angle_scaler= ( vec_to_light * texel.normal ) / vec_to_light_length;
+			if( !( angle_scaler > 0.0f ) )
+				return false;
+
+			out_light= light_color * ( angle_scaler / vec_to_light_square_length );
+			out_light_pos= light_pos;
+			return true;
+		} );
+}
+
+void plb_CpuLightmapsBuilder::SurfaceSampleLightPass(
+	const m_Vec3& light_pos,
+	const m_Vec3& light_normal,
+	const m_Vec3& light_color )
+{
+	PrimaryLightPass(
+		GetPrimaryTexelsNearLight( light_pos, light_color ),
+		[&]( const LightTexel& texel, m_Vec3& out_light, m_Vec3& out_light_pos ) -> bool
+		{
+			const m_Vec3 vec_to_light= light_pos - texel.pos;
+			const float vec_to_light_length=
+				std::max( g_surface_sample_light_min_length, vec_to_light.Length() );
+			const m_Vec3 normalized_vec_to_light= vec_to_light / vec_to_light_length;
+
+			const float angle_scaler=
+				std::max( 0.0f, normalized_vec_to_light * texel.normal ) *
+				std::max( 0.0f, -( normalized_vec_to_light * light_normal ) );
+			if( !( angle_scaler > 0.0f ) )
+				return false;
+
+			out_light= light_color * ( angle_scaler / ( vec_to_light_length * vec_to_light_length ) );
+			// Light sample lies on surface, move it forward.
+			out_light_pos= light_pos + light_normal * g_shadow_ray_offset;
+			return true;
+		} );
+}
+
+void plb_CpuLightmapsBuilder::DirectionalLightPass( const plb_DirectionalLight& light )
+{
+	m_Vec3 light_dir( light.direction );
+	light_dir.Normalize();
+
+	m_Vec3 light_color( float(light.color[0]), float(light.color[1]), float(light.color[2]) );
+	light_color*= light.intensity / 255.0f;
+
+	PrimaryLightPass(
+		GetAllPrimaryTexels(),
+		[&]( const LightTexel& texel, m_Vec3& out_light, m_Vec3& out_light_pos ) -> bool
+		{
+			const float normal_vec_to_light_cos= texel.normal * light_dir;
+			if( !( normal_vec_to_light_cos > 0.0f ) )
+				return false;
+
+			out_light= light_color * normal_vec_to_light_cos;
+			// Trace to point outside level. Sky polygons are not in tracer, so, ray, which reach sky, is not shadowed.
+			out_light_pos= texel.pos + light_dir * level_diagonal_length_;
+			return true;
+		} );
+}
+
+void plb_CpuLightmapsBuilder::ConeLightPass( const plb_ConeLight& light )
+{
+	const m_Vec3 light_pos( light.pos );
+	m_Vec3 light_dir( light.direction );
+	light_dir.Normalize();
+
+	m_Vec3 light_color( float(light.color[0]), float(light.color[1]), float(light.color[2]) );
+	light_color*= light.intensity / 255.0f;
+
+	const float inv_tan_half_angle= 1.0f / std::tan( light.angle );
+
+	PrimaryLightPass(
+		GetAllPrimaryTexels(),
+		[&]( const LightTexel& texel, m_Vec3& out_light, m_Vec3& out_light_pos ) -> bool
+		{
+			const m_Vec3 vec_from_light= texel.pos - light_pos;
+
+			// Cull cone light back
+			const float depth= vec_from_light * light_dir;
+			if( !( depth > 0.0f ) )
+				return false;
+
+			// Same falloff, as in shader - radius in projection plane.
+			const float radius=
+				( vec_from_light - light_dir * depth ).Length() * inv_tan_half_angle / depth;
+			const float cone_factor= 1.0f - SmoothStep( 0.8f * 0.8f, 1.0f, radius * radius );
+			if( !( cone_factor > 0.0f ) )
+				return false;
+
+			const float vec_to_light_square_length= vec_from_light.SquareLength();
+			const float angle_scaler=
+				-( vec_from_light * texel.normal ) / std::sqrt( vec_to_light_square_length );
+			if( !( angle_scaler > 0.0f ) )
+				return false;
+
+			out_light= light_color * ( cone_factor * angle_scaler / vec_to_light_square_length );
+			out_light_pos= light_pos;
+			return true;
+		} );
+}
+
+void plb_CpuLightmapsBuilder::SecondaryLightPass(
+	const LightTexels& secondary_texels,
+	const unsigned int start_texel,
+	const Atlas* const previous_bounce,
+	const std::function<void( unsigned int texels_done )>& progress_callback )
+{
+	const unsigned int c_texels_per_wake_up= 4096u;
+
+	const auto start_time= std::chrono::steady_clock::now();
+
+	const float ray_length= level_diagonal_length_;
+	const float inv_ray_count= 1.0f / float(hemisphere_directions_.size());
+
+	for( unsigned int first_texel= start_texel; first_texel < secondary_texels.size(); first_texel+= c_texels_per_wake_up )
+	{
+		const unsigned int texel_count=
+			std::min( c_texels_per_wake_up, static_cast<unsigned int>(secondary_texels.size()) - first_texel );
+
+		plbParallelFor(
+			texel_count,
+			threads_count_,
+			[&]( const unsigned int begin, const unsigned int end, unsigned int )
+			{
+				for( unsigned int t= first_texel + begin; t < first_texel + end; t++ )
+				{
+					const LightTexel& texel= secondary_texels[t];
+
+					m_Vec3 tangent, binormal;
+					GetNormalBasis( texel.normal, tangent, binormal );
+
+					// Rotate hemisphere directions for each texel, for prevention of banding.
+					const float rotation_angle= plb_Constants::two_pi * RadicalInverse( t + 1u );
+					const float rotation_cos= std::cos( rotation_angle );
+					const float rotation_sin= std::sin( rotation_angle );
+
+					const m_Vec3 ray_start= texel.pos + texel.normal * g_shadow_ray_offset;
+
+					m_Vec3 light( 0.0f, 0.0f, 0.0f );
+					for( const m_Vec3& local_dir : hemisphere_directions_ )
+					{
+						const m_Vec3 dir=
+							tangent * ( local_dir.x * rotation_cos - local_dir.y * rotation_sin ) +
+							binormal * ( local_dir.x * rotation_sin + local_dir.y * rotation_cos ) +
+							texel.normal * local_dir.z;
+
+						// Find nearest front face.
+						plb_Tracer::TraceResult nearest_result;
+						if( !tracer_.TraceClosest( ray_start, ray_start + dir * ray_length, nearest_result, true ) )
+							continue;
+
+						const MaterialColors& colors= materials_colors_[ nearest_result.material_id ];
+						m_Vec3 surface_light;
+						if( previous_bounce == nullptr )
+						{
+							surface_light= FetchPrimaryLight( nearest_result.lightmap_coord );
+							light+= colors.emission;
+						}
+						else
+							surface_light= FetchSecondaryLight( *previous_bounce, nearest_result.lightmap_coord );
+
+						light+= m_Vec3(
+							surface_light.x * colors.albedo.x,
+							surface_light.y * colors.albedo.y,
+							surface_light.z * colors.albedo.z );
+					} // for rays
+
+					// Cosine-weighted rays, so, result is just average.
+					light*= inv_ray_count;
+
+					float* const dst= secondary_atlas_.data.data() + 4u * texel.texel_index;
+					dst[0]= light.x;
+					dst[1]= light.y;
+					dst[2]= light.z;
+					dst[3]= 1.0f;
+				} // for texels
+			} );
+
+		std::cout << "Secondary light texels: " << first_texel + texel_count << "/" << secondary_texels.size() << std::endl;
+		progress_callback( first_texel + texel_count );
+	}
+
+	const auto end_time= std::chrono::steady_clock::now();
+	const auto time_ms= std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+
+	const unsigned int texels_built= static_cast<unsigned int>(secondary_texels.size()) - std::min( start_texel, static_cast<unsigned int>(secondary_texels.size()) );
+	std::cout << "Build light for " << texels_built << " texels." <<
+		" Time: " << static_cast<float>(time_ms) / 1000.0f << " s." <<
+		" Texels per second: " << static_cast<float>(texels_built) / static_cast<float>( std::max<long long>( time_ms, 1 ) ) * 1000.0f
+		<< std::endl;
+}
+
+void plb_CpuLightmapsBuilder::ForEachAtlasLayer(
+	const bool secondary,
+	const std::function<void( float* layer_data, const unsigned int* layer_size, unsigned int layer )>& func )
+{
+	Atlas& atlas= secondary ? secondary_atlas_ : primary_atlas_;
+	const unsigned int layer_texels= atlas.size[0] * atlas.size[1];
+
+	for( unsigned int layer= 0u; layer < atlas.size[2]; layer++ )
+		func( atlas.data.data() + 4u * layer_texels * layer, atlas.size, layer );
+}
+
+void plb_CpuLightmapsBuilder::PrimaryLightPass(
+	const plb_LightTexelsGrid::TexelsRanges& texels_ranges,
+	const PrimaryLightFunc& func )
+{
+	// Offset of each range in sequence of all texels of all ranges.
+	std::vector<unsigned int> ranges_offsets( texels_ranges.size() + 1u );
+	ranges_offsets[0]= 0u;
+	for( unsigned int r= 0; r < texels_ranges.size(); r++ )
+		ranges_offsets[ r + 1u ]= ranges_offsets[r] + texels_ranges[r].count;
+
+	plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, ranges_offsets.back() );
+
+	// Light of texels, which share atlas texel with other texels, is collected by each thread
+	// and added to atlas after all threads are finished.
+	std::vector< std::vector<SharedTexelLight> > shared_texels_lights( threads_count_ );
+
+	plbParallelFor(
+		ranges_offsets.back(),
+		threads_count_,
+		[&]( const unsigned int begin, const unsigned int end, const unsigned int thread_number )
+		{
+			std::vector<SharedTexelLight>& thread_shared_texels_lights= shared_texels_lights[ thread_number ];
+
+			// Shadow rays of neighbor texels are traced together, in packets.
+			const unsigned int c_packet_size= plb_Tracer::c_max_packet_size;
+			unsigned int packet_texels[ c_packet_size ];
+			m_Vec3 packet_lights[ c_packet_size ];
+			m_Vec3 packet_rays_from[ c_packet_size ];
+			m_Vec3 packet_rays_to[ c_packet_size ];
+			bool packet_occluded[ c_packet_size ];
+			unsigned int packet_size= 0;
+
+			const auto add_light=
+			[&]( const unsigned int t, const m_Vec3& light )
+			{
+				if( primary_texels_shared_[t] )
+				{
+					thread_shared_texels_lights.push_back( SharedTexelLight{ t, light, 0.0f } );
+					return;
+				}
+
+				float* const dst= primary_atlas_.data.data() + 4u * primary_texels_[t].texel_index;
+				dst[0]+= light.x;
+				dst[1]+= light.y;
+				dst[2]+= light.z;
+			};
+
+			const auto flush_packet=
+			[&]()
+			{
+				tracer_.OccludedPacket( packet_rays_from, packet_rays_to, packet_size, packet_occluded );
+				for( unsigned int i= 0; i < packet_size; i++ )
+				{
+					if( !packet_occluded[i] )
+						add_light( packet_texels[i], packet_lights[i] );
+				}
+				packet_size= 0;
+			};
+
+			// Find range, containing first texel.
+			unsigned int range_index=
+				static_cast<unsigned int>(
+					std::upper_bound( ranges_offsets.begin(), ranges_offsets.end(), begin ) - ranges_offsets.begin() ) - 1u;
+
+			for( unsigned int i= begin; i < end; i++ )
+			{
+				while( i >= ranges_offsets[ range_index + 1u ] )
+					range_index++;
+
+				const unsigned int t= texels_ranges[ range_index ].first + ( i - ranges_offsets[ range_index ] );
+				const LightTexel& texel= primary_texels_[t];
+
+				// Blending "ONE, ONE" in OpenGL version adds 1 to alpha in each pass.
+				if( primary_texels_shared_[t] )
+					thread_shared_texels_lights.push_back( SharedTexelLight{ t, m_Vec3( 0.0f, 0.0f, 0.0f ), 1.0f } );
+				else
+					primary_atlas_.data[ 4u * texel.texel_index + 3u ]+= 1.0f;
+
+				m_Vec3 light, light_pos;
+				if( !func( texel, light, light_pos ) )
+					continue;
+
+				if( !GetShadowRay(
+						texel.pos, texel.normal, light_pos,
+						packet_rays_from[ packet_size ], packet_rays_to[ packet_size ] ) )
+				{
+					add_light( t, light );
+					continue;
+				}
+
+				packet_texels[ packet_size ]= t;
+				packet_lights[ packet_size ]= light;
+				packet_size++;
+				if( packet_size == c_packet_size )
+					flush_packet();
+			}
+
+			if( packet_size > 0 )
+				flush_packet();
+		} );
+
+	// Add light in order of texels, so, result does not depend on distribution of work between threads.
+	std::vector<SharedTexelLight> all_shared_texels_lights;
+	for( const std::vector<SharedTexelLight>& thread_shared_texels_lights : shared_texels_lights )
+		all_shared_texels_lights.insert( all_shared_texels_lights.end(), thread_shared_texels_lights.begin(), thread_shared_texels_lights.end() );
+
+	std::stable_sort(
+		all_shared_texels_lights.begin(), all_shared_texels_lights.end(),
+		[]( const SharedTexelLight& l, const SharedTexelLight& r ) { return l.texel < r.texel; } );
+
+	for( const SharedTexelLight& texel_light : all_shared_texels_lights )
+	{
+		float* const dst= primary_atlas_.data.data() + 4u * primary_texels_[ texel_light.texel ].texel_index;
+		dst[0]+= texel_light.light.x;
+		dst[1]+= texel_light.light.y;
+		dst[2]+= texel_light.light.z;
+		dst[3]+= texel_light.alpha;
+	}
+}
+
+const plb_LightTexelsGrid::TexelsRanges& plb_CpuLightmapsBuilder::GetPrimaryTexelsNearLight(
+	const m_Vec3& light_pos,
+	const m_Vec3& light_color )
+{
+	primary_texels_ranges_.clear();
+	primary_texels_grid_->GetTexelsInSphere(
+		light_pos,
+		plb_LightTexelsGrid::GetLightCutoffRadius( light_color, config_.light_cutoff_threshold ),
+		primary_texels_ranges_ );
+	plb_LightTexelsGrid::MergeRanges( primary_texels_ranges_ );
+
+	if( primary_texels_ranges_.empty() )
+		plbProfilerAddCounter( plb_ProfilerCounter::LightsCulled, 1u );
+
+	return primary_texels_ranges_;
+}
+
+const plb_LightTexelsGrid::TexelsRanges& plb_CpuLightmapsBuilder::GetAllPrimaryTexels()
+{
+	primary_texels_ranges_.clear();
+	if( !primary_texels_.empty() )
+		primary_texels_ranges_.push_back( plb_LightTexelsGrid::TexelsRange{ 0u, static_cast<unsigned int>(primary_texels_.size()) } );
+
+	return primary_texels_ranges_;
+}
+
+bool plb_CpuLightmapsBuilder::GetShadowRay(
+	const m_Vec3& texel_pos,
+	const m_Vec3& texel_normal,
+	const m_Vec3& light_pos,
+	m_Vec3& out_from,
+	m_Vec3& out_to ) const
+{
+	out_from= texel_pos + texel_normal * g_shadow_ray_offset;
+
+	m_Vec3 to_light= light_pos - out_from;
+	const float distance_to_light= to_light.Length();
+	if( distance_to_light <= g_light_pos_offset )
+		return false;
+
+	to_light/= distance_to_light;
+	out_to= light_pos - to_light * g_light_pos_offset;
+
+	return true;
+}
+
+m_Vec3 plb_CpuLightmapsBuilder::FetchPrimaryLight( const m_Vec3& lightmap_coord ) const
+{
+	const int x=
+		std::min(
+			std::max( int( lightmap_coord.x * float(primary_atlas_.size[0]) ), 0 ),
+			int(primary_atlas_.size[0]) - 1 );
+	const int y=
+		std::min(
+			std::max( int( lightmap_coord.y * float(primary_atlas_.size[1]) ), 0 ),
+			int(primary_atlas_.size[1]) - 1 );
+	const int layer=
+		std::min(
+			std::max( int( lightmap_coord.z + 0.5f ), 0 ),
+			int(primary_atlas_.size[2]) - 1 );
+
+	const float* const src=
+		primary_atlas_.data.data() +
+		4u * ( x + ( y + layer * primary_atlas_.size[1] ) * primary_atlas_.size[0] );
+
+	return m_Vec3( src[0], src[1], src[2] );
+}
+
+m_Vec3 plb_CpuLightmapsBuilder::FetchSecondaryLight( const Atlas& atlas, const m_Vec3& lightmap_coord ) const
+{
+	// Secondary atlas has same layout, as primary atlas, but texels are "secondary_lightmap_scaler" times bigger.
+	const float scaler= float( std::max( 1u, config_.secondary_lightmap_scaler ) );
+	const int x=
+		std::min(
+			std::max( int( lightmap_coord.x * float(primary_atlas_.size[0]) / scaler ), 0 ),
+			int(atlas.size[0]) - 1 );
+	const int y=
+		std::min(
+			std::max( int( lightmap_coord.y * float(primary_atlas_.size[1]) / scaler ), 0 ),
+			int(atlas.size[1]) - 1 );
+	const int layer=
+		std::min(
+			std::max( int( lightmap_coord.z + 0.5f ), 0 ),
+			int(atlas.size[2]) - 1 );
+
+	const float* const src=
+		atlas.data.data() +
+		4u * ( x + ( y + layer * atlas.size[1] ) * atlas.size[0] );
+
+	return m_Vec3( src[0], src[1], src[2] );
+}
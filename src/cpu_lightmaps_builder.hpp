@@ -0,0 +1,150 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <vec.hpp>
+
+#include "formats.hpp"
+#include "light_texels_grid.hpp"
+#include "textures_manager.hpp"
+#include "tracer.hpp"
+
+// Lightmaps builder, which works without OpenGL.
+// Shadows are calculated via tracing of rays through level geometry, secondary light - via
+// gathering of light from hemisphere around each texel.
+// All passes are multithreaded.
+class plb_CpuLightmapsBuilder final
+{
+public:
+	struct LightTexel
+	{
+		m_Vec3 pos;
+		m_Vec3 normal;
+		unsigned int texel_index; // x + y * atlas_width + layer * atlas_width * atlas_height
+	};
+
+	typedef std::vector<LightTexel> LightTexels;
+
+	struct Atlas
+	{
+		unsigned int size[3];
+		std::vector<float> data; // RGBA, 4 floats per texel
+	};
+
+	plb_CpuLightmapsBuilder(
+		const plb_LevelData& level_data,
+		const plb_Config& config,
+		const plb_Tracer& tracer,
+		const plb_TexturesManager& textures_manager,
+		const unsigned int* atlas_size, // width, height, layers
+		const unsigned int* secondary_atlas_size ); // width, height
+
+	~plb_CpuLightmapsBuilder();
+
+	void SetPrimaryLightTexels( LightTexels texels );
+	// Texels are sorted by cells of grid.
+	const LightTexels& GetPrimaryLightTexels() const;
+
+	void PointLightPass( const m_Vec3& light_pos, const m_Vec3& light_color );
+	void SurfaceSampleLightPass( const m_Vec3& light_pos, const m_Vec3& light_normal, const m_Vec3& light_color );
+	void DirectionalLightPass( const plb_DirectionalLight& light );
+	void ConeLightPass( const plb_ConeLight& light );
+
+	// Texel indeces in secondary texels must be indeces of secondary atlas.
+	// Light is calculated for texels starting from "start_texel", light of previous texels must be already in atlas.
+	// If "previous_bounce" is null, first bounce is calculated - light of primary atlas and luminous surfaces is gathered.
+	// Otherwise light of previous bounce (atlas with size of secondary atlas) is gathered.
+	// Callback is called after each block of texels with number of finished texels.
+	void SecondaryLightPass(
+		const LightTexels& secondary_texels,
+		unsigned int start_texel,
+		const Atlas* previous_bounce,
+		const std::function<void( unsigned int texels_done )>& progress_callback );
+
+	// Calls function for each layer of primary or secondary atlas. Function may modify layer data.
+	void ForEachAtlasLayer(
+		bool secondary,
+		const std::function<void( float* layer_data, const unsigned int* layer_size, unsigned int layer )>& func );
+
+	const Atlas& GetPrimaryAtlas() const;
+	const Atlas& GetSecondaryAtlas() const;
+
+private:
+	struct MaterialColors
+	{
+		m_Vec3 albedo; // in range [0; 1]
+		m_Vec3 emission; // luminosity multiplied by light texture color
+	};
+
+	// Function calculates unshadowed light of one texel and position of light source for shadow test.
+	// Returns false, if texel is not lit.
+	typedef std::function<bool( const LightTexel& texel, m_Vec3& out_light, m_Vec3& out_light_pos )> PrimaryLightFunc;
+
+	// Light of primary texel, which shares atlas texel with other primary texels.
+	struct SharedTexelLight
+	{
+		unsigned int texel; // Index in primary texels.
+		m_Vec3 light;
+		float alpha;
+	};
+
+	// Calculates light for primary light texels in given ranges in parallel.
+	// Shadow rays are traced in packets.
+	void PrimaryLightPass( const plb_LightTexelsGrid::TexelsRanges& texels_ranges, const PrimaryLightFunc& func );
+
+	// Returns ranges of primary texels, which may get light above cutoff threshold from point light source.
+	const plb_LightTexelsGrid::TexelsRanges& GetPrimaryTexelsNearLight( const m_Vec3& light_pos, const m_Vec3& light_color );
+	const plb_LightTexelsGrid::TexelsRanges& GetAllPrimaryTexels();
+
+	// Returns false, if texel is too close to light source and can not be shadowed.
+	bool GetShadowRay(
+		const m_Vec3& texel_pos,
+		const m_Vec3& texel_normal,
+		const m_Vec3& light_pos,
+		m_Vec3& out_from,
+		m_Vec3& out_to ) const;
+
+	m_Vec3 FetchPrimaryLight( const m_Vec3& lightmap_coord ) const;
+	// Lightmap coordinates are coordinates of primary atlas.
+	m_Vec3 FetchSecondaryLight( const Atlas& atlas, const m_Vec3& lightmap_coord ) const;
+
+private:
+	const plb_LevelData& level_data_;
+	const plb_Config& config_;
+	const plb_Tracer& tracer_;
+
+	const unsigned int threads_count_;
+
+	float level_diagonal_length_;
+
+	std::vector<MaterialColors> materials_colors_;
+
+	// Precalculated cosine-weighted directions for hemisphere around z+.
+	std::vector<m_Vec3> hemisphere_directions_;
+
+	// Primary texels are sorted by cells of grid.
+	LightTexels primary_texels_;
+	// For each primary texel - true, if other primary texels have same atlas index.
+	std::vector<bool> primary_texels_shared_;
+	std::unique_ptr<plb_LightTexelsGrid> primary_texels_grid_;
+	plb_LightTexelsGrid::TexelsRanges primary_texels_ranges_;
+
+	Atlas primary_atlas_;
+	Atlas secondary_atlas_;
+};
+
+inline const plb_CpuLightmapsBuilder::LightTexels& plb_CpuLightmapsBuilder::GetPrimaryLightTexels() const
+{
+	return primary_texels_;
+}
+
+inline const plb_CpuLightmapsBuilder::Atlas& plb_CpuLightmapsBuilder::GetPrimaryAtlas() const
+{
+	return primary_atlas_;
+}
+
+inline const plb_CpuLightmapsBuilder::Atlas& plb_CpuLightmapsBuilder::GetSecondaryAtlas() const
+{
+	return secondary_atlas_;
+}
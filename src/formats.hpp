@@ -232,12 +232,140 @@ struct plb_Config
 	// nahodilisj blizko v pamäti, no i ne ocenj malenjkim - ctoby vlezli samyje boljšije poverhnosti.
 	unsigned int lightmaps_atlas_size[2]= { 512, 2048 };
 
+	// Algorithm of placement of lightmaps into atlas layers.
+	enum class LightmapsAtlasPacker
+	{
+		Shelf, // Rows of lightmaps, sorted by height.
+		Skyline, // Bottom-left placement on upper contour of placed lightmaps, with rotation.
+		MaxRects, // Best short side fit into maximal free rectangles, with rotation. Slower, but denser.
+	};
+
+	LightmapsAtlasPacker lightmaps_atlas_packer= LightmapsAtlasPacker::Skyline;
+
 	// Otnošenije razmera ishodnoj karty osvescenija k karte osvescenija ot vtoricnyh istocnikov.
 	unsigned int secondary_lightmap_scaler= 4;
 
+	// Maximum number of bounces of secondary light. Values in range [1; 8] are supported.
+	// Each next bounce gathers light of previous bounce. OpenGL backend uses twice coarser sampling step for each next bounce.
+	unsigned int secondary_light_bounces= 1;
+
+	// Bounces stop, when light of last bounce is less, than this part of light of first bounce.
+	float secondary_light_bounces_energy_threshold= 0.05f;
+
+	// Step of grid of adaptive sampling of first secondary light bounce in OpenGL backend.
+	// Hemicubes are rendered for grid corners first. Light inside smooth cells is interpolated,
+	// other cells are sampled for each texel. Value 1 disables adaptive sampling.
+	unsigned int secondary_light_adaptive_step= 1;
+
+	// Cell is smooth, if light difference between its corners is less, than this part of average light.
+	float secondary_light_adaptive_threshold= 0.1f;
+
+	// Maximum error of irradiance cache in secondary light pass of OpenGL backend.
+	// Texels near existing cache record reuse its light instead of rendering of own hemicube.
+	// Typical values are in range [0.1; 0.5], zero disables cache. Adaptive sampling takes precedence.
+	float secondary_light_irradiance_cache_error= 0.0f;
+
+	// Number of hemicubes, rendered together in secondary light pass of OpenGL backend.
+	// Values in range [1; 8] are supported.
+	unsigned int secondary_light_pass_batch_size= 8;
+
+	// Number of point lights (or surface sample lights), which shadowmaps are rendered together
+	// and which light is accumulated in one pass of OpenGL backend.
+	// Values in range [1; 8] are supported. Each light in batch requires own depth cubemap.
+	unsigned int point_light_pass_batch_size= 4;
+
+	// Minimal light of point light sources (and surface sample lights), which is calculated.
+	// Texels, where unshadowed light of source is weaker, than this threshold, are skipped.
+	// Zero value - process all texels for each light. Values about 1/256 give almost same result much faster.
+	float light_cutoff_threshold= 0.0f;
+
+	// Number of iterations of edge-aware "à-trous" filter of secondary light. Zero disables filtering.
+	// Each iteration doubles filter radius. Allows using of smaller secondary light pass cubemaps.
+	unsigned int secondary_light_denoise_iterations= 0;
+
+	// Allowed relative difference of light of texels, filtered together.
+	// Bigger values make result smoother, but blur light edges.
+	float secondary_light_denoise_strength= 0.5f;
+
+	// Number of passes of filling of empty texels near lightmaps borders. Each pass fills one texel wide border.
+	// Prevents bleeding of black texels on surfaces seams. Zero disables dilation.
+	unsigned int lightmaps_dilation_passes= 3;
+
 	// Ispoljzovatj li usrednenije çveta tekstury svetäscejsä poverhnosti pri rascöte
 	// sveta ot nejo.
 	bool use_average_texture_color_for_luminous_surfaces= true;
+
+	enum class Backend
+	{
+		OpenGL,
+		CPU, // Headless, without window and OpenGL context. Shadows are traced, not rasterized.
+	};
+
+	Backend backend= Backend::OpenGL;
+
+	// Number of threads for CPU backend and for other multithreaded stages (tracer building, dilation, denoising). 0 - use all hardware threads.
+	unsigned int cpu_threads= 0;
+
+	// Number of hemisphere rays per texel in secondary light pass of CPU backend.
+	unsigned int cpu_secondary_light_pass_rays= 256;
+
+	// Encoding of texels in output lightmaps file.
+	enum class LightmapsFileEncoding
+	{
+		Float32, // 16 bytes per texel
+		Float16, // 8 bytes per texel
+		RGBE, // 4 bytes per texel, shared exponent, without alpha
+	};
+
+	LightmapsFileEncoding lightmaps_file_encoding= LightmapsFileEncoding::Float32;
+
+	// Multiplier for conversion of calculated light into 8-bit lightmaps of BSP files.
+	float bsp_lightmap_scale= 16.0f;
+
+	// File for periodic saving of progress of secondary light pass. Empty string disables checkpoints.
+	// If file exists and was created for same level and options, secondary light pass continues from saved progress.
+	std::string secondary_light_checkpoint_file;
+
+	// Minimal interval between checkpoints, in seconds.
+	unsigned int secondary_light_checkpoint_interval= 300;
+
+	// File with lights and light of previous build. Empty string disables caching.
+	// If geometry and options are not changed since previous build, light is rebuilt only for changed lights.
+	// If only geometry is changed, light is rebuilt only for surfaces near changed geometry and changed lights.
+	std::string light_cache_file;
+
+	// Shard of worker process of distributed build. Worker builds light only for texels
+	// with atlas index, which remainder of division by shard count is equal to shard.
+	// Shard count 1 means usual build of all texels.
+	unsigned int worker_shard= 0;
+	unsigned int worker_shard_count= 1;
+};
+
+// Potentially visible sets of BSP level.
+// Empty, if source level has no visibility information.
+struct plb_VisibilityData
+{
+	struct Node
+	{
+		// Plane normal and distance. Point is in front of plane, if dot( normal, point ) > distance.
+		float plane[4];
+		// Children for front and back sides of plane.
+		// Non-negative value - node index, negative - "-1 - leaf index".
+		int children[2];
+	};
+
+	std::vector<Node> nodes; // Root is first node.
+	std::vector<int> leafs_clusters; // Cluster of each leaf, -1 for leafs outside level.
+
+	unsigned int cluster_count= 0;
+	unsigned int cluster_row_size= 0; // Size of visibility bit row of one cluster, in bytes.
+	std::vector<unsigned char> clusters_visibility; // Uncompressed bit rows.
+
+	// Surfaces of each cluster. Surface index is polygon index for polygons
+	// and "polygons count + curve index" for curved surfaces.
+	// Surfaces without clusters (sky, models, inline BSP models) are visible from everywhere.
+	std::vector<unsigned int> clusters_surfaces_offsets; // Size is cluster_count + 1
+	std::vector<unsigned int> clusters_surfaces;
 };
 
 struct plb_LevelData
@@ -266,4 +394,6 @@ struct plb_LevelData
 
 	plb_CurvedSurfaces curved_surfaces;
 	plb_Vertices curved_surfaces_vertices;
+
+	plb_VisibilityData visibility;
 };
@@ -25,6 +25,8 @@ extern "C"
 
 }
 
+static const unsigned int g_no_polygon= ~0u;
+
 static const bool IsSky( const std::string& name )
 {
 	return
@@ -131,8 +133,11 @@ static void LoadPolygons(
 	plb_Polygons& out_polygons,
 	std::vector<unsigned int>& out_indeces,
 	plb_Polygons& out_sky_polygons,
-	std::vector<unsigned int>& out_sky_indeces )
+	std::vector<unsigned int>& out_sky_indeces,
+	std::vector<unsigned int>& out_faces_polygons )
 {
+	out_faces_polygons.assign( numfaces, g_no_polygon );
+
 	for( const dmodel_t* model= dmodels; model < dmodels + nummodels; model++ )
 	{
 		const unsigned int model_number= model - dmodels;
@@ -160,6 +165,9 @@ static void LoadPolygons(
 			current_polygons.emplace_back();
 			plb_Polygon& poly= current_polygons.back();
 
+			if( !is_sky )
+				out_faces_polygons[ face - dfaces ]= out_polygons.size() - 1u;
+
 			const float side= face->side == 0 ? 1.0f : -1.0f;
 			poly.normal[0]= dplanes[ face->planenum ].normal[0] * side;
 			poly.normal[1]= dplanes[ face->planenum ].normal[1] * side;
@@ -270,6 +278,63 @@ static void LoadPolygons(
 	} // for models
 }
 
+// Visibility of Quake1 BSP is calculated for leafs, so, each leaf (except solid leaf 0) is cluster.
+static void LoadVisibility(
+	const std::vector<unsigned int>& faces_polygons,
+	plb_VisibilityData& out_visibility )
+{
+	const unsigned int cluster_count= static_cast<unsigned int>( dmodels[0].visleafs );
+	if( visdatasize <= 0 || cluster_count == 0u || numnodes <= 0 || dmodels[0].headnode[0] != 0 )
+		return;
+
+	out_visibility.nodes.resize( numnodes );
+	for( unsigned int i= 0; i < (unsigned int)numnodes; i++ )
+	{
+		const dnode_t& in_node= dnodes[i];
+		const dplane_t& plane= dplanes[ in_node.planenum ];
+		plb_VisibilityData::Node& out_node= out_visibility.nodes[i];
+
+		for( unsigned int j= 0; j < 3; j++ )
+			out_node.plane[j]= plane.normal[j];
+		out_node.plane[3]= plane.dist;
+
+		for( unsigned int j= 0; j < 2; j++ )
+			out_node.children[j]= in_node.children[j]; // Leafs are "-1 - leaf" too.
+	}
+
+	out_visibility.leafs_clusters.resize( numleafs );
+	for( unsigned int l= 0; l < (unsigned int)numleafs; l++ )
+		out_visibility.leafs_clusters[l]= ( l >= 1u && l <= cluster_count ) ? int(l - 1u) : -1;
+
+	out_visibility.cluster_count= cluster_count;
+	out_visibility.cluster_row_size= ( cluster_count + 7u ) / 8u;
+	out_visibility.clusters_visibility.resize( cluster_count * out_visibility.cluster_row_size );
+
+	std::vector< std::pair<unsigned int, unsigned int> > clusters_surfaces;
+	for( unsigned int c= 0; c < cluster_count; c++ )
+	{
+		const dleaf_t& leaf= dleafs[ c + 1u ];
+
+		unsigned char* const row= out_visibility.clusters_visibility.data() + c * out_visibility.cluster_row_size;
+		if( leaf.visofs < 0 )
+			std::memset( row, 0xFF, out_visibility.cluster_row_size );
+		else
+			plbDecompressQuakeVisibilityRow(
+				dvisdata + leaf.visofs, dvisdata + visdatasize,
+				out_visibility.cluster_row_size, row );
+
+		for( unsigned int i= 0; i < leaf.nummarksurfaces; i++ )
+		{
+			const unsigned int polygon_index= faces_polygons[ dmarksurfaces[ leaf.firstmarksurface + i ] ];
+			if( polygon_index != g_no_polygon )
+				clusters_surfaces.emplace_back( c, polygon_index );
+		}
+	}
+
+	plbSetClustersSurfaces( clusters_surfaces, out_visibility );
+	plbTransformVisibilityFromQuakeSystem( out_visibility );
+}
+
 static void ParseLightAndColor( const char* str, float& out_light, unsigned char* out_color )
 {
 	double val[4];
@@ -476,10 +541,14 @@ PLB_DLL_FUNC void LoadBsp(
 
 	LoadMaterials( level_data.materials, level_data.textures );
 
+	std::vector<unsigned int> faces_polygons;
 	LoadPolygons(
 		level_data.materials,
 		level_data.vertices, level_data.polygons, level_data.polygons_indeces,
-		level_data.sky_polygons, level_data.sky_polygons_indeces );
+		level_data.sky_polygons, level_data.sky_polygons_indeces,
+		faces_polygons );
+
+	LoadVisibility( faces_polygons, level_data.visibility );
 
 	plbTransformCoordinatesFromQuakeSystem(
 		level_data.polygons,
@@ -489,3 +558,99 @@ PLB_DLL_FUNC void LoadBsp(
 
 	GetBSPLights( level_data.point_lights, level_data.cone_lights, level_data.directional_lights );
 }
+
+PLB_DLL_FUNC bool SaveBsp(
+	const char* in_file_name,
+	const char* out_file_name,
+	const plb_Config& config,
+	const plb_LevelData& level_data,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas )
+{
+	LoadBSPFile( const_cast<char*>(in_file_name) );
+
+	plb_Materials materials;
+	plb_ImageInfos textures;
+	LoadMaterials( materials, textures );
+
+	std::vector<m_Vec3> face_vertices;
+	std::vector<m_Vec3> face_light;
+
+	unsigned int polygon_number= 0u;
+	for( const dmodel_t* model= dmodels; model < dmodels + nummodels; model++ )
+	{
+		for(
+			dface_t* face= dfaces + model->firstface;
+			face < dfaces + model->firstface + model->numfaces;
+			face++ )
+		{
+			// Skip faces in same way, as in "LoadPolygons".
+			const std::string& texture_file_name= materials[ face->texinfo ].albedo_texture_file_name;
+			if( SkipSurfaceWithTexture( texture_file_name ) || IsSky( texture_file_name ) )
+				continue;
+
+			if( polygon_number >= level_data.polygons.size() )
+			{
+				std::cout << "BSP file \"" << in_file_name << "\" does not match level data" << std::endl;
+				return false;
+			}
+
+			const plb_Polygon& poly= level_data.polygons[ polygon_number ];
+			polygon_number++;
+
+			if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+				continue;
+
+			face_vertices.resize( face->numedges );
+			for( unsigned int i= 0; i < (unsigned int)face->numedges; i++ )
+			{
+				const int e= dsurfedges[ face->firstedge + i ];
+				const dvertex_t& in_vertex=
+					e >= 0
+						? dvertexes[ dedges[+e].v[0] ]
+						: dvertexes[ dedges[-e].v[1] ];
+
+				face_vertices[i]= m_Vec3( in_vertex.point );
+			}
+
+			const dplane_t& plane= dplanes[ face->planenum ];
+
+			unsigned int lightmap_size[2];
+			if( !plbCalculateQuakeFaceLightmap(
+					config,
+					primary_atlas, secondary_atlas,
+					level_data, poly,
+					face_vertices,
+					texinfo[ face->texinfo ].vecs,
+					m_Vec3( plane.normal ), plane.dist,
+					lightmap_size, face_light ) )
+				continue;
+
+			// Replace first light style of face. Allocate new lightmap, if face has no lightmap.
+			if( face->lightofs < 0 || face->styles[0] == 255 )
+			{
+				if( lightdatasize + int( face_light.size() * 3u ) > MAX_MAP_LIGHTING )
+				{
+					std::cout << "Lighting data overflow" << std::endl;
+					return false;
+				}
+
+				face->lightofs= lightdatasize;
+				lightdatasize+= face_light.size() * 3u;
+
+				face->styles[0]= 0;
+				for( unsigned int i= 1; i < MAXLIGHTMAPS; i++ )
+					face->styles[i]= 255;
+			}
+
+			byte* const dst= dlightdata + face->lightofs;
+			for( unsigned int i= 0; i < face_light.size(); i++ )
+				plbLightToBSPLightmapColor( config, face_light[i], dst + i * 3u );
+		} // for faces
+	} // for models
+
+	WriteBSPFile( const_cast<char*>(out_file_name) );
+
+	std::cout << "BSP file with new lightmaps saved to \"" << out_file_name << "\"" << std::endl;
+	return true;
+}
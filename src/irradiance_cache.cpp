@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <cmath>
+
+#include "math_utils.hpp"
+
+#include "irradiance_cache.hpp"
+
+// Number of rays for estimation of record radius.
+static const unsigned int g_radius_rays= 32u;
+static const float g_ray_offset= 1.0f / 64.0f;
+static const unsigned int g_max_octree_depth= 16u;
+// Records in front of point are not used (see Ward's irradiance caching).
+static const float g_max_front_distance= 0.05f;
+
+static float RadicalInverse( unsigned int i )
+{
+	i= ( i << 16u ) | ( i >> 16u );
+	i= ( ( i & 0x55555555u ) << 1u ) | ( ( i & 0xAAAAAAAAu ) >> 1u );
+	i= ( ( i & 0x33333333u ) << 2u ) | ( ( i & 0xCCCCCCCCu ) >> 2u );
+	i= ( ( i & 0x0F0F0F0Fu ) << 4u ) | ( ( i & 0xF0F0F0F0u ) >> 4u );
+	i= ( ( i & 0x00FF00FFu ) << 8u ) | ( ( i & 0xFF00FF00u ) >> 8u );
+	return float(i) * ( 1.0f / 4294967296.0f );
+}
+
+static void GetNormalBasis( const m_Vec3& normal, m_Vec3& out_tangent, m_Vec3& out_binormal )
+{
+	const m_Vec3 axis=
+		std::abs( normal.x ) < 0.8f
+			? m_Vec3( 1.0f, 0.0f, 0.0f )
+			: m_Vec3( 0.0f, 1.0f, 0.0f );
+
+	out_tangent= mVec3Cross( normal, axis );
+	out_tangent.Normalize();
+	out_binormal= mVec3Cross( normal, out_tangent );
+}
+
+plb_IrradianceCache::plb_IrradianceCache(
+	const plb_Tracer& tracer,
+	const m_Vec3& bb_min,
+	const m_Vec3& bb_max,
+	const float max_error )
+	: tracer_(tracer)
+	, max_error_(max_error)
+{
+	const m_Vec3 extent= bb_max - bb_min;
+	max_distance_= std::max( extent.Length(), 1.0f );
+
+	// Hammersley points, mapped to cosine-weighted hemisphere.
+	hemisphere_directions_.resize( g_radius_rays );
+	for( unsigned int i= 0; i < g_radius_rays; i++ )
+	{
+		const float u= ( float(i) + 0.5f ) / float(g_radius_rays);
+		const float phi= plb_Constants::two_pi * RadicalInverse(i);
+		const float r= std::sqrt(u);
+
+		hemisphere_directions_[i]=
+			m_Vec3(
+				r * std::cos(phi),
+				r * std::sin(phi),
+				std::sqrt( std::max( 0.0f, 1.0f - u ) ) );
+	}
+
+	nodes_.emplace_back();
+	nodes_.back().center= ( bb_min + bb_max ) * 0.5f;
+	nodes_.back().half_size= 0.5f * std::max( extent.x, std::max( extent.y, extent.z ) ) + 1.0f;
+	std::fill( nodes_.back().children, nodes_.back().children + 8, 0u );
+}
+
+plb_IrradianceCache::~plb_IrradianceCache()
+{
+}
+
+template<class Func>
+void plb_IrradianceCache::ForEachValidRecord( const m_Vec3& pos, const m_Vec3& normal, const Func& func ) const
+{
+	unsigned int stack[ g_max_octree_depth * 8u + 1u ];
+	unsigned int stack_size= 0u;
+	stack[ stack_size++ ]= 0u;
+
+	while( stack_size > 0u )
+	{
+		const Node& node= nodes_[ stack[ --stack_size ] ];
+
+		for( const unsigned int record_index : node.records )
+		{
+			const float weight= GetRecordWeight( records_[ record_index ], pos, normal );
+			if( weight > 0.0f )
+				func( record_index, weight );
+		}
+
+		for( const unsigned int child_index : node.children )
+		{
+			if( child_index == 0u )
+				continue;
+
+			// Check loose bounds of child. Loose bounds are twice bigger, than node.
+			const Node& child= nodes_[ child_index ];
+			const m_Vec3 vec= pos - child.center;
+			const float loose_half_size= child.half_size * 2.0f;
+			if( std::abs( vec.x ) <= loose_half_size &&
+				std::abs( vec.y ) <= loose_half_size &&
+				std::abs( vec.z ) <= loose_half_size )
+				stack[ stack_size++ ]= child_index;
+		}
+	}
+}
+
+bool plb_IrradianceCache::HasValidRecord( const m_Vec3& pos, const m_Vec3& normal ) const
+{
+	bool found= false;
+	ForEachValidRecord(
+		pos, normal,
+		[&]( unsigned int, float )
+		{
+			found= true;
+		} );
+
+	return found;
+}
+
+unsigned int plb_IrradianceCache::AddRecord(
+	const m_Vec3& pos,
+	const m_Vec3& normal,
+	const float min_radius,
+	const float max_radius )
+{
+	const unsigned int record_index= records_.size();
+
+	// Calculate harmonic mean distance to visible geometry.
+	m_Vec3 tangent, binormal;
+	GetNormalBasis( normal, tangent, binormal );
+
+	// Rotate directions for each record, for prevention of banding.
+	const float rotation_angle= plb_Constants::two_pi * RadicalInverse( record_index + 1u );
+	const float rotation_cos= std::cos( rotation_angle );
+	const float rotation_sin= std::sin( rotation_angle );
+
+	const m_Vec3 ray_start= pos + normal * g_ray_offset;
+
+	float inv_distances_sum= 0.0f;
+	for( const m_Vec3& local_dir : hemisphere_directions_ )
+	{
+		const m_Vec3 dir=
+			tangent * ( local_dir.x * rotation_cos - local_dir.y * rotation_sin ) +
+			binormal * ( local_dir.x * rotation_sin + local_dir.y * rotation_cos ) +
+			normal * local_dir.z;
+
+		float distance= max_distance_;
+		plb_Tracer::TraceResult result;
+		if( tracer_.TraceClosest( ray_start, ray_start + dir * max_distance_, result, true ) )
+			distance= std::max( ( result.pos - ray_start ).Length(), g_ray_offset );
+
+		inv_distances_sum+= 1.0f / distance;
+	}
+
+	records_.emplace_back();
+	Record& record= records_.back();
+	record.pos= pos;
+	record.normal= normal;
+	record.radius=
+		std::max( min_radius, std::min( float(hemisphere_directions_.size()) / inv_distances_sum, max_radius ) );
+	record.irradiance= m_Vec3( 0.0f, 0.0f, 0.0f );
+	record.alpha= 0.0f;
+	for( m_Vec3& gradient : record.gradients )
+		gradient= m_Vec3( 0.0f, 0.0f, 0.0f );
+
+	// Place record into deepest node, which loose bounds contain sphere of record validity.
+	const float validity_radius= record.radius * max_error_;
+
+	unsigned int node_index= 0u;
+	for( unsigned int depth= 0u; depth < g_max_octree_depth; depth++ )
+	{
+		const float child_half_size= nodes_[ node_index ].half_size * 0.5f;
+		if( validity_radius > child_half_size )
+			break;
+
+		unsigned int child= 0u;
+		m_Vec3 child_center= nodes_[ node_index ].center;
+		for( unsigned int j= 0; j < 3; j++ )
+		{
+			if( pos.ToArr()[j] >= nodes_[ node_index ].center.ToArr()[j] )
+			{
+				child|= 1u << j;
+				child_center.ToArr()[j]+= child_half_size;
+			}
+			else
+				child_center.ToArr()[j]-= child_half_size;
+
+			// Record outside root node.
+			if( std::abs( pos.ToArr()[j] - child_center.ToArr()[j] ) > child_half_size )
+				child= ~0u;
+		}
+		if( child == ~0u )
+			break;
+
+		if( nodes_[ node_index ].children[ child ] == 0u )
+		{
+			const unsigned int new_node_index= nodes_.size();
+			nodes_[ node_index ].children[ child ]= new_node_index;
+
+			nodes_.emplace_back();
+			nodes_.back().center= child_center;
+			nodes_.back().half_size= child_half_size;
+			std::fill( nodes_.back().children, nodes_.back().children + 8, 0u );
+		}
+		node_index= nodes_[ node_index ].children[ child ];
+	}
+
+	nodes_[ node_index ].records.push_back( record_index );
+
+	return record_index;
+}
+
+void plb_IrradianceCache::CalculateGradients()
+{
+	for( unsigned int i= 0u; i < records_.size(); i++ )
+	{
+		Record& record= records_[i];
+
+		m_Vec3 tangent, binormal;
+		GetNormalBasis( record.normal, tangent, binormal );
+
+		// Weighted least squares fit of gradient in record plane.
+		float mat[3]= { 0.0f, 0.0f, 0.0f }; // xx, xy, yy
+		float rhs[3][2]= { { 0.0f, 0.0f }, { 0.0f, 0.0f }, { 0.0f, 0.0f } };
+		unsigned int neighbor_count= 0u;
+
+		ForEachValidRecord(
+			record.pos, record.normal,
+			[&]( const unsigned int neighbor_index, const float weight )
+			{
+				if( neighbor_index == i )
+					return;
+
+				const Record& neighbor= records_[ neighbor_index ];
+				const m_Vec3 vec= neighbor.pos - record.pos;
+				const float dx= vec * tangent;
+				const float dy= vec * binormal;
+
+				mat[0]+= weight * dx * dx;
+				mat[1]+= weight * dx * dy;
+				mat[2]+= weight * dy * dy;
+				for( unsigned int c= 0; c < 3; c++ )
+				{
+					const float delta= neighbor.irradiance.ToArr()[c] - record.irradiance.ToArr()[c];
+					rhs[c][0]+= weight * delta * dx;
+					rhs[c][1]+= weight * delta * dy;
+				}
+				neighbor_count++;
+			} );
+
+		if( neighbor_count < 2u )
+			continue;
+
+		const float det= mat[0] * mat[2] - mat[1] * mat[1];
+		const float trace= mat[0] + mat[2];
+		if( !( det > 1.0e-4f * trace * trace ) )
+			continue; // Neighbors lie on one line.
+
+		const float inv_det= 1.0f / det;
+		for( unsigned int c= 0; c < 3; c++ )
+		{
+			const float gx= ( mat[2] * rhs[c][0] - mat[1] * rhs[c][1] ) * inv_det;
+			const float gy= ( mat[0] * rhs[c][1] - mat[1] * rhs[c][0] ) * inv_det;
+			record.gradients[c]= tangent * gx + binormal * gy;
+		}
+	}
+}
+
+bool plb_IrradianceCache::Interpolate(
+	const m_Vec3& pos,
+	const m_Vec3& normal,
+	m_Vec3& out_irradiance,
+	float& out_alpha ) const
+{
+	m_Vec3 irradiance_sum( 0.0f, 0.0f, 0.0f );
+	float alpha_sum= 0.0f;
+	float weight_sum= 0.0f;
+
+	ForEachValidRecord(
+		pos, normal,
+		[&]( const unsigned int record_index, const float weight )
+		{
+			const Record& record= records_[ record_index ];
+			const m_Vec3 vec= pos - record.pos;
+
+			for( unsigned int c= 0; c < 3; c++ )
+				irradiance_sum.ToArr()[c]+= weight * ( record.irradiance.ToArr()[c] + record.gradients[c] * vec );
+			alpha_sum+= weight * record.alpha;
+			weight_sum+= weight;
+		} );
+
+	if( weight_sum <= 0.0f )
+		return false;
+
+	const float inv_weight_sum= 1.0f / weight_sum;
+	for( unsigned int c= 0; c < 3; c++ )
+		out_irradiance.ToArr()[c]= std::max( 0.0f, irradiance_sum.ToArr()[c] * inv_weight_sum );
+	out_alpha= alpha_sum * inv_weight_sum;
+
+	return true;
+}
+
+float plb_IrradianceCache::GetRecordWeight( const Record& record, const m_Vec3& pos, const m_Vec3& normal ) const
+{
+	const m_Vec3 vec= pos - record.pos;
+
+	// Record is in front of point.
+	if( vec * ( normal + record.normal ) * 0.5f < -g_max_front_distance * record.radius )
+		return -1.0f;
+
+	const float error=
+		vec.Length() / record.radius +
+		std::sqrt( std::max( 0.0f, 1.0f - normal * record.normal ) );
+	if( error >= max_error_ )
+		return -1.0f;
+
+	// Weight smoothly falls to zero at border of validity area.
+	return 1.0f / std::max( error, 1.0e-3f ) - 1.0f / max_error_;
+}
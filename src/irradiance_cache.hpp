@@ -0,0 +1,94 @@
+#pragma once
+#include <vector>
+
+#include <vec.hpp>
+
+#include "tracer.hpp"
+
+// World-space cache of secondary light irradiance records (Ward's irradiance caching).
+// Each record is valid inside radius, derived from harmonic mean distance to geometry around it.
+// Records are placed into loose octree, so, lookup checks only records near given point.
+class plb_IrradianceCache final
+{
+public:
+	struct Record
+	{
+		m_Vec3 pos;
+		m_Vec3 normal;
+		float radius; // Harmonic mean distance to geometry, visible from record, clamped.
+
+		// Light of record. Alpha is nonzero for covered texels.
+		m_Vec3 irradiance;
+		float alpha;
+		// Translational gradients of red, green, blue irradiance components.
+		m_Vec3 gradients[3];
+	};
+
+	typedef std::vector<Record> Records;
+
+	// max_error - maximum allowed error of interpolation, which limits validity of records.
+	// Smaller values produce more records.
+	plb_IrradianceCache(
+		const plb_Tracer& tracer,
+		const m_Vec3& bb_min,
+		const m_Vec3& bb_max,
+		float max_error );
+
+	~plb_IrradianceCache();
+
+	// Returns true, if there is at least one record, valid for given point.
+	bool HasValidRecord( const m_Vec3& pos, const m_Vec3& normal ) const;
+
+	// Adds record with zero irradiance. Record radius is clamped to range [min_radius; max_radius].
+	// Returns index of new record.
+	unsigned int AddRecord( const m_Vec3& pos, const m_Vec3& normal, float min_radius, float max_radius );
+
+	Records& GetRecords();
+	const Records& GetRecords() const;
+
+	// Calculates gradients of records from irradiance of neighbor records.
+	// Must be called after setting of irradiance of all records.
+	void CalculateGradients();
+
+	// Calculates weighted sum of valid records, extrapolated using gradients.
+	// Returns false, if there are no valid records.
+	bool Interpolate( const m_Vec3& pos, const m_Vec3& normal, m_Vec3& out_irradiance, float& out_alpha ) const;
+
+private:
+	struct Node
+	{
+		m_Vec3 center;
+		float half_size;
+		unsigned int children[8]; // Zero - no child (root is never child).
+		std::vector<unsigned int> records;
+	};
+
+private:
+	// Calls func for each record, which is valid for given point, with record weight.
+	template<class Func>
+	void ForEachValidRecord( const m_Vec3& pos, const m_Vec3& normal, const Func& func ) const;
+
+	// Returns negative value, if record is not valid for given point.
+	float GetRecordWeight( const Record& record, const m_Vec3& pos, const m_Vec3& normal ) const;
+
+private:
+	const plb_Tracer& tracer_;
+	const float max_error_;
+	float max_distance_;
+
+	// Cosine-weighted directions around z+ for estimation of records radius.
+	std::vector<m_Vec3> hemisphere_directions_;
+
+	std::vector<Node> nodes_; // Root is first node.
+	Records records_;
+};
+
+inline plb_IrradianceCache::Records& plb_IrradianceCache::GetRecords()
+{
+	return records_;
+}
+
+inline const plb_IrradianceCache::Records& plb_IrradianceCache::GetRecords() const
+{
+	return records_;
+}
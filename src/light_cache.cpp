@@ -0,0 +1,160 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "light_cache.hpp"
+
+// Reserved fields are not initialized by some loaders, clear them for deterministic files.
+template<class T>
+static std::vector<T> ClearReservedFields( const std::vector<T>& items )
+{
+	std::vector<T> result= items;
+	for( T& item : result )
+		item.reserved= 0u;
+	return result;
+}
+
+bool plbWriteLightCache( const char* const file_name, const plb_LightCache& cache )
+{
+	const std::string temp_file_name= std::string( file_name ) + ".tmp";
+
+	FILE* const f= std::fopen( temp_file_name.c_str(), "wb" );
+	if( f == nullptr )
+	{
+		std::cout << "Can not open file: " << temp_file_name << std::endl;
+		return false;
+	}
+
+	bool ok= true;
+	const auto write=
+	[&]( const void* data, size_t size )
+	{
+		if( ok && size > 0u && std::fwrite( data, 1, size, f ) != size )
+			ok= false;
+	};
+
+	const plb_PointLights point_lights= ClearReservedFields( cache.point_lights );
+	const plb_DirectionalLights directional_lights= ClearReservedFields( cache.directional_lights );
+	const plb_ConeLights cone_lights= ClearReservedFields( cache.cone_lights );
+	const plb_SurfaceSampleLights surface_sample_lights= ClearReservedFields( cache.surface_sample_lights );
+	const plb_LightCacheSurfaces surfaces= ClearReservedFields( cache.surfaces );
+
+	plb_LightCacheHeader header;
+	std::memset( &header, 0, sizeof(header) );
+	std::strncpy( header.id, PLB_LIGHT_CACHE_FILE_ID, sizeof(header.id) );
+	header.version= PLB_LIGHT_CACHE_FILE_VERSION;
+	header.geometry_key= cache.geometry_key;
+	header.options_key= cache.options_key;
+	header.secondary_light_key= cache.secondary_light_key;
+	for( unsigned int i= 0; i < 3; i++ )
+		header.atlas_size[i]= cache.atlas_size[i];
+	for( unsigned int i= 0; i < 2; i++ )
+		header.secondary_atlas_size[i]= cache.secondary_atlas_size[i];
+	header.point_light_count= point_lights.size();
+	header.directional_light_count= directional_lights.size();
+	header.cone_light_count= cone_lights.size();
+	header.surface_sample_light_count= surface_sample_lights.size();
+	header.surface_count= surfaces.size();
+	header.primary_light_size= cache.primary_light.size();
+	header.secondary_light_size= cache.secondary_light.size();
+	write( &header, sizeof(header) );
+
+	write( point_lights.data(), point_lights.size() * sizeof(plb_PointLight) );
+	write( directional_lights.data(), directional_lights.size() * sizeof(plb_DirectionalLight) );
+	write( cone_lights.data(), cone_lights.size() * sizeof(plb_ConeLight) );
+	write( surface_sample_lights.data(), surface_sample_lights.size() * sizeof(plb_SurfaceSampleLight) );
+	write( surfaces.data(), surfaces.size() * sizeof(plb_LightCacheSurface) );
+	write( cache.primary_light.data(), cache.primary_light.size() * sizeof(float) );
+	write( cache.secondary_light.data(), cache.secondary_light.size() * sizeof(float) );
+
+	if( std::fclose(f) != 0 )
+		ok= false;
+
+	if( !ok )
+	{
+		std::cout << "Error, writing file: " << temp_file_name << std::endl;
+		std::remove( temp_file_name.c_str() );
+		return false;
+	}
+
+	// Rename does not replace existing files on some systems.
+	std::remove( file_name );
+	if( std::rename( temp_file_name.c_str(), file_name ) != 0 )
+	{
+		std::cout << "Can not rename \"" << temp_file_name << "\" to \"" << file_name << "\"" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool plbReadLightCache( const char* const file_name, plb_LightCache& out_cache )
+{
+	FILE* const f= std::fopen( file_name, "rb" );
+	if( f == nullptr )
+		return false;
+
+	bool ok= true;
+	const auto read=
+	[&]( void* data, size_t size )
+	{
+		if( ok && size > 0u && std::fread( data, 1, size, f ) != size )
+			ok= false;
+	};
+
+	plb_LightCacheHeader header;
+	read( &header, sizeof(header) );
+
+	ok= ok &&
+		std::strncmp( header.id, PLB_LIGHT_CACHE_FILE_ID, sizeof(header.id) ) == 0 &&
+		header.version == PLB_LIGHT_CACHE_FILE_VERSION;
+
+	if( ok )
+	{
+		out_cache.geometry_key= header.geometry_key;
+		out_cache.options_key= header.options_key;
+		out_cache.secondary_light_key= header.secondary_light_key;
+		for( unsigned int i= 0; i < 3; i++ )
+			out_cache.atlas_size[i]= header.atlas_size[i];
+		for( unsigned int i= 0; i < 2; i++ )
+			out_cache.secondary_atlas_size[i]= header.secondary_atlas_size[i];
+
+		// Sizes are checked by caller, but protect against huge allocations for broken files.
+		const uint64_t max_size= 4ull * header.atlas_size[0] * header.atlas_size[1] * header.atlas_size[2];
+		const uint64_t max_light_count= 1u << 24u;
+		const uint64_t max_surface_count= 1u << 24u;
+		ok=
+			header.primary_light_size <= max_size &&
+			header.secondary_light_size <= max_size &&
+			header.point_light_count <= max_light_count &&
+			header.directional_light_count <= max_light_count &&
+			header.cone_light_count <= max_light_count &&
+			header.surface_sample_light_count <= max_light_count &&
+			header.surface_count <= max_surface_count;
+	}
+	if( ok )
+	{
+		out_cache.point_lights.resize( header.point_light_count );
+		out_cache.directional_lights.resize( header.directional_light_count );
+		out_cache.cone_lights.resize( header.cone_light_count );
+		out_cache.surface_sample_lights.resize( header.surface_sample_light_count );
+		out_cache.surfaces.resize( header.surface_count );
+		out_cache.primary_light.resize( header.primary_light_size );
+		out_cache.secondary_light.resize( header.secondary_light_size );
+		read( out_cache.point_lights.data(), out_cache.point_lights.size() * sizeof(plb_PointLight) );
+		read( out_cache.directional_lights.data(), out_cache.directional_lights.size() * sizeof(plb_DirectionalLight) );
+		read( out_cache.cone_lights.data(), out_cache.cone_lights.size() * sizeof(plb_ConeLight) );
+		read( out_cache.surface_sample_lights.data(), out_cache.surface_sample_lights.size() * sizeof(plb_SurfaceSampleLight) );
+		read( out_cache.surfaces.data(), out_cache.surfaces.size() * sizeof(plb_LightCacheSurface) );
+		read( out_cache.primary_light.data(), out_cache.primary_light.size() * sizeof(float) );
+		read( out_cache.secondary_light.data(), out_cache.secondary_light.size() * sizeof(float) );
+	}
+
+	std::fclose(f);
+
+	if( !ok )
+		std::cout << "Invalid light cache file: " << file_name << std::endl;
+
+	return ok;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "formats.hpp"
+
+// Cache of previous build. Allows rebuilding of light only for changed lights
+// and only for surfaces near changed geometry.
+//
+// Layout:
+//   plb_LightCacheHeader
+//   plb_PointLight[ point_light_count ]
+//   plb_DirectionalLight[ directional_light_count ]
+//   plb_ConeLight[ cone_light_count ]
+//   plb_SurfaceSampleLight[ surface_sample_light_count ]
+//   plb_LightCacheSurface[ surface_count ]
+//   float[ primary_light_size ] - primary light atlas before dilation (RGBA texels)
+//   float[ secondary_light_size ] - secondary light atlas before denoising and dilation
+
+#define PLB_LIGHT_CACHE_FILE_ID "PLBLCACH"
+#define PLB_LIGHT_CACHE_FILE_VERSION 2u
+
+struct plb_LightCacheHeader
+{
+	char id[8];
+	uint32_t version;
+	uint32_t reserved;
+
+	uint64_t geometry_key; // Hash of level and options, which affect primary light, except lights.
+	uint64_t options_key; // Hash of options, which affect primary light. Light of surfaces is reused only with same options.
+	uint64_t secondary_light_key; // Hash of options of secondary light.
+
+	uint32_t atlas_size[3]; // width, height, layers of primary atlas
+	uint32_t secondary_atlas_size[2]; // width, height of secondary atlas
+
+	uint32_t point_light_count;
+	uint32_t directional_light_count;
+	uint32_t cone_light_count;
+	uint32_t surface_sample_light_count;
+	uint32_t surface_count;
+	uint32_t primary_light_size;
+	uint32_t secondary_light_size;
+};
+
+// Polygon, curved surface or model of level.
+struct plb_LightCacheSurface
+{
+	uint64_t hash; // Hash of geometry, material and lightmap basis.
+	float bb_min[3];
+	float bb_max[3];
+	plb_SurfaceLightmapData lightmap_data; // Zero size for surfaces without own lightmap.
+	uint32_t reserved;
+};
+
+typedef std::vector<plb_LightCacheSurface> plb_LightCacheSurfaces;
+
+struct plb_LightCache
+{
+	uint64_t geometry_key= 0u;
+	uint64_t options_key= 0u;
+	uint64_t secondary_light_key= 0u;
+	unsigned int atlas_size[3]= { 0u, 0u, 0u };
+	unsigned int secondary_atlas_size[2]= { 0u, 0u };
+
+	plb_PointLights point_lights;
+	plb_DirectionalLights directional_lights;
+	plb_ConeLights cone_lights;
+	plb_SurfaceSampleLights surface_sample_lights;
+
+	// Polygons, then curved surfaces, then models.
+	plb_LightCacheSurfaces surfaces;
+
+	std::vector<float> primary_light;
+	std::vector<float> secondary_light; // Empty, if secondary light was not built.
+};
+
+// Writes temporary file first and replaces old cache only after successful writing.
+// Returns true on success.
+bool plbWriteLightCache( const char* file_name, const plb_LightCache& cache );
+
+// Returns false, if file does not exist or is not valid light cache.
+bool plbReadLightCache( const char* file_name, plb_LightCache& out_cache );
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cmath>
+
+#include "math_utils.hpp"
+
+#include "light_texels_grid.hpp"
+
+// Maximum number of cells along each axis.
+static const unsigned int g_max_grid_size= 64u;
+// Average number of texels per cell, which is used for selection of cell size.
+static const float g_texels_per_cell= 32.0f;
+
+plb_LightTexelsGrid::plb_LightTexelsGrid( const std::vector<m_Vec3>& texels_positions )
+{
+	m_Vec3 bb_min= plb_Constants::max_vec;
+	m_Vec3 bb_max= plb_Constants::min_vec;
+	for( const m_Vec3& pos : texels_positions )
+	{
+		for( unsigned int j= 0; j < 3; j++ )
+		{
+			bb_min.ToArr()[j]= std::min( bb_min.ToArr()[j], pos.ToArr()[j] );
+			bb_max.ToArr()[j]= std::max( bb_max.ToArr()[j], pos.ToArr()[j] );
+		}
+	}
+
+	if( texels_positions.empty() )
+		bb_min= bb_max= m_Vec3( 0.0f, 0.0f, 0.0f );
+
+	// Select cell size for g_texels_per_cell texels in cell, if texels are distributed uniformly.
+	// Texels lie on surfaces, so, use area of bounding box sides for estimation.
+	const m_Vec3 extent= bb_max - bb_min;
+	const float max_extent= std::max( extent.x, std::max( extent.y, extent.z ) );
+	const float area= extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+	cell_size_=
+		std::max(
+			std::sqrt( area * g_texels_per_cell / std::max( float(texels_positions.size()), 1.0f ) ),
+			max_extent / float(g_max_grid_size) );
+	cell_size_= std::max( cell_size_, 1.0f / 64.0f );
+	inv_cell_size_= 1.0f / cell_size_;
+
+	grid_min_= bb_min;
+	for( unsigned int j= 0; j < 3; j++ )
+		size_[j]=
+			std::min(
+				static_cast<unsigned int>( extent.ToArr()[j] * inv_cell_size_ ) + 1u,
+				g_max_grid_size );
+
+	const auto get_cell=
+	[&]( const m_Vec3& pos ) -> unsigned int
+	{
+		unsigned int coord[3];
+		for( unsigned int j= 0; j < 3; j++ )
+			coord[j]=
+				std::min(
+					static_cast<unsigned int>( std::max( 0.0f, ( pos.ToArr()[j] - grid_min_.ToArr()[j] ) * inv_cell_size_ ) ),
+					size_[j] - 1u );
+		return coord[0] + ( coord[1] + coord[2] * size_[1] ) * size_[0];
+	};
+
+	// Counting sort of texels by cells.
+	const unsigned int cell_count= size_[0] * size_[1] * size_[2];
+	cells_offsets_.resize( cell_count + 1u, 0u );
+
+	std::vector<unsigned int> texels_cells( texels_positions.size() );
+	for( unsigned int i= 0; i < texels_positions.size(); i++ )
+	{
+		texels_cells[i]= get_cell( texels_positions[i] );
+		cells_offsets_[ texels_cells[i] + 1u ]++;
+	}
+
+	for( unsigned int c= 0; c < cell_count; c++ )
+		cells_offsets_[ c + 1u ]+= cells_offsets_[c];
+
+	std::vector<unsigned int> cells_fill( cells_offsets_.begin(), cells_offsets_.end() - 1 );
+	texels_order_.resize( texels_positions.size() );
+	for( unsigned int i= 0; i < texels_positions.size(); i++ )
+	{
+		texels_order_[ cells_fill[ texels_cells[i] ] ]= i;
+		cells_fill[ texels_cells[i] ]++;
+	}
+}
+
+plb_LightTexelsGrid::~plb_LightTexelsGrid()
+{
+}
+
+void plb_LightTexelsGrid::GetTexelsInSphere( const m_Vec3& center, const float radius, TexelsRanges& out_ranges ) const
+{
+	if( texels_order_.empty() )
+		return;
+
+	unsigned int cell_min[3], cell_max[3];
+	for( unsigned int j= 0; j < 3; j++ )
+	{
+		const float grid_size= float(size_[j]);
+		const float rel_min= ( center.ToArr()[j] - radius - grid_min_.ToArr()[j] ) * inv_cell_size_;
+		const float rel_max= ( center.ToArr()[j] + radius - grid_min_.ToArr()[j] ) * inv_cell_size_;
+		if( !( rel_max >= 0.0f && rel_min < grid_size ) )
+			return;
+
+		cell_min[j]= static_cast<unsigned int>( std::max( 0.0f, rel_min ) );
+		cell_max[j]= static_cast<unsigned int>( std::min( rel_max, grid_size - 1.0f ) );
+	}
+
+	const float square_radius= radius * radius;
+	for( unsigned int z= cell_min[2]; z <= cell_max[2]; z++ )
+	{
+		// Distance from center to cell along axis, zero if center is inside cell.
+		const float cell_z= grid_min_.z + float(z) * cell_size_;
+		const float dz= std::max( 0.0f, std::max( cell_z - center.z, center.z - cell_z - cell_size_ ) );
+
+		for( unsigned int y= cell_min[1]; y <= cell_max[1]; y++ )
+		{
+			const float cell_y= grid_min_.y + float(y) * cell_size_;
+			const float dy= std::max( 0.0f, std::max( cell_y - center.y, center.y - cell_y - cell_size_ ) );
+
+			const float square_yz_dist= dy * dy + dz * dz;
+			if( square_yz_dist > square_radius )
+				continue;
+
+			// Row of cells inside circle - section of sphere.
+			const float half_chord= std::sqrt( square_radius - square_yz_dist );
+			const unsigned int x_min=
+				std::max(
+					static_cast<unsigned int>( std::max( 0.0f, ( center.x - half_chord - grid_min_.x ) * inv_cell_size_ ) ),
+					cell_min[0] );
+			const unsigned int x_max=
+				std::min(
+					static_cast<unsigned int>( std::max( 0.0f, std::min( ( center.x + half_chord - grid_min_.x ) * inv_cell_size_, float(size_[0]) - 1.0f ) ) ),
+					cell_max[0] );
+			if( x_min > x_max )
+				continue;
+
+			const unsigned int row_offset= ( y + z * size_[1] ) * size_[0];
+			const unsigned int first= cells_offsets_[ row_offset + x_min ];
+			const unsigned int last= cells_offsets_[ row_offset + x_max + 1u ];
+			if( last > first )
+				out_ranges.push_back( TexelsRange{ first, last - first } );
+		}
+	}
+}
+
+void plb_LightTexelsGrid::MergeRanges( TexelsRanges& ranges )
+{
+	if( ranges.empty() )
+		return;
+
+	std::sort(
+		ranges.begin(), ranges.end(),
+		[]( const TexelsRange& a, const TexelsRange& b ) -> bool
+		{
+			return a.first < b.first;
+		} );
+
+	unsigned int result_size= 1u;
+	for( unsigned int i= 1u; i < ranges.size(); i++ )
+	{
+		TexelsRange& prev= ranges[ result_size - 1u ];
+		const TexelsRange& cur= ranges[i];
+		if( cur.first <= prev.first + prev.count )
+			prev.count= std::max( prev.count, cur.first + cur.count - prev.first );
+		else
+		{
+			ranges[ result_size ]= cur;
+			result_size++;
+		}
+	}
+
+	ranges.resize( result_size );
+}
+
+float plb_LightTexelsGrid::GetLightCutoffRadius( const m_Vec3& light_color, const float threshold )
+{
+	if( !( threshold > 0.0f ) )
+		return plb_Constants::max_float;
+
+	// Light falls as 1 / (distance ^ 2), angle factor is not greater, than 1.
+	const float max_component=
+		std::max( std::abs( light_color.x ), std::max( std::abs( light_color.y ), std::abs( light_color.z ) ) );
+	return std::sqrt( max_component / threshold );
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <vector>
+
+#include <vec.hpp>
+
+// Uniform grid of light texels positions.
+// Texels are sorted by grid cells, cells are ordered by x, then y, then z.
+// So, texels of consecutive cells along x axis form one continuous range.
+class plb_LightTexelsGrid final
+{
+public:
+	struct TexelsRange
+	{
+		unsigned int first;
+		unsigned int count;
+	};
+
+	typedef std::vector<TexelsRange> TexelsRanges;
+
+	explicit plb_LightTexelsGrid( const std::vector<m_Vec3>& texels_positions );
+	~plb_LightTexelsGrid();
+
+	// Order of texels inside grid. For each sorted texel - index of texel in source positions list.
+	const std::vector<unsigned int>& GetTexelsOrder() const;
+
+	unsigned int GetTexelCount() const;
+
+	// Adds to out_ranges ranges of sorted texels, which cells intersect sphere.
+	// Result ranges are not merged.
+	void GetTexelsInSphere( const m_Vec3& center, float radius, TexelsRanges& out_ranges ) const;
+
+	// Sorts ranges and merges overlapping and adjacent ranges.
+	static void MergeRanges( TexelsRanges& ranges );
+
+	// Returns distance, where light of point source with given color becomes weaker, than threshold.
+	// Returns max float if threshold is not positive.
+	// Negative color (used for subtraction of light) gives same radius, as positive.
+	static float GetLightCutoffRadius( const m_Vec3& light_color, float threshold );
+
+private:
+	m_Vec3 grid_min_;
+	float inv_cell_size_;
+	float cell_size_;
+	unsigned int size_[3];
+
+	// First sorted texel of each cell. Size is cell count + 1.
+	std::vector<unsigned int> cells_offsets_;
+	std::vector<unsigned int> texels_order_;
+};
+
+inline const std::vector<unsigned int>& plb_LightTexelsGrid::GetTexelsOrder() const
+{
+	return texels_order_;
+}
+
+inline unsigned int plb_LightTexelsGrid::GetTexelCount() const
+{
+	return texels_order_.size();
+}
@@ -3,15 +3,27 @@
 #include <numeric>
 #include <cstring>
 #include <chrono>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
 
 #include <shaders_loading.hpp>
 
 #include "lightmaps_builder.hpp"
 
+#include "atlas_packer.hpp"
+#include "boxes_grid.hpp"
 #include "curves.hpp"
+#include "irradiance_cache.hpp"
+#include "lightmaps_denoiser.hpp"
+#include "lightmaps_dilation.hpp"
+#include "lightmaps_layout.hpp"
+#include "profiler.hpp"
 #include "loaders_common.hpp"
 #include "math_utils.hpp"
+#include "parallel_for.hpp"
 #include "rasterizer.hpp"
+#include "visibility.hpp"
 
 #define VEC3_CPY(dst,src) (dst)[0]= (src)[0]; (dst)[1]= (src)[1]; (dst)[2]= (src)[2];
 #define ARR_VEC3_CPY(dst,vec) dst[0]= vec.x; dst[1]= vec.y; dst[2]= vec.z;
@@ -35,8 +47,19 @@ struct LightTexelVertex
 
 static const r_GLSLVersion g_glsl_version( r_GLSLVersion::KnowmNumbers::v430 );
 
-static const float g_cubemaps_znear= 1.0f / 32.0f;
-static const float g_cubemaps_min_clip_distance= g_cubemaps_znear * std::sqrt(3.0f);
+// Offset of secondary light samples along normal for search of visibility cluster.
+// Samples lie on surfaces, and surface plane is usually boundary of solid leaf.
+static const float g_visibility_sample_offset= 1.0f / 32.0f;
+
+// Limited by number of uniforms in geometry shader - 6 matrices per hemicube.
+static const unsigned int g_max_secondary_light_pass_batch_size= 8;
+// Limited by number of uniforms in geometry shader and by number of emitted vertices.
+static const unsigned int g_max_point_light_pass_batch_size= 8;
+
+// Maximum radius of irradiance cache record validity, in secondary lightmap texels.
+static const float g_irradiance_cache_max_record_texels= 32.0f;
+
+static const float g_cubemaps_znear= plb_light_sample_cubemap_znear;
 
 static void GenCubemapSideDirectionMultipler( unsigned int size, unsigned char* out_data, unsigned int side_num )
 {
@@ -186,6 +209,16 @@ static void CreateConeLightMatrix(
 	out_mat= translate * rotate * perspective;
 }
 
+// Sum of light of all texels of RGBA lightmap.
+static double GetLightEnergy( const std::vector<float>& light_data )
+{
+	double energy= 0.0;
+	for( unsigned int t= 0u; t < light_data.size(); t+= 4u )
+		energy+= double( light_data[ t + 0u ] + light_data[ t + 1u ] + light_data[ t + 2u ] );
+
+	return energy;
+}
+
 // Axis-aligned cubemap
 static void GenCubemapMatrices( const m_Vec3& pos, m_Mat4* out_matrices )
 {
@@ -232,15 +265,25 @@ static void GenCubemapMatrices( const m_Vec3& pos, const m_Vec3& dir, m_Mat4* ou
 		out_matrices[i]= rotate_and_shift * out_matrices[i] * perspective;
 }
 
-plb_LightmapsBuilder::plb_LightmapsBuilder( const char* file_name, const plb_Config& config )
+plb_LightmapsBuilder::plb_LightmapsBuilder(
+	const char* file_name,
+	const plb_Config& config,
+	plb_SharedResources* const shared_resources )
 	: config_( config )
+	, shared_resources_( shared_resources )
 {
-	LoadBsp( file_name , config_, level_data_ );
-
-	textures_manager_.reset(
-		new plb_TexturesManager(
-			config_,
-			level_data_.textures, level_data_.build_in_images ) );
+	{
+		const plb_ProfilerScope profiler_scope( "Level loading" );
+		LoadBsp( file_name , config_, level_data_ );
+	}
+	{
+		const plb_ProfilerScope profiler_scope( "Textures loading" );
+		textures_manager_.reset(
+			new plb_TexturesManager(
+				config_,
+				level_data_.textures, level_data_.build_in_images,
+				shared_resources_ == nullptr ? nullptr : &shared_resources_->textures_cache ) );
+	}
 
 	MarkLuminousMaterials();
 
@@ -251,6 +294,29 @@ plb_LightmapsBuilder::plb_LightmapsBuilder( const char* file_name, const plb_Con
 
 	BuildLuminousSurfacesLights();
 
+	{
+		const plb_ProfilerScope profiler_scope( "Tracer build" );
+		tracer_.reset( new plb_Tracer( level_data_, plbGetThreadCount( config_.cpu_threads ) ) );
+	}
+
+	if( config_.backend == plb_Config::Backend::CPU )
+	{
+		cpu_builder_.reset(
+			new plb_CpuLightmapsBuilder(
+				level_data_,
+				config_,
+				*tracer_,
+				*textures_manager_,
+				lightmap_atlas_texture_.size,
+				lightmap_atlas_texture_.secondary_lightmap_size ) );
+
+		PrepareLightSources();
+		PrepareLightTexelsPoints();
+
+		// All light passes are performed in MakePrimaryLight and MakeSecondaryLight.
+		return;
+	}
+
 	lights_visualizer_.reset(
 		new plb_LightsVisualizer(
 			level_data_.point_lights,
@@ -258,10 +324,12 @@ plb_LightmapsBuilder::plb_LightmapsBuilder( const char* file_name, const plb_Con
 			level_data_.cone_lights,
 			bright_luminous_surfaces_lights_ ) );
 
-	tracer_.reset( new plb_Tracer( level_data_ ) );
-
-	world_vertex_buffer_.reset( new plb_WorldVertexBuffer( level_data_ ) );
+	{
+		const plb_ProfilerScope profiler_scope( "World vertex buffer" );
+		world_vertex_buffer_.reset( new plb_WorldVertexBuffer( level_data_ ) );
+	}
 
+	PrepareLightSources();
 	PrepareLightTexelsPoints();
 
 	polygons_preview_shader_.ShaderSource(
@@ -305,47 +373,8 @@ plb_LightmapsBuilder::plb_LightmapsBuilder( const char* file_name, const plb_Con
 	Setup2dShadowmap( directional_light_shadowmap_, 1 << config_.directional_light_shadowmap_size_log2 );
 	Setup2dShadowmap( cone_light_shadowmap_, 1 << config_.cone_light_shadowmap_size_log2 );
 
-	for( const plb_PointLight& light : level_data_.point_lights )
-	{
-		m_Vec3 light_color;
-		unsigned char max_color_component= 1;
-		for( int j= 0; j< 3; j++ )
-		{
-			unsigned char c= light.color[j];
-			light_color.ToArr()[j]= light.intensity * float(c) / 255.0f;
-			if( c > max_color_component ) max_color_component= c;
-		}
-		light_color/= float(max_color_component) / 255.0f;
-		
-		const m_Vec3 light_pos( light.pos );
-
-		GenPointlightShadowmap( light_pos );
-		PointLightPass( light_pos, light_color );
-	}
-
-	for( const plb_DirectionalLight& light : level_data_.directional_lights )
-	{
-		m_Mat4 mat;
-		CreateDirectionalLightMatrix(
-			light,
-			level_bounding_box_.min,
-			level_bounding_box_.max,
-			mat );
-
-		GenDirectionalLightShadowmap( mat );
-		DirectionalLightPass( light, mat );
-	}
-
-	for( const plb_ConeLight& cone_light : level_data_.cone_lights )
-	{
-		m_Mat4 mat;
-		CreateConeLightMatrix( cone_light, mat );
-
-		GenConeLightShadowmap( mat );
-		ConeLightPass( cone_light, mat );
-	}
-
-	//FillBorderLightmapTexels();
+	// All light passes are performed in MakePrimaryLight and MakeSecondaryLight, same as for CPU backend.
+	// Primary light passes are additive, so, light must not be built here.
 
 	GenSecondaryLightPassCubemap();
 	GenSecondaryLightPassUnwrapBuffer();
@@ -353,10 +382,43 @@ plb_LightmapsBuilder::plb_LightmapsBuilder( const char* file_name, const plb_Con
 
 plb_LightmapsBuilder::~plb_LightmapsBuilder()
 {
+	// CPU backend has no OpenGL objects.
+	if( cpu_builder_ != nullptr )
+		return;
+
+	// Release OpenGL objects, because many builders may be created in one process.
+	// Zero names are silently ignored.
+	glDeleteTextures( 1, &lightmap_atlas_texture_.tex_id );
+	glDeleteFramebuffers( 1, &lightmap_atlas_texture_.fbo_id );
+	glDeleteTextures( PLB_MAX_LIGHT_PASSES, lightmap_atlas_texture_.secondary_tex_id );
+	glDeleteFramebuffers( 1, &lightmap_atlas_texture_.secondary_tex_fbo );
+
+	glDeleteTextures( 1, &point_light_shadowmap_cubemap_.depth_tex_id );
+	glDeleteFramebuffers( 1, &point_light_shadowmap_cubemap_.fbo_id );
+
+	glDeleteTextures( 1, &secondary_light_pass_cubemap_.tex_id );
+	glDeleteTextures( 1, &secondary_light_pass_cubemap_.depth_tex_id );
+	glDeleteFramebuffers( 1, &secondary_light_pass_cubemap_.fbo_id );
+	glDeleteTextures( 1, &secondary_light_pass_cubemap_.direction_multipler_tex_id );
+	glDeleteTextures( 1, &secondary_light_pass_cubemap_.unwrap_tex_id );
+	glDeleteFramebuffers( 1, &secondary_light_pass_cubemap_.unwrap_fbo_id );
 }
 
 void plb_LightmapsBuilder::MakePrimaryLight(
 	const std::function<void()>& wake_up_callback )
+{
+	const plb_ProfilerScope profiler_scope( "Primary light" );
+
+	MakePrimaryLightPasses( wake_up_callback );
+
+	// Cache light before dilation, because changed lights are added to it in next builds.
+	if( !config_.light_cache_file.empty() )
+		ReadLightmapsAtlas( false, light_cache_.primary_light );
+
+	DilateLightmaps( false );
+}
+
+void plb_LightmapsBuilder::MakePrimaryLightPasses( const std::function<void()>& wake_up_callback )
 {
 	char wake_up_message[ 256 ];
 
@@ -378,369 +440,2308 @@ void plb_LightmapsBuilder::MakePrimaryLight(
 	const unsigned int c_cone_lights_per_wake_up= 80u;
 	const unsigned int c_suraface_sample_lights_per_wake_up= c_point_lights_per_wake_up;
 
-	const auto start_time= std::chrono::steady_clock::now();
+	// Lights are processed in batches. For CPU backend batch is just a group of consecutive lights.
+	const unsigned int point_lights_batch_size=
+		cpu_builder_ != nullptr ? 1u : point_light_shadowmap_cubemap_.batch_size;
 
 	// Point lights
-	iteration= 0u;
-	for( const plb_PointLight& light : level_data_.point_lights )
 	{
-		m_Vec3 light_color;
-		unsigned char max_color_component= 1;
-		for( int j= 0; j< 3; j++ )
-		{
-			unsigned char c= light.color[j];
-			light_color.ToArr()[j]= light.intensity * float(c) / 255.0f;
-			if( c > max_color_component ) max_color_component= c;
-		}
-		light_color/= float(max_color_component) / 255.0f;
+		const plb_ProfilerScope profiler_scope( "Point lights" );
 
-		const m_Vec3 light_pos( light.pos );
+		const auto start_time= std::chrono::steady_clock::now();
 
-		GenPointlightShadowmap( light_pos );
-		PointLightPass( light_pos, light_color );
+		iteration= 0u;
+		for( unsigned int first_light= 0u; first_light < light_sources_.point_lights.size(); first_light+= point_lights_batch_size )
+		{
+			const unsigned int light_count=
+				std::min( point_lights_batch_size, static_cast<unsigned int>(light_sources_.point_lights.size()) - first_light );
 
-		std::snprintf(
-			wake_up_message, sizeof(wake_up_message),
-			"Point lights: %u/%u",
-			1u + ( &light - level_data_.point_lights.data() ),
-			level_data_.point_lights.size() );
+			m_Vec3 lights_pos[ g_max_point_light_pass_batch_size ];
+			m_Vec3 lights_colors[ g_max_point_light_pass_batch_size ];
+			for( unsigned int i= 0u; i < light_count; i++ )
+			{
+				const plb_PointLight& light= light_sources_.point_lights[ first_light + i ];
+				lights_pos[i]= m_Vec3( light.pos );
+				lights_colors[i]= plbGetPointLightColor( light );
+			}
 
-		try_wake_up(
-			c_point_lights_per_wake_up,
-			&light == &level_data_.point_lights.back() );
-	}
+			if( cpu_builder_ != nullptr )
+			{
+				for( unsigned int i= 0u; i < light_count; i++ )
+					cpu_builder_->PointLightPass( lights_pos[i], lights_colors[i] );
+			}
+			else
+			{
+				GenPointlightShadowmaps( lights_pos, light_count );
+				PointLightsPass( lights_pos, lights_colors, light_count );
+			}
 
-	const auto end_time= std::chrono::steady_clock::now();
-	const auto time_ms= std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+			std::snprintf(
+				wake_up_message, sizeof(wake_up_message),
+				"Point lights: %u/%u",
+				first_light + light_count,
+				light_sources_.point_lights.size() );
+
+			// Count each light of batch as iteration.
+			iteration+= light_count - 1u;
+			try_wake_up(
+				c_point_lights_per_wake_up,
+				first_light + light_count == light_sources_.point_lights.size() );
+		}
 
-	glFlush();
-	glFinish();
-	wake_up_callback();
-	std::cout << "Build light for " << level_data_.point_lights.size() << " point lights." <<
-		" Time: " << static_cast<float>(time_ms) / 1000.0f << " s." <<
-		" Lights per second: " << static_cast<float>(level_data_.point_lights.size()) / static_cast<float>( time_ms ) * 1000.0f
-		<< std::endl;
+		const auto end_time= std::chrono::steady_clock::now();
+		const auto time_ms= std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+
+		if( cpu_builder_ == nullptr )
+		{
+			glFlush();
+			glFinish();
+		}
+		wake_up_callback();
+		std::cout << "Build light for " << light_sources_.point_lights.size() << " point lights." <<
+			" Time: " << static_cast<float>(time_ms) / 1000.0f << " s." <<
+			" Lights per second: " << static_cast<float>(light_sources_.point_lights.size()) / static_cast<float>( std::max<long long>( time_ms, 1 ) ) * 1000.0f
+			<< std::endl;
+	}
 
 	// Directional lights
-	iteration= 0u;
-	for( const plb_DirectionalLight& light : level_data_.directional_lights )
 	{
-		m_Mat4 mat;
-		CreateDirectionalLightMatrix(
-			light,
-			level_bounding_box_.min,
-			level_bounding_box_.max,
-			mat );
+		const plb_ProfilerScope profiler_scope( "Directional lights" );
 
-		GenDirectionalLightShadowmap( mat );
-		DirectionalLightPass( light, mat );
+		iteration= 0u;
+		for( const plb_DirectionalLight& light : light_sources_.directional_lights )
+		{
+			if( cpu_builder_ != nullptr )
+				cpu_builder_->DirectionalLightPass( light );
+			else
+			{
+				m_Mat4 mat;
+				CreateDirectionalLightMatrix(
+					light,
+					level_bounding_box_.min,
+					level_bounding_box_.max,
+					mat );
+
+				GenDirectionalLightShadowmap( mat );
+				DirectionalLightPass( light, mat );
+			}
 
-		std::snprintf(
-			wake_up_message, sizeof(wake_up_message),
-			"Directional lights: %u/%u",
-			1u + ( &light - level_data_.directional_lights.data() ),
-			level_data_.directional_lights.size() );
+			std::snprintf(
+				wake_up_message, sizeof(wake_up_message),
+				"Directional lights: %u/%u",
+				1u + ( &light - light_sources_.directional_lights.data() ),
+				light_sources_.directional_lights.size() );
 
-		try_wake_up(
-			c_directional_lights_per_wake_up,
-			&light == &level_data_.directional_lights.back() );
+			try_wake_up(
+				c_directional_lights_per_wake_up,
+				&light == &light_sources_.directional_lights.back() );
+		}
 	}
 
 	// Cone lights
-	iteration= 0u;
-	for( const plb_ConeLight& cone_light : level_data_.cone_lights )
 	{
-		m_Mat4 mat;
-		CreateConeLightMatrix( cone_light, mat );
+		const plb_ProfilerScope profiler_scope( "Cone lights" );
+
+		iteration= 0u;
+		for( const plb_ConeLight& cone_light : light_sources_.cone_lights )
+		{
+			if( cpu_builder_ != nullptr )
+				cpu_builder_->ConeLightPass( cone_light );
+			else
+			{
+				m_Mat4 mat;
+				CreateConeLightMatrix( cone_light, mat );
 
-		GenConeLightShadowmap( mat );
-		ConeLightPass( cone_light, mat );
+				GenConeLightShadowmap( mat, m_Vec3( cone_light.pos ) );
+				ConeLightPass( cone_light, mat );
+			}
 
-		std::snprintf(
-			wake_up_message, sizeof(wake_up_message),
-			"Cone lights: %u/%u",
-			1u + ( &cone_light - level_data_.cone_lights.data() ),
-			level_data_.cone_lights.size() );
+			std::snprintf(
+				wake_up_message, sizeof(wake_up_message),
+				"Cone lights: %u/%u",
+				1u + ( &cone_light - light_sources_.cone_lights.data() ),
+				light_sources_.cone_lights.size() );
 
-		try_wake_up(
-			c_cone_lights_per_wake_up,
-			&cone_light == &level_data_.cone_lights.back() );
+			try_wake_up(
+				c_cone_lights_per_wake_up,
+				&cone_light == &light_sources_.cone_lights.back() );
+		}
 	}
 
 	// Surface sample lights
-	iteration= 0u;
-	for( const plb_SurfaceSampleLight& light : bright_luminous_surfaces_lights_ )
 	{
-		m_Vec3 light_color;
+		const plb_ProfilerScope profiler_scope( "Surface sample lights" );
+
+		iteration= 0u;
+		for( unsigned int first_light= 0u; first_light < light_sources_.surface_sample_lights.size(); first_light+= point_lights_batch_size )
+		{
+			const unsigned int light_count=
+				std::min( point_lights_batch_size, static_cast<unsigned int>(light_sources_.surface_sample_lights.size()) - first_light );
 
-		for( int j= 0; j< 3; j++ )
-			light_color.ToArr()[j]= light.intensity * float(light.color[j]) / 255.0f;
+			m_Vec3 lights_pos[ g_max_point_light_pass_batch_size ];
+			m_Vec3 lights_normals[ g_max_point_light_pass_batch_size ];
+			m_Vec3 lights_colors[ g_max_point_light_pass_batch_size ];
+			for( unsigned int i= 0u; i < light_count; i++ )
+			{
+				const plb_SurfaceSampleLight& light= light_sources_.surface_sample_lights[ first_light + i ];
+				lights_pos[i]= m_Vec3( light.pos );
+				lights_normals[i]= m_Vec3( light.normal );
+				for( int j= 0; j< 3; j++ )
+					lights_colors[i].ToArr()[j]= light.intensity * float(light.color[j]) / 255.0f;
+			}
 
-		GenPointlightShadowmap( m_Vec3( light.pos ) );
-		SurfaceSampleLightPass(
-			m_Vec3( light.pos ),
-			m_Vec3( light.normal ),
-			light_color );
+			if( cpu_builder_ != nullptr )
+			{
+				for( unsigned int i= 0u; i < light_count; i++ )
+					cpu_builder_->SurfaceSampleLightPass( lights_pos[i], lights_normals[i], lights_colors[i] );
+			}
+			else
+			{
+				GenPointlightShadowmaps( lights_pos, light_count );
+				SurfaceSampleLightsPass( lights_pos, lights_normals, lights_colors, light_count );
+			}
 
-		std::snprintf(
-			wake_up_message, sizeof(wake_up_message),
-			"Surface sample lights: %u/%u",
-			1u + ( &light - bright_luminous_surfaces_lights_.data() ),
-			bright_luminous_surfaces_lights_.size() );
+			std::snprintf(
+				wake_up_message, sizeof(wake_up_message),
+				"Surface sample lights: %u/%u",
+				first_light + light_count,
+				light_sources_.surface_sample_lights.size() );
 
-		try_wake_up(
-			c_suraface_sample_lights_per_wake_up,
-			&light == &bright_luminous_surfaces_lights_.back() );
+			iteration+= light_count - 1u;
+			try_wake_up(
+				c_suraface_sample_lights_per_wake_up,
+				first_light + light_count == light_sources_.surface_sample_lights.size() );
+		}
 	}
 }
 
 void plb_LightmapsBuilder::MakeSecondaryLight( const std::function<void()>& wake_up_callback )
 {
-	unsigned int counter= 0;
-	unsigned int total_secondary_texels= 0u;
+	const plb_ProfilerScope profiler_scope( "Secondary light" );
 
-	glGenFramebuffers( 1, &lightmap_atlas_texture_.secondary_tex_fbo );
-	glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.secondary_tex_fbo );
-	glFramebufferTexture( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 , lightmap_atlas_texture_.secondary_tex_id[0], 0 );
-	const GLuint color_attachment= GL_COLOR_ATTACHMENT0;
-	glDrawBuffers( 1, &color_attachment );
+	plb_SecondaryLightCheckpoint checkpoint;
+	const bool resume= LoadSecondaryLightCheckpoint( checkpoint );
+	last_secondary_light_checkpoint_time_= std::chrono::steady_clock::now();
 
-	glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
-	glClear( GL_COLOR_BUFFER_BIT );
+	if( cpu_builder_ != nullptr )
+	{
+		plb_CpuLightmapsBuilder::LightTexels secondary_texels;
+		PrepareSecondaryLightTexels( secondary_texels, incremental_secondary_light_ );
 
-	secondary_light_pass_cubemap_.write_shader.Bind();
-	secondary_light_pass_cubemap_.write_shader.Uniform( "tex", int(0) );
-	secondary_light_pass_cubemap_.write_shader.Uniform( "mip", int(config_.secondary_light_pass_cubemap_size_log2) );
-	secondary_light_pass_cubemap_.write_shader.Uniform(
-		"normalizer", secondary_light_pass_cubemap_.direction_multiplier_normalizer );
+		// Light of other texels is taken from cache.
+		if( incremental_secondary_light_ )
+			WriteLightmapsAtlas( true, light_cache_.secondary_light );
 
-	plb_Tracer::SurfacesList surfaces_list;
-	plb_Tracer::LineSegments segments;
+		const unsigned int texel_count= static_cast<unsigned int>(secondary_texels.size());
 
-	const auto start_time= std::chrono::steady_clock::now();
-	for( const plb_Polygon& poly : level_data_.polygons )
-	{
-		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
-			continue;
+		unsigned int start_texel= 0u;
+		if( resume )
+		{
+			cpu_builder_->ForEachAtlasLayer(
+				true,
+				[&]( float* const layer_data, const unsigned int* const layer_size, const unsigned int layer )
+				{
+					const unsigned int layer_floats= 4u * layer_size[0] * layer_size[1];
+					std::memcpy( layer_data, checkpoint.bounce_light.data() + layer * layer_floats, layer_floats * sizeof(float) );
+				} );
+			start_texel= checkpoint.complete ? texel_count : std::min( checkpoint.items_done, texel_count );
+		}
 
-		GetPolygonNeighborsSegments( poly, surfaces_list, segments );
+		cpu_builder_->SecondaryLightPass(
+			secondary_texels,
+			start_texel,
+			nullptr,
+			[&]( const unsigned int texels_done )
+			{
+				wake_up_callback();
+				if( texels_done < texel_count && SecondaryLightCheckpointIsDue() )
+				{
+					checkpoint.items_done= texels_done;
+					checkpoint.bounce_light= cpu_builder_->GetSecondaryAtlas().data;
+					SaveSecondaryLightCheckpoint( checkpoint );
+				}
+			} );
+		plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, texel_count - start_texel );
+
+		// Each next bounce gathers light of previous bounce, light of all bounces is summed.
+		// Checkpoints are saved only in first bounce, light of complete checkpoint is already final.
+		const unsigned int bounce_count=
+			std::max( 1u, std::min( config_.secondary_light_bounces, static_cast<unsigned int>(PLB_MAX_LIGHT_PASSES) ) );
+		if( bounce_count > 1u && !checkpoint.complete )
+		{
+			plb_CpuLightmapsBuilder::Atlas previous_bounce= cpu_builder_->GetSecondaryAtlas();
+			std::vector<float> accumulated_light= previous_bounce.data;
+			const double first_bounce_energy= GetLightEnergy( previous_bounce.data );
 
-		const m_Vec3 normal(poly.normal);
+			for( unsigned int bounce= 1u; bounce < bounce_count; bounce++ )
+			{
+				cpu_builder_->SecondaryLightPass(
+					secondary_texels,
+					0u,
+					&previous_bounce,
+					[&]( unsigned int )
+					{
+						wake_up_callback();
+					} );
+				plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, texel_count );
 
-		const unsigned int sx=
-			( poly.lightmap_data.size[0] + config_.secondary_lightmap_scaler - 1 ) /
-			config_.secondary_lightmap_scaler;
-		const unsigned int sy=
-			( poly.lightmap_data.size[1] + config_.secondary_lightmap_scaler - 1 ) /
-			config_.secondary_lightmap_scaler;
+				previous_bounce.data= cpu_builder_->GetSecondaryAtlas().data;
+				const double bounce_energy= GetLightEnergy( previous_bounce.data );
+				std::cout << "Secondary light bounce " << bounce + 1u << " energy: " << bounce_energy << std::endl;
 
-		const float basis_scale= float(config_.secondary_lightmap_scaler);
+				for( unsigned int t= 0u; t < accumulated_light.size(); t+= 4u )
+				{
+					accumulated_light[ t + 0u ]+= previous_bounce.data[ t + 0u ];
+					accumulated_light[ t + 1u ]+= previous_bounce.data[ t + 1u ];
+					accumulated_light[ t + 2u ]+= previous_bounce.data[ t + 2u ];
+				}
+
+				if( bounce_energy <= first_bounce_energy * double(config_.secondary_light_bounces_energy_threshold) )
+					break;
+			}
+
+			WriteLightmapsAtlas( true, accumulated_light );
+		}
 
-		for( unsigned int y= 0; y < sy; y++ )
-		for( unsigned int x= 0; x < sx; x++ )
+		if( !checkpoint.complete && !config_.secondary_light_checkpoint_file.empty() )
 		{
-			const m_Vec3 pos=
-				( float(x) + 0.5f ) * basis_scale * m_Vec3(poly.lightmap_basis[0]) +
-				( float(y) + 0.5f ) * basis_scale * m_Vec3(poly.lightmap_basis[1]) +
-				m_Vec3( poly.lightmap_pos );
+			checkpoint.complete= true;
+			checkpoint.items_done= texel_count;
+			checkpoint.bounce_light= cpu_builder_->GetSecondaryAtlas().data;
+			SaveSecondaryLightCheckpoint( checkpoint );
+		}
 
-			const m_Vec3 pos_corrected= CorrectSecondaryLightSample( pos, poly, segments );
-			SecondaryLightPass( pos_corrected, normal );
+		SaveLightCache();
+		DenoiseSecondaryLightmaps();
+		DilateLightmaps( true );
+		return;
+	}
+
+	glGenFramebuffers( 1, &lightmap_atlas_texture_.secondary_tex_fbo );
 
-			glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.secondary_tex_fbo );
-			glViewport(
-				0, 0,
-				lightmap_atlas_texture_.secondary_lightmap_size[0],
-				lightmap_atlas_texture_.secondary_lightmap_size[1] );
+	const unsigned int bounce_count=
+		std::max( 1u, std::min( config_.secondary_light_bounces, static_cast<unsigned int>(PLB_MAX_LIGHT_PASSES) ) );
 
-			const float tc_x=
-				( float( x + poly.lightmap_data.coord[0] / config_.secondary_lightmap_scaler ) + 0.5f ) /
-				float(lightmap_atlas_texture_.secondary_lightmap_size[0]);
-			const float tc_y=
-				( float( y + poly.lightmap_data.coord[1] / config_.secondary_lightmap_scaler ) + 0.5f ) /
-				float(lightmap_atlas_texture_.secondary_lightmap_size[1]);
+	const auto start_time= std::chrono::steady_clock::now();
 
-			secondary_light_pass_cubemap_.unwrap_framebuffer.GetTextures().front().Bind(0);
+	unsigned int total_secondary_texels= 0u;
 
-			secondary_light_pass_cubemap_.write_shader.Bind();
-			secondary_light_pass_cubemap_.write_shader.Uniform(
-				"tex_coord",
-				m_Vec3( tc_x, tc_y, float(poly.lightmap_data.atlas_id) + 0.01f ) );
+	// Light of all bounces is summed on CPU side and written into texture of first bounce at end.
+	std::vector<float> accumulated_light, bounce_light;
+	double first_bounce_energy= 0.0;
+	unsigned int bounces_done= 0u;
+	unsigned int first_bounce= 0u;
+	unsigned int first_item= 0u;
 
-			glDrawArrays( GL_POINTS, 0, 1 );
+	// Light of samples, which can not see changed lights or geometry, is taken from cache.
+	if( incremental_secondary_light_ )
+		WriteSecondaryLightBounce( 0u, light_cache_.secondary_light );
 
-			counter++;
-			if( counter >= 100 )
-			{
-				counter= 0;
-				r_Framebuffer::BindScreenFramebuffer();
-				wake_up_callback();
-				printf( "Polygon : %d/%d\n", &poly - level_data_.polygons.data(), level_data_.polygons.size() );
-			}
+	if( resume )
+	{
+		first_bounce= std::min( checkpoint.bounce, bounce_count - 1u );
+		first_item= checkpoint.items_done;
+		first_bounce_energy= checkpoint.first_bounce_energy;
+		accumulated_light= checkpoint.accumulated_light;
+		bounces_done= first_bounce;
+
+		// Restore light of previous bounce - source of light for bounce in progress, and finished part of bounce in progress.
+		if( first_bounce > 0u )
+		{
+			if( first_bounce > 1u )
+				CreateSecondaryLightBounceTexture( first_bounce - 1u );
+			WriteSecondaryLightBounce( first_bounce - 1u, checkpoint.previous_bounce_light );
+			CreateSecondaryLightBounceTexture( first_bounce );
 		}
-		total_secondary_texels+= sx * sy;
+		if( !checkpoint.bounce_light.empty() )
+			WriteSecondaryLightBounce( first_bounce, checkpoint.bounce_light );
 	}
 
-	std::vector<PositionAndNormal> curve_coords;
-	for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
+	// Light of complete checkpoint is already final.
+	for( unsigned int bounce= first_bounce; bounce < bounce_count && !checkpoint.complete; bounce++ )
 	{
-		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
-			continue;
-
-		const unsigned int lightmap_size[2]=
+		if( bounce > first_bounce )
+			CreateSecondaryLightBounceTexture( bounce );
+
+		total_secondary_texels+=
+			MakeSecondaryLightBounce(
+				bounce,
+				bounce == first_bounce ? first_item : 0u,
+				wake_up_callback,
+				[&]( const unsigned int items_done )
+				{
+					checkpoint.bounce= bounce;
+					checkpoint.items_done= items_done;
+					checkpoint.first_bounce_energy= first_bounce_energy;
+					ReadSecondaryLightBounce( bounce, checkpoint.bounce_light );
+					if( bounce > 0u )
+						ReadSecondaryLightBounce( bounce - 1u, checkpoint.previous_bounce_light );
+					else
+						checkpoint.previous_bounce_light.clear();
+					checkpoint.accumulated_light= accumulated_light;
+					SaveSecondaryLightCheckpoint( checkpoint );
+				} );
+		bounces_done++;
+
+		if( bounce_count == 1u )
+			break;
+
+		const double bounce_energy= ReadSecondaryLightBounce( bounce, bounce_light );
+		std::cout << "Secondary light bounce " << bounce + 1u << " energy: " << bounce_energy << std::endl;
+
+		if( bounce == 0u )
 		{
-			( curve.lightmap_data.size[0] + config_.secondary_lightmap_scaler - 1 ) /
-				config_.secondary_lightmap_scaler,
-			( curve.lightmap_data.size[1] + config_.secondary_lightmap_scaler - 1 ) /
-				config_.secondary_lightmap_scaler,
-		};
+			accumulated_light.swap( bounce_light );
+			first_bounce_energy= bounce_energy;
+		}
+		else
+		{
+			for( unsigned int t= 0u; t < accumulated_light.size(); t+= 4u )
+			{
+				accumulated_light[ t + 0u ]+= bounce_light[ t + 0u ];
+				accumulated_light[ t + 1u ]+= bounce_light[ t + 1u ];
+				accumulated_light[ t + 2u ]+= bounce_light[ t + 2u ];
+			}
+		}
 
-		curve_coords.resize( lightmap_size[0] * lightmap_size[1] );
-		std::memset( curve_coords.data(), 0, curve_coords.size() * sizeof(PositionAndNormal) );
+		if( bounce_energy <= first_bounce_energy * double(config_.secondary_light_bounces_energy_threshold) )
+			break;
 
-		const m_Vec2 lightmap_coord_scaler(
-			float(lightmap_atlas_texture_.size[0]) / float(config_.secondary_lightmap_scaler),
-			float(lightmap_atlas_texture_.size[1]) / float(config_.secondary_lightmap_scaler) );
-		const m_Vec2 lightmap_coord_shift(
-				-float(curve.lightmap_data.coord[0] / config_.secondary_lightmap_scaler),
-				-float(curve.lightmap_data.coord[1] / config_.secondary_lightmap_scaler));
+		if( bounce + 1u < bounce_count && SecondaryLightCheckpointIsDue() )
+		{
+			// Next bounce is not started yet, save only its source of light.
+			checkpoint.bounce= bounce + 1u;
+			checkpoint.items_done= 0u;
+			checkpoint.first_bounce_energy= first_bounce_energy;
+			checkpoint.bounce_light.clear();
+			ReadSecondaryLightBounce( bounce, checkpoint.previous_bounce_light );
+			checkpoint.accumulated_light= accumulated_light;
+			SaveSecondaryLightCheckpoint( checkpoint );
+		}
+	}
 
-		CalculateCurveCoordinatesForLightTexels(
-			curve,
-			lightmap_coord_scaler, lightmap_coord_shift,
-			lightmap_size,
-			level_data_.curved_surfaces_vertices,
-			curve_coords.data() );
+	if( bounces_done > 1u )
+	{
+		WriteSecondaryLightBounce( 0u, accumulated_light );
 
-		for( unsigned int y= 0; y < lightmap_size[1]; y++ )
-		for( unsigned int x= 0; x < lightmap_size[0]; x++ )
+		// Textures of next bounces are not needed anymore.
+		for( unsigned int bounce= 1u; bounce < bounces_done; bounce++ )
 		{
-			const PositionAndNormal& texel_pos= curve_coords[ x + y * lightmap_size[0] ];
+			glDeleteTextures( 1, &lightmap_atlas_texture_.secondary_tex_id[ bounce ] );
+			lightmap_atlas_texture_.secondary_tex_id[ bounce ]= 0u;
+		}
+	}
 
-			// Degenerate texel
-			if( texel_pos.normal.SquareLength() <= 0.01f )
-				continue;
+	if( !checkpoint.complete && !config_.secondary_light_checkpoint_file.empty() )
+	{
+		checkpoint.complete= true;
+		checkpoint.bounce= 0u;
+		checkpoint.items_done= 0u;
+		ReadSecondaryLightBounce( 0u, checkpoint.bounce_light );
+		checkpoint.previous_bounce_light.clear();
+		checkpoint.accumulated_light.clear();
+		SaveSecondaryLightCheckpoint( checkpoint );
+	}
 
-			SecondaryLightPass( texel_pos.pos, texel_pos.normal );
+	const auto end_time= std::chrono::steady_clock::now();
+	const auto time_ms= std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
 
-			glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.secondary_tex_fbo );
-			glViewport(
-				0, 0,
-				lightmap_atlas_texture_.secondary_lightmap_size[0],
-				lightmap_atlas_texture_.secondary_lightmap_size[1] );
+	plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, total_secondary_texels );
 
-			const float tc_x=
-				( float( x + curve.lightmap_data.coord[0] / config_.secondary_lightmap_scaler ) + 0.5f ) /
-				float(lightmap_atlas_texture_.secondary_lightmap_size[0]);
-			const float tc_y=
-				( float( y + curve.lightmap_data.coord[1] / config_.secondary_lightmap_scaler ) + 0.5f ) /
-				float(lightmap_atlas_texture_.secondary_lightmap_size[1]);
+	// Time may be zero for small levels.
+	std::cout << "Build light for " << total_secondary_texels << " texels." <<
+		" Time: " << static_cast<float>(time_ms) / 1000.0f << " s." <<
+		" Texels per second: " << static_cast<float>(total_secondary_texels) / static_cast<float>( std::max<long long>( time_ms, 1 ) ) * 1000.0f
+		<< std::endl;
 
-			secondary_light_pass_cubemap_.unwrap_framebuffer.GetTextures().front().Bind(0);
+	SaveLightCache();
+	DenoiseSecondaryLightmaps();
+	DilateLightmaps( true );
 
-			secondary_light_pass_cubemap_.write_shader.Bind();
-			secondary_light_pass_cubemap_.write_shader.Uniform(
-				"tex_coord",
-				m_Vec3( tc_x, tc_y, float(curve.lightmap_data.atlas_id) + 0.01f ) );
+	r_Framebuffer::BindScreenFramebuffer();
+}
 
-			glDrawArrays( GL_POINTS, 0, 1 );
+// Worker takes texels with atlas index, matching its shard. So, all light passes
+// of one atlas texel (and its duplicates) are performed in same worker.
+static void TakeWorkerShard( plb_CpuLightmapsBuilder::LightTexels& texels, const plb_Config& config )
+{
+	if( config.worker_shard_count <= 1u )
+		return;
 
-			counter++;
-			if( counter >= 100 )
+	texels.erase(
+		std::remove_if(
+			texels.begin(), texels.end(),
+			[&]( const plb_CpuLightmapsBuilder::LightTexel& texel )
 			{
-				counter= 0;
-				r_Framebuffer::BindScreenFramebuffer();
-				wake_up_callback();
-			}
-		}
-		total_secondary_texels+= lightmap_size[0] * lightmap_size[1];
-	}
+				return texel.texel_index % config.worker_shard_count != config.worker_shard;
+			} ),
+		texels.end() );
+}
 
-	// Correct lightmap coordinates for secondary lightmaps,
-	// because size % scaler != 0, sometimes.
-	const float tex_scale_x=
-		float(lightmap_atlas_texture_.size[0]) /
-		float( lightmap_atlas_texture_.secondary_lightmap_size[0] * config_.secondary_lightmap_scaler );
-	const float tex_scale_y=
-		float(lightmap_atlas_texture_.size[1]) /
-		float( lightmap_atlas_texture_.secondary_lightmap_size[1] * config_.secondary_lightmap_scaler );
+// Takes light of given texels from atlas. Each atlas texel is taken only once.
+static void GetWorkerTexels(
+	const plb_CpuLightmapsBuilder::LightTexels& texels,
+	const std::vector<float>& atlas_data,
+	plb_WorkerTexels& out_texels )
+{
+	std::vector<bool> taken_texels( atlas_data.size() / 4u, false );
 
-	for( const plb_LevelModel& model : level_data_.models )
+	out_texels.clear();
+	for( const plb_CpuLightmapsBuilder::LightTexel& texel : texels )
 	{
-		if( ( model.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+		if( taken_texels[ texel.texel_index ] )
 			continue;
+		taken_texels[ texel.texel_index ]= true;
 
-		for( unsigned int v= 0; v < model.vertex_count; v++ )
-		{
-			const plb_Vertex& vertex= level_data_.models_vertices[ model.first_vertex_number + v ];
-			const plb_Normal& src_normal= level_data_.models_normals[ model.first_vertex_number + v ];
+		out_texels.emplace_back();
+		plb_WorkerTexel& out_texel= out_texels.back();
+		out_texel.texel_index= texel.texel_index;
+		std::memcpy( out_texel.light, atlas_data.data() + 4u * texel.texel_index, sizeof(out_texel.light) );
+	}
+}
 
-			m_Vec3 normal(
-				float(src_normal.xyz[0]),
-				float(src_normal.xyz[1]),
-				float(src_normal.xyz[2]) );
-			normal.Normalize();
+// Returns false, if some texel is outside atlas.
+static bool ApplyWorkerTexels( const plb_WorkerTexels& texels, std::vector<float>& atlas_data )
+{
+	for( const plb_WorkerTexel& texel : texels )
+	{
+		if( texel.texel_index >= atlas_data.size() / 4u )
+		{
+			std::cout << "Invalid texel of worker: " << texel.texel_index << std::endl;
+			return false;
+		}
+		std::memcpy( atlas_data.data() + 4u * texel.texel_index, texel.light, sizeof(texel.light) );
+	}
+	return true;
+}
 
-			SecondaryLightPass( m_Vec3( vertex.pos ), normal );
+bool plb_LightmapsBuilder::RunWorker( FILE* const input, FILE* const output, const std::function<void()>& wake_up_callback )
+{
+	if( cpu_builder_ == nullptr )
+	{
+		std::cout << "Workers are supported only for CPU backend" << std::endl;
+		return false;
+	}
 
-			glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.secondary_tex_fbo );
-			glViewport(
-				0, 0,
-				lightmap_atlas_texture_.secondary_lightmap_size[0],
-				lightmap_atlas_texture_.secondary_lightmap_size[1] );
+	plb_WorkerTexels worker_texels;
 
-			const float tc_x= vertex.lightmap_coord[0] * tex_scale_x;
-			const float tc_y= vertex.lightmap_coord[1] * tex_scale_y;
+	{
+		const plb_ProfilerScope profiler_scope( "Primary light" );
 
-			secondary_light_pass_cubemap_.unwrap_framebuffer.GetTextures().front().Bind(0);
+		MakePrimaryLightPasses( wake_up_callback );
 
-			secondary_light_pass_cubemap_.write_shader.Bind();
-			secondary_light_pass_cubemap_.write_shader.Uniform(
-				"tex_coord",
-				m_Vec3( tc_x, tc_y, float(vertex.tex_maps[2]) + 0.01f ) );
+		GetWorkerTexels( cpu_builder_->GetPrimaryLightTexels(), cpu_builder_->GetPrimaryAtlas().data, worker_texels );
+		if( !plbWriteWorkerTexels( output, plb_WorkerMessageType::PrimaryLightTexels, worker_texels ) )
+			return false;
+	}
 
-			glDrawArrays( GL_POINTS, 0, 1 );
+	// Secondary light gathers dilated primary light of all shards.
+	std::vector<float> primary_light( cpu_builder_->GetPrimaryAtlas().data.size() );
+	if( !plbReadWorkerAtlas( input, primary_light ) )
+		return false;
+	WriteLightmapsAtlas( false, primary_light );
 
-			counter++;
-			if( counter >= 100 )
-			{
-				counter= 0;
-				r_Framebuffer::BindScreenFramebuffer();
-				wake_up_callback();
-			}
-		} // for model vertices
-		total_secondary_texels+= model.vertex_count;
-	} // for models
+	const plb_ProfilerScope profiler_scope( "Secondary light" );
 
-	const auto end_time= std::chrono::steady_clock::now();
-	const auto time_s= std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time).count();
+	plb_CpuLightmapsBuilder::LightTexels secondary_texels;
+	PrepareSecondaryLightTexels( secondary_texels, incremental_secondary_light_ );
+	TakeWorkerShard( secondary_texels, config_ );
 
-	std::cout << "Build light for " << total_secondary_texels << " texels." <<
-		" Time: " << time_s << " s." <<
-		" Texels per second: " << total_secondary_texels / time_s;
+	cpu_builder_->SecondaryLightPass(
+		secondary_texels,
+		0u,
+		nullptr,
+		[&]( unsigned int )
+		{
+			wake_up_callback();
+		} );
+	plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, secondary_texels.size() );
 
-	r_Framebuffer::BindScreenFramebuffer();
+	GetWorkerTexels( secondary_texels, cpu_builder_->GetSecondaryAtlas().data, worker_texels );
+	return plbWriteWorkerTexels( output, plb_WorkerMessageType::SecondaryLightTexels, worker_texels );
 }
 
-void plb_LightmapsBuilder::DrawPreview(
-	const m_Mat4& view_matrix, const m_Vec3& cam_pos,
-	const m_Vec3& cam_dir,
-	float brightness,
-	bool show_primary_lightmap, bool show_secondary_lightmap, bool show_textures,
-	bool draw_luminous_surfaces, bool draw_shadowless_surfaces, bool smooth_lightmaps )
+bool plb_LightmapsBuilder::MakeLightWithWorkers(
+	const std::vector<std::unique_ptr<plb_WorkerProcess>>& workers,
+	const std::function<void()>& wake_up_callback )
 {
-	r_Framebuffer::BindScreenFramebuffer();
+	if( cpu_builder_ == nullptr )
+	{
+		std::cout << "Workers are supported only for CPU backend" << std::endl;
+		return false;
+	}
 
-	glClearColor ( 0.1f, 0.05f, 0.1f, 0.0f );
-	glClear ( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+	plb_WorkerTexels worker_texels;
 
-	const auto bind_lightmaps=
-		[this]( const GLenum filtration )
-		{
-			glActiveTexture( GL_TEXTURE0 + 0 );
-			glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
-			glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filtration );
-			glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filtration );
+	{
+		const plb_ProfilerScope profiler_scope( "Primary light" );
+
+		// Atlas contains cached light of texels, which are not relit by workers.
+		std::vector<float> primary_light;
+		ReadLightmapsAtlas( false, primary_light );
+		for( const std::unique_ptr<plb_WorkerProcess>& worker : workers )
+		{
+			if( !plbReadWorkerTexels( worker->GetOutput(), plb_WorkerMessageType::PrimaryLightTexels, primary_light.size() / 4u, worker_texels ) ||
+				!ApplyWorkerTexels( worker_texels, primary_light ) )
+				return false;
+			wake_up_callback();
+		}
+		WriteLightmapsAtlas( false, primary_light );
+
+		// Cache light before dilation, because changed lights are added to it in next builds.
+		if( !config_.light_cache_file.empty() )
+			light_cache_.primary_light= std::move(primary_light);
+
+		DilateLightmaps( false );
+	}
+
+	const plb_ProfilerScope profiler_scope( "Secondary light" );
+
+	{
+		std::vector<float> primary_light;
+		ReadLightmapsAtlas( false, primary_light );
+		for( const std::unique_ptr<plb_WorkerProcess>& worker : workers )
+		{
+			if( !plbWriteWorkerAtlas( worker->GetInput(), primary_light ) )
+				return false;
+		}
+	}
+
+	// Light of other texels is taken from cache.
+	if( incremental_secondary_light_ )
+		WriteLightmapsAtlas( true, light_cache_.secondary_light );
+
+	std::vector<float> secondary_light;
+	ReadLightmapsAtlas( true, secondary_light );
+	for( const std::unique_ptr<plb_WorkerProcess>& worker : workers )
+	{
+		if( !plbReadWorkerTexels( worker->GetOutput(), plb_WorkerMessageType::SecondaryLightTexels, secondary_light.size() / 4u, worker_texels ) ||
+			!ApplyWorkerTexels( worker_texels, secondary_light ) )
+			return false;
+		wake_up_callback();
+	}
+	WriteLightmapsAtlas( true, secondary_light );
+
+	SaveLightCache();
+	DenoiseSecondaryLightmaps();
+	DilateLightmaps( true );
+	return true;
+}
+
+unsigned int plb_LightmapsBuilder::MakeSecondaryLightBounce(
+	const unsigned int bounce,
+	const unsigned int first_item,
+	const std::function<void()>& wake_up_callback,
+	const std::function<void( unsigned int items_done )>& checkpoint_callback )
+{
+	const plb_ProfilerScope profiler_scope( "Secondary light bounce" );
+
+	// Each next bounce is calculated with twice coarser sampling step.
+	// One hemicube gives light for whole block of step * step texels.
+	const unsigned int step= 1u << bounce;
+
+	// Adaptive sampling is used only for first bounce, next bounces are already coarse.
+	const unsigned int adaptive_step= bounce == 0u ? config_.secondary_light_adaptive_step : 1u;
+	const bool adaptive= adaptive_step > 1u;
+
+	// Irradiance cache is used for plain sampling of all bounces.
+	std::unique_ptr<plb_IrradianceCache> irradiance_cache;
+	if( !adaptive && config_.secondary_light_irradiance_cache_error > 0.0f )
+		irradiance_cache.reset(
+			new plb_IrradianceCache(
+				*tracer_,
+				level_bounding_box_.min, level_bounding_box_.max,
+				config_.secondary_light_irradiance_cache_error ) );
+	std::vector<IrradianceCacheSample> irradiance_cache_samples;
+
+	unsigned int counter= 0;
+	unsigned int total_secondary_texels= 0u;
+	const plb_Polygon* current_polygon= nullptr;
+
+	// Samples are accumulated and rendered in batches.
+	std::vector<SecondaryLightSample> batch;
+	batch.reserve( secondary_light_pass_cubemap_.batch_size );
+
+	const auto flush_batch=
+	[&]()
+	{
+		if( batch.empty() )
+			return;
+
+		SecondaryLightPass( batch.data(), batch.size(), bounce );
+
+		counter+= batch.size();
+		batch.clear();
+		if( counter >= 100 )
+		{
+			counter= 0;
+			r_Framebuffer::BindScreenFramebuffer();
+			wake_up_callback();
+			if( current_polygon != nullptr )
+				printf( "Polygon : %d/%d\n", current_polygon - level_data_.polygons.data(), level_data_.polygons.size() );
+		}
+	};
+
+	const auto add_sample=
+	[&]( const m_Vec3& pos, const m_Vec3& normal, const m_Vec3& tex_coord, const unsigned int block_size_x, const unsigned int block_size_y )
+	{
+		batch.emplace_back();
+		batch.back().pos= pos;
+		batch.back().normal= normal;
+		batch.back().tex_coord= tex_coord;
+		batch.back().block_size[0]= block_size_x;
+		batch.back().block_size[1]= block_size_y;
+
+		if( batch.size() >= secondary_light_pass_cubemap_.batch_size )
+			flush_batch();
+
+		total_secondary_texels++;
+	};
+
+	// Light of surface or vertex does not depend on other items only for plain sampling,
+	// so, checkpoints inside bounce are possible only for it.
+	const bool checkpoints_allowed= !adaptive && irradiance_cache == nullptr;
+
+	// Returns false for items, which are already done.
+	unsigned int item_index= 0u;
+	const auto start_item=
+	[&]() -> bool
+	{
+		const unsigned int index= item_index;
+		item_index++;
+		if( index < first_item )
+			return false;
+
+		if( checkpoints_allowed && SecondaryLightCheckpointIsDue() )
+		{
+			flush_batch();
+			checkpoint_callback( index );
+		}
+		return true;
+	};
+
+	glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.secondary_tex_fbo );
+	glFramebufferTexture( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 , lightmap_atlas_texture_.secondary_tex_id[ bounce ], 0 );
+	const GLuint color_attachment= GL_COLOR_ATTACHMENT0;
+	glDrawBuffers( 1, &color_attachment );
+
+	// Texture contains light of finished items, if bounce is continued from checkpoint,
+	// or cached light in incremental build.
+	if( first_item == 0u && !incremental_secondary_light_ )
+	{
+		glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
+		glClear( GL_COLOR_BUFFER_BIT );
+	}
+
+	ForEachSecondaryLightSurface(
+		[&]( const SecondaryLightSurfaceTexels& surface )
+		{
+			if( !start_item() )
+				return;
+
+			current_polygon= surface.polygon;
+
+			if( adaptive )
+			{
+				// Sample only corners of grid cells.
+				for( const unsigned int y : GetAdaptiveGridCoordinates( surface.size[1], adaptive_step ) )
+				for( const unsigned int x : GetAdaptiveGridCoordinates( surface.size[0], adaptive_step ) )
+				{
+					SecondaryLightSample sample;
+					if( GetSecondaryLightSurfaceSample( surface, x, y, 1u, 1u, sample ) )
+						add_sample( sample.pos, sample.normal, sample.tex_coord, 1u, 1u );
+				}
+				return;
+			}
+
+			for( unsigned int y= 0; y < surface.size[1]; y+= step )
+			for( unsigned int x= 0; x < surface.size[0]; x+= step )
+			{
+				const unsigned int block_size_x= std::min( step, surface.size[0] - x );
+				const unsigned int block_size_y= std::min( step, surface.size[1] - y );
+
+				SecondaryLightSample sample;
+				if( !GetSecondaryLightSurfaceSample( surface, x, y, block_size_x, block_size_y, sample ) )
+					continue;
+
+				if( irradiance_cache == nullptr )
+				{
+					// Incremental build is possible only for plain sampling, light of other samples is taken from cache.
+					if( IsSecondaryLightSampleAffected( sample.pos, sample.normal, false ) )
+						add_sample( sample.pos, sample.normal, sample.tex_coord, block_size_x, block_size_y );
+					continue;
+				}
+
+				// Render hemicube only if there is no valid record near sample.
+				irradiance_cache_samples.emplace_back();
+				irradiance_cache_samples.back().sample= sample;
+				irradiance_cache_samples.back().record_index= ~0u;
+				if( irradiance_cache->HasValidRecord( sample.pos, sample.normal ) )
+					continue;
+
+				const float block_texel_size= surface.texel_size * float( std::max( block_size_x, block_size_y ) );
+				irradiance_cache_samples.back().record_index=
+					irradiance_cache->AddRecord(
+						sample.pos, sample.normal,
+						block_texel_size / config_.secondary_light_irradiance_cache_error,
+						block_texel_size * g_irradiance_cache_max_record_texels / config_.secondary_light_irradiance_cache_error );
+				add_sample( sample.pos, sample.normal, sample.tex_coord, block_size_x, block_size_y );
+			}
+		} );
+	current_polygon= nullptr;
+
+	// Correct lightmap coordinates for secondary lightmaps,
+	// because size % scaler != 0, sometimes.
+	const float tex_scale_x=
+		float(lightmap_atlas_texture_.size[0]) /
+		float( lightmap_atlas_texture_.secondary_lightmap_size[0] * config_.secondary_lightmap_scaler );
+	const float tex_scale_y=
+		float(lightmap_atlas_texture_.size[1]) /
+		float( lightmap_atlas_texture_.secondary_lightmap_size[1] * config_.secondary_lightmap_scaler );
+
+	// Vertices of models have own texels, so, they are not sampled coarser in next bounces.
+	for( const plb_LevelModel& model : level_data_.models )
+	{
+		if( ( model.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+			continue;
+
+		for( unsigned int v= 0; v < model.vertex_count; v++ )
+		{
+			if( !start_item() )
+				continue;
+
+			const plb_Vertex& vertex= level_data_.models_vertices[ model.first_vertex_number + v ];
+			const plb_Normal& src_normal= level_data_.models_normals[ model.first_vertex_number + v ];
+
+			m_Vec3 normal(
+				float(src_normal.xyz[0]),
+				float(src_normal.xyz[1]),
+				float(src_normal.xyz[2]) );
+			normal.Normalize();
+
+			if( !IsSecondaryLightSampleAffected( m_Vec3( vertex.pos ), normal, true ) )
+				continue;
+
+			const float tc_x= vertex.lightmap_coord[0] * tex_scale_x;
+			const float tc_y= vertex.lightmap_coord[1] * tex_scale_y;
+
+			add_sample(
+				m_Vec3( vertex.pos ), normal,
+				m_Vec3( tc_x, tc_y, float(vertex.tex_maps[2]) + 0.01f ),
+				1u, 1u );
+		} // for model vertices
+	} // for models
+
+	flush_batch();
+
+	if( irradiance_cache != nullptr )
+		ApplySecondaryLightIrradianceCache( bounce, *irradiance_cache, irradiance_cache_samples );
+
+	if( adaptive )
+	{
+		// Read light of grid corners, interpolate light inside smooth cells,
+		// render hemicubes for texels of other cells.
+		std::vector<float> light_data;
+		ReadSecondaryLightBounce( bounce, light_data );
+
+		std::vector<SecondaryLightSample> refine_samples;
+		unsigned int interpolated_texels= 0u;
+
+		ForEachSecondaryLightSurface(
+			[&]( const SecondaryLightSurfaceTexels& surface )
+			{
+				interpolated_texels+= RefineAdaptiveSecondaryLight( surface, adaptive_step, light_data, refine_samples );
+			} );
+
+		WriteSecondaryLightBounce( bounce, light_data );
+
+		glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.secondary_tex_fbo );
+		for( const SecondaryLightSample& sample : refine_samples )
+			add_sample( sample.pos, sample.normal, sample.tex_coord, 1u, 1u );
+		flush_batch();
+
+		std::cout << "Adaptive secondary light: " << refine_samples.size() << " texels refined, " <<
+			interpolated_texels << " texels interpolated" << std::endl;
+	}
+
+	return total_secondary_texels;
+}
+
+void plb_LightmapsBuilder::ApplySecondaryLightIrradianceCache(
+	const unsigned int bounce,
+	plb_IrradianceCache& irradiance_cache,
+	const std::vector<IrradianceCacheSample>& samples )
+{
+	std::vector<float> light_data;
+	ReadSecondaryLightBounce( bounce, light_data );
+
+	const unsigned int atlas_width= lightmap_atlas_texture_.secondary_lightmap_size[0];
+	const unsigned int atlas_height= lightmap_atlas_texture_.secondary_lightmap_size[1];
+
+	const auto get_texel_data=
+	[&]( const SecondaryLightSample& sample, const unsigned int dx, const unsigned int dy ) -> float*
+	{
+		const unsigned int x= static_cast<unsigned int>( sample.tex_coord.x * float(atlas_width ) ) + dx;
+		const unsigned int y= static_cast<unsigned int>( sample.tex_coord.y * float(atlas_height) ) + dy;
+		const unsigned int layer= static_cast<unsigned int>( sample.tex_coord.z );
+		return light_data.data() + 4u * ( x + ( y + layer * atlas_height ) * atlas_width );
+	};
+
+	// Take light of records from rendered hemicubes.
+	plb_IrradianceCache::Records& records= irradiance_cache.GetRecords();
+	for( const IrradianceCacheSample& sample : samples )
+	{
+		if( sample.record_index == ~0u )
+			continue;
+
+		const float* const src= get_texel_data( sample.sample, 0u, 0u );
+		plb_IrradianceCache::Record& record= records[ sample.record_index ];
+		record.irradiance= m_Vec3( src[0], src[1], src[2] );
+		record.alpha= src[3];
+	}
+
+	irradiance_cache.CalculateGradients();
+
+	unsigned int interpolated_samples= 0u;
+	for( const IrradianceCacheSample& sample : samples )
+	{
+		if( sample.record_index != ~0u )
+			continue;
+
+		m_Vec3 irradiance;
+		float alpha;
+		if( !irradiance_cache.Interpolate( sample.sample.pos, sample.sample.normal, irradiance, alpha ) )
+			continue;
+
+		for( unsigned int dy= 0u; dy < sample.sample.block_size[1]; dy++ )
+		for( unsigned int dx= 0u; dx < sample.sample.block_size[0]; dx++ )
+		{
+			float* const dst= get_texel_data( sample.sample, dx, dy );
+			dst[0]= irradiance.x;
+			dst[1]= irradiance.y;
+			dst[2]= irradiance.z;
+			dst[3]= alpha;
+		}
+		interpolated_samples++;
+	}
+
+	WriteSecondaryLightBounce( bounce, light_data );
+
+	std::cout << "Irradiance cache: " << records.size() << " records, " <<
+		interpolated_samples << " samples interpolated" << std::endl;
+}
+
+void plb_LightmapsBuilder::ForEachSecondaryLightSurface( const std::function<void( const SecondaryLightSurfaceTexels& )>& func )
+{
+	const std::vector<plb_Tracer::LineSegments>& polygons_segments= GetPolygonsNeighborsSegments();
+
+	for( const plb_Polygon& poly : level_data_.polygons )
+	{
+		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+			continue;
+
+		const plb_Tracer::LineSegments& segments= polygons_segments[ &poly - level_data_.polygons.data() ];
+
+		const m_Vec3 normal(poly.normal);
+		const float basis_scale= float(config_.secondary_lightmap_scaler);
+		const m_Vec3 basis_u= basis_scale * m_Vec3(poly.lightmap_basis[0]);
+		const m_Vec3 basis_v= basis_scale * m_Vec3(poly.lightmap_basis[1]);
+
+		SecondaryLightSurfaceTexels surface;
+		surface.polygon= &poly;
+		surface.size[0]=
+			( poly.lightmap_data.size[0] + config_.secondary_lightmap_scaler - 1 ) /
+			config_.secondary_lightmap_scaler;
+		surface.size[1]=
+			( poly.lightmap_data.size[1] + config_.secondary_lightmap_scaler - 1 ) /
+			config_.secondary_lightmap_scaler;
+		surface.coord[0]= poly.lightmap_data.coord[0] / config_.secondary_lightmap_scaler;
+		surface.coord[1]= poly.lightmap_data.coord[1] / config_.secondary_lightmap_scaler;
+		surface.layer= poly.lightmap_data.atlas_id;
+		surface.texel_size= std::max( basis_u.Length(), basis_v.Length() );
+
+		surface.get_texel=
+		[&]( const float x, const float y, m_Vec3& out_pos, m_Vec3& out_normal ) -> bool
+		{
+			const m_Vec3 pos= x * basis_u + y * basis_v + m_Vec3( poly.lightmap_pos );
+			out_pos= plbCorrectLightSample( config_, pos, poly, segments );
+			out_normal= normal;
+			return true;
+		};
+
+		surface.is_near_edge=
+		[&]( const unsigned int x0, const unsigned int y0, const unsigned int x1, const unsigned int y1 ) -> bool
+		{
+			// Check distance from center of block to edges of neighbor geometry.
+			const m_Vec3 center=
+				( 0.5f * float( x0 + x1 + 1u ) ) * basis_u +
+				( 0.5f * float( y0 + y1 + 1u ) ) * basis_v +
+				m_Vec3( poly.lightmap_pos );
+			const float radius=
+				0.5f * ( float( x1 + 1u - x0 ) * basis_u + float( y1 + 1u - y0 ) * basis_v ).Length() +
+				std::max( basis_u.Length(), basis_v.Length() );
+
+			for( const plb_Tracer::LineSegment& segment : segments )
+				if( ( plbGetNearestSegmentPoint( center, segment ) - center ).SquareLength() <= radius * radius )
+					return true;
+
+			return false;
+		};
+
+		func( surface );
+	}
+
+	std::vector<PositionAndNormal> curve_coords;
+	for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
+	{
+		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+			continue;
+
+		const unsigned int lightmap_size[2]=
+		{
+			( curve.lightmap_data.size[0] + config_.secondary_lightmap_scaler - 1 ) /
+				config_.secondary_lightmap_scaler,
+			( curve.lightmap_data.size[1] + config_.secondary_lightmap_scaler - 1 ) /
+				config_.secondary_lightmap_scaler,
+		};
+
+		curve_coords.resize( lightmap_size[0] * lightmap_size[1] );
+		std::memset( curve_coords.data(), 0, curve_coords.size() * sizeof(PositionAndNormal) );
+
+		const m_Vec2 lightmap_coord_scaler(
+			float(lightmap_atlas_texture_.size[0]) / float(config_.secondary_lightmap_scaler),
+			float(lightmap_atlas_texture_.size[1]) / float(config_.secondary_lightmap_scaler) );
+		const m_Vec2 lightmap_coord_shift(
+				-float(curve.lightmap_data.coord[0] / config_.secondary_lightmap_scaler),
+				-float(curve.lightmap_data.coord[1] / config_.secondary_lightmap_scaler));
+
+		CalculateCurveCoordinatesForLightTexels(
+			curve,
+			lightmap_coord_scaler, lightmap_coord_shift,
+			lightmap_size,
+			level_data_.curved_surfaces_vertices,
+			curve_coords.data() );
+
+		SecondaryLightSurfaceTexels surface;
+		surface.polygon= nullptr;
+		surface.size[0]= lightmap_size[0];
+		surface.size[1]= lightmap_size[1];
+		surface.coord[0]= curve.lightmap_data.coord[0] / config_.secondary_lightmap_scaler;
+		surface.coord[1]= curve.lightmap_data.coord[1] / config_.secondary_lightmap_scaler;
+		surface.layer= curve.lightmap_data.atlas_id;
+
+		// Estimate texel size as average distance between neighbor texels.
+		float texels_distance_sum= 0.0f;
+		unsigned int texels_distance_count= 0u;
+		for( unsigned int y= 0u; y < lightmap_size[1]; y++ )
+		for( unsigned int x= 0u; x + 1u < lightmap_size[0]; x++ )
+		{
+			const PositionAndNormal& texel0= curve_coords[ x      + y * lightmap_size[0] ];
+			const PositionAndNormal& texel1= curve_coords[ x + 1u + y * lightmap_size[0] ];
+			if( texel0.normal.SquareLength() <= 0.01f || texel1.normal.SquareLength() <= 0.01f )
+				continue;
+			texels_distance_sum+= ( texel1.pos - texel0.pos ).Length();
+			texels_distance_count++;
+		}
+		surface.texel_size=
+			texels_distance_count > 0u
+				? texels_distance_sum / float(texels_distance_count)
+				: float(config_.secondary_lightmap_scaler);
+
+		surface.get_texel=
+		[&]( const float x, const float y, m_Vec3& out_pos, m_Vec3& out_normal ) -> bool
+		{
+			// Take nearest texel.
+			const unsigned int texel_x= std::min( static_cast<unsigned int>(x), lightmap_size[0] - 1u );
+			const unsigned int texel_y= std::min( static_cast<unsigned int>(y), lightmap_size[1] - 1u );
+			const PositionAndNormal& texel_pos= curve_coords[ texel_x + texel_y * lightmap_size[0] ];
+
+			// Degenerate texel
+			if( texel_pos.normal.SquareLength() <= 0.01f )
+				return false;
+
+			out_pos= texel_pos.pos;
+			out_normal= texel_pos.normal;
+			return true;
+		};
+
+		surface.is_near_edge=
+		[]( unsigned int, unsigned int, unsigned int, unsigned int ) -> bool
+		{
+			return false;
+		};
+
+		func( surface );
+	}
+}
+
+bool plb_LightmapsBuilder::GetSecondaryLightSurfaceSample(
+	const SecondaryLightSurfaceTexels& surface,
+	const unsigned int x, const unsigned int y,
+	const unsigned int block_size_x, const unsigned int block_size_y,
+	SecondaryLightSample& out_sample ) const
+{
+	// Sample in center of block.
+	if( !surface.get_texel(
+			float(x) + 0.5f * float(block_size_x),
+			float(y) + 0.5f * float(block_size_y),
+			out_sample.pos, out_sample.normal ) )
+		return false;
+
+	out_sample.tex_coord=
+		m_Vec3(
+			( float( x + surface.coord[0] ) + 0.5f ) / float(lightmap_atlas_texture_.secondary_lightmap_size[0]),
+			( float( y + surface.coord[1] ) + 0.5f ) / float(lightmap_atlas_texture_.secondary_lightmap_size[1]),
+			float(surface.layer) + 0.01f );
+	out_sample.block_size[0]= block_size_x;
+	out_sample.block_size[1]= block_size_y;
+
+	return true;
+}
+
+unsigned int plb_LightmapsBuilder::RefineAdaptiveSecondaryLight(
+	const SecondaryLightSurfaceTexels& surface,
+	const unsigned int grid_step,
+	std::vector<float>& light_data,
+	std::vector<SecondaryLightSample>& out_samples ) const
+{
+	const std::vector<unsigned int> grid_x= GetAdaptiveGridCoordinates( surface.size[0], grid_step );
+	const std::vector<unsigned int> grid_y= GetAdaptiveGridCoordinates( surface.size[1], grid_step );
+	if( grid_x.empty() || grid_y.empty() )
+		return 0u;
+
+	const auto get_texel_data=
+	[&]( const unsigned int x, const unsigned int y ) -> float*
+	{
+		return
+			light_data.data() +
+			4u * (
+				( surface.coord[0] + x ) +
+				( ( surface.coord[1] + y ) + surface.layer * lightmap_atlas_texture_.secondary_lightmap_size[1] ) *
+				lightmap_atlas_texture_.secondary_lightmap_size[0] );
+	};
+
+	enum class TexelState : unsigned char
+	{
+		NotProcessed= 0,
+		GridCorner,
+		Interpolated,
+		Sampled,
+	};
+
+	std::vector<TexelState> texels_states( surface.size[0] * surface.size[1], TexelState::NotProcessed );
+	for( const unsigned int y : grid_y )
+	for( const unsigned int x : grid_x )
+		texels_states[ x + y * surface.size[0] ]= TexelState::GridCorner;
+
+	unsigned int interpolated_texels= 0u;
+
+	// Surface with size 1 along some axis has one column (row) of degenerate cells.
+	const unsigned int cells_x= std::max( 1u, static_cast<unsigned int>(grid_x.size()) - 1u );
+	const unsigned int cells_y= std::max( 1u, static_cast<unsigned int>(grid_y.size()) - 1u );
+	for( unsigned int cell_y= 0u; cell_y < cells_y; cell_y++ )
+	for( unsigned int cell_x= 0u; cell_x < cells_x; cell_x++ )
+	{
+		const unsigned int x0= grid_x[ cell_x ];
+		const unsigned int y0= grid_y[ cell_y ];
+		const unsigned int x1= grid_x[ std::min( cell_x + 1u, static_cast<unsigned int>(grid_x.size()) - 1u ) ];
+		const unsigned int y1= grid_y[ std::min( cell_y + 1u, static_cast<unsigned int>(grid_y.size()) - 1u ) ];
+
+		const float* const corners[4]=
+		{
+			get_texel_data( x0, y0 ), get_texel_data( x1, y0 ),
+			get_texel_data( x0, y1 ), get_texel_data( x1, y1 ),
+		};
+
+		// Cell is smooth, if all corners are sampled, light difference between corners is small,
+		// and there are no geometry edges inside cell.
+		bool smooth= true;
+		m_Vec3 min_light( plb_Constants::max_float, plb_Constants::max_float, plb_Constants::max_float );
+		m_Vec3 max_light( 0.0f, 0.0f, 0.0f );
+		float average_light= 0.0f;
+		for( const float* const corner : corners )
+		{
+			if( corner[3] <= 0.0f )
+				smooth= false;
+			for( unsigned int j= 0; j < 3; j++ )
+			{
+				min_light.ToArr()[j]= std::min( min_light.ToArr()[j], corner[j] );
+				max_light.ToArr()[j]= std::max( max_light.ToArr()[j], corner[j] );
+				average_light+= corner[j];
+			}
+		}
+		average_light/= 12.0f;
+
+		const m_Vec3 light_difference= max_light - min_light;
+		const float max_difference= std::max( light_difference.x, std::max( light_difference.y, light_difference.z ) );
+		if( max_difference > config_.secondary_light_adaptive_threshold * average_light )
+			smooth= false;
+
+		if( smooth && surface.is_near_edge( x0, y0, x1, y1 ) )
+			smooth= false;
+
+		for( unsigned int y= y0; y <= y1; y++ )
+		for( unsigned int x= x0; x <= x1; x++ )
+		{
+			TexelState& state= texels_states[ x + y * surface.size[0] ];
+			if( state == TexelState::GridCorner || state == TexelState::Sampled )
+				continue;
+
+			if( !smooth )
+			{
+				// Texel may be already interpolated in neighbor cell. Hemicube will overwrite it.
+				SecondaryLightSample sample;
+				if( GetSecondaryLightSurfaceSample( surface, x, y, 1u, 1u, sample ) )
+					out_samples.push_back( sample );
+				if( state == TexelState::Interpolated )
+					interpolated_texels--;
+				state= TexelState::Sampled;
+			}
+			else if( state == TexelState::NotProcessed )
+			{
+				// Bilinear interpolation between corners.
+				const float fx= x1 > x0 ? float( x - x0 ) / float( x1 - x0 ) : 0.0f;
+				const float fy= y1 > y0 ? float( y - y0 ) / float( y1 - y0 ) : 0.0f;
+				const float weights[4]=
+				{
+					( 1.0f - fx ) * ( 1.0f - fy ), fx * ( 1.0f - fy ),
+					( 1.0f - fx ) * fy, fx * fy,
+				};
+
+				float* const dst= get_texel_data( x, y );
+				for( unsigned int j= 0; j < 4; j++ )
+				{
+					dst[j]= 0.0f;
+					for( unsigned int c= 0; c < 4; c++ )
+						dst[j]+= corners[c][j] * weights[c];
+				}
+
+				interpolated_texels++;
+				state= TexelState::Interpolated;
+			}
+		}
+	} // for cells
+
+	return interpolated_texels;
+}
+
+std::vector<unsigned int> plb_LightmapsBuilder::GetAdaptiveGridCoordinates( const unsigned int size, const unsigned int step )
+{
+	// Grid with given step, last texel is always included.
+	std::vector<unsigned int> result;
+	for( unsigned int i= 0u; i < size; i+= step )
+		result.push_back(i);
+
+	if( !result.empty() && result.back() != size - 1u )
+		result.push_back( size - 1u );
+
+	return result;
+}
+
+void plb_LightmapsBuilder::CreateSecondaryLightBounceTexture( const unsigned int bounce )
+{
+	GLuint& tex_id= lightmap_atlas_texture_.secondary_tex_id[ bounce ];
+
+	glGenTextures( 1, &tex_id );
+	glBindTexture( GL_TEXTURE_2D_ARRAY, tex_id );
+	glTexImage3D( GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F,
+		lightmap_atlas_texture_.secondary_lightmap_size[0], lightmap_atlas_texture_.secondary_lightmap_size[1],
+		lightmap_atlas_texture_.size[2],
+		0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+}
+
+double plb_LightmapsBuilder::ReadSecondaryLightBounce( const unsigned int bounce, std::vector<float>& out_data )
+{
+	out_data.resize(
+		4u *
+		lightmap_atlas_texture_.secondary_lightmap_size[0] *
+		lightmap_atlas_texture_.secondary_lightmap_size[1] *
+		lightmap_atlas_texture_.size[2] );
+
+	glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.secondary_tex_id[ bounce ] );
+	glGetTexImage( GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, GL_FLOAT, out_data.data() );
+
+	return GetLightEnergy( out_data );
+}
+
+void plb_LightmapsBuilder::WriteSecondaryLightBounce( const unsigned int bounce, const std::vector<float>& data )
+{
+	glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.secondary_tex_id[ bounce ] );
+	glTexSubImage3D(
+		GL_TEXTURE_2D_ARRAY, 0,
+		0, 0, 0,
+		lightmap_atlas_texture_.secondary_lightmap_size[0],
+		lightmap_atlas_texture_.secondary_lightmap_size[1],
+		lightmap_atlas_texture_.size[2],
+		GL_RGBA, GL_FLOAT, data.data() );
+	plbProfilerAddCounter( plb_ProfilerCounter::BytesUploaded, data.size() * sizeof(float) );
+}
+
+template<class T>
+static void HashValue( uint64_t& hash, const T& value )
+{
+	hash= plbHashData( &value, sizeof(T), hash );
+}
+
+template<class T>
+static void HashVector( uint64_t& hash, const std::vector<T>& v )
+{
+	HashValue( hash, uint32_t(v.size()) );
+	hash= plbHashData( v.data(), v.size() * sizeof(T), hash );
+}
+
+// Hashes geometry and lightmaps coordinates. Structures of geometry have no padding.
+static void HashLevelGeometry( uint64_t& hash, const plb_LevelData& level_data )
+{
+	HashVector( hash, level_data.vertices );
+	HashVector( hash, level_data.polygons );
+	HashVector( hash, level_data.models_vertices );
+	HashVector( hash, level_data.models_normals );
+	HashVector( hash, level_data.models );
+	HashVector( hash, level_data.curved_surfaces );
+	HashVector( hash, level_data.curved_surfaces_vertices );
+}
+
+// Reserved fields are not initialized by some loaders, so, lights are hashed field by field.
+static void HashLight( uint64_t& hash, const plb_PointLight& light )
+{
+	HashValue( hash, light.pos );
+	HashValue( hash, light.intensity );
+	HashValue( hash, light.color );
+}
+
+static void HashLight( uint64_t& hash, const plb_ConeLight& light )
+{
+	HashLight( hash, static_cast<const plb_PointLight&>(light) );
+	HashValue( hash, light.direction );
+	HashValue( hash, light.angle );
+}
+
+static void HashLight( uint64_t& hash, const plb_DirectionalLight& light )
+{
+	HashValue( hash, light.direction );
+	HashValue( hash, light.intensity );
+	HashValue( hash, light.color );
+}
+
+static void HashLight( uint64_t& hash, const plb_SurfaceSampleLight& light )
+{
+	HashLight( hash, static_cast<const plb_PointLight&>(light) );
+	HashValue( hash, light.normal );
+}
+
+template<class Light>
+static uint64_t GetLightHash( const Light& light )
+{
+	uint64_t hash= plbHashData( nullptr, 0u );
+	HashLight( hash, light );
+	return hash;
+}
+
+// Returns lights, which have no equal light in other lights. Equal lights are matched one to one.
+template<class Light>
+static std::vector<Light> GetUnmatchedLights( const std::vector<Light>& lights, const std::vector<Light>& other_lights )
+{
+	std::unordered_map<uint64_t, unsigned int> other_lights_count;
+	for( const Light& light : other_lights )
+		other_lights_count[ GetLightHash( light ) ]++;
+
+	std::vector<Light> result;
+	for( const Light& light : lights )
+	{
+		const auto it= other_lights_count.find( GetLightHash( light ) );
+		if( it != other_lights_count.end() && it->second > 0u )
+			it->second--;
+		else
+			result.push_back( light );
+	}
+
+	return result;
+}
+
+static void HashSecondaryLightOptions( uint64_t& hash, const plb_Config& config )
+{
+	HashValue( hash, config.secondary_light_pass_cubemap_size_log2 );
+	HashValue( hash, config.secondary_light_bounces );
+	HashValue( hash, config.secondary_light_bounces_energy_threshold );
+	HashValue( hash, config.secondary_light_adaptive_step );
+	HashValue( hash, config.secondary_light_adaptive_threshold );
+	HashValue( hash, config.secondary_light_irradiance_cache_error );
+	HashValue( hash, config.secondary_light_pass_batch_size );
+	HashValue( hash, config.cpu_secondary_light_pass_rays );
+}
+
+uint64_t plb_LightmapsBuilder::GetSecondaryLightCheckpointKey() const
+{
+	uint64_t hash= plbHashData( nullptr, 0u );
+
+	HashValue( hash, config_.backend );
+	HashValue( hash, lightmap_atlas_texture_.secondary_lightmap_size );
+	HashValue( hash, lightmap_atlas_texture_.size );
+
+	HashLevelGeometry( hash, level_data_ );
+
+	for( const plb_PointLight& light : level_data_.point_lights )
+		HashLight( hash, light );
+	for( const plb_ConeLight& light : level_data_.cone_lights )
+		HashLight( hash, light );
+	for( const plb_DirectionalLight& light : level_data_.directional_lights )
+		HashLight( hash, light );
+	for( const plb_Material& material : level_data_.materials )
+		HashValue( hash, material.luminosity );
+
+	HashSecondaryLightOptions( hash, config_ );
+
+	return hash;
+}
+
+bool plb_LightmapsBuilder::LoadSecondaryLightCheckpoint( plb_SecondaryLightCheckpoint& checkpoint ) const
+{
+	checkpoint.key= GetSecondaryLightCheckpointKey();
+	checkpoint.atlas_size[0]= lightmap_atlas_texture_.secondary_lightmap_size[0];
+	checkpoint.atlas_size[1]= lightmap_atlas_texture_.secondary_lightmap_size[1];
+	checkpoint.atlas_size[2]= lightmap_atlas_texture_.size[2];
+
+	const char* const file_name= config_.secondary_light_checkpoint_file.c_str();
+	if( config_.secondary_light_checkpoint_file.empty() )
+		return false;
+
+	plb_SecondaryLightCheckpoint file_checkpoint;
+	if( !plbReadSecondaryLightCheckpoint( file_name, file_checkpoint ) )
+		return false;
+
+	const size_t atlas_data_size= 4u * checkpoint.atlas_size[0] * checkpoint.atlas_size[1] * checkpoint.atlas_size[2];
+	const auto is_valid_size=
+	[&]( const std::vector<float>& data, const bool required )
+	{
+		return data.size() == atlas_data_size || ( !required && data.empty() );
+	};
+
+	const bool continued_bounce= file_checkpoint.bounce > 0u && !file_checkpoint.complete;
+	if( file_checkpoint.key != checkpoint.key ||
+		file_checkpoint.atlas_size[0] != checkpoint.atlas_size[0] ||
+		file_checkpoint.atlas_size[1] != checkpoint.atlas_size[1] ||
+		file_checkpoint.atlas_size[2] != checkpoint.atlas_size[2] ||
+		file_checkpoint.bounce >= PLB_MAX_LIGHT_PASSES ||
+		!is_valid_size( file_checkpoint.bounce_light, file_checkpoint.items_done > 0u || file_checkpoint.complete ) ||
+		!is_valid_size( file_checkpoint.previous_bounce_light, continued_bounce ) ||
+		!is_valid_size( file_checkpoint.accumulated_light, continued_bounce ) )
+	{
+		std::cout << "Checkpoint \"" << file_name << "\" was created for other level or options, ignore it" << std::endl;
+		return false;
+	}
+
+	std::cout << "Continue secondary light from checkpoint \"" << file_name << "\"";
+	if( file_checkpoint.complete )
+		std::cout << ", secondary light is complete" << std::endl;
+	else
+		std::cout << ", bounce " << file_checkpoint.bounce + 1u << ", " << file_checkpoint.items_done << " items done" << std::endl;
+
+	checkpoint= std::move(file_checkpoint);
+	return true;
+}
+
+bool plb_LightmapsBuilder::SecondaryLightCheckpointIsDue() const
+{
+	return
+		!config_.secondary_light_checkpoint_file.empty() &&
+		std::chrono::steady_clock::now() - last_secondary_light_checkpoint_time_ >=
+			std::chrono::seconds( config_.secondary_light_checkpoint_interval );
+}
+
+void plb_LightmapsBuilder::SaveSecondaryLightCheckpoint( const plb_SecondaryLightCheckpoint& checkpoint )
+{
+	const plb_ProfilerScope profiler_scope( "Secondary light checkpoint" );
+
+	if( plbWriteSecondaryLightCheckpoint( config_.secondary_light_checkpoint_file.c_str(), checkpoint ) )
+		std::cout << "Secondary light checkpoint saved to \"" << config_.secondary_light_checkpoint_file << "\"" << std::endl;
+
+	// Do not retry failed writing immediately.
+	last_secondary_light_checkpoint_time_= std::chrono::steady_clock::now();
+}
+
+void plb_LightmapsBuilder::RemoveSecondaryLightCheckpoint()
+{
+	if( !config_.secondary_light_checkpoint_file.empty() )
+		std::remove( config_.secondary_light_checkpoint_file.c_str() );
+}
+
+// Strings of materials are hashed by content.
+static void HashMaterial( uint64_t& hash, const plb_Material& material )
+{
+	HashValue( hash, uint32_t(material.albedo_texture_file_name.size()) );
+	hash= plbHashData( material.albedo_texture_file_name.data(), material.albedo_texture_file_name.size(), hash );
+	HashValue( hash, uint32_t(material.light_texture_file_name.size()) );
+	hash= plbHashData( material.light_texture_file_name.data(), material.light_texture_file_name.size(), hash );
+	HashValue( hash, material.luminosity );
+	HashValue( hash, material.split_to_point_lights );
+	HashValue( hash, material.cast_alpha_shadow );
+}
+
+static bool BBoxesIntersect( const m_BBox3& box0, const m_BBox3& box1 )
+{
+	for( unsigned int i= 0; i < 3; i++ )
+	{
+		if(
+			box0.max.ToArr()[i] < box1.min.ToArr()[i] ||
+			box1.max.ToArr()[i] < box0.min.ToArr()[i] )
+			return false;
+	}
+
+	return true;
+}
+
+// Copies lightmap of surface from one atlas into other. Atlas size is width, height, layers.
+// Returns false, if lightmap is outside of atlas.
+static bool CopySurfaceLightmap(
+	const std::vector<float>& src_atlas, const unsigned int* const src_atlas_size, const plb_SurfaceLightmapData& src_lightmap,
+	std::vector<float>& dst_atlas, const unsigned int* const dst_atlas_size, const plb_SurfaceLightmapData& dst_lightmap,
+	const unsigned int scaler )
+{
+	const unsigned int size[2]=
+	{
+		( src_lightmap.size[0] + scaler - 1u ) / scaler,
+		( src_lightmap.size[1] + scaler - 1u ) / scaler,
+	};
+	const unsigned int src_coord[2]= { src_lightmap.coord[0] / scaler, src_lightmap.coord[1] / scaler };
+	const unsigned int dst_coord[2]= { dst_lightmap.coord[0] / scaler, dst_lightmap.coord[1] / scaler };
+
+	if( src_lightmap.atlas_id >= src_atlas_size[2] || dst_lightmap.atlas_id >= dst_atlas_size[2] )
+		return false;
+	for( unsigned int i= 0; i < 2; i++ )
+	{
+		if( src_coord[i] + size[i] > src_atlas_size[i] || dst_coord[i] + size[i] > dst_atlas_size[i] )
+			return false;
+	}
+
+	for( unsigned int y= 0; y < size[1]; y++ )
+	{
+		const float* const src=
+			src_atlas.data() +
+			4u * ( src_coord[0] + ( src_coord[1] + y + src_lightmap.atlas_id * src_atlas_size[1] ) * src_atlas_size[0] );
+		float* const dst=
+			dst_atlas.data() +
+			4u * ( dst_coord[0] + ( dst_coord[1] + y + dst_lightmap.atlas_id * dst_atlas_size[1] ) * dst_atlas_size[0] );
+		std::memcpy( dst, src, 4u * size[0] * sizeof(float) );
+	}
+
+	return true;
+}
+
+// Writes to out_mask bits of clusters, potentially visible from clusters of given points.
+// Unlike plbGetVisibleClustersMask, points outside of level are skipped.
+// Returns false, if level has no visibility data.
+static bool GetClustersVisibleFromPoints(
+	const plb_VisibilityData& visibility,
+	const std::vector<m_Vec3>& points,
+	std::vector<unsigned char>& out_mask )
+{
+	if( visibility.cluster_count == 0u )
+		return false;
+
+	std::vector<unsigned char> points_clusters_mask( visibility.cluster_row_size, 0u );
+	for( const m_Vec3& point : points )
+	{
+		const int cluster= plbGetPointCluster( visibility, point );
+		if( cluster >= 0 )
+			points_clusters_mask[ cluster >> 3 ]|= 1u << ( cluster & 7 );
+	}
+
+	out_mask= points_clusters_mask;
+	for( unsigned int cluster= 0u; cluster < visibility.cluster_count; cluster++ )
+	{
+		if( ( points_clusters_mask[ cluster >> 3 ] & ( 1u << ( cluster & 7 ) ) ) == 0 )
+			continue;
+
+		const unsigned char* const row= visibility.clusters_visibility.data() + cluster * visibility.cluster_row_size;
+		for( unsigned int j= 0; j < visibility.cluster_row_size; j++ )
+			out_mask[j]|= row[j];
+	}
+
+	return true;
+}
+
+static m_BBox3 ClampBBox( const m_BBox3& box, const m_BBox3& level_box )
+{
+	m_BBox3 result;
+	for( unsigned int i= 0; i < 3; i++ )
+	{
+		result.min.ToArr()[i]= std::max( box.min.ToArr()[i], level_box.min.ToArr()[i] );
+		result.max.ToArr()[i]= std::min( box.max.ToArr()[i], level_box.max.ToArr()[i] );
+	}
+	return result;
+}
+
+// Point lights and lights of luminous surfaces affect only surfaces inside sphere of cutoff radius.
+static m_BBox3 GetLightBBox( const plb_PointLight& light, const float cutoff_threshold, const m_BBox3& level_box )
+{
+	const float radius= plb_LightTexelsGrid::GetLightCutoffRadius( plbGetPointLightColor( light ), cutoff_threshold );
+	const m_Vec3 radius_vec( radius, radius, radius );
+	return ClampBBox( m_BBox3( m_Vec3( light.pos ) - radius_vec, m_Vec3( light.pos ) + radius_vec ), level_box );
+}
+
+// Cone light passes are not limited by cutoff radius, cone light affects all surfaces inside cone.
+// Cone, cut by level diagonal, lies inside convex hull of apex and disc of cone base.
+static m_BBox3 GetLightBBox( const plb_ConeLight& light, const float cutoff_threshold, const m_BBox3& level_box )
+{
+	(void)cutoff_threshold;
+
+	// Cone with almost flat base lights half of space.
+	if( !( light.angle < plb_Constants::half_pi * 0.99f ) )
+		return level_box;
+
+	const float length= ( level_box.max - level_box.min ).Length();
+	const float radius= length * std::tan( light.angle );
+	const m_Vec3 pos( light.pos );
+	const m_Vec3 dir( light.direction );
+	const m_Vec3 base_center= pos + dir * length;
+
+	m_BBox3 box( pos, pos );
+	for( unsigned int i= 0; i < 3; i++ )
+	{
+		const float d= dir.ToArr()[i];
+		const float base_extent= radius * std::sqrt( std::max( 0.0f, 1.0f - d * d ) );
+		box.min.ToArr()[i]= std::min( box.min.ToArr()[i], base_center.ToArr()[i] - base_extent );
+		box.max.ToArr()[i]= std::max( box.max.ToArr()[i], base_center.ToArr()[i] + base_extent );
+	}
+
+	return ClampBBox( box, level_box );
+}
+
+// Adds to out_boxes boxes of added and removed lights and of lights, which may be shadowed by changed geometry.
+template<class Light>
+static void GetAffectedLightsBoxes(
+	const std::vector<Light>& lights,
+	const std::vector<Light>& cached_lights,
+	const std::vector<m_BBox3>& changed_boxes,
+	const float cutoff_threshold,
+	const m_BBox3& level_box,
+	std::vector<m_BBox3>& out_boxes )
+{
+	for( const Light& light : GetUnmatchedLights( lights, cached_lights ) )
+		out_boxes.push_back( GetLightBBox( light, cutoff_threshold, level_box ) );
+	for( const Light& light : GetUnmatchedLights( cached_lights, lights ) )
+		out_boxes.push_back( GetLightBBox( light, cutoff_threshold, level_box ) );
+
+	for( const Light& light : lights )
+	{
+		const m_BBox3 light_box= GetLightBBox( light, cutoff_threshold, level_box );
+		for( const m_BBox3& box : changed_boxes )
+		{
+			if( BBoxesIntersect( light_box, box ) )
+			{
+				out_boxes.push_back( light_box );
+				break;
+			}
+		}
+	}
+}
+
+uint64_t plb_LightmapsBuilder::GetLightCacheOptionsKey() const
+{
+	uint64_t hash= plbHashData( nullptr, 0u );
+
+	HashValue( hash, config_.backend );
+
+	// Options of lightmaps layout, textures and primary light.
+	HashValue( hash, config_.lightmap_scale_to_original );
+	HashValue( hash, config_.secondary_lightmap_scaler );
+	HashValue( hash, config_.textures_gamma );
+	HashValue( hash, config_.min_textures_size_log2 );
+	HashValue( hash, config_.max_textures_size_log2 );
+	HashValue( hash, config_.use_average_texture_color_for_luminous_surfaces );
+	HashValue( hash, config_.point_light_shadowmap_cubemap_size_log2 );
+	HashValue( hash, config_.directional_light_shadowmap_size_log2 );
+	HashValue( hash, config_.cone_light_shadowmap_size_log2 );
+	HashValue( hash, config_.point_light_pass_batch_size );
+	HashValue( hash, config_.light_cutoff_threshold );
+
+	return hash;
+}
+
+uint64_t plb_LightmapsBuilder::GetLightCacheGeometryKey() const
+{
+	uint64_t hash= plbHashData( nullptr, 0u );
+
+	HashValue( hash, GetLightCacheOptionsKey() );
+	HashValue( hash, lightmap_atlas_texture_.secondary_lightmap_size );
+	HashValue( hash, lightmap_atlas_texture_.size );
+
+	HashLevelGeometry( hash, level_data_ );
+
+	// Surface sample lights are built from luminous materials, so, they are part of geometry.
+	for( const plb_Material& material : level_data_.materials )
+	{
+		HashValue( hash, material.luminosity );
+		HashValue( hash, material.split_to_point_lights );
+		HashValue( hash, material.cast_alpha_shadow );
+	}
+	for( const plb_SurfaceSampleLight& light : bright_luminous_surfaces_lights_ )
+		HashLight( hash, light );
+
+	return hash;
+}
+
+uint64_t plb_LightmapsBuilder::GetLightCacheSecondaryLightKey() const
+{
+	uint64_t hash= plbHashData( nullptr, 0u );
+	HashSecondaryLightOptions( hash, config_ );
+	return hash;
+}
+
+void plb_LightmapsBuilder::GetLightCacheSurfaces( plb_LightCacheSurfaces& out_surfaces ) const
+{
+	out_surfaces.clear();
+	out_surfaces.reserve( level_data_.polygons.size() + level_data_.curved_surfaces.size() + level_data_.models.size() );
+
+	const auto add_surface=
+	[&]( const uint64_t hash, const m_BBox3& bbox, const plb_SurfaceLightmapData* const lightmap_data )
+	{
+		out_surfaces.emplace_back();
+		plb_LightCacheSurface& surface= out_surfaces.back();
+		std::memset( &surface, 0, sizeof(surface) );
+
+		surface.hash= hash;
+		VEC3_CPY( surface.bb_min, bbox.min.ToArr() );
+		VEC3_CPY( surface.bb_max, bbox.max.ToArr() );
+		if( lightmap_data != nullptr )
+			surface.lightmap_data= *lightmap_data;
+	};
+
+	// Only vertex attributes, which do not depend on placement in lightmaps atlas, are hashed.
+	const auto hash_vertex=
+	[]( uint64_t& hash, const plb_Vertex& vertex )
+	{
+		HashValue( hash, vertex.pos );
+		HashValue( hash, vertex.tex_coord );
+	};
+
+	for( const plb_Polygon& poly : level_data_.polygons )
+	{
+		uint64_t hash= plbHashData( nullptr, 0u );
+		m_BBox3 bbox( plb_Constants::max_vec, plb_Constants::min_vec );
+
+		for( unsigned int v= 0; v < poly.vertex_count; v++ )
+		{
+			const plb_Vertex& vertex= level_data_.vertices[ poly.first_vertex_number + v ];
+			hash_vertex( hash, vertex );
+			bbox+= m_Vec3( vertex.pos );
+		}
+		for( unsigned int i= 0; i < poly.index_count; i++ )
+			HashValue( hash, level_data_.polygons_indeces[ poly.first_index + i ] - poly.first_vertex_number );
+
+		HashValue( hash, poly.texture_basis );
+		HashValue( hash, poly.lightmap_basis );
+		HashValue( hash, poly.lightmap_pos );
+		HashValue( hash, poly.normal );
+		HashValue( hash, poly.flags );
+		HashValue( hash, poly.lightmap_data.size );
+		HashMaterial( hash, level_data_.materials[ poly.material_id ] );
+
+		add_surface(
+			hash, bbox,
+			( poly.flags & plb_SurfaceFlags::NoLightmap ) == 0 ? &poly.lightmap_data : nullptr );
+	}
+
+	for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
+	{
+		uint64_t hash= plbHashData( nullptr, 0u );
+		m_BBox3 bbox( plb_Constants::max_vec, plb_Constants::min_vec );
+
+		// Curve lies inside convex hull of control points.
+		for( unsigned int v= 0; v < curve.grid_size[0] * curve.grid_size[1]; v++ )
+		{
+			const plb_Vertex& vertex= level_data_.curved_surfaces_vertices[ curve.first_vertex_number + v ];
+			hash_vertex( hash, vertex );
+			bbox+= m_Vec3( vertex.pos );
+		}
+
+		HashValue( hash, curve.grid_size );
+		HashValue( hash, curve.flags );
+		HashValue( hash, curve.lightmap_data.size );
+		HashMaterial( hash, level_data_.materials[ curve.material_id ] );
+
+		add_surface(
+			hash, bbox,
+			( curve.flags & plb_SurfaceFlags::NoLightmap ) == 0 ? &curve.lightmap_data : nullptr );
+	}
+
+	for( const plb_LevelModel& model : level_data_.models )
+	{
+		uint64_t hash= plbHashData( nullptr, 0u );
+		m_BBox3 bbox( plb_Constants::max_vec, plb_Constants::min_vec );
+
+		for( unsigned int v= 0; v < model.vertex_count; v++ )
+		{
+			const plb_Vertex& vertex= level_data_.models_vertices[ model.first_vertex_number + v ];
+			hash_vertex( hash, vertex );
+			HashValue( hash, level_data_.models_normals[ model.first_vertex_number + v ].xyz );
+			bbox+= m_Vec3( vertex.pos );
+		}
+		for( unsigned int i= 0; i < model.index_count; i++ )
+			HashValue( hash, level_data_.models_indeces[ model.first_index + i ] - model.first_vertex_number );
+
+		HashValue( hash, model.flags );
+		HashMaterial( hash, level_data_.materials[ model.material_id ] );
+
+		// Texels of models are placed into atlas in order of vertices, so, they have no own lightmaps.
+		add_surface( hash, bbox, nullptr );
+	}
+}
+
+void plb_LightmapsBuilder::PrepareLightSources()
+{
+	light_sources_.point_lights= level_data_.point_lights;
+	light_sources_.directional_lights= level_data_.directional_lights;
+	light_sources_.cone_lights= level_data_.cone_lights;
+	light_sources_.surface_sample_lights= bright_luminous_surfaces_lights_;
+
+	if( config_.light_cache_file.empty() )
+		return;
+
+	const char* const file_name= config_.light_cache_file.c_str();
+
+	plb_LightCache cache;
+	if( !plbReadLightCache( file_name, cache ) )
+		return;
+
+	if( cache.options_key != GetLightCacheOptionsKey() )
+	{
+		std::cout << "Light cache \"" << file_name << "\" was created with other options, build all light" << std::endl;
+		return;
+	}
+
+	const size_t primary_light_size=
+		4u * lightmap_atlas_texture_.size[0] * lightmap_atlas_texture_.size[1] * lightmap_atlas_texture_.size[2];
+
+	if( cache.geometry_key != GetLightCacheGeometryKey() ||
+		cache.atlas_size[0] != lightmap_atlas_texture_.size[0] ||
+		cache.atlas_size[1] != lightmap_atlas_texture_.size[1] ||
+		cache.atlas_size[2] != lightmap_atlas_texture_.size[2] ||
+		cache.secondary_atlas_size[0] != lightmap_atlas_texture_.secondary_lightmap_size[0] ||
+		cache.secondary_atlas_size[1] != lightmap_atlas_texture_.secondary_lightmap_size[1] ||
+		cache.primary_light.size() != primary_light_size )
+	{
+		ReuseLightOfUnchangedSurfaces( cache );
+		return;
+	}
+
+	// Light passes are additive, so, previous light of changed light source is subtracted
+	// by pass with negative intensity, and then new light is added.
+	const plb_PointLights new_point_lights= GetUnmatchedLights( level_data_.point_lights, cache.point_lights );
+	const plb_PointLights old_point_lights= GetUnmatchedLights( cache.point_lights, level_data_.point_lights );
+	const plb_DirectionalLights new_directional_lights= GetUnmatchedLights( level_data_.directional_lights, cache.directional_lights );
+	const plb_DirectionalLights old_directional_lights= GetUnmatchedLights( cache.directional_lights, level_data_.directional_lights );
+	const plb_ConeLights new_cone_lights= GetUnmatchedLights( level_data_.cone_lights, cache.cone_lights );
+	const plb_ConeLights old_cone_lights= GetUnmatchedLights( cache.cone_lights, level_data_.cone_lights );
+
+	light_sources_.point_lights= new_point_lights;
+	for( plb_PointLight light : old_point_lights )
+	{
+		light.intensity= -light.intensity;
+		light_sources_.point_lights.push_back( light );
+	}
+	light_sources_.directional_lights= new_directional_lights;
+	for( plb_DirectionalLight light : old_directional_lights )
+	{
+		light.intensity= -light.intensity;
+		light_sources_.directional_lights.push_back( light );
+	}
+	light_sources_.cone_lights= new_cone_lights;
+	for( plb_ConeLight light : old_cone_lights )
+	{
+		light.intensity= -light.intensity;
+		light_sources_.cone_lights.push_back( light );
+	}
+	light_sources_.surface_sample_lights.clear();
+
+	WriteLightmapsAtlas( false, cache.primary_light );
+
+	std::cout << "Light cache \"" << file_name << "\" is used. Changed lights:" <<
+		" point " << new_point_lights.size() << " added, " << old_point_lights.size() << " removed;" <<
+		" directional " << new_directional_lights.size() << " added, " << old_directional_lights.size() << " removed;" <<
+		" cone " << new_cone_lights.size() << " added, " << old_cone_lights.size() << " removed" << std::endl;
+
+	if( !SecondaryLightCacheIsUsable( cache ) )
+		return;
+
+	// Directional lights may light whole level.
+	if( !light_sources_.directional_lights.empty() )
+		return;
+
+	std::vector<m_Vec3> changed_lights_positions;
+	for( const plb_PointLight& light : light_sources_.point_lights )
+		changed_lights_positions.emplace_back( light.pos );
+	for( const plb_ConeLight& light : light_sources_.cone_lights )
+		changed_lights_positions.emplace_back( light.pos );
+
+	changed_clusters_mask_.clear();
+	if( !changed_lights_positions.empty() )
+	{
+		// Changed light reaches texels in clusters, visible from light sources.
+		// Secondary light samples gather light of these texels from clusters, visible from them.
+		std::vector<unsigned char> lit_clusters_mask;
+		if( !plbGetVisibleClustersMask(
+				level_data_.visibility,
+				changed_lights_positions.data(), changed_lights_positions.size(),
+				lit_clusters_mask ) )
+			return;
+
+		const plb_VisibilityData& visibility= level_data_.visibility;
+		changed_clusters_mask_.assign( visibility.cluster_row_size, 0u );
+		for( unsigned int cluster= 0u; cluster < visibility.cluster_count; cluster++ )
+		{
+			if( ( lit_clusters_mask[ cluster >> 3 ] & ( 1u << ( cluster & 7 ) ) ) == 0 )
+				continue;
+
+			const unsigned char* const row= visibility.clusters_visibility.data() + cluster * visibility.cluster_row_size;
+			for( unsigned int j= 0; j < visibility.cluster_row_size; j++ )
+				changed_clusters_mask_[j]|= row[j];
+			changed_clusters_mask_[ cluster >> 3 ]|= 1u << ( cluster & 7 );
+		}
+	}
+
+	incremental_secondary_light_= true;
+	light_cache_.secondary_light= std::move(cache.secondary_light);
+}
+
+void plb_LightmapsBuilder::ReuseLightOfUnchangedSurfaces( const plb_LightCache& cache )
+{
+	const plb_ProfilerScope profiler_scope( "Light cache surfaces matching" );
+
+	const char* const file_name= config_.light_cache_file.c_str();
+
+	if( cache.primary_light.size() != 4u * cache.atlas_size[0] * cache.atlas_size[1] * cache.atlas_size[2] )
+	{
+		std::cout << "Invalid light cache file: " << file_name << std::endl;
+		return;
+	}
+
+	// Directional lights may light whole level.
+	if( !GetUnmatchedLights( level_data_.directional_lights, cache.directional_lights ).empty() ||
+		!GetUnmatchedLights( cache.directional_lights, level_data_.directional_lights ).empty() )
+	{
+		std::cout << "Geometry and directional lights are changed since creation of light cache \"" << file_name << "\", build all light" << std::endl;
+		return;
+	}
+
+	plb_LightCacheSurfaces surfaces;
+	GetLightCacheSurfaces( surfaces );
+
+	// Surfaces with equal hashes are matched one to one. Not matched cached surfaces are left in map.
+	std::unordered_multimap<uint64_t, unsigned int> cached_surfaces;
+	for( unsigned int i= 0u; i < cache.surfaces.size(); i++ )
+		cached_surfaces.emplace( cache.surfaces[i].hash, i );
+
+	std::vector<unsigned int> surfaces_matches( surfaces.size(), ~0u );
+	for( unsigned int i= 0u; i < surfaces.size(); i++ )
+	{
+		const auto it= cached_surfaces.find( surfaces[i].hash );
+		if( it == cached_surfaces.end() )
+			continue;
+
+		surfaces_matches[i]= it->second;
+		cached_surfaces.erase( it );
+	}
+
+	const auto get_bbox=
+	[]( const plb_LightCacheSurface& surface ) -> m_BBox3
+	{
+		return m_BBox3( m_Vec3( surface.bb_min ), m_Vec3( surface.bb_max ) );
+	};
+
+	// Boxes of added, changed and removed surfaces.
+	std::vector<m_BBox3> changed_boxes;
+	unsigned int changed_surface_count= 0u;
+	for( unsigned int i= 0u; i < surfaces.size(); i++ )
+	{
+		if( surfaces_matches[i] != ~0u )
+			continue;
+
+		changed_boxes.push_back( get_bbox( surfaces[i] ) );
+		changed_surface_count++;
+	}
+	for( const auto& cached_surface : cached_surfaces )
+		changed_boxes.push_back( get_bbox( cache.surfaces[ cached_surface.second ] ) );
+
+	std::vector<m_BBox3> surfaces_boxes( surfaces.size() );
+	for( unsigned int i= 0u; i < surfaces.size(); i++ )
+		surfaces_boxes[i]= get_bbox( surfaces[i] );
+	const plb_BoxesGrid surfaces_grid( surfaces_boxes );
+
+	std::vector<bool> affected_surfaces( surfaces.size(), false );
+	std::vector<unsigned int> surfaces_in_box;
+	const auto mark_surfaces_in_box=
+	[&]( const m_BBox3& box )
+	{
+		surfaces_in_box.clear();
+		surfaces_grid.GetBoxesInBox( box, surfaces_in_box );
+		for( const unsigned int i : surfaces_in_box )
+			affected_surfaces[i]= true;
+	};
+
+	for( unsigned int i= 0u; i < surfaces.size(); i++ )
+		affected_surfaces[i]= surfaces_matches[i] == ~0u;
+
+	// Light texels are moved out of neighbor geometry, so, texels of surfaces near changed geometry may be moved.
+	// Use same distance, as in search of polygon neighbors.
+	float neighbors_distance= 0.0f;
+	for( const plb_Polygon& poly : level_data_.polygons )
+		neighbors_distance=
+			std::max(
+				neighbors_distance,
+				plb_Constants::sqrt_2 *
+				float( config_.secondary_lightmap_scaler ) *
+				std::sqrt(
+					std::max(
+						m_Vec3(poly.lightmap_basis[0]).SquareLength(),
+						m_Vec3(poly.lightmap_basis[1]).SquareLength() ) ) );
+	const m_Vec3 neighbors_distance_vec( neighbors_distance, neighbors_distance, neighbors_distance );
+	for( const m_BBox3& box : changed_boxes )
+		mark_surfaces_in_box( m_BBox3( box.min - neighbors_distance_vec, box.max + neighbors_distance_vec ) );
+
+	const m_BBox3 level_box( level_bounding_box_.min, level_bounding_box_.max );
+	const float cutoff_threshold= config_.light_cutoff_threshold;
+	std::vector<m_BBox3> lights_boxes;
+	GetAffectedLightsBoxes( level_data_.point_lights, cache.point_lights, changed_boxes, cutoff_threshold, level_box, lights_boxes );
+	GetAffectedLightsBoxes( level_data_.cone_lights, cache.cone_lights, changed_boxes, cutoff_threshold, level_box, lights_boxes );
+	GetAffectedLightsBoxes( bright_luminous_surfaces_lights_, cache.surface_sample_lights, changed_boxes, cutoff_threshold, level_box, lights_boxes );
+	for( const m_BBox3& box : lights_boxes )
+		mark_surfaces_in_box( box );
+
+	// Shadows of directional lights are not limited by distance.
+	const float level_diagonal= ( level_bounding_box_.max - level_bounding_box_.min ).Length();
+	for( const plb_DirectionalLight& light : level_data_.directional_lights )
+	{
+		const m_Vec3 shadow_shift= m_Vec3( light.direction ) * (-level_diagonal);
+		for( const m_BBox3& box : changed_boxes )
+		{
+			m_BBox3 shadow_box= box;
+			shadow_box+= box.min + shadow_shift;
+			shadow_box+= box.max + shadow_shift;
+			mark_surfaces_in_box( shadow_box );
+		}
+	}
+
+	// Copy light of unchanged surfaces into new atlas.
+	// Secondary light of relit surfaces is copied too, it is rebuilt later only if it is changed.
+	const bool reuse_secondary_light= SecondaryLightCacheIsUsable( cache );
+
+	const unsigned int* const atlas_size= lightmap_atlas_texture_.size;
+	const unsigned int secondary_atlas_size[3]=
+		{ lightmap_atlas_texture_.secondary_lightmap_size[0], lightmap_atlas_texture_.secondary_lightmap_size[1], atlas_size[2] };
+	const unsigned int cached_secondary_atlas_size[3]=
+		{ cache.secondary_atlas_size[0], cache.secondary_atlas_size[1], cache.atlas_size[2] };
+
+	std::vector<float> primary_light( 4u * atlas_size[0] * atlas_size[1] * atlas_size[2], 0.0f );
+	std::vector<float> secondary_light;
+	if( reuse_secondary_light )
+		secondary_light.resize( 4u * secondary_atlas_size[0] * secondary_atlas_size[1] * secondary_atlas_size[2], 0.0f );
+
+	const unsigned int level_surface_count= level_data_.polygons.size() + level_data_.curved_surfaces.size();
+	relit_surfaces_.assign( level_surface_count, true );
+	unsigned int relit_surface_count= 0u;
+	for( unsigned int i= 0u; i < level_surface_count; i++ )
+	{
+		const plb_SurfaceLightmapData& lightmap_data= surfaces[i].lightmap_data;
+		if( lightmap_data.size[0] == 0u || lightmap_data.size[1] == 0u )
+			continue;
+
+		if( surfaces_matches[i] != ~0u )
+		{
+			const plb_SurfaceLightmapData& cached_lightmap_data= cache.surfaces[ surfaces_matches[i] ].lightmap_data;
+			if( reuse_secondary_light )
+				CopySurfaceLightmap(
+					cache.secondary_light, cached_secondary_atlas_size, cached_lightmap_data,
+					secondary_light, secondary_atlas_size, lightmap_data,
+					config_.secondary_lightmap_scaler );
+
+			if( !affected_surfaces[i] &&
+				CopySurfaceLightmap(
+					cache.primary_light, cache.atlas_size, cached_lightmap_data,
+					primary_light, atlas_size, lightmap_data,
+					1u ) )
+				relit_surfaces_[i]= false;
+		}
+
+		if( relit_surfaces_[i] )
+			relit_surface_count++;
+	}
+
+	level_geometry_changed_= true;
+	WriteLightmapsAtlas( false, primary_light );
+
+	std::cout << "Light cache \"" << file_name << "\" is used. Changed surfaces: " <<
+		changed_surface_count << " added, " << cached_surfaces.size() << " removed;" <<
+		" relit surfaces: " << relit_surface_count << std::endl;
+
+	if( !reuse_secondary_light )
+		return;
+
+	// Secondary light of sample is changed, if sample sees relit surface or place of changed surface.
+	// Points are placed a bit above surfaces, because surface plane is usually boundary of solid leaf.
+	std::vector<m_Vec3> changed_points;
+	for( const m_BBox3& box : changed_boxes )
+		changed_points.push_back( ( box.min + box.max ) * 0.5f );
+
+	for( const plb_Polygon& poly : level_data_.polygons )
+	{
+		const unsigned int surface_index= &poly - level_data_.polygons.data();
+		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 || !relit_surfaces_[ surface_index ] )
+			continue;
+
+		m_Vec3 normal( poly.normal );
+		normal.Normalize();
+
+		const float basis_scale= float(config_.secondary_lightmap_scaler);
+		for( unsigned int y= 0; y < poly.lightmap_data.size[1]; y+= config_.secondary_lightmap_scaler )
+		for( unsigned int x= 0; x < poly.lightmap_data.size[0]; x+= config_.secondary_lightmap_scaler )
+			changed_points.push_back(
+				m_Vec3( poly.lightmap_pos ) +
+				( float(x) + 0.5f * basis_scale ) * m_Vec3( poly.lightmap_basis[0] ) +
+				( float(y) + 0.5f * basis_scale ) * m_Vec3( poly.lightmap_basis[1] ) +
+				normal * g_visibility_sample_offset );
+	}
+
+	for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
+	{
+		const unsigned int surface_index= level_data_.polygons.size() + ( &curve - level_data_.curved_surfaces.data() );
+		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) != 0 || !relit_surfaces_[ surface_index ] )
+			continue;
+
+		for( unsigned int v= 0; v < curve.grid_size[0] * curve.grid_size[1]; v++ )
+			changed_points.emplace_back( level_data_.curved_surfaces_vertices[ curve.first_vertex_number + v ].pos );
+	}
+
+	for( const plb_PointLight& light : GetUnmatchedLights( level_data_.point_lights, cache.point_lights ) )
+		changed_points.emplace_back( light.pos );
+	for( const plb_ConeLight& light : GetUnmatchedLights( level_data_.cone_lights, cache.cone_lights ) )
+		changed_points.emplace_back( light.pos );
+
+	if( !GetClustersVisibleFromPoints( level_data_.visibility, changed_points, changed_clusters_mask_ ) )
+		return;
+
+	incremental_secondary_light_= true;
+	light_cache_.secondary_light= std::move(secondary_light);
+}
+
+bool plb_LightmapsBuilder::SecondaryLightCacheIsUsable( const plb_LightCache& cache ) const
+{
+	// Secondary light can be rebuilt partially only for plain sampling of one bounce,
+	// because in other modes light of samples depends on other samples.
+	return
+		cache.secondary_light_key == GetLightCacheSecondaryLightKey() &&
+		cache.secondary_light.size() == 4u * cache.secondary_atlas_size[0] * cache.secondary_atlas_size[1] * cache.atlas_size[2] &&
+		!cache.secondary_light.empty() &&
+		config_.secondary_light_bounces <= 1u &&
+		config_.secondary_light_adaptive_step <= 1u &&
+		config_.secondary_light_irradiance_cache_error <= 0.0f;
+}
+
+void plb_LightmapsBuilder::SaveLightCache()
+{
+	if( config_.light_cache_file.empty() )
+		return;
+
+	const plb_ProfilerScope profiler_scope( "Save light cache" );
+
+	light_cache_.geometry_key= GetLightCacheGeometryKey();
+	light_cache_.options_key= GetLightCacheOptionsKey();
+	light_cache_.secondary_light_key= GetLightCacheSecondaryLightKey();
+	for( unsigned int i= 0; i < 3; i++ )
+		light_cache_.atlas_size[i]= lightmap_atlas_texture_.size[i];
+	for( unsigned int i= 0; i < 2; i++ )
+		light_cache_.secondary_atlas_size[i]= lightmap_atlas_texture_.secondary_lightmap_size[i];
+
+	light_cache_.point_lights= level_data_.point_lights;
+	light_cache_.directional_lights= level_data_.directional_lights;
+	light_cache_.cone_lights= level_data_.cone_lights;
+	light_cache_.surface_sample_lights= bright_luminous_surfaces_lights_;
+	GetLightCacheSurfaces( light_cache_.surfaces );
+
+	// Primary light is read in MakePrimaryLight.
+	ReadLightmapsAtlas( true, light_cache_.secondary_light );
+
+	if( plbWriteLightCache( config_.light_cache_file.c_str(), light_cache_ ) )
+		std::cout << "Light cache saved to \"" << config_.light_cache_file << "\"" << std::endl;
+}
+
+bool plb_LightmapsBuilder::IsSurfaceRelit( const unsigned int surface_index ) const
+{
+	return relit_surfaces_.empty() || relit_surfaces_[ surface_index ];
+}
+
+bool plb_LightmapsBuilder::IsSecondaryLightSampleAffected( const m_Vec3& pos, const m_Vec3& normal, const bool model_sample ) const
+{
+	if( !incremental_secondary_light_ )
+		return true;
+
+	// Texels of models are placed into atlas in order of vertices, so, their cached light can not be copied into atlas of changed level.
+	if( model_sample && level_geometry_changed_ )
+		return true;
+
+	// Nothing is changed.
+	if( changed_clusters_mask_.empty() )
+		return false;
+
+	// Samples lie on surfaces, and surface plane is usually boundary of solid leaf.
+	const int cluster= plbGetPointCluster( level_data_.visibility, pos + normal * g_visibility_sample_offset );
+	if( cluster < 0 )
+		return true;
+
+	return ( changed_clusters_mask_[ cluster >> 3 ] & ( 1u << ( cluster & 7 ) ) ) != 0;
+}
+
+void plb_LightmapsBuilder::ReadLightmapsAtlas( const bool secondary, std::vector<float>& out_data )
+{
+	if( cpu_builder_ != nullptr )
+	{
+		out_data= secondary ? cpu_builder_->GetSecondaryAtlas().data : cpu_builder_->GetPrimaryAtlas().data;
+		return;
+	}
+
+	if( secondary )
+	{
+		ReadSecondaryLightBounce( 0u, out_data );
+		return;
+	}
+
+	out_data.resize( 4u * lightmap_atlas_texture_.size[0] * lightmap_atlas_texture_.size[1] * lightmap_atlas_texture_.size[2] );
+
+	glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+	glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
+	glGetTexImage( GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, GL_FLOAT, out_data.data() );
+}
+
+void plb_LightmapsBuilder::WriteLightmapsAtlas( const bool secondary, const std::vector<float>& data )
+{
+	if( cpu_builder_ != nullptr )
+	{
+		cpu_builder_->ForEachAtlasLayer(
+			secondary,
+			[&]( float* const layer_data, const unsigned int* const layer_size, const unsigned int layer )
+			{
+				const unsigned int layer_floats= 4u * layer_size[0] * layer_size[1];
+				std::memcpy( layer_data, data.data() + layer * layer_floats, layer_floats * sizeof(float) );
+			} );
+		return;
+	}
+
+	if( secondary )
+	{
+		WriteSecondaryLightBounce( 0u, data );
+		return;
+	}
+
+	glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
+	glTexSubImage3D(
+		GL_TEXTURE_2D_ARRAY, 0,
+		0, 0, 0,
+		lightmap_atlas_texture_.size[0],
+		lightmap_atlas_texture_.size[1],
+		lightmap_atlas_texture_.size[2],
+		GL_RGBA, GL_FLOAT, data.data() );
+	plbProfilerAddCounter( plb_ProfilerCounter::BytesUploaded, data.size() * sizeof(float) );
+}
+
+bool plb_LightmapsBuilder::SaveLightmaps( const char* const file_name )
+{
+	const plb_ProfilerScope profiler_scope( "Save lightmaps" );
+
+	plb_LightmapsAtlasView primary_atlas, secondary_atlas;
+	std::vector<float> primary_data, secondary_data;
+	GetLightmapsAtlases( primary_atlas, secondary_atlas, primary_data, secondary_data );
+
+	const bool ok=
+		plbWriteLightmapsFile(
+			file_name,
+			config_.lightmaps_file_encoding,
+			level_data_,
+			config_.secondary_lightmap_scaler,
+			primary_atlas,
+			secondary_atlas );
+
+	if( ok )
+		std::cout << "Lightmaps saved to \"" << file_name << "\"" << std::endl;
+
+	return ok;
+}
+
+bool plb_LightmapsBuilder::SaveBsp( const char* const in_file_name, const char* const out_file_name )
+{
+	const plb_ProfilerScope profiler_scope( "Save BSP" );
+
+	plb_LightmapsAtlasView primary_atlas, secondary_atlas;
+	std::vector<float> primary_data, secondary_data;
+	GetLightmapsAtlases( primary_atlas, secondary_atlas, primary_data, secondary_data );
+
+	return
+		::SaveBsp(
+			in_file_name, out_file_name,
+			config_,
+			level_data_,
+			primary_atlas, secondary_atlas );
+}
+
+void plb_LightmapsBuilder::GetLightmapsAtlases(
+	plb_LightmapsAtlasView& out_primary_atlas,
+	plb_LightmapsAtlasView& out_secondary_atlas,
+	std::vector<float>& primary_data,
+	std::vector<float>& secondary_data )
+{
+	for( unsigned int i= 0; i < 3; i++ )
+		out_primary_atlas.size[i]= lightmap_atlas_texture_.size[i];
+	out_secondary_atlas.size[0]= lightmap_atlas_texture_.secondary_lightmap_size[0];
+	out_secondary_atlas.size[1]= lightmap_atlas_texture_.secondary_lightmap_size[1];
+	out_secondary_atlas.size[2]= lightmap_atlas_texture_.size[2];
+
+	if( cpu_builder_ != nullptr )
+	{
+		out_primary_atlas.data= cpu_builder_->GetPrimaryAtlas().data.data();
+		out_secondary_atlas.data= cpu_builder_->GetSecondaryAtlas().data.data();
+	}
+	else
+	{
+		primary_data.resize( 4u * out_primary_atlas.size[0] * out_primary_atlas.size[1] * out_primary_atlas.size[2] );
+		secondary_data.resize( 4u * out_secondary_atlas.size[0] * out_secondary_atlas.size[1] * out_secondary_atlas.size[2] );
+
+		glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+
+		glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
+		glGetTexImage( GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, GL_FLOAT, primary_data.data() );
+
+		glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.secondary_tex_id[0] );
+		glGetTexImage( GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, GL_FLOAT, secondary_data.data() );
+
+		out_primary_atlas.data= primary_data.data();
+		out_secondary_atlas.data= secondary_data.data();
+	}
+}
+
+void plb_LightmapsBuilder::DrawPreview(
+	const m_Mat4& view_matrix, const m_Vec3& cam_pos,
+	const m_Vec3& cam_dir,
+	float brightness,
+	bool show_primary_lightmap, bool show_secondary_lightmap, bool show_textures,
+	bool draw_luminous_surfaces, bool draw_shadowless_surfaces, bool smooth_lightmaps )
+{
+	r_Framebuffer::BindScreenFramebuffer();
+
+	glClearColor ( 0.1f, 0.05f, 0.1f, 0.0f );
+	glClear ( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+
+	const auto bind_lightmaps=
+		[this]( const GLenum filtration )
+		{
+			glActiveTexture( GL_TEXTURE0 + 0 );
+			glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
+			glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filtration );
+			glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filtration );
 
 			glActiveTexture( GL_TEXTURE0 + 1 );
 			glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.secondary_tex_id[0] );
@@ -751,7 +2752,7 @@ void plb_LightmapsBuilder::DrawPreview(
 	bind_lightmaps( smooth_lightmaps ? GL_LINEAR : GL_NEAREST );
 
 	glActiveTexture( GL_TEXTURE0 + 2 );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, point_light_shadowmap_cubemap_.depth_tex_id );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARRAY, point_light_shadowmap_cubemap_.depth_tex_id );
 
 	glActiveTexture( GL_TEXTURE0 + 0 );
 
@@ -831,9 +2832,15 @@ void plb_LightmapsBuilder::DrawPreview(
 	lights_visualizer_->Draw( view_matrix, cam_pos );
 	// Debug secondary light pass
 	/*
-	SecondaryLightPass( cam_pos, cam_dir );
+	SecondaryLightSample sample;
+	sample.pos= cam_pos;
+	sample.normal= cam_dir;
+	sample.tex_coord= m_Vec3( 0.0f, 0.0f, 0.0f );
+	sample.block_size[0]= sample.block_size[1]= 1u;
+	SecondaryLightPass( &sample, 1, 0 );
 
-	secondary_light_pass_cubemap_.unwrap_framebuffer.GetTextures().front().Bind(0);
+	glActiveTexture( GL_TEXTURE0 );
+	glBindTexture( GL_TEXTURE_2D_ARRAY, secondary_light_pass_cubemap_.unwrap_tex_id );
 
 	texture_show_shader_.Bind();
 	texture_show_shader_.Uniform( "tex", int(0) );
@@ -843,109 +2850,149 @@ void plb_LightmapsBuilder::DrawPreview(
 
 void plb_LightmapsBuilder::LoadLightPassShaders()
 {
+	const plb_ProfilerScope profiler_scope( "Light pass shaders loading" );
+
 	const std::vector<std::string> alpha_test_defines{ "ALPHA_TEST" };
 
-	point_light_pass_shader_.ShaderSource(
-		rLoadShader( "point_light_pass_f.glsl", g_glsl_version),
+	secondary_light_pass_cubemap_.batch_size=
+		std::min(
+			std::max( config_.secondary_light_pass_batch_size, 1u ),
+			g_max_secondary_light_pass_batch_size );
+	const std::vector<std::string> batch_defines
+		{ "BATCH_SIZE " + std::to_string( secondary_light_pass_cubemap_.batch_size ) };
+
+	point_light_shadowmap_cubemap_.batch_size=
+		std::min(
+			std::max( config_.point_light_pass_batch_size, 1u ),
+			g_max_point_light_pass_batch_size );
+	const std::vector<std::string> point_light_batch_defines
+		{ "BATCH_SIZE " + std::to_string( point_light_shadowmap_cubemap_.batch_size ) };
+	std::vector<std::string> point_light_alpha_test_batch_defines= point_light_batch_defines;
+	point_light_alpha_test_batch_defines.push_back( "ALPHA_TEST" );
+
+	if( shared_resources_ != nullptr )
+	{
+		for( const std::shared_ptr<plb_LightPassShaders>& shaders : shared_resources_->light_pass_shaders )
+		{
+			if( shaders->point_light_pass_batch_size == point_light_shadowmap_cubemap_.batch_size &&
+				shaders->secondary_light_pass_batch_size == secondary_light_pass_cubemap_.batch_size &&
+				shaders->use_average_texture_color_for_luminous_surfaces == config_.use_average_texture_color_for_luminous_surfaces )
+			{
+				light_pass_shaders_= shaders;
+				return;
+			}
+		}
+	}
+
+	light_pass_shaders_= std::make_shared<plb_LightPassShaders>();
+	light_pass_shaders_->point_light_pass_batch_size= point_light_shadowmap_cubemap_.batch_size;
+	light_pass_shaders_->secondary_light_pass_batch_size= secondary_light_pass_cubemap_.batch_size;
+	light_pass_shaders_->use_average_texture_color_for_luminous_surfaces= config_.use_average_texture_color_for_luminous_surfaces;
+
+	if( shared_resources_ != nullptr )
+		shared_resources_->light_pass_shaders.push_back( light_pass_shaders_ );
+
+	light_pass_shaders_->point_light_pass_shader.ShaderSource(
+		rLoadShader( "point_light_pass_f.glsl", g_glsl_version, point_light_batch_defines ),
 		rLoadShader( "point_light_pass_v.glsl", g_glsl_version),
 		rLoadShader( "point_light_pass_g.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(point_light_pass_shader_);
-	point_light_pass_shader_.Create();
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->point_light_pass_shader);
+	light_pass_shaders_->point_light_pass_shader.Create();
 
 
-	surface_sample_light_pass_shader_.ShaderSource(
-		rLoadShader( "surface_sample_light_pass_f.glsl", g_glsl_version),
+	light_pass_shaders_->surface_sample_light_pass_shader.ShaderSource(
+		rLoadShader( "surface_sample_light_pass_f.glsl", g_glsl_version, point_light_batch_defines ),
 		rLoadShader( "point_light_pass_v.glsl", g_glsl_version),
 		rLoadShader( "point_light_pass_g.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(surface_sample_light_pass_shader_);
-	surface_sample_light_pass_shader_.Create();
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->surface_sample_light_pass_shader);
+	light_pass_shaders_->surface_sample_light_pass_shader.Create();
 
-	point_light_shadowmap_shader_.ShaderSource(
+	light_pass_shaders_->point_light_shadowmap_shader.ShaderSource(
 		rLoadShader( "point_light_shadowmap_f.glsl", g_glsl_version),
 		rLoadShader( "point_light_shadowmap_v.glsl", g_glsl_version),
-		rLoadShader( "point_light_shadowmap_g.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(point_light_shadowmap_shader_);
-	point_light_shadowmap_shader_.Create();
+		rLoadShader( "point_light_shadowmap_g.glsl", g_glsl_version, point_light_batch_defines ));
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->point_light_shadowmap_shader);
+	light_pass_shaders_->point_light_shadowmap_shader.Create();
 
-	point_light_shadowmap_alphatested_shader_.ShaderSource(
+	light_pass_shaders_->point_light_shadowmap_alphatested_shader.ShaderSource(
 		rLoadShader( "point_light_shadowmap_f.glsl", g_glsl_version, alpha_test_defines ),
 		rLoadShader( "point_light_shadowmap_v.glsl", g_glsl_version ),
-		rLoadShader( "point_light_shadowmap_g.glsl", g_glsl_version ));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(point_light_shadowmap_alphatested_shader_);
-	point_light_shadowmap_alphatested_shader_.Create();
+		rLoadShader( "point_light_shadowmap_g.glsl", g_glsl_version, point_light_alpha_test_batch_defines ));
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->point_light_shadowmap_alphatested_shader);
+	light_pass_shaders_->point_light_shadowmap_alphatested_shader.Create();
 
-	secondary_light_pass_shader_.ShaderSource(
+	light_pass_shaders_->secondary_light_pass_shader.ShaderSource(
 		rLoadShader( "secondary_light_pass_f.glsl", g_glsl_version),
 		rLoadShader( "secondary_light_pass_v.glsl", g_glsl_version),
-		rLoadShader( "secondary_light_pass_g.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(secondary_light_pass_shader_);
-	secondary_light_pass_shader_.Create();
+		rLoadShader( "secondary_light_pass_g.glsl", g_glsl_version, batch_defines ));
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->secondary_light_pass_shader);
+	light_pass_shaders_->secondary_light_pass_shader.Create();
 
 	{
 		std::vector<std::string> frag_defines;
 		if( config_.use_average_texture_color_for_luminous_surfaces )
 			frag_defines.emplace_back( "AVERAGE_LIGHT" );
 
-		secondary_light_pass_luminocity_shader_.ShaderSource(
+		light_pass_shaders_->secondary_light_pass_luminocity_shader.ShaderSource(
 			rLoadShader( "secondary_light_pass_luminosity_f.glsl", g_glsl_version, frag_defines ),
 			rLoadShader( "secondary_light_pass_v.glsl", g_glsl_version ),
-			rLoadShader( "secondary_light_pass_g.glsl", g_glsl_version ) );
-		plb_WorldVertexBuffer::SetupLevelVertexAttributes(secondary_light_pass_luminocity_shader_);
-		secondary_light_pass_luminocity_shader_.Create();
+			rLoadShader( "secondary_light_pass_g.glsl", g_glsl_version, batch_defines ) );
+		plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->secondary_light_pass_luminocity_shader);
+		light_pass_shaders_->secondary_light_pass_luminocity_shader.Create();
 	}
 
-	secondary_light_pass_alphatested_shader_.ShaderSource(
+	light_pass_shaders_->secondary_light_pass_alphatested_shader.ShaderSource(
 		rLoadShader( "secondary_light_pass_f.glsl", g_glsl_version, alpha_test_defines ),
 		rLoadShader( "secondary_light_pass_v.glsl", g_glsl_version ),
-		rLoadShader( "secondary_light_pass_g.glsl", g_glsl_version ));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(secondary_light_pass_alphatested_shader_);
-	secondary_light_pass_alphatested_shader_.Create();
+		rLoadShader( "secondary_light_pass_g.glsl", g_glsl_version, batch_defines ));
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->secondary_light_pass_alphatested_shader);
+	light_pass_shaders_->secondary_light_pass_alphatested_shader.Create();
 
-	secondary_light_pass_vertex_lighted_shader_.ShaderSource(
+	light_pass_shaders_->secondary_light_pass_vertex_lighted_shader.ShaderSource(
 		rLoadShader( "secondary_light_pass_vertex_lighted_f.glsl", g_glsl_version ),
 		rLoadShader( "secondary_light_pass_vertex_lighted_v.glsl", g_glsl_version ),
-		rLoadShader( "secondary_light_pass_vertex_lighted_g.glsl", g_glsl_version ));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(secondary_light_pass_vertex_lighted_shader_);
-	secondary_light_pass_vertex_lighted_shader_.Create();
+		rLoadShader( "secondary_light_pass_vertex_lighted_g.glsl", g_glsl_version, batch_defines ));
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->secondary_light_pass_vertex_lighted_shader);
+	light_pass_shaders_->secondary_light_pass_vertex_lighted_shader.Create();
 
-	secondary_light_pass_vertex_lighted_alphatested_shader_.ShaderSource(
+	light_pass_shaders_->secondary_light_pass_vertex_lighted_alphatested_shader.ShaderSource(
 		rLoadShader( "secondary_light_pass_vertex_lighted_f.glsl", g_glsl_version, alpha_test_defines ),
 		rLoadShader( "secondary_light_pass_vertex_lighted_v.glsl", g_glsl_version ),
-		rLoadShader( "secondary_light_pass_vertex_lighted_g.glsl", g_glsl_version ));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(secondary_light_pass_vertex_lighted_alphatested_shader_);
-	secondary_light_pass_vertex_lighted_alphatested_shader_.Create();
+		rLoadShader( "secondary_light_pass_vertex_lighted_g.glsl", g_glsl_version, batch_defines ));
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->secondary_light_pass_vertex_lighted_alphatested_shader);
+	light_pass_shaders_->secondary_light_pass_vertex_lighted_alphatested_shader.Create();
 
-	shadowmap_shader_.ShaderSource(
+	light_pass_shaders_->shadowmap_shader.ShaderSource(
 		"", // No fragment shader
 		rLoadShader( "shadowmap_v.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(shadowmap_shader_);
-	shadowmap_shader_.Create();
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->shadowmap_shader);
+	light_pass_shaders_->shadowmap_shader.Create();
 
-	shadowmap_alphatested_shader_.ShaderSource(
+	light_pass_shaders_->shadowmap_alphatested_shader.ShaderSource(
 		rLoadShader( "shadowmap_f.glsl", g_glsl_version, alpha_test_defines ),
 		rLoadShader( "shadowmap_v.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(shadowmap_alphatested_shader_);
-	shadowmap_alphatested_shader_.Create();
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->shadowmap_alphatested_shader);
+	light_pass_shaders_->shadowmap_alphatested_shader.Create();
 
-	directional_light_sky_mark_shader_.ShaderSource(
+	light_pass_shaders_->directional_light_sky_mark_shader.ShaderSource(
 		rLoadShader( "directional_light_sky_mark_f.glsl", g_glsl_version ),
 		rLoadShader( "shadowmap_v.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(directional_light_sky_mark_shader_);
-	directional_light_sky_mark_shader_.Create();
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->directional_light_sky_mark_shader);
+	light_pass_shaders_->directional_light_sky_mark_shader.Create();
 
-	directional_light_pass_shader_.ShaderSource(
+	light_pass_shaders_->directional_light_pass_shader.ShaderSource(
 		rLoadShader( "sun_light_pass_f.glsl", g_glsl_version),
 		rLoadShader( "point_light_pass_v.glsl", g_glsl_version),
 		rLoadShader( "point_light_pass_g.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(directional_light_pass_shader_);
-	directional_light_pass_shader_.Create();
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->directional_light_pass_shader);
+	light_pass_shaders_->directional_light_pass_shader.Create();
 
-	cone_light_pass_shader_.ShaderSource(
+	light_pass_shaders_->cone_light_pass_shader.ShaderSource(
 		rLoadShader( "cone_light_pass_f.glsl", g_glsl_version),
 		rLoadShader( "point_light_pass_v.glsl", g_glsl_version),
 		rLoadShader( "point_light_pass_g.glsl", g_glsl_version));
-	plb_WorldVertexBuffer::SetupLevelVertexAttributes(cone_light_pass_shader_);
-	cone_light_pass_shader_.Create();
+	plb_WorldVertexBuffer::SetupLevelVertexAttributes(light_pass_shaders_->cone_light_pass_shader);
+	light_pass_shaders_->cone_light_pass_shader.Create();
 }
 
 void plb_LightmapsBuilder::CreateShadowmapCubemap()
@@ -954,18 +3001,20 @@ void plb_LightmapsBuilder::CreateShadowmapCubemap()
 	point_light_shadowmap_cubemap_.max_light_distance= 128.0f;
 	const unsigned int texture_size= point_light_shadowmap_cubemap_.size;
 
+	// Cubemap for each light of batch.
 	glGenTextures( 1, &point_light_shadowmap_cubemap_.depth_tex_id );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, point_light_shadowmap_cubemap_.depth_tex_id );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL );
-	for( unsigned int i= 0; i< 6; i++ )
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT16,
-			texture_size, texture_size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARRAY, point_light_shadowmap_cubemap_.depth_tex_id );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL );
+	glTexImage3D(
+		GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_DEPTH_COMPONENT16,
+		texture_size, texture_size, 6 * point_light_shadowmap_cubemap_.batch_size,
+		0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL );
 
 	glGenFramebuffers( 1, &point_light_shadowmap_cubemap_.fbo_id );
 	glBindFramebuffer( GL_FRAMEBUFFER, point_light_shadowmap_cubemap_.fbo_id );
@@ -1010,48 +3059,60 @@ void plb_LightmapsBuilder::CreateShadowmapCubemap()
 	cubemap_show_buffer_.SetPrimitiveType(GL_TRIANGLES);
 }
 
-void plb_LightmapsBuilder::GenPointlightShadowmap( const m_Vec3& light_pos )
+void plb_LightmapsBuilder::GenPointlightShadowmaps( const m_Vec3* const lights_pos, const unsigned int light_count )
 {
 	glViewport( 0, 0, point_light_shadowmap_cubemap_.size, point_light_shadowmap_cubemap_.size );
 
 	glBindFramebuffer( GL_FRAMEBUFFER, point_light_shadowmap_cubemap_.fbo_id );
 	glClear( GL_DEPTH_BUFFER_BIT );
 
-	m_Mat4 final_matrices[6];
-	GenCubemapMatrices( light_pos, final_matrices );
+	m_Mat4 final_matrices[ 6 * g_max_point_light_pass_batch_size ];
+	for( unsigned int i= 0u; i < light_count; i++ )
+		GenCubemapMatrices( lights_pos[i], final_matrices + 6u * i );
 	const float inv_max_light_dst= 1.0f / point_light_shadowmap_cubemap_.max_light_distance;
+
+	// Only surfaces, potentially visible from lights, can cast shadows on lit texels.
+	const unsigned char* const visible_clusters_mask= GetVisibleClustersMask( lights_pos, light_count );
 	
 	// Regular geometry
-	point_light_shadowmap_shader_.Bind();
-	point_light_shadowmap_shader_.Uniform( "view_matrices", final_matrices, 6 );
-	point_light_shadowmap_shader_.Uniform( "inv_max_light_dst", inv_max_light_dst );
+	light_pass_shaders_->point_light_shadowmap_shader.Bind();
+	light_pass_shaders_->point_light_shadowmap_shader.Uniform( "view_matrices", final_matrices, 6 * light_count );
+	light_pass_shaders_->point_light_shadowmap_shader.Uniform( "light_count", int(light_count) );
+	light_pass_shaders_->point_light_shadowmap_shader.Uniform( "inv_max_light_dst", inv_max_light_dst );
 
-	world_vertex_buffer_->Draw( {
-		plb_WorldVertexBuffer::PolygonType::WorldCommon,
-		plb_WorldVertexBuffer::PolygonType::VertexLighted } );
+	world_vertex_buffer_->Draw(
+		{
+			plb_WorldVertexBuffer::PolygonType::WorldCommon,
+			plb_WorldVertexBuffer::PolygonType::VertexLighted
+		},
+		visible_clusters_mask );
 
 	// Alpha-tested geometry
 	glDisable( GL_CULL_FACE );
 
-	point_light_shadowmap_alphatested_shader_.Bind();
-	point_light_shadowmap_alphatested_shader_.Uniform( "view_matrices", final_matrices, 6 );
-	point_light_shadowmap_alphatested_shader_.Uniform( "inv_max_light_dst", inv_max_light_dst );
+	light_pass_shaders_->point_light_shadowmap_alphatested_shader.Bind();
+	light_pass_shaders_->point_light_shadowmap_alphatested_shader.Uniform( "view_matrices", final_matrices, 6 * light_count );
+	light_pass_shaders_->point_light_shadowmap_alphatested_shader.Uniform( "light_count", int(light_count) );
+	light_pass_shaders_->point_light_shadowmap_alphatested_shader.Uniform( "inv_max_light_dst", inv_max_light_dst );
 
 	int textures_uniform[32];
 	const unsigned int arrays_bindings_unit= 3;
 	textures_manager_->BindTextureArrays( arrays_bindings_unit );
 	for( unsigned int i= 0; i< textures_manager_->ArraysCount(); i++ )
 		textures_uniform[i]= arrays_bindings_unit + i;
-	point_light_shadowmap_alphatested_shader_.Uniform( "textures", textures_uniform, textures_manager_->ArraysCount() );
+	light_pass_shaders_->point_light_shadowmap_alphatested_shader.Uniform( "textures", textures_uniform, textures_manager_->ArraysCount() );
 
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::AlphaShadow );
+	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::AlphaShadow, visible_clusters_mask );
 
 	glEnable( GL_CULL_FACE );
 
 	r_Framebuffer::BindScreenFramebuffer();
 }
 
-void plb_LightmapsBuilder::PointLightPass(const m_Vec3& light_pos, const m_Vec3& light_color)
+void plb_LightmapsBuilder::PointLightsPass(
+	const m_Vec3* const lights_pos,
+	const m_Vec3* const lights_colors,
+	const unsigned int light_count )
 {
 	glDisable( GL_CULL_FACE );
 	glEnable( GL_BLEND );
@@ -1061,15 +3122,20 @@ void plb_LightmapsBuilder::PointLightPass(const m_Vec3& light_pos, const m_Vec3&
 	glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.fbo_id );
 
 	glActiveTexture( GL_TEXTURE0 + 0 );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, point_light_shadowmap_cubemap_.depth_tex_id );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARRAY, point_light_shadowmap_cubemap_.depth_tex_id );
 
-	point_light_pass_shader_.Bind();
-	point_light_pass_shader_.Uniform( "light_pos", light_pos );
-	point_light_pass_shader_.Uniform( "light_color", light_color );
-	point_light_pass_shader_.Uniform( "cubemap", int(0) );
-	point_light_pass_shader_.Uniform( "inv_max_light_dst", 1.0f / point_light_shadowmap_cubemap_.max_light_distance );
+	light_pass_shaders_->point_light_pass_shader.Bind();
+	for( unsigned int i= 0u; i < light_count; i++ )
+	{
+		const std::string index_str= "[" + std::to_string(i) + "]";
+		light_pass_shaders_->point_light_pass_shader.Uniform( ( "light_pos" + index_str ).c_str(), lights_pos[i] );
+		light_pass_shaders_->point_light_pass_shader.Uniform( ( "light_color" + index_str ).c_str(), lights_colors[i] );
+	}
+	light_pass_shaders_->point_light_pass_shader.Uniform( "light_count", int(light_count) );
+	light_pass_shaders_->point_light_pass_shader.Uniform( "cubemap", int(0) );
+	light_pass_shaders_->point_light_pass_shader.Uniform( "inv_max_light_dst", 1.0f / point_light_shadowmap_cubemap_.max_light_distance );
 
-	light_texels_points_.Draw();
+	DrawLightTexelsNearLights( lights_pos, lights_colors, light_count );
 
 	r_Framebuffer::BindScreenFramebuffer();
 
@@ -1077,10 +3143,11 @@ void plb_LightmapsBuilder::PointLightPass(const m_Vec3& light_pos, const m_Vec3&
 	glDisable( GL_BLEND );
 }
 
-void plb_LightmapsBuilder::SurfaceSampleLightPass(
-	const m_Vec3& light_pos,
-	const m_Vec3& light_normal,
-	const m_Vec3& light_color )
+void plb_LightmapsBuilder::SurfaceSampleLightsPass(
+	const m_Vec3* const lights_pos,
+	const m_Vec3* const lights_normals,
+	const m_Vec3* const lights_colors,
+	const unsigned int light_count )
 {
 	glDisable( GL_CULL_FACE );
 	glEnable( GL_BLEND );
@@ -1090,16 +3157,21 @@ void plb_LightmapsBuilder::SurfaceSampleLightPass(
 	glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.fbo_id );
 
 	glActiveTexture( GL_TEXTURE0 + 0 );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, point_light_shadowmap_cubemap_.depth_tex_id );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARRAY, point_light_shadowmap_cubemap_.depth_tex_id );
 
-	surface_sample_light_pass_shader_.Bind();
-	surface_sample_light_pass_shader_.Uniform( "light_pos", light_pos );
-	surface_sample_light_pass_shader_.Uniform( "light_normal", light_normal );
-	surface_sample_light_pass_shader_.Uniform( "light_color", light_color );
-	surface_sample_light_pass_shader_.Uniform( "cubemap", int(0) );
-	surface_sample_light_pass_shader_.Uniform( "inv_max_light_dst", 1.0f / point_light_shadowmap_cubemap_.max_light_distance );
+	light_pass_shaders_->surface_sample_light_pass_shader.Bind();
+	for( unsigned int i= 0u; i < light_count; i++ )
+	{
+		const std::string index_str= "[" + std::to_string(i) + "]";
+		light_pass_shaders_->surface_sample_light_pass_shader.Uniform( ( "light_pos" + index_str ).c_str(), lights_pos[i] );
+		light_pass_shaders_->surface_sample_light_pass_shader.Uniform( ( "light_normal" + index_str ).c_str(), lights_normals[i] );
+		light_pass_shaders_->surface_sample_light_pass_shader.Uniform( ( "light_color" + index_str ).c_str(), lights_colors[i] );
+	}
+	light_pass_shaders_->surface_sample_light_pass_shader.Uniform( "light_count", int(light_count) );
+	light_pass_shaders_->surface_sample_light_pass_shader.Uniform( "cubemap", int(0) );
+	light_pass_shaders_->surface_sample_light_pass_shader.Uniform( "inv_max_light_dst", 1.0f / point_light_shadowmap_cubemap_.max_light_distance );
 
-	light_texels_points_.Draw();
+	DrawLightTexelsNearLights( lights_pos, lights_colors, light_count );
 
 	r_Framebuffer::BindScreenFramebuffer();
 
@@ -1107,6 +3179,33 @@ void plb_LightmapsBuilder::SurfaceSampleLightPass(
 	glDisable( GL_BLEND );
 }
 
+void plb_LightmapsBuilder::DrawLightTexelsNearLights(
+	const m_Vec3* const lights_pos,
+	const m_Vec3* const lights_colors,
+	const unsigned int light_count )
+{
+	light_texels_ranges_.clear();
+	for( unsigned int i= 0u; i < light_count; i++ )
+	{
+		const size_t prev_ranges_count= light_texels_ranges_.size();
+		light_texels_grid_->GetTexelsInSphere(
+			lights_pos[i],
+			plb_LightTexelsGrid::GetLightCutoffRadius( lights_colors[i], config_.light_cutoff_threshold ),
+			light_texels_ranges_ );
+		if( light_texels_ranges_.size() == prev_ranges_count )
+			plbProfilerAddCounter( plb_ProfilerCounter::LightsCulled, 1u );
+	}
+
+	plb_LightTexelsGrid::MergeRanges( light_texels_ranges_ );
+
+	light_texels_points_.Bind();
+	for( const plb_LightTexelsGrid::TexelsRange& range : light_texels_ranges_ )
+	{
+		glDrawArrays( GL_POINTS, range.first, range.count );
+		plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, range.count );
+	}
+}
+
 void plb_LightmapsBuilder::GenSecondaryLightPassCubemap()
 {
 	secondary_light_pass_cubemap_.size= 1 << config_.secondary_light_pass_cubemap_size_log2;
@@ -1149,31 +3248,32 @@ void plb_LightmapsBuilder::GenSecondaryLightPassCubemap()
 			float(multiplier_sum);
 	}
 
+	// Cubemap arrays - one cubemap for each hemicube in batch.
+	const unsigned int cubemap_layers= 6u * secondary_light_pass_cubemap_.batch_size;
+
 	// depth texture
 	glGenTextures( 1, &secondary_light_pass_cubemap_.depth_tex_id );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, secondary_light_pass_cubemap_.depth_tex_id );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
-	for( unsigned int i= 0; i< 6; i++ )
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT24,
-			secondary_light_pass_cubemap_.size, secondary_light_pass_cubemap_.size,
-			0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARRAY, secondary_light_pass_cubemap_.depth_tex_id );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
+	glTexImage3D( GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_DEPTH_COMPONENT24,
+		secondary_light_pass_cubemap_.size, secondary_light_pass_cubemap_.size, cubemap_layers,
+		0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL );
 
 	// main texture
 	glGenTextures( 1, &secondary_light_pass_cubemap_.tex_id );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, secondary_light_pass_cubemap_.tex_id );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
-	for( unsigned int i= 0; i< 6; i++ )
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA32F,
-			secondary_light_pass_cubemap_.size, secondary_light_pass_cubemap_.size,
-			0, GL_RGBA, GL_FLOAT, NULL );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARRAY, secondary_light_pass_cubemap_.tex_id );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
+	glTexImage3D( GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_RGBA32F,
+		secondary_light_pass_cubemap_.size, secondary_light_pass_cubemap_.size, cubemap_layers,
+		0, GL_RGBA, GL_FLOAT, NULL );
 
 	glGenFramebuffers( 1, &secondary_light_pass_cubemap_.fbo_id );
 	glBindFramebuffer( GL_FRAMEBUFFER, secondary_light_pass_cubemap_.fbo_id );
@@ -1187,9 +3287,13 @@ void plb_LightmapsBuilder::GenSecondaryLightPassCubemap()
 
 void plb_LightmapsBuilder::GenSecondaryLightPassUnwrapBuffer()
 {
+	const std::vector<std::string> batch_defines
+		{ "BATCH_SIZE " + std::to_string( secondary_light_pass_cubemap_.batch_size ) };
+
 	secondary_light_pass_cubemap_.unwrap_shader.ShaderSource(
 		rLoadShader( "secondary_light_pass_cubemap_unwrap_f.glsl", g_glsl_version ),
-		rLoadShader( "secondary_light_pass_cubemap_unwrap_v.glsl", g_glsl_version ) );
+		rLoadShader( "secondary_light_pass_cubemap_unwrap_v.glsl", g_glsl_version ),
+		rLoadShader( "secondary_light_pass_cubemap_unwrap_g.glsl", g_glsl_version, batch_defines ) );
 	secondary_light_pass_cubemap_.unwrap_shader.SetAttribLocation( "coord", 0 );
 	secondary_light_pass_cubemap_.unwrap_shader.SetAttribLocation( "tex_coord", 1 );
 	secondary_light_pass_cubemap_.unwrap_shader.Create();
@@ -1265,22 +3369,37 @@ void plb_LightmapsBuilder::GenSecondaryLightPassUnwrapBuffer()
 	secondary_light_pass_cubemap_.unwrap_geometry.VertexAttribPointer( 1, 2, GL_FLOAT, false, sizeof(float) * 3 );
 	secondary_light_pass_cubemap_.unwrap_geometry.SetPrimitiveType( GL_TRIANGLES );
 
-	secondary_light_pass_cubemap_.unwrap_framebuffer=
-		r_Framebuffer(
-			{ r_Texture::PixelFormat::RGBA32F }, // one floating point texture
-			r_Texture::PixelFormat::Unknown, // no depth buffer,
-			secondary_light_pass_cubemap_.size * 3,
-			secondary_light_pass_cubemap_.size );
+	// Floating point texture array without depth buffer. Layer for each hemicube in batch.
+	glGenTextures( 1, &secondary_light_pass_cubemap_.unwrap_tex_id );
+	glBindTexture( GL_TEXTURE_2D_ARRAY, secondary_light_pass_cubemap_.unwrap_tex_id );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexImage3D( GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F,
+		secondary_light_pass_cubemap_.size * 3, secondary_light_pass_cubemap_.size,
+		secondary_light_pass_cubemap_.batch_size,
+		0, GL_RGBA, GL_FLOAT, NULL );
+	glGenerateMipmap( GL_TEXTURE_2D_ARRAY );
+
+	glGenFramebuffers( 1, &secondary_light_pass_cubemap_.unwrap_fbo_id );
+	glBindFramebuffer( GL_FRAMEBUFFER, secondary_light_pass_cubemap_.unwrap_fbo_id );
+	glFramebufferTexture( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, secondary_light_pass_cubemap_.unwrap_tex_id, 0 );
+	const GLuint color_attachment= GL_COLOR_ATTACHMENT0;
+	glDrawBuffers( 1, &color_attachment );
+
+	r_Framebuffer::BindScreenFramebuffer();
 
 	secondary_light_pass_cubemap_.write_shader.ShaderSource(
 		rLoadShader( "secondary_light_pass_write_f.glsl", g_glsl_version ),
-		rLoadShader( "secondary_light_pass_write_v.glsl", g_glsl_version ),
+		rLoadShader( "secondary_light_pass_write_v.glsl", g_glsl_version, batch_defines ),
 		rLoadShader( "secondary_light_pass_write_g.glsl", g_glsl_version ));
 	secondary_light_pass_cubemap_.write_shader.SetAttribLocation( "tex_coord", 0 );
 	secondary_light_pass_cubemap_.write_shader.Create();
 }
 
-void plb_LightmapsBuilder::SecondaryLightPass( const m_Vec3& pos, const m_Vec3& normal )
+void plb_LightmapsBuilder::SecondaryLightPass(
+	const SecondaryLightSample* const samples,
+	const unsigned int sample_count,
+	const unsigned int bounce )
 {
 	glViewport( 0, 0, secondary_light_pass_cubemap_.size, secondary_light_pass_cubemap_.size );
 	glBindFramebuffer( GL_FRAMEBUFFER, secondary_light_pass_cubemap_.fbo_id );
@@ -1290,12 +3409,34 @@ void plb_LightmapsBuilder::SecondaryLightPass( const m_Vec3& pos, const m_Vec3&
 	glEnable(GL_CLIP_DISTANCE0);
 
 	// matrices generation
-	m_Mat4 final_matrices[6];
-	GenCubemapMatrices( pos, normal, final_matrices );
-
-	// bind lightmap texture
+	m_Mat4 final_matrices[ 6 * g_max_secondary_light_pass_batch_size ];
+	for( unsigned int i= 0; i < sample_count; i++ )
+		GenCubemapMatrices( samples[i].pos, samples[i].normal, final_matrices + 6 * i );
+
+	// Opaque geometry is culled by visibility of samples.
+	// Luminous surfaces are drawn with additive blending and can not be culled.
+	m_Vec3 samples_visibility_pos[ g_max_secondary_light_pass_batch_size ];
+	for( unsigned int i= 0; i < sample_count; i++ )
+		samples_visibility_pos[i]= samples[i].pos + samples[i].normal * g_visibility_sample_offset;
+	const unsigned char* const visible_clusters_mask= GetVisibleClustersMask( samples_visibility_pos, sample_count );
+
+	// Bind lightmap texture. First bounce gathers primary light, next bounces - light of previous bounce.
+	// Lightmap coordinates of vertices are coordinates in primary lightmap,
+	// correct them for secondary lightmaps, because size % scaler != 0, sometimes.
+	m_Vec2 lightmap_coord_scale( 1.0f, 1.0f );
 	glActiveTexture( GL_TEXTURE0 + 0 );
-	glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
+	if( bounce == 0u )
+		glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
+	else
+	{
+		glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.secondary_tex_id[ bounce - 1u ] );
+		lightmap_coord_scale.x=
+			float(lightmap_atlas_texture_.size[0]) /
+			float( lightmap_atlas_texture_.secondary_lightmap_size[0] * config_.secondary_lightmap_scaler );
+		lightmap_coord_scale.y=
+			float(lightmap_atlas_texture_.size[1]) /
+			float( lightmap_atlas_texture_.secondary_lightmap_size[1] * config_.secondary_lightmap_scaler );
+	}
 
 	// bind cubemap texture
 	unsigned int arrays_bindings_unit= 3;
@@ -1310,86 +3451,124 @@ void plb_LightmapsBuilder::SecondaryLightPass( const m_Vec3& pos, const m_Vec3&
 		shader.Bind();
 		shader.Uniform( "textures", textures_uniform, textures_manager_->ArraysCount() );
 		shader.Uniform( "lightmap", int(0) );
-		shader.Uniform( "view_matrices", final_matrices, 6 );
-		shader.Uniform( "clip_plane", normal.x, normal.y, normal.z, -(normal * pos) );
+		shader.Uniform( "lightmap_coord_scale", lightmap_coord_scale );
+		shader.Uniform( "view_matrices", final_matrices, 6 * sample_count );
+		shader.Uniform( "cube_count", int(sample_count) );
+		for( unsigned int i= 0; i < sample_count; i++ )
+		{
+			const m_Vec3& normal= samples[i].normal;
+			shader.Uniform(
+				( "clip_planes[" + std::to_string(i) + "]" ).c_str(),
+				normal.x, normal.y, normal.z, -(normal * samples[i].pos) );
+		}
 	};
 
-	bind_and_set_uniforms( secondary_light_pass_shader_ );
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::WorldCommon );
+	bind_and_set_uniforms( light_pass_shaders_->secondary_light_pass_shader );
+	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::WorldCommon, visible_clusters_mask );
 
 	// Alpha-tested polygons (include alpha-tested luminocity polygons )
 	glDisable( GL_CULL_FACE );
-	bind_and_set_uniforms( secondary_light_pass_alphatested_shader_ );
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::AlphaShadow );
+	bind_and_set_uniforms( light_pass_shaders_->secondary_light_pass_alphatested_shader );
+	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::AlphaShadow, visible_clusters_mask );
 	glEnable( GL_CULL_FACE );
 
 	// Polygons with lights in vertices
-	bind_and_set_uniforms( secondary_light_pass_vertex_lighted_shader_ );
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::VertexLighted );
+	bind_and_set_uniforms( light_pass_shaders_->secondary_light_pass_vertex_lighted_shader );
+	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::VertexLighted, visible_clusters_mask );
 
 	// Alpha-tested polygons (include alpha-tested luminocity polygons ) with light in vertices
 	glDisable( GL_CULL_FACE );
-	bind_and_set_uniforms( secondary_light_pass_vertex_lighted_alphatested_shader_ );
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::VertexLightedAlphaShadow );
+	bind_and_set_uniforms( light_pass_shaders_->secondary_light_pass_vertex_lighted_alphatested_shader );
+	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::VertexLightedAlphaShadow, visible_clusters_mask );
 	glEnable( GL_CULL_FACE );
 
-	// Luminocity polygons.
-	// Luminocity polygons already drawn, draw it again, but with different texture and shader.
-	// Add luminocity light to diffuse surface light.
-	bind_and_set_uniforms( secondary_light_pass_luminocity_shader_ );
+	// Light of luminous surfaces and sky is already gathered in first bounce.
+	if( bounce == 0u )
+	{
+		// Luminocity polygons.
+		// Luminocity polygons already drawn, draw it again, but with different texture and shader.
+		// Add luminocity light to diffuse surface light.
+		bind_and_set_uniforms( light_pass_shaders_->secondary_light_pass_luminocity_shader );
 
-	// Draw sky polygons as normal polygons, but with luminocity sahader
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::Sky );
+		// Draw sky polygons as normal polygons, but with luminocity sahader
+		world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::Sky );
 
-	glEnable( GL_BLEND );
-	glBlendFunc( GL_ONE, GL_ONE );
-	glDepthFunc( GL_EQUAL );
+		glEnable( GL_BLEND );
+		glBlendFunc( GL_ONE, GL_ONE );
+		glDepthFunc( GL_EQUAL );
 
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::Luminous );
+		world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::Luminous );
 
-	glDepthFunc( GL_LESS );
+		glDepthFunc( GL_LESS );
 
-	// Draw luminous noshadow surfaces without depth-write and with additive blending.
-	glDepthMask( 0 );
+		// Draw luminous noshadow surfaces without depth-write and with additive blending.
+		glDepthMask( 0 );
 
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::NoShadowLuminous );
+		world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::NoShadowLuminous );
 
-	glDepthMask( 1 );
-	glDisable( GL_BLEND );
+		glDepthMask( 1 );
+		glDisable( GL_BLEND );
+	}
 
 	glDisable(GL_CLIP_DISTANCE0);
 
-	// Unwrap
+	// Unwrap all hemicubes of batch.
 	//
-	r_Framebuffer::BindScreenFramebuffer();
-
 	glDisable( GL_CULL_FACE );
 
-	secondary_light_pass_cubemap_.unwrap_framebuffer.Bind();
+	glBindFramebuffer( GL_FRAMEBUFFER, secondary_light_pass_cubemap_.unwrap_fbo_id );
+	glViewport( 0, 0, secondary_light_pass_cubemap_.size * 3, secondary_light_pass_cubemap_.size );
 	glClearColor( 1, 0, 1, 0 );
 	glClear( GL_COLOR_BUFFER_BIT );
 
 	glActiveTexture( GL_TEXTURE0 + 0 );
-	glBindTexture( GL_TEXTURE_CUBE_MAP, secondary_light_pass_cubemap_.tex_id );
+	glBindTexture( GL_TEXTURE_CUBE_MAP_ARRAY, secondary_light_pass_cubemap_.tex_id );
 	glActiveTexture( GL_TEXTURE0 + 1 );
 	glBindTexture( GL_TEXTURE_CUBE_MAP, secondary_light_pass_cubemap_.direction_multipler_tex_id );
 
 	secondary_light_pass_cubemap_.unwrap_shader.Bind();
 	secondary_light_pass_cubemap_.unwrap_shader.Uniform( "cubemap", int(0) );
 	secondary_light_pass_cubemap_.unwrap_shader.Uniform( "cubemap_multiplier", int(1) );
+	secondary_light_pass_cubemap_.unwrap_shader.Uniform( "cube_count", int(sample_count) );
 
 	secondary_light_pass_cubemap_.unwrap_geometry.Draw();
 
 	glEnable( GL_CULL_FACE );
 
-	r_Framebuffer::BindScreenFramebuffer();
+	// Build Mips. Light of each hemicube is summed in its own layer, all layers at once.
+	glActiveTexture( GL_TEXTURE0 + 0 );
+	glBindTexture( GL_TEXTURE_2D_ARRAY, secondary_light_pass_cubemap_.unwrap_tex_id );
+	glGenerateMipmap( GL_TEXTURE_2D_ARRAY );
+
+	// Write result light of all hemicubes into secondary lightmap atlas with one draw call.
+	glBindFramebuffer( GL_FRAMEBUFFER, lightmap_atlas_texture_.secondary_tex_fbo );
+	glViewport(
+		0, 0,
+		lightmap_atlas_texture_.secondary_lightmap_size[0],
+		lightmap_atlas_texture_.secondary_lightmap_size[1] );
+
+	r_GLSLProgram& write_shader= secondary_light_pass_cubemap_.write_shader;
+	write_shader.Bind();
+	write_shader.Uniform( "tex", int(0) );
+	write_shader.Uniform( "mip", int(config_.secondary_light_pass_cubemap_size_log2) );
+	write_shader.Uniform( "normalizer", secondary_light_pass_cubemap_.direction_multiplier_normalizer );
+	write_shader.Uniform(
+		"inv_tex_size",
+		m_Vec2(
+			1.0f / float(lightmap_atlas_texture_.secondary_lightmap_size[0]),
+			1.0f / float(lightmap_atlas_texture_.secondary_lightmap_size[1]) ) );
+	for( unsigned int i= 0; i < sample_count; i++ )
+	{
+		const std::string index_str= "[" + std::to_string(i) + "]";
+		write_shader.Uniform( ( "tex_coords" + index_str ).c_str(), samples[i].tex_coord );
+		write_shader.Uniform(
+			( "blocks_sizes" + index_str ).c_str(),
+			m_Vec2( float(samples[i].block_size[0]), float(samples[i].block_size[1]) ) );
+	}
+
+	glDrawArrays( GL_POINTS, 0, sample_count );
 
-	// Build Mips.
-	// TODO - maybe, manually downsample?
-	r_Texture& tex= secondary_light_pass_cubemap_.unwrap_framebuffer.GetTextures().front();
-	tex.Bind(0);
-	tex.SetFiltration( r_Texture::Filtration::NearestMipmapNearest, r_Texture::Filtration::Nearest );
-	tex.BuildMips();
+	r_Framebuffer::BindScreenFramebuffer();
 }
 
 void plb_LightmapsBuilder::GenDirectionalLightShadowmap( const m_Mat4& shadow_mat )
@@ -1406,8 +3585,8 @@ void plb_LightmapsBuilder::GenDirectionalLightShadowmap( const m_Mat4& shadow_ma
 	//glDisable( GL_CULL_FACE );
 	glDepthFunc( GL_ALWAYS );
 
-	directional_light_sky_mark_shader_.Bind();
-	directional_light_sky_mark_shader_.Uniform( "view_matrix", shadow_mat );
+	light_pass_shaders_->directional_light_sky_mark_shader.Bind();
+	light_pass_shaders_->directional_light_sky_mark_shader.Uniform( "view_matrix", shadow_mat );
 
 	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::Sky );
 
@@ -1419,23 +3598,23 @@ void plb_LightmapsBuilder::GenDirectionalLightShadowmap( const m_Mat4& shadow_ma
 	glDisable( GL_CULL_FACE );
 
 	// Regular geometry
-	shadowmap_shader_.Bind();
-	shadowmap_shader_.Uniform( "view_matrix", shadow_mat );
+	light_pass_shaders_->shadowmap_shader.Bind();
+	light_pass_shaders_->shadowmap_shader.Uniform( "view_matrix", shadow_mat );
 
 	world_vertex_buffer_->Draw( {
 		plb_WorldVertexBuffer::PolygonType::WorldCommon,
 		plb_WorldVertexBuffer::PolygonType::VertexLighted } );
 
 	// Alpha-tested geometry
-	shadowmap_alphatested_shader_.Bind();
-	shadowmap_alphatested_shader_.Uniform( "view_matrix", shadow_mat );
+	light_pass_shaders_->shadowmap_alphatested_shader.Bind();
+	light_pass_shaders_->shadowmap_alphatested_shader.Uniform( "view_matrix", shadow_mat );
 
 	int textures_uniform[32];
 	const unsigned int arrays_bindings_unit= 3;
 	textures_manager_->BindTextureArrays( arrays_bindings_unit );
 	for( unsigned int i= 0; i< textures_manager_->ArraysCount(); i++ )
 		textures_uniform[i]= arrays_bindings_unit + i;
-	shadowmap_alphatested_shader_.Uniform( "textures", textures_uniform, textures_manager_->ArraysCount() );
+	light_pass_shaders_->shadowmap_alphatested_shader.Uniform( "textures", textures_uniform, textures_manager_->ArraysCount() );
 
 	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::AlphaShadow );
 
@@ -1460,13 +3639,14 @@ void plb_LightmapsBuilder::DirectionalLightPass(
 	m_Vec3 light_color( float(light.color[0]), float(light.color[1]), float(light.color[2]) );
 	light_color*= light.intensity / 255.0f;
 
-	directional_light_pass_shader_.Bind();
-	directional_light_pass_shader_.Uniform( "light_dir", m_Vec3(light.direction) );
-	directional_light_pass_shader_.Uniform( "light_color", light_color );
-	directional_light_pass_shader_.Uniform( "shadowmap", int(0) );
-	directional_light_pass_shader_.Uniform( "view_matrix", shadow_mat );
+	light_pass_shaders_->directional_light_pass_shader.Bind();
+	light_pass_shaders_->directional_light_pass_shader.Uniform( "light_dir", m_Vec3(light.direction) );
+	light_pass_shaders_->directional_light_pass_shader.Uniform( "light_color", light_color );
+	light_pass_shaders_->directional_light_pass_shader.Uniform( "shadowmap", int(0) );
+	light_pass_shaders_->directional_light_pass_shader.Uniform( "view_matrix", shadow_mat );
 
 	light_texels_points_.Draw();
+	plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, light_texels_count_ );
 
 	r_Framebuffer::BindScreenFramebuffer();
 
@@ -1474,33 +3654,38 @@ void plb_LightmapsBuilder::DirectionalLightPass(
 	glDisable( GL_BLEND );
 }
 
-void plb_LightmapsBuilder::GenConeLightShadowmap( const m_Mat4& shadow_mat )
+void plb_LightmapsBuilder::GenConeLightShadowmap( const m_Mat4& shadow_mat, const m_Vec3& light_pos )
 {
 	glDisable( GL_CULL_FACE );
 
 	cone_light_shadowmap_.Bind();
 	glClear( GL_DEPTH_BUFFER_BIT );
 
+	const unsigned char* const visible_clusters_mask= GetVisibleClustersMask( &light_pos, 1u );
+
 	// Regular geometry
-	shadowmap_shader_.Bind();
-	shadowmap_shader_.Uniform( "view_matrix", shadow_mat );
+	light_pass_shaders_->shadowmap_shader.Bind();
+	light_pass_shaders_->shadowmap_shader.Uniform( "view_matrix", shadow_mat );
 
-	world_vertex_buffer_->Draw( {
-		plb_WorldVertexBuffer::PolygonType::WorldCommon,
-		plb_WorldVertexBuffer::PolygonType::VertexLighted } );
+	world_vertex_buffer_->Draw(
+		{
+			plb_WorldVertexBuffer::PolygonType::WorldCommon,
+			plb_WorldVertexBuffer::PolygonType::VertexLighted
+		},
+		visible_clusters_mask );
 
 	// Alpha-tested geometry
-	shadowmap_alphatested_shader_.Bind();
-	shadowmap_alphatested_shader_.Uniform( "view_matrix", shadow_mat );
+	light_pass_shaders_->shadowmap_alphatested_shader.Bind();
+	light_pass_shaders_->shadowmap_alphatested_shader.Uniform( "view_matrix", shadow_mat );
 
 	int textures_uniform[32];
 	const unsigned int arrays_bindings_unit= 3;
 	textures_manager_->BindTextureArrays( arrays_bindings_unit );
 	for( unsigned int i= 0; i< textures_manager_->ArraysCount(); i++ )
 		textures_uniform[i]= arrays_bindings_unit + i;
-	shadowmap_alphatested_shader_.Uniform( "textures", textures_uniform, textures_manager_->ArraysCount() );
+	light_pass_shaders_->shadowmap_alphatested_shader.Uniform( "textures", textures_uniform, textures_manager_->ArraysCount() );
 
-	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::AlphaShadow );
+	world_vertex_buffer_->Draw( plb_WorldVertexBuffer::PolygonType::AlphaShadow, visible_clusters_mask );
 
 	r_Framebuffer::BindScreenFramebuffer();
 	glEnable( GL_CULL_FACE );
@@ -1520,13 +3705,14 @@ void plb_LightmapsBuilder::ConeLightPass( const plb_ConeLight& light, const m_Ma
 	m_Vec3 light_color( float(light.color[0]), float(light.color[1]), float(light.color[2]) );
 	light_color*= light.intensity / 255.0f;
 
-	cone_light_pass_shader_.Bind();
-	cone_light_pass_shader_.Uniform( "light_pos", m_Vec3(light.pos) );
-	cone_light_pass_shader_.Uniform( "light_color", light_color );
-	cone_light_pass_shader_.Uniform( "shadowmap", int(0) );
-	cone_light_pass_shader_.Uniform( "view_matrix", shadow_mat );
+	light_pass_shaders_->cone_light_pass_shader.Bind();
+	light_pass_shaders_->cone_light_pass_shader.Uniform( "light_pos", m_Vec3(light.pos) );
+	light_pass_shaders_->cone_light_pass_shader.Uniform( "light_color", light_color );
+	light_pass_shaders_->cone_light_pass_shader.Uniform( "shadowmap", int(0) );
+	light_pass_shaders_->cone_light_pass_shader.Uniform( "view_matrix", shadow_mat );
 
 	light_texels_points_.Draw();
+	plbProfilerAddCounter( plb_ProfilerCounter::TexelsProcessed, light_texels_count_ );
 
 	r_Framebuffer::BindScreenFramebuffer();
 
@@ -1545,6 +3731,8 @@ void plb_LightmapsBuilder::MarkLuminousMaterials()
 
 void plb_LightmapsBuilder::BuildLuminousSurfacesLights()
 {
+	const plb_ProfilerScope profiler_scope( "Luminous surfaces lights" );
+
 	typedef plb_Rasterizer<float> Rasterizer;
 
 	const unsigned int c_scale_in_rasterizer= 4;
@@ -1749,281 +3937,83 @@ void plb_LightmapsBuilder::TransformTexturesCoordinates()
 	{
 		const plb_ImageInfo& img=
 			level_data_.textures[ level_data_.materials[ polygon.material_id ].albedo_texture_number ];
-		for( unsigned int v= polygon.first_vertex_number; v< polygon.first_vertex_number + polygon.vertex_count; v++ )
-		{
-			v_p[v].tex_maps[0]= img.texture_array_id;
-			v_p[v].tex_maps[1]= img.texture_layer_id;
-		}
-	}
-
-	if( level_data_.curved_surfaces.size() > 0 )
-	{
-		v_p= level_data_.curved_surfaces_vertices.data();
-		for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
-		{
-			const plb_ImageInfo& img=
-				level_data_.textures[ level_data_.materials[ curve.material_id ].albedo_texture_number ];
-			for( unsigned int v= curve.first_vertex_number; v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
-			{
-				v_p[v].tex_maps[0]= img.texture_array_id;
-				v_p[v].tex_maps[1]= img.texture_layer_id;
-			}
-		}
-	}
-
-	// Quake1BSP and Quake2BSP stroes unnormalized textures coordinates. Normalize it.
-	if(
-		config_.source_data_type == plb_Config::SourceDataType::Quake1BSP ||
-		config_.source_data_type == plb_Config::SourceDataType::Quake2BSP ||
-		config_.source_data_type == plb_Config::SourceDataType::HalfLifeBSP)
-	{
-		for( const plb_Polygon& polygon : level_data_.polygons )
-		{
-			const plb_ImageInfo& img=
-				level_data_.textures[ level_data_.materials[ polygon.material_id ].albedo_texture_number ];
-
-			const float scale_x= 1.0f / float( img.original_size[0] );
-			const float scale_y= 1.0f / float( img.original_size[1] );
-
-			for( unsigned int v= polygon.first_vertex_number; v< polygon.first_vertex_number + polygon.vertex_count; v++ )
-			{
-				v_p[v].tex_coord[0]*= scale_x;
-				v_p[v].tex_coord[1]*= scale_y;
-			}
-		}
-	}
-}
-
-void plb_LightmapsBuilder::ClalulateLightmapAtlasCoordinates()
-{
-	if( config_.lightmap_scale_to_original != 1 )
-	{
-		const float inv_scale= 1.0f / float(config_.lightmap_scale_to_original);
-		for( plb_Polygon& polygon : level_data_.polygons )
-		{
-			polygon.lightmap_basis[0][0]*= inv_scale;
-			polygon.lightmap_basis[0][1]*= inv_scale;
-			polygon.lightmap_basis[0][2]*= inv_scale;
-			polygon.lightmap_basis[1][0]*= inv_scale;
-			polygon.lightmap_basis[1][1]*= inv_scale;
-			polygon.lightmap_basis[1][2]*= inv_scale;
-		}
-
-		for( plb_CurvedSurface & curve : level_data_.curved_surfaces )
-		{
-			curve.lightmap_data.size[0]*= config_.lightmap_scale_to_original;
-			curve.lightmap_data.size[1]*= config_.lightmap_scale_to_original;
-		}
-	}
-
-	const float secondary_lightmap_scaler( config_.secondary_lightmap_scaler );
-	const float inv_secondary_lightmap_scaler= 1.0f / secondary_lightmap_scaler;
-	const float half_secondary_lightmap_scaler= 0.5f * secondary_lightmap_scaler;
-
-	plb_Vertex* v_p= level_data_.vertices.data();
-	for( plb_Polygon& polygon : level_data_.polygons )
-	{
-		float max_uv[2]= { 1.0f, 1.0f };
-
-		m_Mat3 inverse_lightmap_basis;
-		plbGetInvLightmapBasisMatrix(
-			m_Vec3( polygon.lightmap_basis[0] ),
-			m_Vec3( polygon.lightmap_basis[1] ),
-			inverse_lightmap_basis );
-
-		for( unsigned int v= polygon.first_vertex_number; v< polygon.first_vertex_number + polygon.vertex_count; v++ )
-		{
-			const m_Vec3 rel_pos= m_Vec3( v_p[v].pos ) - m_Vec3( polygon.lightmap_pos );
-			const m_Vec2 uv= ( rel_pos * inverse_lightmap_basis ).xy();
-			if( uv.x > max_uv[0] ) max_uv[0]= uv.x;
-			if( uv.y > max_uv[1] ) max_uv[1]= uv.y;
-		}
-
-		for( unsigned int j= 0; j < 2; j++ )
-		{
-			unsigned int size= ( (unsigned int) std::ceil( max_uv[j] * inv_secondary_lightmap_scaler + 0.5f ) ) + 1u;
-			size= std::max( size, 2u );
-			polygon.lightmap_data.size[j]=
-				size * config_.secondary_lightmap_scaler;
-		}
-
-		const m_Vec3 basis_vec_u( polygon.lightmap_basis[0] );
-		const m_Vec3 basis_vec_v( polygon.lightmap_basis[1] );
-		const m_Vec3 moved_basis=
-			m_Vec3( polygon.lightmap_pos ) -
-			( basis_vec_u + basis_vec_v ) * half_secondary_lightmap_scaler;
-
-		VEC3_CPY( polygon.lightmap_pos, moved_basis.ToArr() );
-
-		// pereveracivajem bazis karty osvescenija, tak nado
-		if( polygon.lightmap_data.size[0] < polygon.lightmap_data.size[1] )
+		for( unsigned int v= polygon.first_vertex_number; v< polygon.first_vertex_number + polygon.vertex_count; v++ )
 		{
-			float tmp[3];
-			std::memcpy( tmp, polygon.lightmap_basis[0], sizeof(float) * 3 );
-			std::memcpy( polygon.lightmap_basis[0], polygon.lightmap_basis[1], sizeof(float) * 3 );
-			std::memcpy( polygon.lightmap_basis[1], tmp, sizeof(float) * 3 );
-
-			std::swap( polygon.lightmap_data.size[0], polygon.lightmap_data.size[1] );
+			v_p[v].tex_maps[0]= img.texture_array_id;
+			v_p[v].tex_maps[1]= img.texture_layer_id;
 		}
 	}
 
-	if( level_data_.curved_surfaces_vertices.size() > 0 )
+	if( level_data_.curved_surfaces.size() > 0 )
 	{
 		v_p= level_data_.curved_surfaces_vertices.data();
-		for( plb_CurvedSurface& curve : level_data_.curved_surfaces )
+		for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
 		{
-			for( unsigned int j= 0; j < 2; j++ )
-			{
-				curve.lightmap_data.size[j]=
-					( curve.lightmap_data.size[j] + config_.secondary_lightmap_scaler - 1 ) /
-					config_.secondary_lightmap_scaler * config_.secondary_lightmap_scaler;
-				if( curve.lightmap_data.size[j] < 2u * config_.secondary_lightmap_scaler )
-					curve.lightmap_data.size[j]= 2u * config_.secondary_lightmap_scaler;
-			}
-
-			// Denormalize and shift.
-			const float smooth_shift= 0.5f * float( config_.secondary_lightmap_scaler );
-			const float denorm_scale[2]=
-			{
-				float( curve.lightmap_data.size[0] - config_.secondary_lightmap_scaler ),
-				float( curve.lightmap_data.size[1] - config_.secondary_lightmap_scaler ),
-			};
-			for( unsigned int v= curve.first_vertex_number;
-				v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
-			{
-				for( unsigned int j= 0; j < 2; j++ )
-					v_p[v].lightmap_coord[j]= v_p[v].lightmap_coord[j] * denorm_scale[j] + smooth_shift;
-			}
-
-			// Swap lightmap sides, if needed.
-			if( curve.lightmap_data.size[0] < curve.lightmap_data.size[1] )
+			const plb_ImageInfo& img=
+				level_data_.textures[ level_data_.materials[ curve.material_id ].albedo_texture_number ];
+			for( unsigned int v= curve.first_vertex_number; v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
 			{
-				std::swap( curve.lightmap_data.size[0], curve.lightmap_data.size[1] );
-
-				for( unsigned int v= curve.first_vertex_number;
-					v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
-				{
-					std::swap( v_p[v].lightmap_coord[0], v_p[v].lightmap_coord[1] );
-				}
+				v_p[v].tex_maps[0]= img.texture_array_id;
+				v_p[v].tex_maps[1]= img.texture_layer_id;
 			}
 		}
 	}
 
-	stub_lightmap_.size[0]= stub_lightmap_.size[1]= config_.secondary_lightmap_scaler * 2u;
-
-	std::vector<plb_SurfaceLightmapData*> sorted_lightmaps;
-	sorted_lightmaps.reserve( 1u + level_data_.polygons.size() + level_data_.curved_surfaces.size() );
-
-	sorted_lightmaps.push_back( &stub_lightmap_ );
-
-	for( plb_Polygon& poly : level_data_.polygons )
-		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
-			sorted_lightmaps.push_back( &poly.lightmap_data );
-
-	for( plb_CurvedSurface& curve : level_data_.curved_surfaces )
-		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
-			sorted_lightmaps.push_back( &curve.lightmap_data );
-
-	std::sort(
-		sorted_lightmaps.begin(),
-		sorted_lightmaps.end(),
-		[]( const plb_SurfaceLightmapData* l0, const plb_SurfaceLightmapData* l1 )
-		{
-			return l0->size[1] > l1->size[1];
-		} );
-
-	/*
-	place lightmaps into atlases
-	*/
-	const unsigned int lightmaps_offset= config_.secondary_lightmap_scaler;
-	const unsigned int lightmap_size[2]=
-	{ // Cut pixels, which not exist in secondary lightmap
-		config_.lightmaps_atlas_size[0] / config_.secondary_lightmap_scaler * config_.secondary_lightmap_scaler,
-		config_.lightmaps_atlas_size[1] / config_.secondary_lightmap_scaler * config_.secondary_lightmap_scaler,
-	};
-	unsigned int current_lightmap_atlas_id= 0;
-	unsigned int current_column_x= lightmaps_offset;
-	unsigned int current_column_y= lightmaps_offset;
-	unsigned int current_column_height= sorted_lightmaps.front()->size[1];
-
-	for( plb_SurfaceLightmapData* const lightmap : sorted_lightmaps )
+	// Quake1BSP and Quake2BSP stroes unnormalized textures coordinates. Normalize it.
+	if(
+		config_.source_data_type == plb_Config::SourceDataType::Quake1BSP ||
+		config_.source_data_type == plb_Config::SourceDataType::Quake2BSP ||
+		config_.source_data_type == plb_Config::SourceDataType::HalfLifeBSP)
 	{
-		const unsigned int width_in_atlas=
-			( lightmap->size[0] + config_.secondary_lightmap_scaler - 1 ) /
-			config_.secondary_lightmap_scaler * config_.secondary_lightmap_scaler;
-
-		if( current_column_x + width_in_atlas + lightmaps_offset >= lightmap_size[0] )
+		for( const plb_Polygon& polygon : level_data_.polygons )
 		{
-			const unsigned int height_in_atlas=
-				( lightmap->size[1] + config_.secondary_lightmap_scaler - 1 ) /
-				config_.secondary_lightmap_scaler * config_.secondary_lightmap_scaler;
+			const plb_ImageInfo& img=
+				level_data_.textures[ level_data_.materials[ polygon.material_id ].albedo_texture_number ];
 
-			current_column_x= lightmaps_offset;
-			current_column_y+= current_column_height + lightmaps_offset;
-			current_column_height= height_in_atlas;
+			const float scale_x= 1.0f / float( img.original_size[0] );
+			const float scale_y= 1.0f / float( img.original_size[1] );
 
-			if( current_column_height + current_column_y + lightmaps_offset >= lightmap_size[1] )
+			for( unsigned int v= polygon.first_vertex_number; v< polygon.first_vertex_number + polygon.vertex_count; v++ )
 			{
-				current_lightmap_atlas_id++;
-				current_column_y= lightmaps_offset;
+				v_p[v].tex_coord[0]*= scale_x;
+				v_p[v].tex_coord[1]*= scale_y;
 			}
 		}
-		
-		lightmap->coord[0]= current_column_x;
-		lightmap->coord[1]= current_column_y;
-		lightmap->atlas_id= current_lightmap_atlas_id;
-
-		current_column_x+= width_in_atlas + lightmaps_offset;
-	}// for polygons
-
-	// Place models vertices
-
-	// start models with new row
-	current_column_y+= current_column_height;
-	current_column_x+= lightmap_size[0];
-
-	for( const plb_LevelModel& model : level_data_.models )
-	{
-		if( ( model.flags & plb_SurfaceFlags::NoShadow ) != 0 )
-			continue;
+	}
+}
 
-		for( unsigned int v= 0; v < model.vertex_count; v++ )
-		{
-			if( current_column_x + lightmaps_offset * 2u >= lightmap_size[0] )
-			{
-				current_column_x= lightmaps_offset;
-				current_column_y+= lightmaps_offset;
+void plb_LightmapsBuilder::ClalulateLightmapAtlasCoordinates()
+{
+	const plb_ProfilerScope profiler_scope( "Atlas packing" );
 
-				if( lightmaps_offset * 3u >= lightmap_size[1] )
-				{
-					current_lightmap_atlas_id++;
-					current_column_y= lightmaps_offset;
-				}
-			}
+	plbCalculateLightmapsSizes( level_data_, config_ );
 
-			plb_Vertex& vertex= level_data_.models_vertices[ model.first_vertex_number + v ];
-			vertex.lightmap_coord[0]= ( float( current_column_x ) + 0.5f ) / float( config_.lightmaps_atlas_size[0] );
-			vertex.lightmap_coord[1]= ( float( current_column_y ) + 0.5f ) / float( config_.lightmaps_atlas_size[1] );
-			vertex.tex_maps[2]= current_lightmap_atlas_id;
+	plb_AtlasRects atlas_rects;
+	plbGetLightmapsAtlasRects( level_data_, config_, atlas_rects );
 
-			current_column_x+= lightmaps_offset;
-		}
-	} // for models
+	const unsigned int layer_count= plbPlaceLightmaps( level_data_, config_, atlas_rects, stub_lightmap_ );
 
 	lightmap_atlas_texture_.size[0]= config_.lightmaps_atlas_size[0];
 	lightmap_atlas_texture_.size[1]= config_.lightmaps_atlas_size[1];
-	lightmap_atlas_texture_.size[2]= current_lightmap_atlas_id+1;
+	lightmap_atlas_texture_.size[2]= layer_count;
 }
 
 
 void plb_LightmapsBuilder::CreateLightmapBuffers()
 {
-	unsigned int lightmap_size[2]= { config_.lightmaps_atlas_size[0], config_.lightmaps_atlas_size[1] };
-
 	lightmap_atlas_texture_.secondary_lightmap_size[0]=
-		lightmap_size[0] / config_.secondary_lightmap_scaler;
+		config_.lightmaps_atlas_size[0] / config_.secondary_lightmap_scaler;
 	lightmap_atlas_texture_.secondary_lightmap_size[1]=
-		lightmap_size[1] / config_.secondary_lightmap_scaler;
+		config_.lightmaps_atlas_size[1] / config_.secondary_lightmap_scaler;
+
+	// CPU backend stores lightmaps in own memory.
+	if( config_.backend == plb_Config::Backend::OpenGL )
+		CreateLightmapTextures();
+}
+
+void plb_LightmapsBuilder::CreateLightmapTextures()
+{
+	const unsigned int lightmap_size[2]= { lightmap_atlas_texture_.size[0], lightmap_atlas_texture_.size[1] };
 
 	//secondary ambient lightmap textures
 	for( unsigned int i= 0; i< 1; i++ )
@@ -2064,219 +4054,73 @@ void plb_LightmapsBuilder::CreateLightmapBuffers()
 
 		r_Framebuffer::BindScreenFramebuffer();
 	}
-
-	const float inv_lightmap_size[2]=
-	{
-		1.0f / float(lightmap_size[0]),
-		1.0f / float(lightmap_size[1]),
-	};
-
-	plb_Vertex* v_p= level_data_.vertices.data();
-	for( plb_Polygon& poly : level_data_.polygons )
-	{
-		m_Mat3 inverse_lightmap_basis;
-		plbGetInvLightmapBasisMatrix(
-			m_Vec3( poly.lightmap_basis[0] ),
-			m_Vec3( poly.lightmap_basis[1] ),
-			inverse_lightmap_basis );
-
-		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
-		{
-			for( unsigned int v= poly.first_vertex_number; v< poly.first_vertex_number + poly.vertex_count; v++ )
-			{
-				const m_Vec3 rel_pos= m_Vec3( v_p[v].pos ) - m_Vec3( poly.lightmap_pos );
-				const m_Vec2 uv= ( rel_pos * inverse_lightmap_basis ).xy();
-
-				for( unsigned int j= 0; j < 2; j++ )
-				{
-					v_p[v].lightmap_coord[j]+= uv.ToArr()[j] + float(poly.lightmap_data.coord[j]);
-					v_p[v].lightmap_coord[j]*= inv_lightmap_size[j];
-				}
-
-				v_p[v].tex_maps[2]= poly.lightmap_data.atlas_id;
-			}
-		} // if has lightmap
-		else
-		{
-			const float lightmap_coord_scale[2]=
-			{
-				float( stub_lightmap_.size[0] ) / float( poly.lightmap_data.size[0] ),
-				float( stub_lightmap_.size[1] ) / float( poly.lightmap_data.size[1] ),
-			};
-
-			for( unsigned int v= poly.first_vertex_number; v< poly.first_vertex_number + poly.vertex_count; v++ )
-			{
-				const m_Vec3 rel_pos= m_Vec3( v_p[v].pos ) - m_Vec3( poly.lightmap_pos );
-				const m_Vec2 uv= ( rel_pos * inverse_lightmap_basis ).xy();
-
-				for( unsigned int j= 0; j < 2; j++ )
-				{
-					v_p[v].lightmap_coord[j]= uv.ToArr()[j] * lightmap_coord_scale[j] + float(stub_lightmap_.coord[j]);
-					v_p[v].lightmap_coord[j]*= inv_lightmap_size[j];
-				}
-
-				v_p[v].tex_maps[2]= stub_lightmap_.atlas_id;
-			}
-		} // has no lightmap
-	}// for polygons
-
-	if( level_data_.curved_surfaces_vertices.size() > 0 )
-	{
-		v_p= level_data_.curved_surfaces_vertices.data();
-		for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
-		{
-			const plb_SurfaceLightmapData& lightmap_data=
-				( curve.flags & plb_SurfaceFlags::NoLightmap ) == 0
-				? curve.lightmap_data : stub_lightmap_;
-
-			for( unsigned int v= curve.first_vertex_number;
-				v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
-			{
-				for( unsigned int j= 0; j < 2; j++ )
-				{
-					v_p[v].lightmap_coord[j]=
-						( v_p[v].lightmap_coord[j] + float(lightmap_data.coord[j]) ) * inv_lightmap_size[j];
-				}
-
-				v_p[v].tex_maps[2]= lightmap_data.atlas_id;
-			}
-		}// for curves
-	}
 }
 
 void plb_LightmapsBuilder::PrepareLightTexelsPoints()
 {
-	std::vector<LightTexelVertex> vertices;
-
-	plb_Tracer::SurfacesList surfaces_list;
-	plb_Tracer::LineSegments segments;
-
-	for( const plb_Polygon& poly : level_data_.polygons )
-	{
-		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
-			continue;
-
-		GetPolygonNeighborsSegments( poly, surfaces_list, segments );
-
-		const unsigned int first_vertex= vertices.size();
-		vertices.resize( vertices.size() + poly.lightmap_data.size[0] * poly.lightmap_data.size[1] );
-
-		for( unsigned int y= 0; y < poly.lightmap_data.size[1]; y++ )
-		for( unsigned int x= 0; x < poly.lightmap_data.size[0]; x++ )
-		{
-			const m_Vec3 pos=
-				m_Vec3( poly.lightmap_pos ) +
-				( float(x) + 0.5f ) * m_Vec3( poly.lightmap_basis[0] ) +
-				( float(y) + 0.5f ) * m_Vec3( poly.lightmap_basis[1] );
-
-			const m_Vec3 pos_corrected= CorrectSecondaryLightSample( pos, poly, segments );
+	const plb_ProfilerScope profiler_scope( "Light texels preparation" );
 
-			LightTexelVertex& v= vertices[ first_vertex + x + y * poly.lightmap_data.size[0] ];
+	plb_CpuLightmapsBuilder::LightTexels texels;
+	plbPreparePrimaryLightTexels(
+		level_data_, config_,
+		GetPolygonsNeighborsSegments(),
+		// Light of other surfaces is taken from cache.
+		[this]( const unsigned int surface_index ) { return IsSurfaceRelit( surface_index ); },
+		texels );
 
-			for( unsigned int i= 0; i < 3; i++ )
-			{
-				v.pos[i]= pos_corrected.ToArr()[i];
-				v.normal[i]= static_cast<char>( 127.0f * poly.normal[i] );
-			}
-
-			v.lightmap_pos[0]= float( poly.lightmap_data.coord[0] + x ) + 0.5f;
-			v.lightmap_pos[1]= float( poly.lightmap_data.coord[1] + y ) + 0.5f;
-			for( unsigned int i= 0; i < 2; i++ )
-				v.lightmap_pos[i]/= float(lightmap_atlas_texture_.size[i]);
+	std::cout << "Primary lightmap texels: " << texels.size() << std::endl;
 
-			v.tex_maps[2]= poly.lightmap_data.atlas_id;
-		}
-	} // for polygons
-
-	std::vector<PositionAndNormal> curve_coords;
-	for( const plb_CurvedSurface& curve : level_data_.curved_surfaces )
+	if( cpu_builder_ != nullptr )
 	{
-		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
-			continue;
-
-		curve_coords.resize( curve.lightmap_data.size[0] * curve.lightmap_data.size[1] );
-
-		const m_Vec2 lightmap_coord_scaler{
-			float(lightmap_atlas_texture_.size[0]),
-			float(lightmap_atlas_texture_.size[1]) };
-
-		const m_Vec2 lightmap_coord_shift{
-			-float(curve.lightmap_data.coord[0]) ,
-			-float(curve.lightmap_data.coord[1]) };
-
-		const unsigned int curve_lightmap_size[2]=
-			{ curve.lightmap_data.size[0], curve.lightmap_data.size[1] };
-
-		CalculateCurveCoordinatesForLightTexels(
-			curve,
-			lightmap_coord_scaler, lightmap_coord_shift,
-			curve_lightmap_size,
-			level_data_.curved_surfaces_vertices,
-			curve_coords.data() );
-
-		for( unsigned int y= 0; y < curve.lightmap_data.size[1]; y++ )
-		for( unsigned int x= 0; x < curve.lightmap_data.size[0]; x++ )
-		{
-			const PositionAndNormal& position_and_normal=
-				curve_coords[ x + y * curve.lightmap_data.size[0] ];
-
-			m_Vec3 normal= position_and_normal.normal;
-			if( normal.SquareLength() < 0.001f )
-				continue; // Bad texel
-			normal.Normalize();
-
-			vertices.emplace_back();
-			LightTexelVertex& v= vertices.back();
-
-			for( unsigned int i= 0; i < 3; i++ )
-			{
-				v.pos[i]= position_and_normal.pos.ToArr()[i];
-				v.normal[i]= static_cast<char>( 127.0f * normal.ToArr()[i] );
-			}
-
-			v.lightmap_pos[0]= float( curve.lightmap_data.coord[0] + x ) + 0.5f;
-			v.lightmap_pos[1]= float( curve.lightmap_data.coord[1] + y ) + 0.5f;
-			for( unsigned int i= 0; i < 2; i++ )
-				v.lightmap_pos[i]/= float(lightmap_atlas_texture_.size[i]);
-
-			v.tex_maps[2]= curve.lightmap_data.atlas_id;
+		TakeWorkerShard( texels, config_ );
+		cpu_builder_->SetPrimaryLightTexels( std::move(texels) );
+		return;
+	}
 
-		} // for xy
-	} // for curves
+	const unsigned int* const atlas_size= lightmap_atlas_texture_.size;
 
-	// Place models vertices
-	for( const plb_LevelModel& model : level_data_.models )
+	std::vector<LightTexelVertex> vertices( texels.size() );
+	for( unsigned int i= 0; i < texels.size(); i++ )
 	{
-		if( ( model.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
-			continue;
+		const plb_CpuLightmapsBuilder::LightTexel& texel= texels[i];
+		LightTexelVertex& v= vertices[i];
+		std::memset( &v, 0, sizeof(LightTexelVertex) );
 
-		for( unsigned int v= 0; v < model.vertex_count; v++ )
+		for( unsigned int j= 0; j < 3; j++ )
 		{
-			const plb_Vertex& in_vertex= level_data_.models_vertices[ model.first_vertex_number + v ];
-			const plb_Normal& in_normal= level_data_.models_normals[ model.first_vertex_number + v ];
+			v.pos[j]= texel.pos.ToArr()[j];
+			v.normal[j]= static_cast<char>( 127.0f * texel.normal.ToArr()[j] );
+		}
 
-			vertices.emplace_back();
-			LightTexelVertex& out_vertex= vertices.back();
+		const unsigned int x= texel.texel_index % atlas_size[0];
+		const unsigned int y= texel.texel_index / atlas_size[0] % atlas_size[1];
+		v.lightmap_pos[0]= ( float(x) + 0.5f ) / float(atlas_size[0]);
+		v.lightmap_pos[1]= ( float(y) + 0.5f ) / float(atlas_size[1]);
 
-			for( unsigned int j= 0; j < 2; j++ )
-				out_vertex.lightmap_pos[j]= in_vertex.lightmap_coord[j];
+		v.tex_maps[2]= texel.texel_index / ( atlas_size[0] * atlas_size[1] );
+	}
 
-			for( unsigned int j= 0; j < 3; j++ )
-			{
-				out_vertex.pos[j]= in_vertex.pos[j];
-				out_vertex.normal[j]= in_normal.xyz[j];
-			}
+	// Sort texels for fast selection of texels near light sources.
+	{
+		std::vector<m_Vec3> texels_positions( vertices.size() );
+		for( unsigned int i= 0; i < vertices.size(); i++ )
+			texels_positions[i]= m_Vec3( vertices[i].pos );
 
-			std::memcpy( out_vertex.tex_maps, in_vertex.tex_maps, 4 );
-		} // for model vertice
-	} // for models
+		light_texels_grid_.reset( new plb_LightTexelsGrid( texels_positions ) );
 
-	std::cout << "Primary lightmap texels: " << vertices.size() << std::endl;
+		std::vector<LightTexelVertex> sorted_vertices( vertices.size() );
+		const std::vector<unsigned int>& texels_order= light_texels_grid_->GetTexelsOrder();
+		for( unsigned int i= 0; i < vertices.size(); i++ )
+			sorted_vertices[i]= vertices[ texels_order[i] ];
+		vertices.swap( sorted_vertices );
+	}
 
 	light_texels_points_.VertexData(
 		vertices.data(),
 		vertices.size() * sizeof(LightTexelVertex),
 		sizeof(LightTexelVertex) );
+	light_texels_count_= vertices.size();
+	plbProfilerAddCounter( plb_ProfilerCounter::BytesUploaded, vertices.size() * sizeof(LightTexelVertex) );
 
 	LightTexelVertex v;
 
@@ -2309,98 +4153,150 @@ void plb_LightmapsBuilder::PrepareLightTexelsPoints()
 	light_texels_points_.SetPrimitiveType( GL_POINTS );
 }
 
-void plb_LightmapsBuilder::FillBorderLightmapTexels()
+void plb_LightmapsBuilder::PrepareSecondaryLightTexels( plb_CpuLightmapsBuilder::LightTexels& out_texels, const bool only_affected )
 {
-	float* lightmap_data= new float[
-		lightmap_atlas_texture_.size[0] *
-		lightmap_atlas_texture_.size[1] *
-		lightmap_atlas_texture_.size[2] * 4 ];
+	plb_LightTexelFilter texel_filter;
+	if( only_affected )
+		texel_filter=
+			[this]( const m_Vec3& pos, const m_Vec3& normal, const bool model_texel )
+			{
+				return IsSecondaryLightSampleAffected( pos, normal, model_texel );
+			};
 
-	const unsigned int max_poly_lightmap_heigth= 512;
-	float* tmp_poly_lightmap_data= new float[ max_poly_lightmap_heigth * lightmap_atlas_texture_.size[0] * 4 ];
-	
-	glBindTexture( GL_TEXTURE_2D_ARRAY, lightmap_atlas_texture_.tex_id );
-	glGetTexImage( GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, GL_FLOAT, lightmap_data );
+	plbPrepareSecondaryLightTexels( level_data_, config_, GetPolygonsNeighborsSegments(), texel_filter, out_texels );
 
+	std::cout << "Secondary lightmap texels: " << out_texels.size() << std::endl;
+}
 
-	static const float sum_table[]= { 0.0f, 1.0f, 0.5f, 0.3333333333333333f, 0.25f };
-	static const int vec_table[]= { 1,0, -1,0, 0,1, 0,-1 };
-	const float eps= 1e-5f;
+void plb_LightmapsBuilder::GetLightmapsRects( const bool secondary, plb_LightmapRects& out_rects ) const
+{
+	plbGetLightmapsRects( level_data_, secondary ? config_.secondary_lightmap_scaler : 1u, out_rects );
+}
 
-	for( plb_Polygon& p : level_data_.polygons )
+void plb_LightmapsBuilder::ProcessLightmapsLayers(
+	const bool secondary,
+	const plb_LightmapRects& rects,
+	const std::function<void( float* layer_data, const unsigned int* layer_size, unsigned int layer )>& func )
+{
+	if( cpu_builder_ != nullptr )
 	{
-		for( unsigned int i= 0; i< 3; i++ )
+		cpu_builder_->ForEachAtlasLayer( secondary, func );
+		return;
+	}
+
+	const unsigned int layer_size[2]=
+	{
+		secondary ? lightmap_atlas_texture_.secondary_lightmap_size[0] : lightmap_atlas_texture_.size[0],
+		secondary ? lightmap_atlas_texture_.secondary_lightmap_size[1] : lightmap_atlas_texture_.size[1],
+	};
+	const GLuint tex_id= secondary ? lightmap_atlas_texture_.secondary_tex_id[0] : lightmap_atlas_texture_.tex_id;
+
+	// Read and write back only layers with lightmaps.
+	std::vector<bool> dirty_layers( lightmap_atlas_texture_.size[2], false );
+	for( const plb_LightmapRect& rect : rects )
+		if( rect.layer < dirty_layers.size() )
+			dirty_layers[ rect.layer ]= true;
+
+	std::vector<float> layer_data( 4u * layer_size[0] * layer_size[1] );
+
+	GLuint read_fbo;
+	glGenFramebuffers( 1, &read_fbo );
+	glBindFramebuffer( GL_READ_FRAMEBUFFER, read_fbo );
+	glReadBuffer( GL_COLOR_ATTACHMENT0 );
+
+	glBindTexture( GL_TEXTURE_2D_ARRAY, tex_id );
+	for( unsigned int layer= 0u; layer < dirty_layers.size(); layer++ )
+	{
+		if( !dirty_layers[layer] )
+			continue;
+
+		glFramebufferTextureLayer( GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex_id, 0, layer );
+		glReadPixels( 0, 0, layer_size[0], layer_size[1], GL_RGBA, GL_FLOAT, layer_data.data() );
+
+		func( layer_data.data(), layer_size, layer );
+
+		glTexSubImage3D(
+			GL_TEXTURE_2D_ARRAY, 0,
+			0, 0, layer,
+			layer_size[0], layer_size[1], 1,
+			GL_RGBA, GL_FLOAT, layer_data.data() );
+		plbProfilerAddCounter( plb_ProfilerCounter::BytesUploaded, layer_data.size() * sizeof(float) );
+	}
+
+	glDeleteFramebuffers( 1, &read_fbo );
+	r_Framebuffer::BindScreenFramebuffer();
+}
+
+void plb_LightmapsBuilder::DilateLightmaps( const bool secondary )
+{
+	const plb_ProfilerScope profiler_scope( "Lightmaps dilation" );
+
+	if( config_.lightmaps_dilation_passes == 0u )
+		return;
+
+	plb_LightmapRects rects;
+	GetLightmapsRects( secondary, rects );
+
+	const unsigned int thread_count= plbGetThreadCount( config_.cpu_threads );
+
+	ProcessLightmapsLayers(
+		secondary, rects,
+		[&]( float* const layer_data, const unsigned int* const layer_size, const unsigned int layer )
 		{
-			float* texels= lightmap_data + 4 * lightmap_atlas_texture_.size[0] * lightmap_atlas_texture_.size[1] *
-				p.lightmap_data.atlas_id;
-			float* texels_src= tmp_poly_lightmap_data;
+			plbDilateLightmapsLayer(
+				layer_data, layer_size, layer,
+				rects,
+				config_.lightmaps_dilation_passes,
+				thread_count );
+		} );
+}
 
-			for( unsigned int y= p.lightmap_data.coord[1], y_end= p.lightmap_data.size[1] + p.lightmap_data.coord[1];
-				y< y_end; y++ )
-			{
-				unsigned int dy= y - p.lightmap_data.coord[1];
-				unsigned int k_src= (p.lightmap_data.coord[0] + y * lightmap_atlas_texture_.size[0])<<2;
-				unsigned int k_dst= (p.lightmap_data.coord[0] + dy * lightmap_atlas_texture_.size[0])<<2;
-				for( unsigned int x= p.lightmap_data.coord[0], x_end= p.lightmap_data.size[0] + p.lightmap_data.coord[0];
-					x< x_end; x++, k_src+=4, k_dst+=4 )
-				{
-					texels_src[k_dst  ]= texels[k_src  ];
-					texels_src[k_dst+1]= texels[k_src+1];
-					texels_src[k_dst+2]= texels[k_src+2];
-					texels_src[k_dst+3]= texels[k_src+3];
-				}
-			}// copy old data to tmp buffer
+void plb_LightmapsBuilder::DenoiseSecondaryLightmaps()
+{
+	const plb_ProfilerScope profiler_scope( "Secondary light denoising" );
 
-			for( unsigned int y= p.lightmap_data.coord[1], y_end= p.lightmap_data.size[1] + p.lightmap_data.coord[1];
-				y< y_end; y++ )
-			{
-				unsigned int dy= y - p.lightmap_data.coord[1];
-				unsigned int k_dst= (p.lightmap_data.coord[0] + y * lightmap_atlas_texture_.size[0])<<2;
-				unsigned int k_src= (p.lightmap_data.coord[0] + dy * lightmap_atlas_texture_.size[0])<<2;
-				for( unsigned int x= p.lightmap_data.coord[0], x_end= p.lightmap_data.size[0] + p.lightmap_data.coord[0];
-					x< x_end; x++, k_dst+= 4, k_src+= 4 )
-				{
-					if( texels_src[k_src+3] < eps ) // empty texel, becouse alpha is zero
-					{
-						unsigned int notzero_count= 0;
-						float sum[]= {0.0f, 0.0f, 0.0f};
-						for( unsigned int v= 0; v< 4; v++ )
-						{
-							int new_x= x + vec_table[v*2];
-							int new_y= y + vec_table[v*2+1];
-							if( new_x >= p.lightmap_data.coord[0] && new_x < ((int)x_end) )
-								if( new_y >= p.lightmap_data.coord[1] && new_y < ((int)y_end) )
-								{
-									unsigned int new_k= (new_x + (new_y-p.lightmap_data.coord[1]) * lightmap_atlas_texture_.size[0])<<2;
-									if( texels_src[new_k+3] > eps ) // if nearest texel alpha is not zero
-									{
-										sum[0]+= texels_src[new_k  ];
-										sum[1]+= texels_src[new_k+1];
-										sum[2]+= texels_src[new_k+2];
-										notzero_count++;
-									}
-								}
-						}// for nearest texels
-						if( notzero_count > 0 )
-						{
-							texels[k_dst  ]= sum[0] * sum_table[notzero_count];
-							texels[k_dst+1]= sum[1] * sum_table[notzero_count];
-							texels[k_dst+2]= sum[2] * sum_table[notzero_count];
-							texels[k_dst+3]= 1.0f; // mark as not null
-						}
-					}
-				}// for x
-			}// for y
-		}// fill iterations
-	}// for polygons
+	if( config_.secondary_light_denoise_iterations == 0u )
+		return;
+
+	const auto start_time= std::chrono::steady_clock::now();
 
-	delete[] tmp_poly_lightmap_data;
+	// Use positions and normals of secondary light texels as guides.
+	plb_CpuLightmapsBuilder::LightTexels secondary_texels;
+	PrepareSecondaryLightTexels( secondary_texels, false );
 
-	glTexSubImage3D( GL_TEXTURE_2D_ARRAY, 0,
-		0, 0, 0,
-		lightmap_atlas_texture_.size[0], lightmap_atlas_texture_.size[1], lightmap_atlas_texture_.size[2],
-		GL_RGBA, GL_FLOAT, lightmap_data );
-	delete[] lightmap_data;
+	const unsigned int layer_texels=
+		lightmap_atlas_texture_.secondary_lightmap_size[0] * lightmap_atlas_texture_.secondary_lightmap_size[1];
+
+	std::vector<m_Vec3> positions( layer_texels * lightmap_atlas_texture_.size[2], m_Vec3( 0.0f, 0.0f, 0.0f ) );
+	std::vector<m_Vec3> normals( positions.size(), m_Vec3( 0.0f, 0.0f, 0.0f ) );
+	for( const plb_CpuLightmapsBuilder::LightTexel& texel : secondary_texels )
+	{
+		positions[ texel.texel_index ]= texel.pos;
+		normals[ texel.texel_index ]= texel.normal;
+	}
+
+	plb_LightmapRects rects;
+	GetLightmapsRects( true, rects );
+
+	const unsigned int thread_count= plbGetThreadCount( config_.cpu_threads );
+
+	ProcessLightmapsLayers(
+		true, rects,
+		[&]( float* const layer_data, const unsigned int* const layer_size, const unsigned int layer )
+		{
+			plbDenoiseLightmapsLayer(
+				layer_data, layer_size, layer,
+				rects,
+				positions.data() + layer_texels * layer,
+				normals.data() + layer_texels * layer,
+				config_.secondary_light_denoise_iterations,
+				config_.secondary_light_denoise_strength,
+				thread_count );
+		} );
+
+	const auto end_time= std::chrono::steady_clock::now();
+	std::cout << "Secondary lightmaps denoised in " <<
+		std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count() << " ms" << std::endl;
 }
 
 
@@ -2422,131 +4318,22 @@ void plb_LightmapsBuilder::CalculateLevelBoundingBox()
 	level_bounding_box_.max= l_max;
 }
 
-m_Vec3 plb_LightmapsBuilder::CorrectSecondaryLightSample(
-	const m_Vec3& pos,
-	const plb_Polygon& poly,
-	const plb_Tracer::LineSegments& neighbors_segments )
+const unsigned char* plb_LightmapsBuilder::GetVisibleClustersMask( const m_Vec3* const points, const unsigned int point_count )
 {
-	const float texel_clip_distance=
-		plb_Constants::sqrt_2 *
-		float( config_.secondary_lightmap_scaler ) *
-		std::sqrt(
-			std::max(
-				m_Vec3(poly.lightmap_basis[0]).SquareLength(),
-				m_Vec3(poly.lightmap_basis[1]).SquareLength() ) );
-
-	float nearest_segment_square_distance= plb_Constants::max_float;
-	const plb_Tracer::LineSegment* nearest_segment= nullptr;
-
-	for( const plb_Tracer::LineSegment& segment : neighbors_segments )
-	{
-		const m_Vec3 projection_to_segment=
-			plbProjectPointToPlane( pos, segment.v[0], segment.normal );
-
-		const m_Vec3 dir_to_segment_vertices[2]=
-		{
-			segment.v[0] - projection_to_segment,
-			segment.v[1] - projection_to_segment,
-		};
-
-		m_Vec3 nearest_point;
-		if( dir_to_segment_vertices[0] * dir_to_segment_vertices[1] <= 0.0f )
-		{
-			// Projection is on segment
-			nearest_point= projection_to_segment;
-		}
-		else
-		{
-			nearest_point=
-				dir_to_segment_vertices[0].SquareLength() < dir_to_segment_vertices[1].SquareLength()
-					? segment.v[0]
-					: segment.v[1];
-		}
-
-		const float square_distance= ( nearest_point - pos ).SquareLength();
-		if( square_distance < nearest_segment_square_distance )
-		{
-			nearest_segment_square_distance= square_distance;
-			nearest_segment= &segment;
-		}
-	} // for segments
-
-	if( nearest_segment == nullptr )
-		return pos; // No near segment
-	if( nearest_segment_square_distance > texel_clip_distance )
-		return pos; // Too far from any segment
-
-	const m_Vec3 projection=
-		plbProjectPointToPlane( pos, nearest_segment->v[0], nearest_segment->normal );
-
-	const float signed_distance_to_projection= ( pos - projection ) * nearest_segment->normal;
-
-	if( signed_distance_to_projection >= 0.0f )
-	{
-		// front
-		if( signed_distance_to_projection < g_cubemaps_min_clip_distance )
-			return projection + nearest_segment->normal * g_cubemaps_min_clip_distance;
-	}
-	else
-	{
-		// back
-		return projection + nearest_segment->normal * g_cubemaps_min_clip_distance;
-	}
+	if( !plbGetVisibleClustersMask( level_data_.visibility, points, point_count, visible_clusters_mask_ ) )
+		return nullptr;
 
-	return pos;
+	return visible_clusters_mask_.data();
 }
 
-void plb_LightmapsBuilder::GetPolygonNeighborsSegments(
-	const plb_Polygon& polygon,
-	plb_Tracer::SurfacesList& tmp_surfaces_container,
-	plb_Tracer::LineSegments& out_segments )
+const std::vector<plb_Tracer::LineSegments>& plb_LightmapsBuilder::GetPolygonsNeighborsSegments()
 {
-	out_segments.clear();
-	tmp_surfaces_container.clear();
+	if( !polygons_neighbors_segments_.empty() || level_data_.polygons.empty() )
+		return polygons_neighbors_segments_;
 
-	const float c_up_eps= 1.0f / 16.0f;
-	//const float c_segment_cut_eps= 1.0f / 64.0f;
-	const float c_segment_shift_eps= 1.0f / 64.0f;
+	const plb_ProfilerScope profiler_scope( "Polygons neighbors segments" );
 
-	const float texel_clip_distance=
-		plb_Constants::sqrt_2 *
-		float( config_.secondary_lightmap_scaler ) *
-		std::sqrt(
-			std::max(
-				m_Vec3(polygon.lightmap_basis[0]).SquareLength(),
-				m_Vec3(polygon.lightmap_basis[1]).SquareLength() ) );
-
-	const m_Vec3 polygon_normal( polygon.normal );
-	const m_Vec3 plane_point=
-		m_Vec3(level_data_.vertices[ polygon.first_vertex_number ].pos ) +
-		polygon_normal * c_up_eps;
-
-	tracer_->GetPolygonNeighbors(
-		polygon,
-		level_data_.vertices,
-		texel_clip_distance,
-		tmp_surfaces_container );
-
-	tracer_->GetPlaneIntersections(
-		tmp_surfaces_container,
-		polygon_normal,
-		plane_point,
-		out_segments );
-
-	// Cut c_segment_shift_eps from segments ends and shift segment forward.
-	for( plb_Tracer::LineSegment& segment : out_segments )
-	{
-		/*const m_Vec3 vec= segment.v[0] - segment.v[1];
-		const float vec_len= vec.Length();
-		const float len_corrected= vec_len - 2.0f * c_segment_cut_eps;
-		const m_Vec3 vec_corrected= vec * ( len_corrected / vec_len );
-
-		const m_Vec3 v0_before= segment.v[0];
-		segment.v[0]= segment.v[1] + vec_corrected;
-		segment.v[1]= v0_before    - vec_corrected;*/
-
-		const m_Vec3 shift_vec= segment.normal * c_segment_shift_eps;
-		segment.v[0]+= shift_vec;
-		segment.v[1]+= shift_vec;
-	}
+	plbGetPolygonsNeighborsSegments( level_data_, config_, *tracer_, polygons_neighbors_segments_ );
+
+	return polygons_neighbors_segments_;
 }
@@ -1,4 +1,5 @@
 ﻿#pragma once
+#include <chrono>
 #include <functional>
 #include <memory>
 
@@ -10,8 +11,17 @@
 #include <texture.hpp>
 #include <vec.hpp>
 
+#include "bake_workers.hpp"
+#include "cpu_lightmaps_builder.hpp"
 #include "formats.hpp"
+#include "irradiance_cache.hpp"
+#include "light_cache.hpp"
+#include "light_texels_grid.hpp"
+#include "lightmaps_dilation.hpp"
+#include "lightmaps_file.hpp"
 #include "lights_visualizer.hpp"
+#include "secondary_light_checkpoint.hpp"
+#include "shared_resources.hpp"
 #include "textures_manager.hpp"
 #include "tracer.hpp"
 #include "world_vertex_buffer.hpp"
@@ -21,13 +31,36 @@
 class plb_LightmapsBuilder final
 {
 public:
-	plb_LightmapsBuilder( const char* file_name, const plb_Config& config );
+	// shared_resources - optional, used for building of lightmaps of many levels in one process.
+	plb_LightmapsBuilder( const char* file_name, const plb_Config& config, plb_SharedResources* shared_resources= nullptr );
 	~plb_LightmapsBuilder();
 
 	void MakePrimaryLight( const std::function<void()>& wake_up_callback );
 
+	// Saves checkpoints and continues from checkpoint, if checkpoint file is specified in config.
 	void MakeSecondaryLight( const std::function<void()>& wake_up_callback );
 
+	// Builds light of own shard of texels in worker process and exchanges it with coordinator.
+	// Used instead of MakePrimaryLight and MakeSecondaryLight. Requires CPU backend. Returns false on error.
+	bool RunWorker( FILE* input, FILE* output, const std::function<void()>& wake_up_callback );
+
+	// Merges light of started worker processes - one for each shard.
+	// Used instead of MakePrimaryLight and MakeSecondaryLight. Requires CPU backend. Returns false on error.
+	bool MakeLightWithWorkers(
+		const std::vector<std::unique_ptr<plb_WorkerProcess>>& workers,
+		const std::function<void()>& wake_up_callback );
+
+	// Removes checkpoint file of secondary light. Call it after successful saving of results.
+	void RemoveSecondaryLightCheckpoint();
+
+	// Reads back lightmaps atlases and writes it to file.
+	// Returns true on success.
+	bool SaveLightmaps( const char* file_name );
+
+	// Writes lightmaps into copy of source BSP file, using loader library.
+	// Returns true on success.
+	bool SaveBsp( const char* in_file_name, const char* out_file_name );
+
 	void DrawPreview(
 		const m_Mat4& view_matrix, const m_Vec3& cam_pos,
 		const m_Vec3& cam_dir,
@@ -36,21 +69,149 @@ public:
 		bool draw_luminous_surfaces, bool draw_shadowless_surfaces, bool smooth_lightmaps );
 
 private:
+	// Returns views of lightmaps atlases. For OpenGL backend reads atlases back into given containers.
+	void GetLightmapsAtlases(
+		plb_LightmapsAtlasView& out_primary_atlas,
+		plb_LightmapsAtlasView& out_secondary_atlas,
+		std::vector<float>& primary_data,
+		std::vector<float>& secondary_data );
+
 	void LoadLightPassShaders();
 
+	// Primary light passes for all light sources, without dilation.
+	void MakePrimaryLightPasses( const std::function<void()>& wake_up_callback );
+
 	void CreateShadowmapCubemap();
-	void GenPointlightShadowmap( const m_Vec3& light_pos );
-	void PointLightPass( const m_Vec3& light_pos, const m_Vec3& light_color );
-	void SurfaceSampleLightPass( const m_Vec3& light_pos, const m_Vec3& light_normal, const m_Vec3& light_color );
+	// Functions for batches of lights. Light count must be not greater, then point light shadowmap batch size.
+	void GenPointlightShadowmaps( const m_Vec3* lights_pos, unsigned int light_count );
+	void PointLightsPass( const m_Vec3* lights_pos, const m_Vec3* lights_colors, unsigned int light_count );
+	void SurfaceSampleLightsPass(
+		const m_Vec3* lights_pos,
+		const m_Vec3* lights_normals,
+		const m_Vec3* lights_colors,
+		unsigned int light_count );
+
+	// Draws light texels, which are inside cutoff radius of at least one light.
+	void DrawLightTexelsNearLights( const m_Vec3* lights_pos, const m_Vec3* lights_colors, unsigned int light_count );
+
+	struct SecondaryLightSample
+	{
+		m_Vec3 pos;
+		m_Vec3 normal;
+		m_Vec3 tex_coord; // Secondary lightmap atlas coordinates of first texel: u, v, layer.
+		unsigned int block_size[2]; // Size of block of texels, which get light of this sample.
+	};
+
+	// Calculates one bounce of secondary light into secondary lightmap texture with index "bounce".
+	// First bounce gathers primary light, each next bounce gathers light of previous bounce.
+	// Surfaces and then vertices of models are processed in fixed order. Items before "first_item"
+	// are skipped - their light must be already in texture. Checkpoint callback gets number of finished items.
+	// Returns number of rendered hemicubes.
+	unsigned int MakeSecondaryLightBounce(
+		unsigned int bounce,
+		unsigned int first_item,
+		const std::function<void()>& wake_up_callback,
+		const std::function<void( unsigned int items_done )>& checkpoint_callback );
+	void CreateSecondaryLightBounceTexture( unsigned int bounce );
+	// Reads secondary lightmap texture of bounce, returns sum of light of all texels.
+	double ReadSecondaryLightBounce( unsigned int bounce, std::vector<float>& out_data );
+	void WriteSecondaryLightBounce( unsigned int bounce, const std::vector<float>& data );
+
+	// Hash of level data and options, which affect secondary light.
+	uint64_t GetSecondaryLightCheckpointKey() const;
+	// Sets key and atlas size of checkpoint. Reads checkpoint file, if it exists and matches level and options.
+	// Returns true, if checkpoint is read.
+	bool LoadSecondaryLightCheckpoint( plb_SecondaryLightCheckpoint& checkpoint ) const;
+	// Returns true, if checkpoints are enabled and checkpoint interval is elapsed.
+	bool SecondaryLightCheckpointIsDue() const;
+	void SaveSecondaryLightCheckpoint( const plb_SecondaryLightCheckpoint& checkpoint );
+
+	// Hash of options, which affect primary light.
+	uint64_t GetLightCacheOptionsKey() const;
+	// Hash of level data and options, which affect primary light, except lights.
+	uint64_t GetLightCacheGeometryKey() const;
+	// Hash of options of secondary light.
+	uint64_t GetLightCacheSecondaryLightKey() const;
+	// Hashes and bounding boxes of polygons, curved surfaces and models of level.
+	void GetLightCacheSurfaces( plb_LightCacheSurfaces& out_surfaces ) const;
+	// Fills light sources for primary light passes. If light cache matches level, uploads cached
+	// primary light and leaves only changed lights. Must be called before preparation of light texels.
+	void PrepareLightSources();
+	// Used, if level geometry is changed since creation of light cache. Uploads cached light
+	// of unchanged surfaces, which can not be affected by changed geometry and lights.
+	void ReuseLightOfUnchangedSurfaces( const plb_LightCache& cache );
+	// Returns true, if cached secondary light was built with same options, and samples of secondary light are independent.
+	bool SecondaryLightCacheIsUsable( const plb_LightCache& cache ) const;
+	// Writes lights and light of current build into light cache file. Must be called before denoising of secondary light.
+	void SaveLightCache();
+	// Returns false for polygons and curved surfaces (numbered after polygons), which light is taken from cache.
+	bool IsSurfaceRelit( unsigned int surface_index ) const;
+	// Returns false for samples of secondary light, which can not see changed lights or geometry. Their light is taken from cache.
+	bool IsSecondaryLightSampleAffected( const m_Vec3& pos, const m_Vec3& normal, bool model_sample ) const;
+
+	// Read and write whole primary or secondary atlas.
+	void ReadLightmapsAtlas( bool secondary, std::vector<float>& out_data );
+	void WriteLightmapsAtlas( bool secondary, const std::vector<float>& data );
+
+	// Texels of one surface in secondary lightmap atlas.
+	struct SecondaryLightSurfaceTexels
+	{
+		unsigned int size[2];
+		unsigned int coord[2]; // Coordinates of corner in secondary lightmap atlas.
+		unsigned int layer;
+		const plb_Polygon* polygon; // Null for curved surfaces.
+		float texel_size; // Approximate size of texel in world space.
+
+		// Calculates position and normal for point with given texel-space coordinates.
+		// Returns false for degenerate texels.
+		std::function<bool( float x, float y, m_Vec3& out_pos, m_Vec3& out_normal )> get_texel;
+		// Returns true, if neighbor geometry is near to block of texels [x0; x1] * [y0; y1].
+		std::function<bool( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 )> is_near_edge;
+	};
+
+	void ForEachSecondaryLightSurface( const std::function<void( const SecondaryLightSurfaceTexels& )>& func );
+
+	// Returns false for degenerate texels.
+	bool GetSecondaryLightSurfaceSample(
+		const SecondaryLightSurfaceTexels& surface,
+		unsigned int x, unsigned int y,
+		unsigned int block_size_x, unsigned int block_size_y,
+		SecondaryLightSample& out_sample ) const;
+
+	// Checks cells of adaptive sampling grid, using light of grid corners.
+	// Interpolates light inside smooth cells and produces samples for texels of other cells.
+	// Returns number of interpolated texels.
+	unsigned int RefineAdaptiveSecondaryLight(
+		const SecondaryLightSurfaceTexels& surface,
+		unsigned int grid_step,
+		std::vector<float>& light_data,
+		std::vector<SecondaryLightSample>& out_samples ) const;
+
+	static std::vector<unsigned int> GetAdaptiveGridCoordinates( unsigned int size, unsigned int step );
+
+	struct IrradianceCacheSample
+	{
+		SecondaryLightSample sample;
+		unsigned int record_index; // ~0, if sample gets light from irradiance cache.
+	};
+
+	// Sets light of irradiance cache records from rendered hemicubes,
+	// interpolates light of records for all other samples.
+	void ApplySecondaryLightIrradianceCache(
+		unsigned int bounce,
+		plb_IrradianceCache& irradiance_cache,
+		const std::vector<IrradianceCacheSample>& samples );
 
 	void GenSecondaryLightPassCubemap();
 	void GenSecondaryLightPassUnwrapBuffer();
-	void SecondaryLightPass( const m_Vec3& pos, const m_Vec3& normal );
+	// Renders hemicubes for all samples together and writes result light into secondary lightmap atlas.
+	// Number of samples must be not greater, than batch size.
+	void SecondaryLightPass( const SecondaryLightSample* samples, unsigned int sample_count, unsigned int bounce );
 
 	void GenDirectionalLightShadowmap( const m_Mat4& shadow_mat );
 	void DirectionalLightPass( const plb_DirectionalLight& light, const m_Mat4& shadow_mat );
 
-	void GenConeLightShadowmap( const m_Mat4& shadow_mat );
+	void GenConeLightShadowmap( const m_Mat4& shadow_mat, const m_Vec3& light_pos );
 	void ConeLightPass( const plb_ConeLight& light, const m_Mat4& shadow_mat );
 
 	void MarkLuminousMaterials();
@@ -65,22 +226,39 @@ private:
 
 	void ClalulateLightmapAtlasCoordinates();
 	void CreateLightmapBuffers();
+	void CreateLightmapTextures();
 
 	void PrepareLightTexelsPoints();
 
-	void FillBorderLightmapTexels();
+	// Secondary light texels for CPU backend. Same as texels, used in GPU secondary light pass.
+	// If "only_affected" is true, skips texels, which light is taken from light cache.
+	void PrepareSecondaryLightTexels( plb_CpuLightmapsBuilder::LightTexels& out_texels, bool only_affected );
+
+	// Rects of surfaces lightmaps in primary or secondary atlas.
+	void GetLightmapsRects( bool secondary, plb_LightmapRects& out_rects ) const;
+
+	// Calls function for layers of primary or secondary atlas, which contain given rects.
+	// Function may modify layer data. In OpenGL backend layers are read back and uploaded one by one.
+	void ProcessLightmapsLayers(
+		bool secondary,
+		const plb_LightmapRects& rects,
+		const std::function<void( float* layer_data, const unsigned int* layer_size, unsigned int layer )>& func );
+
+	// Fills empty texels near borders of lightmaps of primary or secondary atlas.
+	void DilateLightmaps( bool secondary );
+
+	// Edge-aware filtering of secondary light, guided by positions and normals of secondary light texels.
+	void DenoiseSecondaryLightmaps();
 
 	void CalculateLevelBoundingBox();
 
-	m_Vec3 CorrectSecondaryLightSample(
-		const m_Vec3& pos,
-		const plb_Polygon& poly,
-		const plb_Tracer::LineSegments& neighbors_segments );
+	// Returns mask of visibility clusters, potentially visible from any of given points.
+	// Returns null, if level has no visibility data or some point is outside level - everything must be drawn.
+	const unsigned char* GetVisibleClustersMask( const m_Vec3* points, unsigned int point_count );
 
-	void GetPolygonNeighborsSegments(
-		const plb_Polygon& polygon,
-		plb_Tracer::SurfacesList& tmp_surfaces_container,
-		plb_Tracer::LineSegments& out_segments );
+	// Returns segments of neighbor geometry for each polygon. Segments are calculated only once,
+	// and reused by all passes over secondary light surfaces.
+	const std::vector<plb_Tracer::LineSegments>& GetPolygonsNeighborsSegments();
 
 private:
 	plb_LevelData level_data_;
@@ -92,8 +270,23 @@ private:
 
 	plb_SurfaceSampleLights bright_luminous_surfaces_lights_;
 
+	// Empty until first call of GetPolygonsNeighborsSegments.
+	std::vector<plb_Tracer::LineSegments> polygons_neighbors_segments_;
+
+	// Sources of primary light passes. In incremental build contains only changed lights -
+	// previous versions with negative intensity for subtraction of previous light and new versions.
+	struct
+	{
+		plb_PointLights point_lights;
+		plb_DirectionalLights directional_lights;
+		plb_ConeLights cone_lights;
+		plb_SurfaceSampleLights surface_sample_lights;
+	} light_sources_;
+
 	const plb_Config config_;
 
+	plb_SharedResources* const shared_resources_;
+
 	r_GLSLProgram polygons_preview_shader_;
 	r_GLSLProgram polygons_preview_alphatested_shader_;
 	r_GLSLProgram polygons_preview_luminosity_shader_;
@@ -109,30 +302,36 @@ private:
 		GLuint fbo_id;
 
 		unsigned int secondary_lightmap_size[2];
-		GLuint secondary_tex_id[ PLB_MAX_LIGHT_PASSES ];
+		GLuint secondary_tex_id[ PLB_MAX_LIGHT_PASSES ]; // For each bounce of secondary light. Result is in first texture.
 		GLuint secondary_tex_fbo; // use 1 FBO and switch between them
-	} lightmap_atlas_texture_;
+	} lightmap_atlas_texture_{};
 
 	// Stub lightmap patch with zero light for surfaces without lightmap.
 	plb_SurfaceLightmapData stub_lightmap_;
 
 	r_PolygonBuffer light_texels_points_;
+	unsigned int light_texels_count_= 0u;
+	// Light texels points are sorted by cells of this grid.
+	std::unique_ptr<plb_LightTexelsGrid> light_texels_grid_;
+	plb_LightTexelsGrid::TexelsRanges light_texels_ranges_;
+
+	std::vector<unsigned char> visible_clusters_mask_;
 
 	struct
 	{
 		unsigned int size; // for cubemap texture is square
+		unsigned int batch_size; // number of cubemaps in cubemap array
 		GLuint depth_tex_id;
 		GLuint fbo_id;
 		float max_light_distance;
-	} point_light_shadowmap_cubemap_;
-	r_GLSLProgram point_light_pass_shader_;
-	r_GLSLProgram surface_sample_light_pass_shader_;
-	r_GLSLProgram point_light_shadowmap_shader_;
-	r_GLSLProgram point_light_shadowmap_alphatested_shader_;
+	} point_light_shadowmap_cubemap_{};
 
 	struct
 	{
 		unsigned int size;
+		unsigned int batch_size; // Number of hemicubes, rendered together.
+
+		// Cubemap arrays with "batch_size" cubemaps.
 		GLuint tex_id;
 		GLuint depth_tex_id;
 		GLuint fbo_id;
@@ -143,28 +342,21 @@ private:
 
 		r_GLSLProgram unwrap_shader;
 		r_PolygonBuffer unwrap_geometry;
-		r_Framebuffer unwrap_framebuffer;
+		// 2D texture array with layer for each hemicube. Mip levels are used for light summation.
+		GLuint unwrap_tex_id;
+		GLuint unwrap_fbo_id;
 
 		r_GLSLProgram write_shader;
 
-	} secondary_light_pass_cubemap_;
-	r_GLSLProgram secondary_light_pass_shader_;
-	r_GLSLProgram secondary_light_pass_luminocity_shader_;
-	r_GLSLProgram secondary_light_pass_alphatested_shader_;
-	r_GLSLProgram secondary_light_pass_vertex_lighted_shader_;
-	r_GLSLProgram secondary_light_pass_vertex_lighted_alphatested_shader_;
+	} secondary_light_pass_cubemap_{};
 
-	r_Framebuffer directional_light_shadowmap_;
+	// Shaders of light passes, may be shared with other builders.
+	std::shared_ptr<plb_LightPassShaders> light_pass_shaders_;
 
-	r_GLSLProgram shadowmap_shader_; // common with cone light
-	r_GLSLProgram shadowmap_alphatested_shader_; // common with cone light
-	r_GLSLProgram directional_light_sky_mark_shader_;
-	r_GLSLProgram directional_light_pass_shader_;
+	r_Framebuffer directional_light_shadowmap_;
 
 	r_Framebuffer cone_light_shadowmap_;
 
-	r_GLSLProgram cone_light_pass_shader_;
-
 	r_GLSLProgram texture_show_shader_;
 	r_PolygonBuffer cubemap_show_buffer_;
 
@@ -172,4 +364,20 @@ private:
 	std::unique_ptr<plb_WorldVertexBuffer> world_vertex_buffer_;
 	std::unique_ptr<plb_Tracer> tracer_;
 	std::unique_ptr<plb_LightsVisualizer> lights_visualizer_;
+
+	// Not null only for CPU backend.
+	std::unique_ptr<plb_CpuLightmapsBuilder> cpu_builder_;
+
+	std::chrono::steady_clock::time_point last_secondary_light_checkpoint_time_;
+
+	// Cache of previous build. Filled with light of current build for saving.
+	plb_LightCache light_cache_;
+	// If true, cached secondary light is rebuilt only for samples, which may see changed lights or geometry.
+	bool incremental_secondary_light_= false;
+	// Visibility clusters, which may see changed lights or geometry. Empty, if nothing is changed.
+	std::vector<unsigned char> changed_clusters_mask_;
+	// True, if light of unchanged surfaces is taken from cache, created for other level geometry.
+	bool level_geometry_changed_= false;
+	// Flags of polygons, then curved surfaces, which primary light is rebuilt. Empty, if all surfaces are rebuilt.
+	std::vector<bool> relit_surfaces_;
 };
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "parallel_for.hpp"
+
+#include "lightmaps_denoiser.hpp"
+
+// Texels with alpha not greater, than this value, are empty.
+static const float g_empty_texel_alpha= 1e-5f;
+
+// B3 spline kernel.
+static const float g_kernel[5]= { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// Buffers of one thread for filtering of one lightmap.
+struct ScratchBuffers
+{
+	std::vector<float> colors[2];
+	std::vector<m_Vec3> positions;
+	std::vector<m_Vec3> normals;
+	std::vector<unsigned char> valid;
+};
+
+static float GetLuminance( const float* const color )
+{
+	return 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2];
+}
+
+// Equivalent of pow( max( dot, 0 ), 32 ).
+static float GetNormalWeight( const m_Vec3& n0, const m_Vec3& n1 )
+{
+	float w= std::max( n0 * n1, 0.0f );
+	w*= w; w*= w; w*= w; w*= w; w*= w;
+	return w;
+}
+
+static void DenoiseRect(
+	float* const layer_data,
+	const unsigned int* const layer_size,
+	const plb_LightmapRect& rect,
+	const m_Vec3* const layer_positions,
+	const m_Vec3* const layer_normals,
+	const unsigned int iterations,
+	const float strength,
+	ScratchBuffers& buffers )
+{
+	const unsigned int width = std::min( rect.size[0], layer_size[0] - std::min( rect.coord[0], layer_size[0] ) );
+	const unsigned int height= std::min( rect.size[1], layer_size[1] - std::min( rect.coord[1], layer_size[1] ) );
+	if( width <= 1u && height <= 1u )
+		return;
+
+	const unsigned int texel_count= width * height;
+	buffers.colors[0].resize( 4u * texel_count );
+	buffers.colors[1].resize( 4u * texel_count );
+	buffers.positions.resize( texel_count );
+	buffers.normals.resize( texel_count );
+	buffers.valid.resize( texel_count );
+
+	// Copy lightmap and guides of texels.
+	for( unsigned int y= 0u; y < height; y++ )
+	{
+		const unsigned int src_offset= rect.coord[0] + ( rect.coord[1] + y ) * layer_size[0];
+		std::memcpy(
+			buffers.colors[0].data() + 4u * y * width,
+			layer_data + 4u * src_offset,
+			4u * width * sizeof(float) );
+
+		for( unsigned int x= 0u; x < width; x++ )
+		{
+			const unsigned int t= x + y * width;
+			buffers.positions[t]= layer_positions[ src_offset + x ];
+			buffers.normals[t]= layer_normals[ src_offset + x ];
+			buffers.valid[t]=
+				buffers.colors[0][ 4u * t + 3u ] > g_empty_texel_alpha &&
+				buffers.normals[t].SquareLength() > 0.01f;
+		}
+	}
+
+	// Estimate texel size in world space, for comparison of positions.
+	float texels_distance_sum= 0.0f;
+	unsigned int texels_distance_count= 0u;
+	for( unsigned int y= 0u; y < height; y++ )
+	for( unsigned int x= 0u; x + 1u < width; x++ )
+	{
+		const unsigned int t= x + y * width;
+		if( buffers.valid[t] && buffers.valid[ t + 1u ] )
+		{
+			texels_distance_sum+= ( buffers.positions[ t + 1u ] - buffers.positions[t] ).Length();
+			texels_distance_count++;
+		}
+	}
+	const float texel_size=
+		texels_distance_count > 0u
+			? std::max( texels_distance_sum / float(texels_distance_count), 1.0e-4f )
+			: 0.0f;
+
+	for( unsigned int iteration= 0u; iteration < iterations; iteration++ )
+	{
+		const int step= 1 << iteration;
+		const float* const src= buffers.colors[0].data();
+		float* const dst= buffers.colors[1].data();
+
+		for( unsigned int y= 0u; y < height; y++ )
+		for( unsigned int x= 0u; x < width; x++ )
+		{
+			const unsigned int t= x + y * width;
+			const float* const color= src + 4u * t;
+			float* const dst_color= dst + 4u * t;
+
+			std::memcpy( dst_color, color, 4u * sizeof(float) );
+			if( !buffers.valid[t] )
+				continue;
+
+			const m_Vec3& pos= buffers.positions[t];
+			const m_Vec3& normal= buffers.normals[t];
+			const float luminance= GetLuminance( color );
+
+			float sum[3]= { 0.0f, 0.0f, 0.0f };
+			float weight_sum= 0.0f;
+			for( int dy= -2; dy <= 2; dy++ )
+			{
+				const int qy= int(y) + dy * step;
+				if( qy < 0 || qy >= int(height) )
+					continue;
+
+				for( int dx= -2; dx <= 2; dx++ )
+				{
+					const int qx= int(x) + dx * step;
+					if( qx < 0 || qx >= int(width) )
+						continue;
+
+					const unsigned int q= static_cast<unsigned int>( qx + qy * int(width) );
+					if( !buffers.valid[q] )
+						continue;
+
+					const float* const q_color= src + 4u * q;
+
+					float weight= g_kernel[ dx + 2 ] * g_kernel[ dy + 2 ];
+					weight*= GetNormalWeight( normal, buffers.normals[q] );
+
+					if( texel_size > 0.0f )
+					{
+						// Compare world distance with distance in lightmap.
+						const float expected_distance= texel_size * float(step) * std::sqrt( float( dx * dx + dy * dy ) );
+						const float deviation= std::abs( ( buffers.positions[q] - pos ).Length() - expected_distance );
+						weight*= std::exp( -deviation / ( texel_size * float(step) ) );
+					}
+
+					const float q_luminance= GetLuminance( q_color );
+					const float luminance_sigma= strength * 0.5f * ( luminance + q_luminance ) + 1.0e-6f;
+					weight*= std::exp( -std::abs( luminance - q_luminance ) / luminance_sigma );
+
+					sum[0]+= q_color[0] * weight;
+					sum[1]+= q_color[1] * weight;
+					sum[2]+= q_color[2] * weight;
+					weight_sum+= weight;
+				}
+			}
+
+			// Weight of central texel is always positive.
+			const float inv_weight_sum= 1.0f / weight_sum;
+			dst_color[0]= sum[0] * inv_weight_sum;
+			dst_color[1]= sum[1] * inv_weight_sum;
+			dst_color[2]= sum[2] * inv_weight_sum;
+		}
+
+		buffers.colors[0].swap( buffers.colors[1] );
+	}
+
+	for( unsigned int y= 0u; y < height; y++ )
+		std::memcpy(
+			layer_data + 4u * ( rect.coord[0] + ( rect.coord[1] + y ) * layer_size[0] ),
+			buffers.colors[0].data() + 4u * y * width,
+			4u * width * sizeof(float) );
+}
+
+void plbDenoiseLightmapsLayer(
+	float* const layer_data,
+	const unsigned int* const layer_size,
+	const unsigned int layer,
+	const plb_LightmapRects& rects,
+	const m_Vec3* const positions,
+	const m_Vec3* const normals,
+	const unsigned int iterations,
+	const float strength,
+	const unsigned int thread_count )
+{
+	if( iterations == 0u )
+		return;
+
+	std::vector<const plb_LightmapRect*> layer_rects;
+	for( const plb_LightmapRect& rect : rects )
+		if( rect.layer == layer )
+			layer_rects.push_back( &rect );
+
+	std::vector<ScratchBuffers> buffers( thread_count );
+
+	plbParallelFor(
+		layer_rects.size(),
+		thread_count,
+		[&]( const unsigned int begin, const unsigned int end, const unsigned int thread_number )
+		{
+			for( unsigned int r= begin; r < end; r++ )
+				DenoiseRect(
+					layer_data, layer_size,
+					*layer_rects[r],
+					positions, normals,
+					iterations, strength,
+					buffers[ thread_number ] );
+		} );
+}
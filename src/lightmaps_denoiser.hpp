@@ -0,0 +1,19 @@
+#pragma once
+#include <vec.hpp>
+
+#include "lightmaps_dilation.hpp"
+
+// Edge-aware "à-trous" wavelet filter of lightmaps of one atlas layer.
+// Weights of texels depend on distance in atlas, difference of normals, positions and light.
+// Texels with zero alpha or zero normal are not filtered and not used as neighbors.
+// Filter never crosses borders of lightmap rects. Rects are processed in parallel.
+void plbDenoiseLightmapsLayer(
+	float* layer_data, // RGBA, 4 floats per texel
+	const unsigned int* layer_size, // width, height
+	unsigned int layer,
+	const plb_LightmapRects& rects,
+	const m_Vec3* positions, // Position of each texel of layer.
+	const m_Vec3* normals, // Normal of each texel of layer.
+	unsigned int iterations, // Each iteration doubles filter radius.
+	float strength, // Bigger values allow bigger difference of light of neighbor texels.
+	unsigned int thread_count );
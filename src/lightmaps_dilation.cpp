@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cstring>
+
+#include "parallel_for.hpp"
+
+#include "lightmaps_dilation.hpp"
+
+// Texels with alpha not greater, than this value, are empty.
+static const float g_empty_texel_alpha= 1e-5f;
+
+// Dilates lightmap, copied into buffer with border of one empty texel.
+// Loops have no branches, so, compiler can vectorize them.
+static void DilateTexels(
+	const float* const src,
+	float* const dst,
+	const unsigned int width, // With border
+	const unsigned int height ) // With border
+{
+	for( unsigned int y= 1u; y + 1u < height; y++ )
+	{
+		const float* const row= src + 4u * y * width;
+		const float* const row_up= row - 4u * width;
+		const float* const row_down= row + 4u * width;
+		float* const dst_row= dst + 4u * y * width;
+
+		for( unsigned int x= 1u; x + 1u < width; x++ )
+		{
+			const float* const neighbors[4]=
+			{
+				row + 4u * ( x - 1u ),
+				row + 4u * ( x + 1u ),
+				row_up + 4u * x,
+				row_down + 4u * x,
+			};
+
+			float sum[3]= { 0.0f, 0.0f, 0.0f };
+			float count= 0.0f;
+			for( const float* const neighbor : neighbors )
+			{
+				const float weight= neighbor[3] > g_empty_texel_alpha ? 1.0f : 0.0f;
+				sum[0]+= neighbor[0] * weight;
+				sum[1]+= neighbor[1] * weight;
+				sum[2]+= neighbor[2] * weight;
+				count+= weight;
+			}
+
+			const float* const texel= row + 4u * x;
+			float* const dst_texel= dst_row + 4u * x;
+
+			const bool fill= texel[3] <= g_empty_texel_alpha && count > 0.0f;
+			const float inv_count= 1.0f / std::max( count, 1.0f );
+			dst_texel[0]= fill ? sum[0] * inv_count : texel[0];
+			dst_texel[1]= fill ? sum[1] * inv_count : texel[1];
+			dst_texel[2]= fill ? sum[2] * inv_count : texel[2];
+			dst_texel[3]= fill ? 1.0f : texel[3]; // mark as not null
+		}
+	}
+}
+
+void plbDilateLightmapsLayer(
+	float* const layer_data,
+	const unsigned int* const layer_size,
+	const unsigned int layer,
+	const plb_LightmapRects& rects,
+	const unsigned int passes,
+	const unsigned int thread_count )
+{
+	if( passes == 0u )
+		return;
+
+	std::vector<const plb_LightmapRect*> layer_rects;
+	for( const plb_LightmapRect& rect : rects )
+		if( rect.layer == layer )
+			layer_rects.push_back( &rect );
+
+	// Two scratch buffers for each thread.
+	std::vector< std::vector<float> > buffers( thread_count * 2u );
+
+	plbParallelFor(
+		layer_rects.size(),
+		thread_count,
+		[&]( const unsigned int begin, const unsigned int end, const unsigned int thread_number )
+		{
+			std::vector<float>& buffer0= buffers[ thread_number * 2u      ];
+			std::vector<float>& buffer1= buffers[ thread_number * 2u + 1u ];
+
+			for( unsigned int r= begin; r < end; r++ )
+			{
+				const plb_LightmapRect& rect= *layer_rects[r];
+				const unsigned int rect_size[2]=
+				{
+					std::min( rect.size[0], layer_size[0] - std::min( rect.coord[0], layer_size[0] ) ),
+					std::min( rect.size[1], layer_size[1] - std::min( rect.coord[1], layer_size[1] ) ),
+				};
+				if( rect_size[0] == 0u || rect_size[1] == 0u )
+					continue;
+
+				// Skip lightmaps without empty texels.
+				bool has_empty_texels= false;
+				for( unsigned int y= 0u; y < rect_size[1] && !has_empty_texels; y++ )
+				{
+					const float* const src= layer_data + 4u * ( rect.coord[0] + ( rect.coord[1] + y ) * layer_size[0] );
+					for( unsigned int x= 0u; x < rect_size[0]; x++ )
+						if( src[ 4u * x + 3u ] <= g_empty_texel_alpha )
+							has_empty_texels= true;
+				}
+				if( !has_empty_texels )
+					continue;
+
+				// Copy lightmap into buffer with empty border.
+				const unsigned int width= rect_size[0] + 2u;
+				const unsigned int height= rect_size[1] + 2u;
+				buffer0.assign( 4u * width * height, 0.0f );
+				buffer1.assign( 4u * width * height, 0.0f );
+
+				for( unsigned int y= 0u; y < rect_size[1]; y++ )
+					std::memcpy(
+						buffer0.data() + 4u * ( 1u + ( y + 1u ) * width ),
+						layer_data + 4u * ( rect.coord[0] + ( rect.coord[1] + y ) * layer_size[0] ),
+						4u * rect_size[0] * sizeof(float) );
+
+				for( unsigned int pass= 0u; pass < passes; pass++ )
+				{
+					DilateTexels( buffer0.data(), buffer1.data(), width, height );
+					buffer0.swap( buffer1 );
+				}
+
+				for( unsigned int y= 0u; y < rect_size[1]; y++ )
+					std::memcpy(
+						layer_data + 4u * ( rect.coord[0] + ( rect.coord[1] + y ) * layer_size[0] ),
+						buffer0.data() + 4u * ( 1u + ( y + 1u ) * width ),
+						4u * rect_size[0] * sizeof(float) );
+			}
+		} );
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <vector>
+
+// Rectangle of one surface lightmap inside atlas layer.
+struct plb_LightmapRect
+{
+	unsigned int coord[2];
+	unsigned int size[2];
+	unsigned int layer;
+};
+
+typedef std::vector<plb_LightmapRect> plb_LightmapRects;
+
+// Fills empty texels (with zero alpha) inside lightmap rects by average of nonempty 4-neighbor texels.
+// Each pass expands lit area of lightmaps by one texel. Texels outside rects are not changed.
+// Only rects of given layer are processed. Rects must not overlap, they are processed in parallel.
+void plbDilateLightmapsLayer(
+	float* layer_data, // RGBA, 4 floats per texel
+	const unsigned int* layer_size, // width, height
+	unsigned int layer,
+	const plb_LightmapRects& rects,
+	unsigned int passes,
+	unsigned int thread_count );
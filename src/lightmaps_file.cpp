@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "lightmaps_file.hpp"
+
+static uint16_t FloatToHalf( const float f )
+{
+	uint32_t bits;
+	std::memcpy( &bits, &f, sizeof(float) );
+
+	const uint16_t sign= uint16_t( ( bits >> 16u ) & 0x8000u );
+	const int exponent= int( ( bits >> 23u ) & 0xFFu ) - 127 + 15;
+	uint32_t mantissa= bits & 0x007FFFFFu;
+
+	if( ( ( bits >> 23u ) & 0xFFu ) == 0xFFu ) // Inf or NaN
+		return sign | 0x7C00u | ( mantissa != 0u ? 0x0200u : 0u );
+
+	if( exponent >= 31 ) // Too big - make Inf
+		return sign | 0x7C00u;
+
+	if( exponent <= 0 )
+	{
+		if( exponent < -10 ) // Too small - make zero
+			return sign;
+
+		// Denormalized half
+		mantissa|= 0x00800000u;
+		const unsigned int shift= unsigned( 14 - exponent );
+		uint32_t half_mantissa= mantissa >> shift;
+		// Round to nearest
+		if( ( mantissa >> ( shift - 1u ) ) & 1u )
+			half_mantissa++;
+		return sign | uint16_t(half_mantissa);
+	}
+
+	uint16_t result= sign | uint16_t( exponent << 10 ) | uint16_t( mantissa >> 13u );
+	// Round to nearest. Overflow of mantissa correctly increments exponent.
+	if( mantissa & 0x00001000u )
+		result++;
+
+	return result;
+}
+
+// Ward's RGBE format.
+static void FloatToRGBE( const float* const rgb, unsigned char* const out_rgbe )
+{
+	const float max_component= std::max( rgb[0], std::max( rgb[1], rgb[2] ) );
+	if( !( max_component > 1e-32f ) )
+	{
+		out_rgbe[0]= out_rgbe[1]= out_rgbe[2]= out_rgbe[3]= 0;
+		return;
+	}
+
+	int exponent;
+	const float scale= std::frexp( max_component, &exponent ) * 256.0f / max_component;
+
+	for( unsigned int j= 0; j < 3; j++ )
+		out_rgbe[j]= static_cast<unsigned char>( std::max( 0.0f, rgb[j] * scale ) );
+	out_rgbe[3]= static_cast<unsigned char>( std::min( std::max( exponent + 128, 0 ), 255 ) );
+}
+
+unsigned int plbGetLightmapsFileTexelSize( const plb_Config::LightmapsFileEncoding encoding )
+{
+	switch( encoding )
+	{
+	case plb_Config::LightmapsFileEncoding::Float32: return 4u * sizeof(float);
+	case plb_Config::LightmapsFileEncoding::Float16: return 4u * sizeof(uint16_t);
+	case plb_Config::LightmapsFileEncoding::RGBE: return 4u;
+	};
+
+	return 0u;
+}
+
+void plbEncodeLightmapTexel(
+	const plb_Config::LightmapsFileEncoding encoding,
+	const float* const texel_rgba,
+	unsigned char* const out_data )
+{
+	switch( encoding )
+	{
+	case plb_Config::LightmapsFileEncoding::Float32:
+		std::memcpy( out_data, texel_rgba, 4u * sizeof(float) );
+		break;
+
+	case plb_Config::LightmapsFileEncoding::Float16:
+		for( unsigned int j= 0; j < 4; j++ )
+		{
+			const uint16_t h= FloatToHalf( texel_rgba[j] );
+			std::memcpy( out_data + j * sizeof(uint16_t), &h, sizeof(uint16_t) );
+		}
+		break;
+
+	case plb_Config::LightmapsFileEncoding::RGBE:
+		FloatToRGBE( texel_rgba, out_data );
+		break;
+	};
+}
+
+bool plbWriteLightmapsFile(
+	const char* const file_name,
+	const plb_Config::LightmapsFileEncoding encoding,
+	const plb_LevelData& level_data,
+	const unsigned int secondary_lightmap_scaler,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas )
+{
+	FILE* const f= std::fopen( file_name, "wb" );
+	if( f == nullptr )
+	{
+		std::cout << "Can not open file: " << file_name << std::endl;
+		return false;
+	}
+
+	bool ok= true;
+	const auto write=
+	[&]( const void* data, size_t size )
+	{
+		if( ok && std::fwrite( data, 1, size, f ) != size )
+			ok= false;
+	};
+
+	plb_LightmapsFileHeader header;
+	std::memset( &header, 0, sizeof(header) );
+	std::strncpy( header.id, PLB_LIGHTMAPS_FILE_ID, sizeof(header.id) );
+	header.version= PLB_LIGHTMAPS_FILE_VERSION;
+	header.encoding= uint32_t(encoding);
+	for( unsigned int i= 0; i < 3; i++ )
+	{
+		header.primary_atlas_size[i]= primary_atlas.size[i];
+		header.secondary_atlas_size[i]= secondary_atlas.size[i];
+	}
+	header.secondary_lightmap_scaler= secondary_lightmap_scaler;
+	header.polygon_count= level_data.polygons.size();
+	header.curve_count= level_data.curved_surfaces.size();
+	write( &header, sizeof(header) );
+
+	// Surfaces table
+	std::vector<plb_SurfaceLightmapData> surfaces_lightmaps;
+	surfaces_lightmaps.reserve( level_data.polygons.size() + level_data.curved_surfaces.size() );
+	for( const plb_Polygon& poly : level_data.polygons )
+		surfaces_lightmaps.push_back( poly.lightmap_data );
+	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
+		surfaces_lightmaps.push_back( curve.lightmap_data );
+	write( surfaces_lightmaps.data(), surfaces_lightmaps.size() * sizeof(plb_SurfaceLightmapData) );
+
+	// Layers
+	const unsigned int texel_size= plbGetLightmapsFileTexelSize( encoding );
+	std::vector<unsigned char> layer_data;
+
+	const plb_LightmapsAtlasView* const atlases[2]= { &primary_atlas, &secondary_atlas };
+	for( unsigned int a= 0; a < 2; a++ )
+	{
+		const plb_LightmapsAtlasView& atlas= *atlases[a];
+		const unsigned int layer_texels= atlas.size[0] * atlas.size[1];
+
+		layer_data.resize( layer_texels * texel_size );
+
+		for( unsigned int layer= 0; layer < atlas.size[2]; layer++ )
+		{
+			const float* const src= atlas.data + 4u * layer_texels * layer;
+			for( unsigned int t= 0; t < layer_texels; t++ )
+				plbEncodeLightmapTexel( encoding, src + 4u * t, layer_data.data() + t * texel_size );
+
+			plb_LightmapsFileLayerHeader layer_header;
+			layer_header.atlas= a;
+			layer_header.layer= layer;
+			layer_header.size[0]= atlas.size[0];
+			layer_header.size[1]= atlas.size[1];
+			layer_header.data_size= layer_data.size();
+
+			write( &layer_header, sizeof(layer_header) );
+			write( layer_data.data(), layer_data.size() );
+		}
+	}
+
+	if( std::fclose(f) != 0 )
+		ok= false;
+
+	if( !ok )
+		std::cout << "Error, writing file: " << file_name << std::endl;
+
+	return ok;
+}
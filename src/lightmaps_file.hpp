@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+
+#include "formats.hpp"
+
+// File with baked lightmaps atlases.
+//
+// Layout:
+//   plb_LightmapsFileHeader
+//   plb_SurfaceLightmapData[ polygon_count ] - for level polygons, in order of plb_LevelData::polygons
+//   plb_SurfaceLightmapData[ curve_count ] - for curved surfaces, in order of plb_LevelData::curved_surfaces
+//   Sections for each layer of primary atlas, then sections for each layer of secondary atlas.
+//   Each section is plb_LightmapsFileLayerHeader, followed by data_size bytes of texels.
+//   Texels are stored row by row, bottom row first (like in OpenGL textures).
+
+#define PLB_LIGHTMAPS_FILE_ID "PLBLMAP"
+#define PLB_LIGHTMAPS_FILE_VERSION 1u
+
+struct plb_LightmapsFileHeader
+{
+	char id[8];
+	uint32_t version;
+	uint32_t encoding; // plb_Config::LightmapsFileEncoding
+
+	uint32_t primary_atlas_size[3]; // width, height, layers
+	uint32_t secondary_atlas_size[3];
+	uint32_t secondary_lightmap_scaler;
+
+	uint32_t polygon_count;
+	uint32_t curve_count;
+};
+
+struct plb_LightmapsFileLayerHeader
+{
+	uint32_t atlas; // 0 - primary, 1 - secondary
+	uint32_t layer;
+	uint32_t size[2];
+	uint32_t data_size; // in bytes
+};
+
+struct plb_LightmapsAtlasView
+{
+	const float* data; // RGBA
+	unsigned int size[3];
+};
+
+// Returns texel size in bytes for encoding.
+unsigned int plbGetLightmapsFileTexelSize( plb_Config::LightmapsFileEncoding encoding );
+
+// Encodes RGBA float texel. Alpha is lost for RGBE encoding.
+void plbEncodeLightmapTexel(
+	plb_Config::LightmapsFileEncoding encoding,
+	const float* texel_rgba,
+	unsigned char* out_data );
+
+// Returns true on success.
+bool plbWriteLightmapsFile(
+	const char* file_name,
+	plb_Config::LightmapsFileEncoding encoding,
+	const plb_LevelData& level_data,
+	unsigned int secondary_lightmap_scaler,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas );
@@ -0,0 +1,812 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "curves.hpp"
+#include "math_utils.hpp"
+
+#include "lightmaps_layout.hpp"
+
+namespace
+{
+
+// Light samples must be outside near plane of cubemaps in any direction.
+const float g_light_sample_min_clip_distance= plb_light_sample_cubemap_znear * std::sqrt(3.0f);
+
+struct AtlasItem
+{
+	enum class Kind
+	{
+		Stub,
+		Polygon,
+		Curve,
+		ModelsVertices,
+	};
+
+	Kind kind;
+	// Index of polygon or curve, or index of first vertex in list of models vertices.
+	unsigned int index;
+	unsigned int vertex_count;
+};
+
+// Swaps lightmap axes of polygon.
+void TransposePolygonLightmap( plb_Polygon& polygon )
+{
+	float tmp[3];
+	std::memcpy( tmp, polygon.lightmap_basis[0], sizeof(float) * 3 );
+	std::memcpy( polygon.lightmap_basis[0], polygon.lightmap_basis[1], sizeof(float) * 3 );
+	std::memcpy( polygon.lightmap_basis[1], tmp, sizeof(float) * 3 );
+
+	std::swap( polygon.lightmap_data.size[0], polygon.lightmap_data.size[1] );
+}
+
+// Swaps lightmap axes of curve. Lightmap coordinates of vertices must be relative to lightmap corner.
+void TransposeCurveLightmap( plb_CurvedSurface& curve, plb_Vertices& curves_vertices )
+{
+	std::swap( curve.lightmap_data.size[0], curve.lightmap_data.size[1] );
+
+	for( unsigned int v= curve.first_vertex_number;
+		v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
+	{
+		std::swap( curves_vertices[v].lightmap_coord[0], curves_vertices[v].lightmap_coord[1] );
+	}
+}
+
+float GetTexelClipDistance( const plb_Config& config, const plb_Polygon& polygon )
+{
+	return
+		plb_Constants::sqrt_2 *
+		float( config.secondary_lightmap_scaler ) *
+		std::sqrt(
+			std::max(
+				m_Vec3(polygon.lightmap_basis[0]).SquareLength(),
+				m_Vec3(polygon.lightmap_basis[1]).SquareLength() ) );
+}
+
+// Returns indeces of vertices of models, which have texels in atlas. Each such vertex has own texel.
+void GetAtlasModelsVertices( const plb_LevelData& level_data, std::vector<unsigned int>& out_vertices )
+{
+	for( const plb_LevelModel& model : level_data.models )
+	{
+		if( ( model.flags & plb_SurfaceFlags::NoShadow ) != 0 )
+			continue;
+
+		for( unsigned int v= 0; v < model.vertex_count; v++ )
+			out_vertices.push_back( model.first_vertex_number + v );
+	}
+}
+
+// Items in order of rects from plbGetLightmapsAtlasRects.
+void GetAtlasItems(
+	const plb_LevelData& level_data,
+	const unsigned int* const layer_size_in_texels,
+	const unsigned int models_vertex_count,
+	std::vector<AtlasItem>& out_items )
+{
+	AtlasItem item;
+	item.vertex_count= 0u;
+
+	item.kind= AtlasItem::Kind::Stub;
+	item.index= 0u;
+	out_items.push_back( item );
+
+	item.kind= AtlasItem::Kind::Polygon;
+	for( const plb_Polygon& poly : level_data.polygons )
+		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
+		{
+			item.index= static_cast<unsigned int>( &poly - level_data.polygons.data() );
+			out_items.push_back( item );
+		}
+
+	item.kind= AtlasItem::Kind::Curve;
+	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
+		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
+		{
+			item.index= static_cast<unsigned int>( &curve - level_data.curved_surfaces.data() );
+			out_items.push_back( item );
+		}
+
+	// Vertices are placed in rows.
+	item.kind= AtlasItem::Kind::ModelsVertices;
+	const unsigned int max_row_vertices= layer_size_in_texels[0] - 1u;
+	for( unsigned int first_vertex= 0u; first_vertex < models_vertex_count; first_vertex+= max_row_vertices )
+	{
+		item.index= first_vertex;
+		item.vertex_count= std::min( max_row_vertices, models_vertex_count - first_vertex );
+		out_items.push_back( item );
+	}
+}
+
+void PrepareLightTexels(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const std::vector<plb_Tracer::LineSegments>& polygons_segments,
+	const unsigned int scaler,
+	const float curve_min_normal_square_length,
+	const plb_LightmapSurfaceFilter& surface_filter,
+	const plb_LightTexelFilter& texel_filter,
+	plb_CpuLightmapsBuilder::LightTexels& out_texels )
+{
+	const unsigned int atlas_size[2]=
+	{
+		config.lightmaps_atlas_size[0] / scaler,
+		config.lightmaps_atlas_size[1] / scaler,
+	};
+
+	const auto add_texel=
+	[&]( const m_Vec3& pos, const m_Vec3& normal, unsigned int x, unsigned int y, unsigned int layer, bool model_texel )
+	{
+		if( x >= atlas_size[0] || y >= atlas_size[1] )
+			return;
+		if( texel_filter != nullptr && !texel_filter( pos, normal, model_texel ) )
+			return;
+
+		out_texels.emplace_back();
+		plb_CpuLightmapsBuilder::LightTexel& texel= out_texels.back();
+		texel.pos= pos;
+		texel.normal= normal;
+		texel.texel_index= x + ( y + layer * atlas_size[1] ) * atlas_size[0];
+	};
+
+	for( const plb_Polygon& poly : level_data.polygons )
+	{
+		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+			continue;
+
+		const unsigned int polygon_index= static_cast<unsigned int>( &poly - level_data.polygons.data() );
+		if( surface_filter != nullptr && !surface_filter( polygon_index ) )
+			continue;
+
+		const plb_Tracer::LineSegments& segments= polygons_segments[ polygon_index ];
+
+		m_Vec3 normal(poly.normal);
+		normal.Normalize();
+
+		const unsigned int sx= ( poly.lightmap_data.size[0] + scaler - 1u ) / scaler;
+		const unsigned int sy= ( poly.lightmap_data.size[1] + scaler - 1u ) / scaler;
+
+		const float basis_scale= float(scaler);
+
+		for( unsigned int y= 0; y < sy; y++ )
+		for( unsigned int x= 0; x < sx; x++ )
+		{
+			const m_Vec3 pos=
+				( float(x) + 0.5f ) * basis_scale * m_Vec3(poly.lightmap_basis[0]) +
+				( float(y) + 0.5f ) * basis_scale * m_Vec3(poly.lightmap_basis[1]) +
+				m_Vec3( poly.lightmap_pos );
+
+			add_texel(
+				plbCorrectLightSample( config, pos, poly, segments ),
+				normal,
+				x + poly.lightmap_data.coord[0] / scaler,
+				y + poly.lightmap_data.coord[1] / scaler,
+				poly.lightmap_data.atlas_id,
+				false );
+		}
+	} // for polygons
+
+	std::vector<PositionAndNormal> curve_coords;
+	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
+	{
+		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+			continue;
+
+		if( surface_filter != nullptr &&
+			!surface_filter( static_cast<unsigned int>( level_data.polygons.size() + ( &curve - level_data.curved_surfaces.data() ) ) ) )
+			continue;
+
+		const unsigned int lightmap_size[2]=
+		{
+			( curve.lightmap_data.size[0] + scaler - 1u ) / scaler,
+			( curve.lightmap_data.size[1] + scaler - 1u ) / scaler,
+		};
+
+		curve_coords.resize( lightmap_size[0] * lightmap_size[1] );
+		std::memset( curve_coords.data(), 0, curve_coords.size() * sizeof(PositionAndNormal) );
+
+		const m_Vec2 lightmap_coord_scaler{
+			float(atlas_size[0]),
+			float(atlas_size[1]) };
+		const m_Vec2 lightmap_coord_shift(
+			-float(curve.lightmap_data.coord[0] / scaler),
+			-float(curve.lightmap_data.coord[1] / scaler) );
+
+		CalculateCurveCoordinatesForLightTexels(
+			curve,
+			lightmap_coord_scaler, lightmap_coord_shift,
+			lightmap_size,
+			level_data.curved_surfaces_vertices,
+			curve_coords.data() );
+
+		for( unsigned int y= 0; y < lightmap_size[1]; y++ )
+		for( unsigned int x= 0; x < lightmap_size[0]; x++ )
+		{
+			const PositionAndNormal& texel_pos= curve_coords[ x + y * lightmap_size[0] ];
+
+			// Degenerate texel
+			if( texel_pos.normal.SquareLength() <= curve_min_normal_square_length )
+				continue;
+
+			m_Vec3 normal= texel_pos.normal;
+			normal.Normalize();
+
+			add_texel(
+				texel_pos.pos,
+				normal,
+				x + curve.lightmap_data.coord[0] / scaler,
+				y + curve.lightmap_data.coord[1] / scaler,
+				curve.lightmap_data.atlas_id,
+				false );
+		}
+	} // for curves
+
+	// Correct lightmap coordinates for secondary lightmaps,
+	// because size % scaler != 0, sometimes.
+	const float tex_scale_x=
+		float(config.lightmaps_atlas_size[0]) /
+		float( atlas_size[0] * scaler );
+	const float tex_scale_y=
+		float(config.lightmaps_atlas_size[1]) /
+		float( atlas_size[1] * scaler );
+
+	for( const plb_LevelModel& model : level_data.models )
+	{
+		if( ( model.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+			continue;
+
+		for( unsigned int v= 0; v < model.vertex_count; v++ )
+		{
+			const plb_Vertex& vertex= level_data.models_vertices[ model.first_vertex_number + v ];
+			const plb_Normal& src_normal= level_data.models_normals[ model.first_vertex_number + v ];
+
+			m_Vec3 normal(
+				float(src_normal.xyz[0]),
+				float(src_normal.xyz[1]),
+				float(src_normal.xyz[2]) );
+			normal.Normalize();
+
+			add_texel(
+				m_Vec3( vertex.pos ),
+				normal,
+				static_cast<unsigned int>( vertex.lightmap_coord[0] * tex_scale_x * float(atlas_size[0]) ),
+				static_cast<unsigned int>( vertex.lightmap_coord[1] * tex_scale_y * float(atlas_size[1]) ),
+				vertex.tex_maps[2],
+				true );
+		} // for model vertices
+	} // for models
+}
+
+} // namespace
+
+void plbCalculateLightmapsSizes( plb_LevelData& level_data, const plb_Config& config )
+{
+	if( config.lightmap_scale_to_original != 1 )
+	{
+		const float inv_scale= 1.0f / float(config.lightmap_scale_to_original);
+		for( plb_Polygon& polygon : level_data.polygons )
+		{
+			polygon.lightmap_basis[0][0]*= inv_scale;
+			polygon.lightmap_basis[0][1]*= inv_scale;
+			polygon.lightmap_basis[0][2]*= inv_scale;
+			polygon.lightmap_basis[1][0]*= inv_scale;
+			polygon.lightmap_basis[1][1]*= inv_scale;
+			polygon.lightmap_basis[1][2]*= inv_scale;
+		}
+
+		for( plb_CurvedSurface & curve : level_data.curved_surfaces )
+		{
+			curve.lightmap_data.size[0]*= config.lightmap_scale_to_original;
+			curve.lightmap_data.size[1]*= config.lightmap_scale_to_original;
+		}
+	}
+
+	const float secondary_lightmap_scaler( config.secondary_lightmap_scaler );
+	const float inv_secondary_lightmap_scaler= 1.0f / secondary_lightmap_scaler;
+	const float half_secondary_lightmap_scaler= 0.5f * secondary_lightmap_scaler;
+
+	plb_Vertex* v_p= level_data.vertices.data();
+	for( plb_Polygon& polygon : level_data.polygons )
+	{
+		float max_uv[2]= { 1.0f, 1.0f };
+
+		m_Mat3 inverse_lightmap_basis;
+		plbGetInvLightmapBasisMatrix(
+			m_Vec3( polygon.lightmap_basis[0] ),
+			m_Vec3( polygon.lightmap_basis[1] ),
+			inverse_lightmap_basis );
+
+		for( unsigned int v= polygon.first_vertex_number; v< polygon.first_vertex_number + polygon.vertex_count; v++ )
+		{
+			const m_Vec3 rel_pos= m_Vec3( v_p[v].pos ) - m_Vec3( polygon.lightmap_pos );
+			const m_Vec2 uv= ( rel_pos * inverse_lightmap_basis ).xy();
+			if( uv.x > max_uv[0] ) max_uv[0]= uv.x;
+			if( uv.y > max_uv[1] ) max_uv[1]= uv.y;
+		}
+
+		for( unsigned int j= 0; j < 2; j++ )
+		{
+			unsigned int size= ( (unsigned int) std::ceil( max_uv[j] * inv_secondary_lightmap_scaler + 0.5f ) ) + 1u;
+			size= std::max( size, 2u );
+			polygon.lightmap_data.size[j]=
+				size * config.secondary_lightmap_scaler;
+		}
+
+		const m_Vec3 basis_vec_u( polygon.lightmap_basis[0] );
+		const m_Vec3 basis_vec_v( polygon.lightmap_basis[1] );
+		const m_Vec3 moved_basis=
+			m_Vec3( polygon.lightmap_pos ) -
+			( basis_vec_u + basis_vec_v ) * half_secondary_lightmap_scaler;
+
+		for( unsigned int j= 0; j < 3; j++ )
+			polygon.lightmap_pos[j]= moved_basis.ToArr()[j];
+
+		// pereveracivajem bazis karty osvescenija, tak nado
+		if( polygon.lightmap_data.size[0] < polygon.lightmap_data.size[1] )
+			TransposePolygonLightmap( polygon );
+	}
+
+	if( level_data.curved_surfaces_vertices.size() > 0 )
+	{
+		v_p= level_data.curved_surfaces_vertices.data();
+		for( plb_CurvedSurface& curve : level_data.curved_surfaces )
+		{
+			for( unsigned int j= 0; j < 2; j++ )
+			{
+				curve.lightmap_data.size[j]=
+					( curve.lightmap_data.size[j] + config.secondary_lightmap_scaler - 1 ) /
+					config.secondary_lightmap_scaler * config.secondary_lightmap_scaler;
+				if( curve.lightmap_data.size[j] < 2u * config.secondary_lightmap_scaler )
+					curve.lightmap_data.size[j]= 2u * config.secondary_lightmap_scaler;
+			}
+
+			// Denormalize and shift.
+			const float smooth_shift= 0.5f * float( config.secondary_lightmap_scaler );
+			const float denorm_scale[2]=
+			{
+				float( curve.lightmap_data.size[0] - config.secondary_lightmap_scaler ),
+				float( curve.lightmap_data.size[1] - config.secondary_lightmap_scaler ),
+			};
+			for( unsigned int v= curve.first_vertex_number;
+				v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
+			{
+				for( unsigned int j= 0; j < 2; j++ )
+					v_p[v].lightmap_coord[j]= v_p[v].lightmap_coord[j] * denorm_scale[j] + smooth_shift;
+			}
+
+			// Swap lightmap sides, if needed.
+			if( curve.lightmap_data.size[0] < curve.lightmap_data.size[1] )
+				TransposeCurveLightmap( curve, level_data.curved_surfaces_vertices );
+		}
+	}
+}
+
+void plbGetLightmapsAtlasLayerSize( const plb_Config& config, unsigned int* const out_size )
+{
+	// Lightmaps are placed in units of secondary lightmap texels.
+	// Each layer has border of one texel.
+	for( unsigned int j= 0; j < 2; j++ )
+		out_size[j]= config.lightmaps_atlas_size[j] / config.secondary_lightmap_scaler - 2u;
+}
+
+void plbGetLightmapsAtlasRects( const plb_LevelData& level_data, const plb_Config& config, plb_AtlasRects& out_rects )
+{
+	const unsigned int scaler= config.secondary_lightmap_scaler;
+
+	unsigned int layer_size_in_texels[2];
+	plbGetLightmapsAtlasLayerSize( config, layer_size_in_texels );
+
+	std::vector<unsigned int> models_vertices;
+	GetAtlasModelsVertices( level_data, models_vertices );
+
+	std::vector<AtlasItem> atlas_items;
+	GetAtlasItems( level_data, layer_size_in_texels, models_vertices.size(), atlas_items );
+
+	const auto add_lightmap_rect=
+	[&]( const unsigned int width, const unsigned int height )
+	{
+		// Each lightmap is followed by one free texel.
+		out_rects.emplace_back();
+		out_rects.back().size[0]= ( width  + scaler - 1u ) / scaler + 1u;
+		out_rects.back().size[1]= ( height + scaler - 1u ) / scaler + 1u;
+	};
+
+	for( const AtlasItem& item : atlas_items )
+	{
+		switch( item.kind )
+		{
+		case AtlasItem::Kind::Stub:
+			add_lightmap_rect( 2u * scaler, 2u * scaler );
+			break;
+
+		case AtlasItem::Kind::Polygon:
+			{
+				const plb_SurfaceLightmapData& lightmap_data= level_data.polygons[ item.index ].lightmap_data;
+				add_lightmap_rect( lightmap_data.size[0], lightmap_data.size[1] );
+			}
+			break;
+
+		case AtlasItem::Kind::Curve:
+			{
+				const plb_SurfaceLightmapData& lightmap_data= level_data.curved_surfaces[ item.index ].lightmap_data;
+				add_lightmap_rect( lightmap_data.size[0], lightmap_data.size[1] );
+			}
+			break;
+
+		case AtlasItem::Kind::ModelsVertices:
+			out_rects.emplace_back();
+			out_rects.back().size[0]= item.vertex_count + 1u;
+			out_rects.back().size[1]= 1u + 1u;
+			break;
+		}
+	}
+}
+
+unsigned int plbPlaceLightmaps(
+	plb_LevelData& level_data,
+	const plb_Config& config,
+	plb_AtlasRects& rects,
+	plb_SurfaceLightmapData& out_stub_lightmap )
+{
+	const unsigned int scaler= config.secondary_lightmap_scaler;
+
+	unsigned int layer_size_in_texels[2];
+	plbGetLightmapsAtlasLayerSize( config, layer_size_in_texels );
+
+	std::vector<unsigned int> models_vertices;
+	GetAtlasModelsVertices( level_data, models_vertices );
+
+	std::vector<AtlasItem> atlas_items;
+	GetAtlasItems( level_data, layer_size_in_texels, models_vertices.size(), atlas_items );
+
+	out_stub_lightmap.size[0]= out_stub_lightmap.size[1]= scaler * 2u;
+
+	const unsigned int layer_count=
+		plbPackAtlasRects(
+			config.lightmaps_atlas_packer,
+			layer_size_in_texels,
+			config.lightmaps_atlas_packer != plb_Config::LightmapsAtlasPacker::Shelf,
+			rects );
+
+	for( unsigned int i= 0u; i < atlas_items.size(); i++ )
+	{
+		const AtlasItem& item= atlas_items[i];
+		const plb_AtlasRect& rect= rects[i];
+
+		const unsigned int coord[2]= { ( rect.pos[0] + 1u ) * scaler, ( rect.pos[1] + 1u ) * scaler };
+
+		plb_SurfaceLightmapData* lightmap= nullptr;
+		switch( item.kind )
+		{
+		case AtlasItem::Kind::Stub:
+			lightmap= &out_stub_lightmap;
+			if( rect.rotated )
+				std::swap( lightmap->size[0], lightmap->size[1] );
+			break;
+
+		case AtlasItem::Kind::Polygon:
+			lightmap= &level_data.polygons[ item.index ].lightmap_data;
+			if( rect.rotated )
+				TransposePolygonLightmap( level_data.polygons[ item.index ] );
+			break;
+
+		case AtlasItem::Kind::Curve:
+			lightmap= &level_data.curved_surfaces[ item.index ].lightmap_data;
+			if( rect.rotated )
+				TransposeCurveLightmap( level_data.curved_surfaces[ item.index ], level_data.curved_surfaces_vertices );
+			break;
+
+		case AtlasItem::Kind::ModelsVertices:
+			for( unsigned int v= 0u; v < item.vertex_count; v++ )
+			{
+				plb_Vertex& vertex= level_data.models_vertices[ models_vertices[ item.index + v ] ];
+				const unsigned int vertex_coord[2]=
+				{
+					coord[0] + ( rect.rotated ? 0u : v * scaler ),
+					coord[1] + ( rect.rotated ? v * scaler : 0u ),
+				};
+				vertex.lightmap_coord[0]= ( float( vertex_coord[0] ) + 0.5f ) / float( config.lightmaps_atlas_size[0] );
+				vertex.lightmap_coord[1]= ( float( vertex_coord[1] ) + 0.5f ) / float( config.lightmaps_atlas_size[1] );
+				vertex.tex_maps[2]= rect.layer;
+			}
+			break;
+		}
+
+		if( lightmap != nullptr )
+		{
+			lightmap->coord[0]= coord[0];
+			lightmap->coord[1]= coord[1];
+			lightmap->atlas_id= rect.layer;
+		}
+	}
+
+	// Rects include free texels after lightmaps, so, count only texels of lightmaps.
+	for( plb_AtlasRect& rect : rects )
+	{
+		rect.size[0]--;
+		rect.size[1]--;
+	}
+	const std::vector<float> layers_occupancy= plbGetAtlasLayersOccupancy( layer_size_in_texels, layer_count, rects );
+
+	std::cout << "Lightmaps atlas layers: " << layer_count << ". Occupancy:";
+	for( const float occupancy : layers_occupancy )
+		std::cout << " " << static_cast<unsigned int>( occupancy * 100.0f + 0.5f ) << "%";
+	std::cout << std::endl;
+
+	/*
+	calculate lightmap coordinates of surfaces vertices
+	*/
+	const float inv_lightmap_size[2]=
+	{
+		1.0f / float(config.lightmaps_atlas_size[0]),
+		1.0f / float(config.lightmaps_atlas_size[1]),
+	};
+
+	plb_Vertex* v_p= level_data.vertices.data();
+	for( plb_Polygon& poly : level_data.polygons )
+	{
+		m_Mat3 inverse_lightmap_basis;
+		plbGetInvLightmapBasisMatrix(
+			m_Vec3( poly.lightmap_basis[0] ),
+			m_Vec3( poly.lightmap_basis[1] ),
+			inverse_lightmap_basis );
+
+		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
+		{
+			for( unsigned int v= poly.first_vertex_number; v< poly.first_vertex_number + poly.vertex_count; v++ )
+			{
+				const m_Vec3 rel_pos= m_Vec3( v_p[v].pos ) - m_Vec3( poly.lightmap_pos );
+				const m_Vec2 uv= ( rel_pos * inverse_lightmap_basis ).xy();
+
+				for( unsigned int j= 0; j < 2; j++ )
+				{
+					v_p[v].lightmap_coord[j]+= uv.ToArr()[j] + float(poly.lightmap_data.coord[j]);
+					v_p[v].lightmap_coord[j]*= inv_lightmap_size[j];
+				}
+
+				v_p[v].tex_maps[2]= poly.lightmap_data.atlas_id;
+			}
+		} // if has lightmap
+		else
+		{
+			const float lightmap_coord_scale[2]=
+			{
+				float( out_stub_lightmap.size[0] ) / float( poly.lightmap_data.size[0] ),
+				float( out_stub_lightmap.size[1] ) / float( poly.lightmap_data.size[1] ),
+			};
+
+			for( unsigned int v= poly.first_vertex_number; v< poly.first_vertex_number + poly.vertex_count; v++ )
+			{
+				const m_Vec3 rel_pos= m_Vec3( v_p[v].pos ) - m_Vec3( poly.lightmap_pos );
+				const m_Vec2 uv= ( rel_pos * inverse_lightmap_basis ).xy();
+
+				for( unsigned int j= 0; j < 2; j++ )
+				{
+					v_p[v].lightmap_coord[j]= uv.ToArr()[j] * lightmap_coord_scale[j] + float(out_stub_lightmap.coord[j]);
+					v_p[v].lightmap_coord[j]*= inv_lightmap_size[j];
+				}
+
+				v_p[v].tex_maps[2]= out_stub_lightmap.atlas_id;
+			}
+		} // has no lightmap
+	}// for polygons
+
+	if( level_data.curved_surfaces_vertices.size() > 0 )
+	{
+		v_p= level_data.curved_surfaces_vertices.data();
+		for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
+		{
+			const plb_SurfaceLightmapData& lightmap_data=
+				( curve.flags & plb_SurfaceFlags::NoLightmap ) == 0
+				? curve.lightmap_data : out_stub_lightmap;
+
+			for( unsigned int v= curve.first_vertex_number;
+				v< curve.first_vertex_number + curve.grid_size[0] * curve.grid_size[1]; v++ )
+			{
+				for( unsigned int j= 0; j < 2; j++ )
+				{
+					v_p[v].lightmap_coord[j]=
+						( v_p[v].lightmap_coord[j] + float(lightmap_data.coord[j]) ) * inv_lightmap_size[j];
+				}
+
+				v_p[v].tex_maps[2]= lightmap_data.atlas_id;
+			}
+		}// for curves
+	}
+
+	return layer_count;
+}
+
+void plbGetLightmapsRects( const plb_LevelData& level_data, const unsigned int scaler, plb_LightmapRects& out_rects )
+{
+	const auto add_rect=
+	[&]( const plb_SurfaceLightmapData& lightmap_data )
+	{
+		out_rects.emplace_back();
+		out_rects.back().coord[0]= lightmap_data.coord[0] / scaler;
+		out_rects.back().coord[1]= lightmap_data.coord[1] / scaler;
+		out_rects.back().size[0]= ( lightmap_data.size[0] + scaler - 1u ) / scaler;
+		out_rects.back().size[1]= ( lightmap_data.size[1] + scaler - 1u ) / scaler;
+		out_rects.back().layer= lightmap_data.atlas_id;
+	};
+
+	for( const plb_Polygon& poly : level_data.polygons )
+		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
+			add_rect( poly.lightmap_data );
+
+	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
+		if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) == 0 )
+			add_rect( curve.lightmap_data );
+}
+
+m_Vec3 plbGetNearestSegmentPoint( const m_Vec3& pos, const plb_Tracer::LineSegment& segment )
+{
+	const m_Vec3 projection_to_segment=
+		plbProjectPointToPlane( pos, segment.v[0], segment.normal );
+
+	const m_Vec3 dir_to_segment_vertices[2]=
+	{
+		segment.v[0] - projection_to_segment,
+		segment.v[1] - projection_to_segment,
+	};
+
+	if( dir_to_segment_vertices[0] * dir_to_segment_vertices[1] <= 0.0f )
+	{
+		// Projection is on segment
+		return projection_to_segment;
+	}
+
+	return
+		dir_to_segment_vertices[0].SquareLength() < dir_to_segment_vertices[1].SquareLength()
+			? segment.v[0]
+			: segment.v[1];
+}
+
+void plbGetPolygonNeighborsSegments(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const plb_Tracer& tracer,
+	const plb_Polygon& polygon,
+	plb_Tracer::SurfacesList& tmp_surfaces_container,
+	plb_Tracer::LineSegments& out_segments )
+{
+	out_segments.clear();
+	tmp_surfaces_container.clear();
+
+	const float c_up_eps= 1.0f / 16.0f;
+	//const float c_segment_cut_eps= 1.0f / 64.0f;
+	const float c_segment_shift_eps= 1.0f / 64.0f;
+
+	const float texel_clip_distance= GetTexelClipDistance( config, polygon );
+
+	const m_Vec3 polygon_normal( polygon.normal );
+	const m_Vec3 plane_point=
+		m_Vec3(level_data.vertices[ polygon.first_vertex_number ].pos ) +
+		polygon_normal * c_up_eps;
+
+	tracer.GetPolygonNeighbors(
+		polygon,
+		level_data.vertices,
+		texel_clip_distance,
+		tmp_surfaces_container );
+
+	tracer.GetPlaneIntersections(
+		tmp_surfaces_container,
+		polygon_normal,
+		plane_point,
+		out_segments );
+
+	// Cut c_segment_shift_eps from segments ends and shift segment forward.
+	for( plb_Tracer::LineSegment& segment : out_segments )
+	{
+		/*const m_Vec3 vec= segment.v[0] - segment.v[1];
+		const float vec_len= vec.Length();
+		const float len_corrected= vec_len - 2.0f * c_segment_cut_eps;
+		const m_Vec3 vec_corrected= vec * ( len_corrected / vec_len );
+
+		const m_Vec3 v0_before= segment.v[0];
+		segment.v[0]= segment.v[1] + vec_corrected;
+		segment.v[1]= v0_before    - vec_corrected;*/
+
+		const m_Vec3 shift_vec= segment.normal * c_segment_shift_eps;
+		segment.v[0]+= shift_vec;
+		segment.v[1]+= shift_vec;
+	}
+}
+
+void plbGetPolygonsNeighborsSegments(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const plb_Tracer& tracer,
+	std::vector<plb_Tracer::LineSegments>& out_polygons_segments )
+{
+	out_polygons_segments.clear();
+	out_polygons_segments.resize( level_data.polygons.size() );
+
+	plb_Tracer::SurfacesList surfaces_list;
+	for( const plb_Polygon& poly : level_data.polygons )
+	{
+		if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+			continue;
+
+		plbGetPolygonNeighborsSegments(
+			level_data, config, tracer,
+			poly,
+			surfaces_list,
+			out_polygons_segments[ &poly - level_data.polygons.data() ] );
+	}
+}
+
+m_Vec3 plbCorrectLightSample(
+	const plb_Config& config,
+	const m_Vec3& pos,
+	const plb_Polygon& poly,
+	const plb_Tracer::LineSegments& neighbors_segments )
+{
+	const float texel_clip_distance= GetTexelClipDistance( config, poly );
+
+	float nearest_segment_square_distance= plb_Constants::max_float;
+	const plb_Tracer::LineSegment* nearest_segment= nullptr;
+
+	for( const plb_Tracer::LineSegment& segment : neighbors_segments )
+	{
+		const float square_distance= ( plbGetNearestSegmentPoint( pos, segment ) - pos ).SquareLength();
+		if( square_distance < nearest_segment_square_distance )
+		{
+			nearest_segment_square_distance= square_distance;
+			nearest_segment= &segment;
+		}
+	} // for segments
+
+	if( nearest_segment == nullptr )
+		return pos; // No near segment
+	if( nearest_segment_square_distance > texel_clip_distance )
+		return pos; // Too far from any segment
+
+	const m_Vec3 projection=
+		plbProjectPointToPlane( pos, nearest_segment->v[0], nearest_segment->normal );
+
+	const float signed_distance_to_projection= ( pos - projection ) * nearest_segment->normal;
+
+	if( signed_distance_to_projection >= 0.0f )
+	{
+		// front
+		if( signed_distance_to_projection < g_light_sample_min_clip_distance )
+			return projection + nearest_segment->normal * g_light_sample_min_clip_distance;
+	}
+	else
+	{
+		// back
+		return projection + nearest_segment->normal * g_light_sample_min_clip_distance;
+	}
+
+	return pos;
+}
+
+void plbPreparePrimaryLightTexels(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const std::vector<plb_Tracer::LineSegments>& polygons_segments,
+	const plb_LightmapSurfaceFilter& surface_filter,
+	plb_CpuLightmapsBuilder::LightTexels& out_texels )
+{
+	PrepareLightTexels(
+		level_data, config, polygons_segments,
+		1u, 0.001f,
+		surface_filter, nullptr,
+		out_texels );
+}
+
+void plbPrepareSecondaryLightTexels(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const std::vector<plb_Tracer::LineSegments>& polygons_segments,
+	const plb_LightTexelFilter& texel_filter,
+	plb_CpuLightmapsBuilder::LightTexels& out_texels )
+{
+	PrepareLightTexels(
+		level_data, config, polygons_segments,
+		config.secondary_lightmap_scaler, 0.01f,
+		nullptr, texel_filter,
+		out_texels );
+}
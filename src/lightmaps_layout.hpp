@@ -0,0 +1,85 @@
+#pragma once
+#include <functional>
+#include <vector>
+
+#include "atlas_packer.hpp"
+#include "cpu_lightmaps_builder.hpp"
+#include "formats.hpp"
+#include "lightmaps_dilation.hpp"
+#include "tracer.hpp"
+
+// Layout of lightmaps in atlas and preparation of light texels.
+// These functions do not use OpenGL, so, they are shared by lightmaps builder and benchmark.
+
+// Distance of near plane of cubemaps, rendered in light samples.
+// Light samples are moved away from neighbor geometry, so, that near plane does not clip it.
+const float plb_light_sample_cubemap_znear= 1.0f / 32.0f;
+
+// Calculates lightmaps sizes of polygons from lightmaps basises and sizes of curves lightmaps,
+// scales lightmaps, if needed, and converts lightmap coordinates of curves vertices into texels.
+void plbCalculateLightmapsSizes( plb_LevelData& level_data, const plb_Config& config );
+
+// Size of atlas layer for packing, in secondary lightmap texels.
+void plbGetLightmapsAtlasLayerSize( const plb_Config& config, unsigned int* out_size );
+
+// Rects for packing into atlas - stub lightmap for surfaces without lightmap, lightmaps of surfaces, rows of models vertices.
+// Sizes are in secondary lightmap texels, each rect includes one free texel after lightmap.
+void plbGetLightmapsAtlasRects( const plb_LevelData& level_data, const plb_Config& config, plb_AtlasRects& out_rects );
+
+// Packs rects, returned by plbGetLightmapsAtlasRects, places lightmaps and models vertices into atlas
+// and calculates lightmap coordinates of vertices. Returns number of atlas layers.
+unsigned int plbPlaceLightmaps(
+	plb_LevelData& level_data,
+	const plb_Config& config,
+	plb_AtlasRects& rects,
+	plb_SurfaceLightmapData& out_stub_lightmap );
+
+// Rects of lightmaps of surfaces in atlas with given scaler (1 for primary lightmaps).
+void plbGetLightmapsRects( const plb_LevelData& level_data, unsigned int scaler, plb_LightmapRects& out_rects );
+
+m_Vec3 plbGetNearestSegmentPoint( const m_Vec3& pos, const plb_Tracer::LineSegment& segment );
+
+// Segments of neighbor geometry in plane of polygon, slightly shifted forward.
+void plbGetPolygonNeighborsSegments(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const plb_Tracer& tracer,
+	const plb_Polygon& polygon,
+	plb_Tracer::SurfacesList& tmp_surfaces_container,
+	plb_Tracer::LineSegments& out_segments );
+
+// Segments of neighbor geometry for each polygon. Segments of polygons without lightmaps are empty.
+void plbGetPolygonsNeighborsSegments(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const plb_Tracer& tracer,
+	std::vector<plb_Tracer::LineSegments>& out_polygons_segments );
+
+// Moves light sample of polygon out of nearest neighbor geometry segment.
+m_Vec3 plbCorrectLightSample(
+	const plb_Config& config,
+	const m_Vec3& pos,
+	const plb_Polygon& poly,
+	const plb_Tracer::LineSegments& neighbors_segments );
+
+// Returns true for surfaces, which texels are needed. Index of curve is number of polygons plus index of curve in level.
+typedef std::function<bool( unsigned int surface_index )> plb_LightmapSurfaceFilter;
+// Returns true for texels, which are needed. "model_texel" is true for texels of models vertices.
+typedef std::function<bool( const m_Vec3& pos, const m_Vec3& normal, bool model_texel )> plb_LightTexelFilter;
+
+// Texels of primary lightmaps of surfaces, passed filter, and of models vertices.
+// Texels of polygons are moved out of neighbor geometry, using segments from plbGetPolygonsNeighborsSegments.
+void plbPreparePrimaryLightTexels(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const std::vector<plb_Tracer::LineSegments>& polygons_segments,
+	const plb_LightmapSurfaceFilter& surface_filter,
+	plb_CpuLightmapsBuilder::LightTexels& out_texels );
+
+// Texels of secondary lightmaps, passed filter. Null filter passes all texels.
+void plbPrepareSecondaryLightTexels(
+	const plb_LevelData& level_data,
+	const plb_Config& config,
+	const std::vector<plb_Tracer::LineSegments>& polygons_segments,
+	const plb_LightTexelFilter& texel_filter,
+	plb_CpuLightmapsBuilder::LightTexels& out_texels );
@@ -1,5 +1,8 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -8,6 +11,7 @@
 #endif
 
 #include "loaders_common.hpp"
+#include "math_utils.hpp"
 
 #ifndef PLB_DLL_BUILD
 
@@ -16,9 +20,27 @@ void (*LoadBsp)(
 	const plb_Config& config,
 	plb_LevelData& level_data )= nullptr;
 
+bool (*SaveBsp)(
+	const char* in_file_name,
+	const char* out_file_name,
+	const plb_Config& config,
+	const plb_LevelData& level_data,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas )= nullptr;
+
 bool LoadLoaderLibrary( const char* const library_name )
 {
-	const char* const c_func_name= "LoadBsp";
+	// Libraries are never unloaded, so, just reuse functions of previously loaded library.
+	static std::unordered_map< std::string, std::pair< decltype(LoadBsp), decltype(SaveBsp) > > loaded_libraries;
+	{
+		const auto it= loaded_libraries.find( library_name );
+		if( it != loaded_libraries.end() )
+		{
+			LoadBsp= it->second.first;
+			SaveBsp= it->second.second;
+			return true;
+		}
+	}
 
 	std::string library_file_name= library_name;
 
@@ -32,13 +54,14 @@ bool LoadLoaderLibrary( const char* const library_name )
 		return false;
 	}
 
-	LoadBsp= reinterpret_cast<decltype(LoadBsp)>( GetProcAddress( module, c_func_name ) );
-
-	if( LoadBsp == nullptr )
+	const auto get_func=
+	[&]( const char* const func_name ) -> void*
 	{
-		std::cout << "Failed to get \"" << c_func_name << "\" from \"" << library_file_name << "\"" << std::endl;
-		return false;
-	}
+		void* const func= reinterpret_cast<void*>( GetProcAddress( module, func_name ) );
+		if( func == nullptr )
+			std::cout << "Failed to get \"" << func_name << "\" from \"" << library_file_name << "\"" << std::endl;
+		return func;
+	};
 
 #else
 	library_file_name= "lib" + library_file_name + ".so";
@@ -51,17 +74,25 @@ bool LoadLoaderLibrary( const char* const library_name )
 		return false;
 	}
 
-	LoadBsp= reinterpret_cast<decltype(LoadBsp)>( dlsym( handle, c_func_name ) );
-
-	if( LoadBsp == nullptr )
+	const auto get_func=
+	[&]( const char* const func_name ) -> void*
 	{
-		std::cout << "Failed to get \"" << c_func_name << "\" from \"" << library_file_name << "\"\n"
-			<< dlerror() << std::endl;
-		return false;
-	}
+		void* const func= dlsym( handle, func_name );
+		if( func == nullptr )
+			std::cout << "Failed to get \"" << func_name << "\" from \"" << library_file_name << "\"\n"
+				<< dlerror() << std::endl;
+		return func;
+	};
 
 #endif
 
+	LoadBsp= reinterpret_cast<decltype(LoadBsp)>( get_func( "LoadBsp" ) );
+	SaveBsp= reinterpret_cast<decltype(SaveBsp)>( get_func( "SaveBsp" ) );
+
+	if( LoadBsp == nullptr || SaveBsp == nullptr )
+		return false;
+
+	loaded_libraries[ library_name ]= std::make_pair( LoadBsp, SaveBsp );
 	return true;
 }
 
@@ -109,3 +140,248 @@ void plbTransformCoordinatesFromQuakeSystem(
 	for( unsigned int i= 0; i < sky_indeces.size(); i+= 3 )
 		std::swap( sky_indeces[i], sky_indeces[i+1] );
 }
+
+m_Vec3 plbTransformVectorFromQuakeSystem( const m_Vec3& v )
+{
+	return m_Vec3( v.x, v.z, v.y ) * INV_Q_UNITS_IN_METER;
+}
+
+void plbTransformVisibilityFromQuakeSystem( plb_VisibilityData& visibility )
+{
+	for( plb_VisibilityData::Node& node : visibility.nodes )
+	{
+		// Normal is not scaled, so, scale distance.
+		std::swap( node.plane[1], node.plane[2] );
+		node.plane[3]*= INV_Q_UNITS_IN_METER;
+	}
+}
+
+void plbDecompressQuakeVisibilityRow(
+	const unsigned char* in,
+	const unsigned char* const in_end,
+	const unsigned int row_size,
+	unsigned char* const out )
+{
+	unsigned int out_size= 0u;
+	while( out_size < row_size && in < in_end )
+	{
+		if( *in != 0 )
+		{
+			out[ out_size ]= *in;
+			out_size++;
+			in++;
+			continue;
+		}
+
+		// Zero byte and count of zero bytes.
+		if( in + 1 >= in_end )
+			break;
+
+		const unsigned int zeros_count= std::min( static_cast<unsigned int>( in[1] ), row_size - out_size );
+		std::fill( out + out_size, out + out_size + zeros_count, 0 );
+		out_size+= zeros_count;
+		in+= 2;
+	}
+
+	// Broken data - make everything visible.
+	std::fill( out + out_size, out + row_size, 0xFF );
+}
+
+void plbSetClustersSurfaces(
+	std::vector< std::pair<unsigned int, unsigned int> >& clusters_surfaces,
+	plb_VisibilityData& visibility )
+{
+	std::sort( clusters_surfaces.begin(), clusters_surfaces.end() );
+	clusters_surfaces.erase(
+		std::unique( clusters_surfaces.begin(), clusters_surfaces.end() ),
+		clusters_surfaces.end() );
+
+	visibility.clusters_surfaces_offsets.assign( visibility.cluster_count + 1u, 0u );
+	visibility.clusters_surfaces.clear();
+	visibility.clusters_surfaces.reserve( clusters_surfaces.size() );
+
+	for( const std::pair<unsigned int, unsigned int>& cluster_surface : clusters_surfaces )
+	{
+		if( cluster_surface.first >= visibility.cluster_count )
+			continue;
+
+		visibility.clusters_surfaces_offsets[ cluster_surface.first + 1u ]++;
+		visibility.clusters_surfaces.push_back( cluster_surface.second );
+	}
+
+	for( unsigned int c= 0u; c < visibility.cluster_count; c++ )
+		visibility.clusters_surfaces_offsets[ c + 1u ]+= visibility.clusters_surfaces_offsets[c];
+}
+
+// Returns point on plane with given texture coordinates.
+static m_Vec3 GetPointForTextureCoordinates(
+	const float (&tex_vecs)[2][4],
+	const m_Vec3& plane_normal, const float plane_dist,
+	const float u, const float v )
+{
+	// Solve system:
+	// dot( point, tex_vecs[0] ) + tex_vecs[0][3] = u
+	// dot( point, tex_vecs[1] ) + tex_vecs[1][3] = v
+	// dot( point, plane_normal ) = plane_dist
+	const m_Vec3 s_vec( tex_vecs[0] );
+	const m_Vec3 t_vec( tex_vecs[1] );
+
+	const m_Vec3 t_cross_n= mVec3Cross( t_vec, plane_normal );
+	const m_Vec3 n_cross_s= mVec3Cross( plane_normal, s_vec );
+	const m_Vec3 s_cross_t= mVec3Cross( s_vec, t_vec );
+
+	const float det= s_vec * t_cross_n;
+	if( std::abs(det) < 1e-12f )
+		return m_Vec3( 0.0f, 0.0f, 0.0f );
+
+	return
+		( t_cross_n * ( u - tex_vecs[0][3] ) +
+		  n_cross_s * ( v - tex_vecs[1][3] ) +
+		  s_cross_t * plane_dist ) / det;
+}
+
+m_Vec2 plbGetPolygonAtlasCoord( const plb_Polygon& polygon, const m_Vec3& pos )
+{
+	m_Mat3 inverse_lightmap_basis;
+	plbGetInvLightmapBasisMatrix(
+		m_Vec3( polygon.lightmap_basis[0] ),
+		m_Vec3( polygon.lightmap_basis[1] ),
+		inverse_lightmap_basis );
+
+	const m_Vec2 uv= ( ( pos - m_Vec3( polygon.lightmap_pos ) ) * inverse_lightmap_basis ).xy();
+
+	return m_Vec2(
+		uv.x + float( polygon.lightmap_data.coord[0] ),
+		uv.y + float( polygon.lightmap_data.coord[1] ) );
+}
+
+m_Vec3 plbFetchAtlasLight(
+	const plb_Config& config,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas,
+	const plb_SurfaceLightmapData& lightmap_data,
+	const m_Vec2& atlas_coord )
+{
+	const int filter_size= int( std::max( config.lightmap_scale_to_original, 1u ) );
+	const float half_filter_size= 0.5f * float(filter_size);
+
+	// First texel with center inside filter square.
+	const int start[2]=
+	{
+		int( std::ceil( atlas_coord.x - half_filter_size - 0.5f ) ),
+		int( std::ceil( atlas_coord.y - half_filter_size - 0.5f ) ),
+	};
+
+	const int min_coord[2]= { int(lightmap_data.coord[0]), int(lightmap_data.coord[1]) };
+	const int max_coord[2]=
+	{
+		min_coord[0] + int(lightmap_data.size[0]) - 1,
+		min_coord[1] + int(lightmap_data.size[1]) - 1,
+	};
+
+	m_Vec3 light( 0.0f, 0.0f, 0.0f );
+	for( int dy= 0; dy < filter_size; dy++ )
+	for( int dx= 0; dx < filter_size; dx++ )
+	{
+		const unsigned int x= std::max( min_coord[0], std::min( start[0] + dx, max_coord[0] ) );
+		const unsigned int y= std::max( min_coord[1], std::min( start[1] + dy, max_coord[1] ) );
+
+		const float* const primary_texel=
+			primary_atlas.data +
+			4u * ( x + ( y + lightmap_data.atlas_id * primary_atlas.size[1] ) * primary_atlas.size[0] );
+
+		const unsigned int secondary_x= x / config.secondary_lightmap_scaler;
+		const unsigned int secondary_y= y / config.secondary_lightmap_scaler;
+		const float* const secondary_texel=
+			secondary_atlas.data +
+			4u * ( secondary_x + ( secondary_y + lightmap_data.atlas_id * secondary_atlas.size[1] ) * secondary_atlas.size[0] );
+
+		light+= m_Vec3( primary_texel ) + m_Vec3( secondary_texel );
+	}
+
+	return light / float( filter_size * filter_size );
+}
+
+bool plbCalculateQuakeFaceLightmap(
+	const plb_Config& config,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas,
+	const plb_LevelData& level_data,
+	const plb_Polygon& polygon,
+	const std::vector<m_Vec3>& face_vertices,
+	const float (&tex_vecs)[2][4],
+	const m_Vec3& plane_normal, const float plane_dist,
+	unsigned int (&out_size)[2],
+	std::vector<m_Vec3>& out_light )
+{
+	const float c_lightmap_block_size= 16.0f;
+	const float c_max_lightmap_extent= 256.0f;
+
+	// Calculate face extents, like "CalcFaceExtents" of Quake "light" utility.
+	float tex_min[2]= {  1e32f,  1e32f };
+	float tex_max[2]= { -1e32f, -1e32f };
+	for( const m_Vec3& v : face_vertices )
+	{
+		for( unsigned int j= 0; j < 2; j++ )
+		{
+			const float val= v * m_Vec3( tex_vecs[j] ) + tex_vecs[j][3];
+			tex_min[j]= std::min( tex_min[j], val );
+			tex_max[j]= std::max( tex_max[j], val );
+		}
+	}
+
+	float texture_mins[2];
+	for( unsigned int j= 0; j < 2; j++ )
+	{
+		const float block_min= std::floor( tex_min[j] / c_lightmap_block_size );
+		const float block_max= std::ceil ( tex_max[j] / c_lightmap_block_size );
+		if( ( block_max - block_min ) * c_lightmap_block_size > c_max_lightmap_extent )
+		{
+			std::cout << "Bad surface extents" << std::endl;
+			return false;
+		}
+
+		texture_mins[j]= block_min * c_lightmap_block_size;
+		out_size[j]= static_cast<unsigned int>( block_max - block_min ) + 1u;
+	}
+
+	// Positions of face and polygon may differ by model origin, so convert only relative positions.
+	const m_Vec3 polygon_first_vertex( level_data.vertices[ polygon.first_vertex_number ].pos );
+
+	out_light.resize( out_size[0] * out_size[1] );
+	for( unsigned int t= 0; t < out_size[1]; t++ )
+	for( unsigned int s= 0; s < out_size[0]; s++ )
+	{
+		const m_Vec3 face_pos=
+			GetPointForTextureCoordinates(
+				tex_vecs,
+				plane_normal, plane_dist,
+				texture_mins[0] + float(s) * c_lightmap_block_size,
+				texture_mins[1] + float(t) * c_lightmap_block_size );
+
+		const m_Vec3 pos=
+			polygon_first_vertex +
+			plbTransformVectorFromQuakeSystem( face_pos - face_vertices.front() );
+
+		out_light[ s + t * out_size[0] ]=
+			plbFetchAtlasLight(
+				config,
+				primary_atlas, secondary_atlas,
+				polygon.lightmap_data,
+				plbGetPolygonAtlasCoord( polygon, pos ) );
+	}
+
+	return true;
+}
+
+void plbLightToBSPLightmapColor( const plb_Config& config, const m_Vec3& light, unsigned char* const out_rgb )
+{
+	m_Vec3 color= light * config.bsp_lightmap_scale;
+
+	const float max_component= std::max( color.x, std::max( color.y, color.z ) );
+	if( max_component > 255.0f )
+		color*= 255.0f / max_component;
+
+	for( unsigned int j= 0; j < 3; j++ )
+		out_rgb[j]= static_cast<unsigned char>( std::max( 0.0f, std::min( color.ToArr()[j] + 0.5f, 255.0f ) ) );
+}
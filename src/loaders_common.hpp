@@ -1,6 +1,11 @@
 #pragma once
+#include <utility>
+#include <vector>
+
+#include <vec.hpp>
 
 #include "formats.hpp"
+#include "lightmaps_file.hpp"
 
 #define Q_UNITS_IN_METER 64.0f
 #define INV_Q_UNITS_IN_METER 0.015625f
@@ -19,6 +24,18 @@ PLB_DLL_FUNC void LoadBsp(
 	const plb_Config& config,
 	plb_LevelData& level_data );
 
+// Writes calculated lightmaps into copy of source BSP file.
+// Atlases are resampled to original lightmaps scale, only lighting data is replaced.
+// level_data must be result of "LoadBsp" for same file, with calculated lightmaps atlas coordinates.
+// Returns true on success.
+PLB_DLL_FUNC bool SaveBsp(
+	const char* in_file_name,
+	const char* out_file_name,
+	const plb_Config& config,
+	const plb_LevelData& level_data,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas );
+
 #else//PLB_DLL_BUILD
 
 extern void (*LoadBsp)(
@@ -26,8 +43,17 @@ extern void (*LoadBsp)(
 	const plb_Config& config,
 	plb_LevelData& level_data );
 
+extern bool (*SaveBsp)(
+	const char* in_file_name,
+	const char* out_file_name,
+	const plb_Config& config,
+	const plb_LevelData& level_data,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas );
+
 // Loads dynamic library with loader.
 // library_name - name of librrary without extension (.so or .dll).
+// Already loaded libraries are not loaded again, only functions pointers are switched.
 // Returns true on success.
 bool LoadLoaderLibrary( const char* const library_name );
 
@@ -38,3 +64,56 @@ void plbTransformCoordinatesFromQuakeSystem(
 	plb_Vertices& vertices,
 	std::vector<unsigned int>& indeces,
 	std::vector<unsigned int>& sky_indeces );
+
+// Transforms vector (or point) from Quake coordinate system to builder coordinate system.
+m_Vec3 plbTransformVectorFromQuakeSystem( const m_Vec3& v );
+
+// Transforms planes of visibility BSP tree from Quake coordinate system to builder coordinate system.
+void plbTransformVisibilityFromQuakeSystem( plb_VisibilityData& visibility );
+
+// Decompresses run-length encoded visibility row of Quake1, Quake2 or Half-Life BSP.
+// Bits of clusters, which data is out of input buffer, are set.
+void plbDecompressQuakeVisibilityRow(
+	const unsigned char* in,
+	const unsigned char* in_end,
+	unsigned int row_size,
+	unsigned char* out );
+
+// Fills surfaces lists of visibility clusters.
+// clusters_surfaces - pairs of cluster and surface indeces, duplicated pairs are allowed.
+void plbSetClustersSurfaces(
+	std::vector< std::pair<unsigned int, unsigned int> >& clusters_surfaces,
+	plb_VisibilityData& visibility );
+
+// Returns coordinates of polygon point in lightmaps atlas, in atlas texels.
+m_Vec2 plbGetPolygonAtlasCoord( const plb_Polygon& polygon, const m_Vec3& pos );
+
+// Returns sum of primary and secondary light for surface point with given atlas coordinates.
+// Light is averaged over square of "lightmap_scale_to_original" texels, texels outside surface lightmap are clamped.
+m_Vec3 plbFetchAtlasLight(
+	const plb_Config& config,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas,
+	const plb_SurfaceLightmapData& lightmap_data,
+	const m_Vec2& atlas_coord );
+
+// Calculates light of Quake-like BSP face (Quake1, Quake2, Half-Life) at original lightmap resolution.
+// Lightmap texels are sampled in corners of 16x16 texture blocks, like in original Quake tools.
+// face_vertices - face vertices in Quake coordinates, first vertex must correspond to first vertex of polygon.
+// out_light - light of lightmap texels, row by row.
+// Returns false, if face extents are too big.
+bool plbCalculateQuakeFaceLightmap(
+	const plb_Config& config,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas,
+	const plb_LevelData& level_data,
+	const plb_Polygon& polygon,
+	const std::vector<m_Vec3>& face_vertices,
+	const float (&tex_vecs)[2][4],
+	const m_Vec3& plane_normal, float plane_dist,
+	unsigned int (&out_size)[2],
+	std::vector<m_Vec3>& out_light );
+
+// Converts light to 8-bit color of BSP lightmaps.
+// Too bright colors are scaled down with preservation of hue.
+void plbLightToBSPLightmapColor( const plb_Config& config, const m_Vec3& light, unsigned char* out_rgb );
@@ -1,8 +1,17 @@
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include <SDL.h>
 
@@ -11,9 +20,12 @@
 #include <panzer_ogl_lib.hpp>
 #include <shaders_loading.hpp>
 
+#include "bake_workers.hpp"
 #include "camera_controller.hpp"
 #include "lightmaps_builder.hpp"
 #include "loaders_common.hpp"
+#include "parallel_for.hpp"
+#include "profiler.hpp"
 
 static void FatalError(const char* message)
 {
@@ -21,16 +33,81 @@ static void FatalError(const char* message)
 	exit(-1);
 }
 
-extern "C" int main(int argc, char *argv[])
+// Callback for baking without preview. Just prints progress from time to time.
+static std::function<void()> MakeBatchProgressCallback()
+{
+	const auto start_time= std::chrono::steady_clock::now();
+	auto last_report_time= start_time;
+	unsigned int steps= 0u;
+
+	return
+		[=]() mutable
+		{
+			steps++;
+
+			const auto current_time= std::chrono::steady_clock::now();
+			if( current_time - last_report_time < std::chrono::seconds(5) )
+				return;
+			last_report_time= current_time;
+
+			std::cout << "Baking... " << steps << " steps done, " <<
+				std::chrono::duration_cast<std::chrono::seconds>(current_time - start_time).count() << " s elapsed" << std::endl;
+		};
+}
+
+// Prints statistics of build stages and writes trace file, if needed.
+static bool FinishProfiling( const char* const trace_path )
 {
-	// TODO - parse more parameters
+	plbProfilerPrintSummary();
+	return trace_path == nullptr || plbProfilerWriteTrace( trace_path );
+}
 
-	#define EXPECT_ARG if( i == argc - 1 ) FatalError( "Expected argument value" );
+static bool SaveOutputs(
+	plb_LightmapsBuilder& lightmaps_builder,
+	const char* const map_path,
+	const char* const output_path,
+	const char* const output_bsp_path )
+{
+	if( output_path != nullptr && !lightmaps_builder.SaveLightmaps( output_path ) )
+		return false;
+	if( output_bsp_path != nullptr && !lightmaps_builder.SaveBsp( map_path, output_bsp_path ) )
+		return false;
+
+	// Results are saved, checkpoint is not needed anymore.
+	lightmaps_builder.RemoveSecondaryLightCheckpoint();
+	return true;
+}
 
+struct Options
+{
 	const char* game= "q3";
 	const char* map_path= "maps/q3/q3dm1.bsp";
+	const char* output_path= nullptr;
+	const char* output_bsp_path= nullptr;
+	const char* jobs_path= nullptr;
+	const char* trace_path= nullptr;
+	bool batch_mode= false;
+	// Number of worker processes of distributed build. 0 or 1 - build in this process.
+	unsigned int workers= 0;
+	// This process is worker of distributed build, started by coordinator.
+	bool worker= false;
 	plb_Config cfg;
-	cfg.textures_path= "textures/q3/";
+
+	// Path of this program and all parsed arguments, used for starting of worker processes.
+	const char* program_path= "";
+	std::vector<std::string> arguments;
+};
+
+// Parses arguments, starting from second. Given options are used as defaults.
+// Prints error and returns false for invalid arguments.
+static bool ParseArguments( const int argc, const char* const* const argv, Options& options )
+{
+	#define PARSE_ERROR( message ) { std::cout << message << std::endl; return false; }
+	#define EXPECT_ARG if( i == argc - 1 ) PARSE_ERROR( "Expected argument value" )
+
+	for( int i= 1; i < argc; ++i )
+		options.arguments.push_back( argv[i] );
+
 	for( int i= 1; i < argc; ++i )
 	{
 		if( argv[i][0] == '-' )
@@ -39,94 +116,326 @@ extern "C" int main(int argc, char *argv[])
 			if( std::strcmp( argv[i], "-game" ) == 0 )
 			{
 				EXPECT_ARG
-				game= val;
-					 if( std::strcmp( game, "q1" ) == 0 ) cfg.source_data_type= plb_Config::SourceDataType::Quake1BSP;
-				else if( std::strcmp( game, "q2" ) == 0 ) cfg.source_data_type= plb_Config::SourceDataType::Quake2BSP;
-				else if( std::strcmp( game, "q3" ) == 0 ) cfg.source_data_type= plb_Config::SourceDataType::Quake3BSP;
-				else if( std::strcmp( game, "hl" ) == 0 ) cfg.source_data_type= plb_Config::SourceDataType::HalfLifeBSP;
+				options.game= val;
+					 if( std::strcmp( options.game, "q1" ) == 0 ) options.cfg.source_data_type= plb_Config::SourceDataType::Quake1BSP;
+				else if( std::strcmp( options.game, "q2" ) == 0 ) options.cfg.source_data_type= plb_Config::SourceDataType::Quake2BSP;
+				else if( std::strcmp( options.game, "q3" ) == 0 ) options.cfg.source_data_type= plb_Config::SourceDataType::Quake3BSP;
+				else if( std::strcmp( options.game, "hl" ) == 0 ) options.cfg.source_data_type= plb_Config::SourceDataType::HalfLifeBSP;
 				else
-					FatalError( "unknown game" );
+					PARSE_ERROR( "unknown game" )
 			}
 			else if( std::strcmp( argv[i], "-map" ) == 0 )
 			{
 				EXPECT_ARG
-				map_path= val;
+				options.map_path= val;
+			}
+			else if( std::strcmp( argv[i], "-batch" ) == 0 )
+			{
+				// Flag without value. Bake, save results and exit without preview.
+				options.batch_mode= true;
+			}
+			else if( std::strcmp( argv[i], "-jobs" ) == 0 )
+			{
+				EXPECT_ARG
+				options.jobs_path= val;
+			}
+			else if( std::strcmp( argv[i], "-trace" ) == 0 )
+			{
+				EXPECT_ARG
+				options.trace_path= val;
+			}
+			else if( std::strcmp( argv[i], "-out" ) == 0 )
+			{
+				EXPECT_ARG
+				options.output_path= val;
+			}
+			else if( std::strcmp( argv[i], "-out_bsp" ) == 0 )
+			{
+				EXPECT_ARG
+				options.output_bsp_path= val;
+			}
+			else if( std::strcmp( argv[i], "-checkpoint" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_checkpoint_file= val;
+			}
+			else if( std::strcmp( argv[i], "-checkpoint_interval" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_checkpoint_interval= std::max( 1, std::min( std::atoi( val ), 86400 ) );
+			}
+			else if( std::strcmp( argv[i], "-light_cache" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.light_cache_file= val;
+			}
+			else if( std::strcmp( argv[i], "-bsp_lightmap_scale" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.bsp_lightmap_scale= std::max( 0.0f, float(std::atof( val )) );
+			}
+			else if( std::strcmp( argv[i], "-out_encoding" ) == 0 )
+			{
+				EXPECT_ARG
+					 if( std::strcmp( val, "float" ) == 0 ) options.cfg.lightmaps_file_encoding= plb_Config::LightmapsFileEncoding::Float32;
+				else if( std::strcmp( val, "half"  ) == 0 ) options.cfg.lightmaps_file_encoding= plb_Config::LightmapsFileEncoding::Float16;
+				else if( std::strcmp( val, "rgbe"  ) == 0 ) options.cfg.lightmaps_file_encoding= plb_Config::LightmapsFileEncoding::RGBE;
+				else
+					PARSE_ERROR( "unknown output encoding" )
 			}
 			else if( std::strcmp( argv[i], "-textures_dir" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.textures_path= val;
+				options.cfg.textures_path= val;
 			}
 			else if( std::strcmp( argv[i], "-textures_gamma" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.textures_gamma= std::max( 0.5f, std::min( float(std::atof( val )), 2.0f ) );
+				options.cfg.textures_gamma= std::max( 0.5f, std::min( float(std::atof( val )), 2.0f ) );
 			}
 			else if( std::strcmp( argv[i], "-min_textures_size_log2" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.min_textures_size_log2= std::max( 4, std::min( std::atoi( val ), 8 ) );
+				options.cfg.min_textures_size_log2= std::max( 4, std::min( std::atoi( val ), 8 ) );
 			}
 			else if( std::strcmp( argv[i], "-max_textures_size_log2" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.max_textures_size_log2= std::max( 6, std::min( std::atoi( val ), 10 ) );
+				options.cfg.max_textures_size_log2= std::max( 6, std::min( std::atoi( val ), 10 ) );
 			}
 			else if( std::strcmp( argv[i], "-lightmap_scale_to_original" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.lightmap_scale_to_original= std::max( 1, std::min( std::atoi( val ), 8 ) );
+				options.cfg.lightmap_scale_to_original= std::max( 1, std::min( std::atoi( val ), 8 ) );
 			}
 			else if( std::strcmp( argv[i], "-point_light_shadowmap_cubemap_size_log2" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.point_light_shadowmap_cubemap_size_log2= std::max( 9, std::min( std::atoi( val ), 11 ) );
+				options.cfg.point_light_shadowmap_cubemap_size_log2= std::max( 9, std::min( std::atoi( val ), 11 ) );
 			}
 			else if( std::strcmp( argv[i], "-directional_light_shadowmap_size_log2" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.directional_light_shadowmap_size_log2= std::max( 10, std::min( std::atoi( val ), 12 ) );
+				options.cfg.directional_light_shadowmap_size_log2= std::max( 10, std::min( std::atoi( val ), 12 ) );
 			}
 			else if( std::strcmp( argv[i], "-cone_light_shadowmap_size_log2" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.cone_light_shadowmap_size_log2= std::max( 9, std::min( std::atoi( val ), 11 ) );
+				options.cfg.cone_light_shadowmap_size_log2= std::max( 9, std::min( std::atoi( val ), 11 ) );
 			}
 			else if( std::strcmp( argv[i], "-secondary_light_pass_cubemap_size_log2" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.secondary_light_pass_cubemap_size_log2= std::max( 6, std::min( std::atoi( val ), 9 ) );
+				options.cfg.secondary_light_pass_cubemap_size_log2= std::max( 6, std::min( std::atoi( val ), 9 ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_pass_batch_size" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_pass_batch_size= std::max( 1, std::min( std::atoi( val ), 8 ) );
+			}
+			else if( std::strcmp( argv[i], "-point_light_pass_batch_size" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.point_light_pass_batch_size= std::max( 1, std::min( std::atoi( val ), 8 ) );
+			}
+			else if( std::strcmp( argv[i], "-light_cutoff_threshold" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.light_cutoff_threshold= std::max( 0.0f, std::min( float(std::atof( val )), 1.0f ) );
 			}
 			else if( std::strcmp( argv[i], "-max_luminocity_for_direct_luminous_surfaces_drawing" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.max_luminocity_for_direct_luminous_surfaces_drawing= std::max( 1.0f, std::min( float(std::atof( val )), 100.0f ) );
+				options.cfg.max_luminocity_for_direct_luminous_surfaces_drawing= std::max( 1.0f, std::min( float(std::atof( val )), 100.0f ) );
 			}
 			else if( std::strcmp( argv[i], "-luminous_surfaces_tessellation_inv_size" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.luminous_surfaces_tessellation_inv_size= std::max( 2, std::min( std::atoi( val ), 20 ) );
+				options.cfg.luminous_surfaces_tessellation_inv_size= std::max( 2, std::min( std::atoi( val ), 20 ) );
 			}
 			else if( std::strcmp( argv[i], "-secondary_lightmap_scaler" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.secondary_lightmap_scaler= std::max( 1, std::min( std::atoi( val ), 8 ) );
+				options.cfg.secondary_lightmap_scaler= std::max( 1, std::min( std::atoi( val ), 8 ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_bounces" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_bounces= std::max( 1, std::min( std::atoi( val ), 8 ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_bounces_energy_threshold" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_bounces_energy_threshold= std::max( 0.0f, std::min( float(std::atof( val )), 1.0f ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_adaptive_step" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_adaptive_step= std::max( 1, std::min( std::atoi( val ), 16 ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_adaptive_threshold" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_adaptive_threshold= std::max( 0.0f, std::min( float(std::atof( val )), 1.0f ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_irradiance_cache_error" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_irradiance_cache_error= std::max( 0.0f, std::min( float(std::atof( val )), 1.0f ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_denoise_iterations" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_denoise_iterations= std::max( 0, std::min( std::atoi( val ), 6 ) );
+			}
+			else if( std::strcmp( argv[i], "-secondary_light_denoise_strength" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.secondary_light_denoise_strength= std::max( 0.01f, std::min( float(std::atof( val )), 10.0f ) );
+			}
+			else if( std::strcmp( argv[i], "-lightmaps_dilation_passes" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.lightmaps_dilation_passes= std::max( 0, std::min( std::atoi( val ), 8 ) );
 			}
 			else if( std::strcmp( argv[i], "-use_average_texture_color_for_luminous_surfaces" ) == 0 )
 			{
 				EXPECT_ARG
-				cfg.use_average_texture_color_for_luminous_surfaces= std::atoi( val ) != 0;
+				options.cfg.use_average_texture_color_for_luminous_surfaces= std::atoi( val ) != 0;
+			}
+			else if( std::strcmp( argv[i], "-atlas_packer" ) == 0 )
+			{
+				EXPECT_ARG
+					 if( std::strcmp( val, "shelf"    ) == 0 ) options.cfg.lightmaps_atlas_packer= plb_Config::LightmapsAtlasPacker::Shelf;
+				else if( std::strcmp( val, "skyline"  ) == 0 ) options.cfg.lightmaps_atlas_packer= plb_Config::LightmapsAtlasPacker::Skyline;
+				else if( std::strcmp( val, "maxrects" ) == 0 ) options.cfg.lightmaps_atlas_packer= plb_Config::LightmapsAtlasPacker::MaxRects;
+				else
+					PARSE_ERROR( "unknown atlas packer" )
+			}
+			else if( std::strcmp( argv[i], "-backend" ) == 0 )
+			{
+				EXPECT_ARG
+					 if( std::strcmp( val, "gl"  ) == 0 ) options.cfg.backend= plb_Config::Backend::OpenGL;
+				else if( std::strcmp( val, "cpu" ) == 0 ) options.cfg.backend= plb_Config::Backend::CPU;
+				else
+					PARSE_ERROR( "unknown backend" )
+			}
+			else if( std::strcmp( argv[i], "-cpu_threads" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.cpu_threads= std::max( 0, std::min( std::atoi( val ), 256 ) );
+			}
+			else if( std::strcmp( argv[i], "-cpu_secondary_light_pass_rays" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.cpu_secondary_light_pass_rays= std::max( 16, std::min( std::atoi( val ), 4096 ) );
+			}
+			else if( std::strcmp( argv[i], "-workers" ) == 0 )
+			{
+				EXPECT_ARG
+				options.workers= std::max( 0, std::min( std::atoi( val ), 256 ) );
+			}
+			else if( std::strcmp( argv[i], "-worker" ) == 0 )
+			{
+				// Options of worker processes, set by coordinator.
+				options.worker= true;
+			}
+			else if( std::strcmp( argv[i], "-worker_shard" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.worker_shard= std::max( 0, std::atoi( val ) );
+			}
+			else if( std::strcmp( argv[i], "-worker_count" ) == 0 )
+			{
+				EXPECT_ARG
+				options.cfg.worker_shard_count= std::max( 1, std::min( std::atoi( val ), 256 ) );
 			}
 			else
-				FatalError( ( std::string( "unknown parameter: " ) +  argv[i] ).c_str() );
+				PARSE_ERROR( "unknown parameter: " << argv[i] )
 		}
 	}
 
-	if( cfg.max_textures_size_log2 < cfg.min_textures_size_log2 )
-		cfg.max_textures_size_log2= cfg.min_textures_size_log2;
+	if( options.cfg.max_textures_size_log2 < options.cfg.min_textures_size_log2 )
+		options.cfg.max_textures_size_log2= options.cfg.min_textures_size_log2;
 
-	LoadLoaderLibrary( ( std::string(game) + "_loader" ).c_str() );
+	if( options.cfg.worker_shard >= options.cfg.worker_shard_count )
+		PARSE_ERROR( "Worker shard must be less, than worker count" )
 
+	#undef EXPECT_ARG
+	#undef PARSE_ERROR
+
+	return true;
+}
+
+// Reads jobs file. Each nonempty line, which is not comment (starting with '#'), contains arguments for one level.
+// Arguments are separated by whitespaces. Options of command line are used as defaults for all jobs.
+// Strings of arguments are stored in container, which never moves its elements.
+// Invalid jobs are reported and skipped. Returns number of skipped jobs.
+static unsigned int ReadJobs(
+	const Options& base_options,
+	std::deque<std::string>& arguments_storage,
+	std::vector<Options>& out_jobs )
+{
+	std::ifstream file( base_options.jobs_path );
+	if( !file.is_open() )
+		FatalError( ( std::string( "Can not open jobs file: " ) + base_options.jobs_path ).c_str() );
+
+	unsigned int skipped_jobs= 0u;
+	unsigned int line_number= 0u;
+	std::string line;
+	while( std::getline( file, line ) )
+	{
+		line_number++;
+
+		std::vector<const char*> args;
+		args.push_back( "" ); // Program name
+
+		std::istringstream line_stream( line );
+		std::string arg;
+		while( line_stream >> arg )
+		{
+			arguments_storage.push_back( arg );
+			args.push_back( arguments_storage.back().c_str() );
+		}
+
+		if( args.size() == 1u || args[1][0] == '#' )
+			continue;
+
+		// Output paths, checkpoints and light caches are unique for each level.
+		Options job= base_options;
+		job.output_path= nullptr;
+		job.output_bsp_path= nullptr;
+		job.trace_path= nullptr;
+		job.cfg.secondary_light_checkpoint_file.clear();
+		job.cfg.light_cache_file.clear();
+		if( !ParseArguments( int(args.size()), args.data(), job ) )
+		{
+			std::cout << "Invalid job at line " << line_number << " of jobs file, job skipped" << std::endl;
+			skipped_jobs++;
+			continue;
+		}
+		job.jobs_path= nullptr;
+		job.batch_mode= true;
+
+		if( job.output_path == nullptr && job.output_bsp_path == nullptr )
+		{
+			std::cout << "Job for \"" << job.map_path << "\" at line " << line_number << " of jobs file has no -out or -out_bsp, job skipped" << std::endl;
+			skipped_jobs++;
+			continue;
+		}
+
+		out_jobs.push_back( job );
+	}
+
+	if( out_jobs.empty() )
+		FatalError( "Jobs file contains no valid jobs" );
+
+	return skipped_jobs;
+}
+
+// Creates window with OpenGL context and prepares OpenGL for lightmaps building.
+static SDL_Window* InitVideo( const int width, const int height, const bool hidden, SDL_GLContext& out_gl_context )
+{
 	if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
 		FatalError("Can not initialize sdl video");
 
@@ -137,23 +446,22 @@ extern "C" int main(int argc, char *argv[])
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
 
-	const int screen_width= 1024, screen_height= 768;
-
 	SDL_Window* const window=
 		SDL_CreateWindow(
 			"Panzerschrek's Lightmaps Builder",
 			SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-			screen_width, screen_height,
-			SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN );
+			width, height,
+			SDL_WINDOW_OPENGL | ( hidden ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN ) );
 
 	if( window == nullptr )
 		FatalError( "Can not create window" );
 
-	const SDL_GLContext gl_context= SDL_GL_CreateContext(window);
-	if( gl_context == nullptr )
+	out_gl_context= SDL_GL_CreateContext(window);
+	if( out_gl_context == nullptr )
 		FatalError( "Can not create OpenGL context" );
 
-	SDL_GL_SetSwapInterval(1);
+	// Hidden window never swaps buffers, but disable vsync anyway.
+	SDL_GL_SetSwapInterval( hidden ? 0 : 1 );
 
 	GetGLFunctions( SDL_GL_GetProcAddress );
 
@@ -170,15 +478,262 @@ extern "C" int main(int argc, char *argv[])
 
 	rSetShadersDir( "shaders" );
 
-	r_Framebuffer::SetScreenFramebufferSize( screen_width, screen_height );
+	r_Framebuffer::SetScreenFramebufferSize( width, height );
 
 	glClearDepth(1.0f);
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
 	glEnable(GL_CULL_FACE);
 
+	return window;
+}
+
+// Starts worker processes of distributed build for job. Each worker gets arguments of job and own shard.
+static bool StartWorkers( const Options& job, std::vector<std::unique_ptr<plb_WorkerProcess>>& out_workers )
+{
+	if( job.cfg.backend != plb_Config::Backend::CPU )
+	{
+		std::cout << "Workers are supported only for CPU backend" << std::endl;
+		return false;
+	}
+	if( job.cfg.secondary_light_bounces > 1u )
+	{
+		std::cout << "Workers support only one bounce of secondary light" << std::endl;
+		return false;
+	}
+
+	// Workers get only options, which affect baking. Outputs, checkpoints, tracing and other options of coordinator are not passed.
+	// Options of light cache and threads are set separately for each job. All these options have values.
+	static const char* const c_worker_options[]=
+	{
+		"-game",
+		"-map",
+		"-textures_dir",
+		"-textures_gamma",
+		"-min_textures_size_log2",
+		"-max_textures_size_log2",
+		"-lightmap_scale_to_original",
+		"-point_light_shadowmap_cubemap_size_log2",
+		"-directional_light_shadowmap_size_log2",
+		"-cone_light_shadowmap_size_log2",
+		"-secondary_light_pass_cubemap_size_log2",
+		"-secondary_light_pass_batch_size",
+		"-point_light_pass_batch_size",
+		"-light_cutoff_threshold",
+		"-max_luminocity_for_direct_luminous_surfaces_drawing",
+		"-luminous_surfaces_tessellation_inv_size",
+		"-secondary_lightmap_scaler",
+		"-secondary_light_bounces",
+		"-secondary_light_bounces_energy_threshold",
+		"-secondary_light_adaptive_step",
+		"-secondary_light_adaptive_threshold",
+		"-secondary_light_irradiance_cache_error",
+		"-secondary_light_denoise_iterations",
+		"-secondary_light_denoise_strength",
+		"-lightmaps_dilation_passes",
+		"-use_average_texture_color_for_luminous_surfaces",
+		"-atlas_packer",
+		"-backend",
+		"-cpu_secondary_light_pass_rays",
+	};
+
+	std::vector<std::string> job_args;
+	for( size_t i= 0u; i + 1u < job.arguments.size(); i++ )
+	{
+		const std::string& arg= job.arguments[i];
+		if( std::find( std::begin(c_worker_options), std::end(c_worker_options), arg ) == std::end(c_worker_options) )
+			continue;
+
+		job_args.push_back( arg );
+		job_args.push_back( job.arguments[ i + 1u ] );
+		i++;
+	}
+
+	// Threads of machine are divided between workers.
+	const unsigned int worker_threads= std::max( 1u, plbGetThreadCount( job.cfg.cpu_threads ) / job.workers );
+
+	for( unsigned int i= 0u; i < job.workers; i++ )
+	{
+		std::vector<std::string> args;
+		args.push_back( job.program_path );
+		args.insert( args.end(), job_args.begin(), job_args.end() );
+		// Light cache of command line is not used by jobs.
+		args.push_back( "-light_cache" );
+		args.push_back( job.cfg.light_cache_file );
+		args.push_back( "-cpu_threads" );
+		args.push_back( std::to_string( worker_threads ) );
+		args.push_back( "-worker" );
+		args.push_back( "-worker_shard" );
+		args.push_back( std::to_string( i ) );
+		args.push_back( "-worker_count" );
+		args.push_back( std::to_string( job.workers ) );
+
+		out_workers.emplace_back( new plb_WorkerProcess );
+		if( !out_workers.back()->Start( args ) )
+			return false;
+	}
+
+	std::cout << "Started " << job.workers << " workers" << std::endl;
+	return true;
+}
+
+static bool RunJob( const Options& job, plb_SharedResources& shared_resources )
+{
+	if( !LoadLoaderLibrary( ( std::string(job.game) + "_loader" ).c_str() ) )
+		return false;
+
+	plbProfilerReset();
+
+	// Workers load level in parallel with coordinator.
+	std::vector<std::unique_ptr<plb_WorkerProcess>> workers;
+	if( job.workers > 1u && !StartWorkers( job, workers ) )
+		return false;
+
+	std::unique_ptr<plb_LightmapsBuilder> lightmaps_builder(
+		new plb_LightmapsBuilder( job.map_path, job.cfg, &shared_resources ) );
+
+	const std::function<void()> wake_up_callback= MakeBatchProgressCallback();
+	if( workers.empty() )
+	{
+		lightmaps_builder->MakePrimaryLight( wake_up_callback );
+		lightmaps_builder->MakeSecondaryLight( wake_up_callback );
+	}
+	else
+	{
+		if( !lightmaps_builder->MakeLightWithWorkers( workers, wake_up_callback ) )
+			return false;
+
+		for( const std::unique_ptr<plb_WorkerProcess>& worker : workers )
+		{
+			if( !worker->Finish() )
+			{
+				std::cout << "Worker " << ( &worker - workers.data() ) << " failed" << std::endl;
+				return false;
+			}
+		}
+	}
+
+	const bool saved= SaveOutputs( *lightmaps_builder, job.map_path, job.output_path, job.output_bsp_path );
+	const bool trace_written= FinishProfiling( job.trace_path );
+	return saved && trace_written;
+}
+
+// Builds light of one shard in worker process. Binary messages are exchanged with coordinator via standard input and output.
+// Returns process exit code.
+static int RunWorker( const Options& options )
+{
+	FILE* const output= plbInitWorkerStreams();
+	if( output == nullptr )
+		return -1;
+
+	if( !LoadLoaderLibrary( ( std::string(options.game) + "_loader" ).c_str() ) )
+		return -1;
+
+	plbProfilerReset();
+
+	plb_LightmapsBuilder lightmaps_builder( options.map_path, options.cfg );
+	const bool ok= lightmaps_builder.RunWorker( stdin, output, MakeBatchProgressCallback() );
+	std::fclose( output );
+	return ok ? 0 : -1;
+}
+
+// Runs jobs one after another without preview. Window is hidden and used only for OpenGL context.
+// Loader libraries, textures and shaders are reused by jobs.
+// Returns process exit code.
+static int RunJobs( const std::vector<Options>& jobs )
+{
+	const bool need_opengl=
+		std::any_of(
+			jobs.begin(), jobs.end(),
+			[]( const Options& job ) { return job.cfg.backend == plb_Config::Backend::OpenGL; } );
+
+	SDL_GLContext gl_context= nullptr;
+	SDL_Window* const window= need_opengl ? InitVideo( 1024, 768, true, gl_context ) : nullptr;
+
+	const auto start_time= std::chrono::steady_clock::now();
+
+	unsigned int failed_jobs= 0u;
+	{
+		plb_SharedResources shared_resources;
+		for( const Options& job : jobs )
+		{
+			std::cout << "Job " << ( &job - jobs.data() ) + 1u << "/" << jobs.size() << ": " << job.map_path << std::endl;
+
+			if( !RunJob( job, shared_resources ) )
+			{
+				std::cout << "Job for \"" << job.map_path << "\" failed" << std::endl;
+				failed_jobs++;
+			}
+		}
+	} // Shared resources must be destroyed before OpenGL context.
+
+	if( jobs.size() > 1u )
+	{
+		const auto end_time= std::chrono::steady_clock::now();
+		std::cout << "Jobs done: " << jobs.size() - failed_jobs << "/" << jobs.size() << ". Time: " <<
+			std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time).count() << " s" << std::endl;
+	}
+
+	if( need_opengl )
+	{
+		SDL_GL_DeleteContext( gl_context );
+		SDL_DestroyWindow( window );
+		SDL_Quit();
+	}
+
+	return failed_jobs == 0u ? 0 : -1;
+}
+
+extern "C" int main(int argc, char *argv[])
+{
+	Options options;
+	options.cfg.textures_path= "textures/q3/";
+	options.program_path= argv[0];
+	if( !ParseArguments( argc, argv, options ) )
+		return -1;
+
+	if( options.worker )
+		return RunWorker( options );
+
+	std::deque<std::string> jobs_arguments;
+	std::vector<Options> jobs;
+	unsigned int skipped_jobs= 0u;
+	if( options.jobs_path != nullptr )
+		skipped_jobs= ReadJobs( options, jobs_arguments, jobs );
+	else
+	{
+		// CPU backend always works without window and OpenGL.
+		if( options.cfg.backend == plb_Config::Backend::CPU )
+			options.batch_mode= true;
+
+		if( options.batch_mode )
+		{
+			if( options.output_path == nullptr && options.output_bsp_path == nullptr )
+				FatalError( "Batch mode requires -out or -out_bsp" );
+			jobs.push_back( options );
+		}
+	}
+
+	if( !jobs.empty() )
+	{
+		// Skipped jobs are failed too.
+		const int result= RunJobs( jobs );
+		return skipped_jobs == 0u ? result : -1;
+	}
+
+	const char* const map_path= options.map_path;
+
+	plbProfilerReset();
+
+	LoadLoaderLibrary( ( std::string(options.game) + "_loader" ).c_str() );
+
+	const int screen_width= 1024, screen_height= 768;
+
+	SDL_GLContext gl_context= nullptr;
+	SDL_Window* const window= InitVideo( screen_width, screen_height, false, gl_context );
+
 	std::unique_ptr<plb_LightmapsBuilder> lightmaps_builder(
-		new plb_LightmapsBuilder( map_path, cfg ) );
+		new plb_LightmapsBuilder( map_path, options.cfg ) );
 
 	plb_CameraController cam_controller( m_Vec3(0.0f,0.0f,0.0f), m_Vec2(0.0f,0.0f), float(screen_width)/float(screen_height) );
 	m_Vec3 prev_pos= cam_controller.GetCamPos();
@@ -327,6 +882,9 @@ extern "C" int main(int argc, char *argv[])
 	preview_allowed= true;
 	lightmaps_builder->MakeSecondaryLight( main_loop_iteration );
 
+	SaveOutputs( *lightmaps_builder, map_path, options.output_path, options.output_bsp_path );
+	FinishProfiling( options.trace_path );
+
 	do
 	{
 		force_redraw = true;
@@ -36,6 +36,21 @@ void plbGetInvLightmapBasisMatrix(
 	out_mat.Inverse();
 }
 
+m_Vec3 plbGetPointLightColor( const plb_PointLight& light )
+{
+	m_Vec3 light_color;
+	unsigned char max_color_component= 1;
+	for( int j= 0; j< 3; j++ )
+	{
+		unsigned char c= light.color[j];
+		light_color.ToArr()[j]= light.intensity * float(c) / 255.0f;
+		if( c > max_color_component ) max_color_component= c;
+	}
+	light_color/= float(max_color_component) / 255.0f;
+
+	return light_color;
+}
+
 m_Vec3 plbGetPolygonCenter(
 	const plb_Polygon& poly,
 	const plb_Vertices& vertices,
@@ -38,6 +38,9 @@ void plbGetInvLightmapBasisMatrix(
 	m_Mat3& out_mat );
 
 
+// Light color of point light source. Color is normalized by largest component, intensity is not changed.
+m_Vec3 plbGetPointLightColor( const plb_PointLight& light );
+
 m_Vec3 plbGetPolygonCenter(
 	const plb_Polygon& poly,
 	const plb_Vertices& vertices,
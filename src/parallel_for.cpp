@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "parallel_for.hpp"
+
+unsigned int plbGetThreadCount( const unsigned int requested_threads )
+{
+	if( requested_threads != 0u )
+		return requested_threads;
+
+	const unsigned int hardware_threads= std::thread::hardware_concurrency();
+	return hardware_threads == 0u ? 1u : hardware_threads;
+}
+
+void plbParallelFor(
+	const unsigned int count,
+	const unsigned int thread_count,
+	const std::function<void( unsigned int begin, unsigned int end, unsigned int thread_number )>& func )
+{
+	if( count == 0u )
+		return;
+
+	if( thread_count <= 1u )
+	{
+		func( 0u, count, 0u );
+		return;
+	}
+
+	// Use many small chunks for better balancing - cost of elements may be very different.
+	const unsigned int c_chunks_per_thread= 16u;
+	const unsigned int chunk_size= std::max( 1u, count / ( thread_count * c_chunks_per_thread ) );
+
+	std::atomic<unsigned int> next_chunk_begin( 0u );
+
+	const auto thread_func=
+	[&]( const unsigned int thread_number )
+	{
+		while(1)
+		{
+			const unsigned int begin= next_chunk_begin.fetch_add( chunk_size );
+			if( begin >= count )
+				break;
+
+			func( begin, std::min( begin + chunk_size, count ), thread_number );
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve( thread_count - 1u );
+	for( unsigned int i= 1u; i < thread_count; i++ )
+		threads.emplace_back( thread_func, i );
+
+	thread_func( 0u );
+
+	for( std::thread& thread : threads )
+		thread.join();
+}
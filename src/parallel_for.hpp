@@ -0,0 +1,14 @@
+#pragma once
+#include <functional>
+
+// Returns number of worker threads for multithreaded stages.
+// requested_threads - value from config, 0 means "all hardware threads".
+unsigned int plbGetThreadCount( unsigned int requested_threads );
+
+// Splits range [0; count) into chunks and processes it in thread_count threads.
+// Function gets range [begin; end) and number of thread, which processes this range.
+// Each thread number is in range [0; thread_count), so per-thread scratch buffers may be used.
+void plbParallelFor(
+	unsigned int count,
+	unsigned int thread_count,
+	const std::function<void( unsigned int begin, unsigned int end, unsigned int thread_number )>& func );
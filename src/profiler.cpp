@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "profiler.hpp"
+
+struct ProfilerStage
+{
+	const char* name;
+	unsigned int thread_index;
+	uint64_t start_us; // From profiler epoch
+	uint64_t duration_us;
+};
+
+struct ProfilerData
+{
+	std::mutex mutex;
+	std::vector<ProfilerStage> stages; // Guarded by mutex.
+	std::chrono::steady_clock::time_point epoch= std::chrono::steady_clock::now(); // Guarded by mutex.
+
+	std::atomic<uint64_t> counters[ static_cast<size_t>(plb_ProfilerCounter::NumCounters) ];
+	std::atomic<unsigned int> next_thread_index{ 0u };
+};
+
+static const char* const g_counters_names[ static_cast<size_t>(plb_ProfilerCounter::NumCounters) ]=
+{
+	"triangles drawn",
+	"texels processed",
+	"lights culled",
+	"bytes uploaded",
+};
+
+static ProfilerData& GetProfilerData()
+{
+	static ProfilerData data;
+	return data;
+}
+
+static unsigned int GetThreadIndex()
+{
+	thread_local const unsigned int index= GetProfilerData().next_thread_index.fetch_add( 1u );
+	return index;
+}
+
+static uint64_t GetMicroseconds( const std::chrono::steady_clock::duration duration )
+{
+	return uint64_t( std::chrono::duration_cast<std::chrono::microseconds>( duration ).count() );
+}
+
+static std::string EscapeJSONString( const char* str )
+{
+	std::string result;
+	for( ; *str != '\0'; str++ )
+	{
+		if( *str == '"' || *str == '\\' )
+			result.push_back( '\\' );
+		result.push_back( *str );
+	}
+	return result;
+}
+
+void plbProfilerAddCounter( const plb_ProfilerCounter counter, const uint64_t value )
+{
+	GetProfilerData().counters[ static_cast<size_t>(counter) ].fetch_add( value, std::memory_order_relaxed );
+}
+
+plb_ProfilerScope::plb_ProfilerScope( const char* const name )
+	: name_( name ), start_time_( std::chrono::steady_clock::now() )
+{}
+
+plb_ProfilerScope::~plb_ProfilerScope()
+{
+	const auto end_time= std::chrono::steady_clock::now();
+	const unsigned int thread_index= GetThreadIndex();
+
+	ProfilerData& data= GetProfilerData();
+	std::lock_guard<std::mutex> lock( data.mutex );
+
+	ProfilerStage stage;
+	stage.name= name_;
+	stage.thread_index= thread_index;
+	stage.start_us= start_time_ > data.epoch ? GetMicroseconds( start_time_ - data.epoch ) : 0u;
+	stage.duration_us= GetMicroseconds( end_time - start_time_ );
+	data.stages.push_back( stage );
+}
+
+void plbProfilerPrintSummary()
+{
+	ProfilerData& data= GetProfilerData();
+	std::lock_guard<std::mutex> lock( data.mutex );
+
+	// Aggregate stages with same name, preserve order of first end of stage.
+	struct StageSummary
+	{
+		const char* name;
+		uint64_t total_us;
+		unsigned int calls;
+	};
+	std::vector<StageSummary> summary;
+	for( const ProfilerStage& stage : data.stages )
+	{
+		StageSummary* stage_summary= nullptr;
+		for( StageSummary& s : summary )
+			if( std::string( s.name ) == stage.name )
+				stage_summary= &s;
+
+		if( stage_summary == nullptr )
+		{
+			summary.push_back( StageSummary{ stage.name, 0u, 0u } );
+			stage_summary= &summary.back();
+		}
+		stage_summary->total_us+= stage.duration_us;
+		stage_summary->calls++;
+	}
+
+	const std::ios_base::fmtflags cout_flags= std::cout.flags();
+	const std::streamsize cout_precision= std::cout.precision();
+
+	std::cout << "Build stages (time of nested stages is included):" << std::endl;
+	for( const StageSummary& s : summary )
+		std::cout << "  " << std::left << std::setw(32) << s.name << std::right <<
+			std::fixed << std::setprecision(3) << std::setw(10) << double(s.total_us) / 1000000.0 << " s" <<
+			std::setw(8) << s.calls << " calls" << std::endl;
+
+	std::cout << "Counters:" << std::endl;
+	for( unsigned int i= 0u; i < static_cast<unsigned int>(plb_ProfilerCounter::NumCounters); i++ )
+		std::cout << "  " << std::left << std::setw(32) << g_counters_names[i] << std::right <<
+			std::setw(16) << data.counters[i].load() << std::endl;
+
+	std::cout.flags( cout_flags );
+	std::cout.precision( cout_precision );
+}
+
+bool plbProfilerWriteTrace( const char* const file_name )
+{
+	ProfilerData& data= GetProfilerData();
+	std::lock_guard<std::mutex> lock( data.mutex );
+
+	std::ofstream file( file_name );
+	if( !file.is_open() )
+	{
+		std::cout << "Can not open trace file \"" << file_name << "\"" << std::endl;
+		return false;
+	}
+
+	file << "{\"traceEvents\":[\n";
+
+	uint64_t end_us= 0u;
+	for( const ProfilerStage& stage : data.stages )
+	{
+		file << "{\"name\":\"" << EscapeJSONString( stage.name ) << "\",\"cat\":\"build\",\"ph\":\"X\"," <<
+			"\"ts\":" << stage.start_us << ",\"dur\":" << stage.duration_us << "," <<
+			"\"pid\":1,\"tid\":" << stage.thread_index << "},\n";
+		end_us= std::max( end_us, stage.start_us + stage.duration_us );
+	}
+
+	// Counters are totals, so, write them once, at end of trace.
+	for( unsigned int i= 0u; i < static_cast<unsigned int>(plb_ProfilerCounter::NumCounters); i++ )
+	{
+		file << "{\"name\":\"" << g_counters_names[i] << "\",\"ph\":\"C\",\"ts\":" << end_us << ",\"pid\":1," <<
+			"\"args\":{\"value\":" << data.counters[i].load() << "}}" <<
+			( i + 1u < static_cast<unsigned int>(plb_ProfilerCounter::NumCounters) ? ",\n" : "\n" );
+	}
+
+	file << "],\"displayTimeUnit\":\"ms\"}\n";
+
+	if( file.fail() )
+	{
+		std::cout << "Can not write trace file \"" << file_name << "\"" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+void plbProfilerReset()
+{
+	ProfilerData& data= GetProfilerData();
+	std::lock_guard<std::mutex> lock( data.mutex );
+
+	data.stages.clear();
+	data.epoch= std::chrono::steady_clock::now();
+	for( std::atomic<uint64_t>& counter : data.counters )
+		counter.store( 0u );
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+// Lightweight instrumentation of lightmaps building - scoped timers of build stages and global counters.
+// Timers and counters may be used from any thread.
+
+enum class plb_ProfilerCounter : unsigned int
+{
+	TrianglesDrawn,
+	TexelsProcessed,
+	LightsCulled, // Lights without lightmap texels inside light cutoff radius.
+	BytesUploaded, // Bytes, transferred to GPU.
+
+	NumCounters
+};
+
+void plbProfilerAddCounter( plb_ProfilerCounter counter, uint64_t value );
+
+// Measures time from construction to destruction and records it as stage with given name.
+// Name must be string literal.
+class plb_ProfilerScope final
+{
+public:
+	explicit plb_ProfilerScope( const char* name );
+	~plb_ProfilerScope();
+
+	plb_ProfilerScope( const plb_ProfilerScope& )= delete;
+	plb_ProfilerScope& operator=( const plb_ProfilerScope& )= delete;
+
+private:
+	const char* const name_;
+	const std::chrono::steady_clock::time_point start_time_;
+};
+
+// Prints total time and calls count of each stage and values of counters.
+void plbProfilerPrintSummary();
+
+// Writes recorded stages and counters in Chrome trace event format (JSON).
+// Result may be opened in Perfetto UI or "chrome://tracing".
+// Returns true on success.
+bool plbProfilerWriteTrace( const char* file_name );
+
+// Clears recorded stages and counters.
+void plbProfilerReset();
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <cstring>
+#include <iostream>
 #include <vector>
 
 #include <vec.hpp>
@@ -23,6 +24,8 @@ extern "C"
 
 }
 
+static const unsigned int g_no_polygon= ~0u;
+
 static void LoadMaterials(
 	plb_Materials& out_materials,
 	plb_ImageInfos& out_textures )
@@ -79,8 +82,11 @@ static void LoadPolygons(
 	plb_Polygons& out_polygons,
 	std::vector<unsigned int>& out_indeces,
 	plb_Polygons& out_sky_polygons,
-	std::vector<unsigned int>& out_sky_indeces )
+	std::vector<unsigned int>& out_sky_indeces,
+	std::vector<unsigned int>& out_faces_polygons )
 {
+	out_faces_polygons.assign( numfaces, g_no_polygon );
+
 	for( const dmodel_t* model= dmodels; model < dmodels + nummodels; model++ )
 	{
 		const unsigned int model_number= model - dmodels;
@@ -106,6 +112,9 @@ static void LoadPolygons(
 			current_polygons.emplace_back();
 			plb_Polygon& poly= current_polygons.back();
 
+			if( !is_sky )
+				out_faces_polygons[ face - dfaces ]= out_polygons.size() - 1u;
+
 			const float side= face->side == 0 ? 1.0f : -1.0f;
 			poly.normal[0]= dplanes[ face->planenum ].normal[0] * side;
 			poly.normal[1]= dplanes[ face->planenum ].normal[1] * side;
@@ -218,6 +227,63 @@ static void LoadPolygons(
 	} // for models
 }
 
+static void LoadVisibility(
+	const std::vector<unsigned int>& faces_polygons,
+	plb_VisibilityData& out_visibility )
+{
+	if( visdatasize <= 0 || numnodes <= 0 || dmodels[0].headnode != 0 )
+		return;
+
+	const unsigned int cluster_count= static_cast<unsigned int>( dvis->numclusters );
+
+	out_visibility.nodes.resize( numnodes );
+	for( unsigned int i= 0; i < (unsigned int)numnodes; i++ )
+	{
+		const dnode_t& in_node= dnodes[i];
+		const dplane_t& plane= dplanes[ in_node.planenum ];
+		plb_VisibilityData::Node& out_node= out_visibility.nodes[i];
+
+		for( unsigned int j= 0; j < 3; j++ )
+			out_node.plane[j]= plane.normal[j];
+		out_node.plane[3]= plane.dist;
+
+		for( unsigned int j= 0; j < 2; j++ )
+			out_node.children[j]= in_node.children[j]; // Leafs are "-1 - leaf" too.
+	}
+
+	std::vector< std::pair<unsigned int, unsigned int> > clusters_surfaces;
+
+	out_visibility.leafs_clusters.resize( numleafs );
+	for( unsigned int l= 0; l < (unsigned int)numleafs; l++ )
+	{
+		const dleaf_t& leaf= dleafs[l];
+		const bool is_valid_cluster= leaf.cluster >= 0 && (unsigned int)leaf.cluster < cluster_count;
+		out_visibility.leafs_clusters[l]= is_valid_cluster ? int(leaf.cluster) : -1;
+		if( !is_valid_cluster )
+			continue;
+
+		for( unsigned int i= 0; i < leaf.numleaffaces; i++ )
+		{
+			const unsigned int polygon_index= faces_polygons[ dleaffaces[ leaf.firstleafface + i ] ];
+			if( polygon_index != g_no_polygon )
+				clusters_surfaces.emplace_back( leaf.cluster, polygon_index );
+		}
+	}
+
+	out_visibility.cluster_count= cluster_count;
+	out_visibility.cluster_row_size= ( cluster_count + 7u ) / 8u;
+	out_visibility.clusters_visibility.resize( cluster_count * out_visibility.cluster_row_size );
+
+	for( unsigned int c= 0; c < cluster_count; c++ )
+		plbDecompressQuakeVisibilityRow(
+			dvisdata + dvis->bitofs[c][DVIS_PVS], dvisdata + visdatasize,
+			out_visibility.cluster_row_size,
+			out_visibility.clusters_visibility.data() + c * out_visibility.cluster_row_size );
+
+	plbSetClustersSurfaces( clusters_surfaces, out_visibility );
+	plbTransformVisibilityFromQuakeSystem( out_visibility );
+}
+
 static void ParseColor( const char* str, unsigned char* out_color )
 {
 	double rgb[3];
@@ -380,9 +446,13 @@ PLB_DLL_FUNC void LoadBsp(
 
 	LoadMaterials( level_data.materials, level_data.textures );
 
+	std::vector<unsigned int> faces_polygons;
 	LoadPolygons(
 		level_data.vertices, level_data.polygons, level_data.polygons_indeces,
-		level_data.sky_polygons, level_data.sky_polygons_indeces );
+		level_data.sky_polygons, level_data.sky_polygons_indeces,
+		faces_polygons );
+
+	LoadVisibility( faces_polygons, level_data.visibility );
 
 	plbTransformCoordinatesFromQuakeSystem(
 		level_data.polygons,
@@ -392,3 +462,95 @@ PLB_DLL_FUNC void LoadBsp(
 
 	GetBSPLights( level_data.point_lights, level_data.cone_lights );
 }
+
+PLB_DLL_FUNC bool SaveBsp(
+	const char* in_file_name,
+	const char* out_file_name,
+	const plb_Config& config,
+	const plb_LevelData& level_data,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas )
+{
+	LoadBSPFile( const_cast<char*>(in_file_name) );
+
+	std::vector<m_Vec3> face_vertices;
+	std::vector<m_Vec3> face_light;
+
+	unsigned int polygon_number= 0u;
+	for( const dmodel_t* model= dmodels; model < dmodels + nummodels; model++ )
+	{
+		for(
+			dface_t* face= dfaces + model->firstface;
+			face < dfaces + model->firstface + model->numfaces;
+			face++ )
+		{
+			// Skip faces in same way, as in "LoadPolygons".
+			const texinfo_t& tex= texinfo[ face->texinfo ];
+			if( ( tex.flags & (SURF_SKY | SURF_NODRAW | SURF_SKIP) ) != 0 )
+				continue;
+
+			if( polygon_number >= level_data.polygons.size() )
+			{
+				std::cout << "BSP file \"" << in_file_name << "\" does not match level data" << std::endl;
+				return false;
+			}
+
+			const plb_Polygon& poly= level_data.polygons[ polygon_number ];
+			polygon_number++;
+
+			if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 )
+				continue;
+
+			face_vertices.resize( face->numedges );
+			for( unsigned int i= 0; i < (unsigned int)face->numedges; i++ )
+			{
+				const int e= dsurfedges[ face->firstedge + i ];
+				const dvertex_t& in_vertex=
+					e >= 0
+						? dvertexes[ dedges[+e].v[0] ]
+						: dvertexes[ dedges[-e].v[1] ];
+
+				face_vertices[i]= m_Vec3( in_vertex.point );
+			}
+
+			const dplane_t& plane= dplanes[ face->planenum ];
+
+			unsigned int lightmap_size[2];
+			if( !plbCalculateQuakeFaceLightmap(
+					config,
+					primary_atlas, secondary_atlas,
+					level_data, poly,
+					face_vertices,
+					tex.vecs,
+					m_Vec3( plane.normal ), plane.dist,
+					lightmap_size, face_light ) )
+				continue;
+
+			// Replace first light style of face. Allocate new lightmap, if face has no lightmap.
+			if( face->lightofs < 0 || face->styles[0] == 255 )
+			{
+				if( lightdatasize + int( face_light.size() * 3u ) > MAX_MAP_LIGHTING )
+				{
+					std::cout << "Lighting data overflow" << std::endl;
+					return false;
+				}
+
+				face->lightofs= lightdatasize;
+				lightdatasize+= face_light.size() * 3u;
+
+				face->styles[0]= 0;
+				for( unsigned int i= 1; i < MAXLIGHTMAPS; i++ )
+					face->styles[i]= 255;
+			}
+
+			byte* const dst= dlightdata + face->lightofs;
+			for( unsigned int i= 0; i < face_light.size(); i++ )
+				plbLightToBSPLightmapColor( config, face_light[i], dst + i * 3u );
+		} // for faces
+	} // for models
+
+	WriteBSPFile( const_cast<char*>(out_file_name) );
+
+	std::cout << "BSP file with new lightmaps saved to \"" << out_file_name << "\"" << std::endl;
+	return true;
+}
@@ -17,6 +17,8 @@ extern "C"
 
 #include <vec.hpp>
 
+static const unsigned int g_no_surface= ~0u;
+static const unsigned int g_curve_surface_flag= 1u << 31u;
 
 // HACK. Use system-specific functions for "listfiles"
 #ifdef _WIN32
@@ -390,9 +392,11 @@ static void BuildPolygons(
 	std::vector<unsigned int>& out_indeces, std::vector<unsigned int>& out_sky_indeces,
 	std::vector<plb_CurvedSurface>& out_curves, std::vector<plb_Vertex>& out_curves_vertices,
 	plb_LevelModels& out_models,
-	plb_Vertices& out_models_vertices, plb_Normals& out_models_normals, std::vector<unsigned int>& out_models_indeces )
+	plb_Vertices& out_models_vertices, plb_Normals& out_models_normals, std::vector<unsigned int>& out_models_indeces,
+	std::vector<unsigned int>& out_draw_surfaces_map )
 {
 	out_polygons.reserve( numDrawSurfaces );
+	out_draw_surfaces_map.assign( numDrawSurfaces, g_no_surface );
 
 	for( const dsurface_t* p= drawSurfaces; p < drawSurfaces + numDrawSurfaces; p++ )
 	{
@@ -436,6 +440,9 @@ static void BuildPolygons(
 
 			polygon.flags= SurfaceFlagsForBSPSurface( *p );
 
+			if( !is_sky )
+				out_draw_surfaces_map[ p - drawSurfaces ]= out_polygons.size();
+
 			(is_sky ? out_sky_polygons : out_polygons).push_back(polygon);
 		}// if normal polygon
 		else if( p->surfaceType == MST_PATCH )// curve
@@ -479,6 +486,8 @@ static void BuildPolygons(
 
 			surf.flags= SurfaceFlagsForBSPSurface( *p );
 
+			out_draw_surfaces_map[ p - drawSurfaces ]= out_curves.size() | g_curve_surface_flag;
+
 			out_curves.push_back(surf);
 		}// if curve
 		else if( p->surfaceType == MST_TRIANGLE_SOUP )
@@ -530,6 +539,79 @@ static void BuildPolygons(
 	}// for polygons
 }
 
+static void LoadVisibility(
+	const std::vector<unsigned int>& draw_surfaces_map,
+	const unsigned int polygon_count,
+	plb_VisibilityData& out_visibility )
+{
+	if( numVisBytes <= VIS_HEADER || numnodes <= 0 )
+		return;
+
+	const unsigned int cluster_count= static_cast<unsigned int>( reinterpret_cast<const int*>(visBytes)[0] );
+	const unsigned int cluster_row_size= static_cast<unsigned int>( reinterpret_cast<const int*>(visBytes)[1] );
+	if( cluster_count == 0u ||
+		cluster_row_size < ( cluster_count + 7u ) / 8u ||
+		VIS_HEADER + cluster_count * cluster_row_size > (unsigned int)numVisBytes )
+	{
+		std::cout << "Invalid visibility data" << std::endl;
+		return;
+	}
+
+	out_visibility.nodes.resize( numnodes );
+	for( unsigned int i= 0; i < (unsigned int)numnodes; i++ )
+	{
+		const dnode_t& in_node= dnodes[i];
+		const dplane_t& plane= dplanes[ in_node.planeNum ];
+		plb_VisibilityData::Node& out_node= out_visibility.nodes[i];
+
+		for( unsigned int j= 0; j < 3; j++ )
+			out_node.plane[j]= plane.normal[j];
+		out_node.plane[3]= plane.dist;
+
+		for( unsigned int j= 0; j < 2; j++ )
+			out_node.children[j]= in_node.children[j]; // Leafs are "-1 - leaf" too.
+	}
+
+	std::vector< std::pair<unsigned int, unsigned int> > clusters_surfaces;
+
+	out_visibility.leafs_clusters.resize( numleafs );
+	for( unsigned int l= 0; l < (unsigned int)numleafs; l++ )
+	{
+		const dleaf_t& leaf= dleafs[l];
+		const bool is_valid_cluster= leaf.cluster >= 0 && (unsigned int)leaf.cluster < cluster_count;
+		out_visibility.leafs_clusters[l]= is_valid_cluster ? leaf.cluster : -1;
+		if( !is_valid_cluster )
+			continue;
+
+		for( int i= 0; i < leaf.numLeafSurfaces; i++ )
+		{
+			const unsigned int surface= draw_surfaces_map[ dleafsurfaces[ leaf.firstLeafSurface + i ] ];
+			if( surface == g_no_surface )
+				continue;
+
+			// Curves are placed after polygons.
+			const unsigned int surface_index=
+				( surface & g_curve_surface_flag ) != 0u
+					? polygon_count + ( surface & ~g_curve_surface_flag )
+					: surface;
+			clusters_surfaces.emplace_back( leaf.cluster, surface_index );
+		}
+	}
+
+	// Quake3 visibility data is not compressed.
+	out_visibility.cluster_count= cluster_count;
+	out_visibility.cluster_row_size= ( cluster_count + 7u ) / 8u;
+	out_visibility.clusters_visibility.resize( cluster_count * out_visibility.cluster_row_size );
+	for( unsigned int c= 0; c < cluster_count; c++ )
+		std::memcpy(
+			out_visibility.clusters_visibility.data() + c * out_visibility.cluster_row_size,
+			visBytes + VIS_HEADER + c * cluster_row_size,
+			out_visibility.cluster_row_size );
+
+	plbSetClustersSurfaces( clusters_surfaces, out_visibility );
+	plbTransformVisibilityFromQuakeSystem( out_visibility );
+}
+
 static void TransformCurves(
 	plb_CurvedSurfaces& curves,
 	plb_Vertices& curves_vertices )
@@ -781,13 +863,17 @@ PLB_DLL_FUNC void LoadBsp(
 
 	LoadVertices( level_data.vertices );
 
+	std::vector<unsigned int> draw_surfaces_map;
 	BuildPolygons(
 		shader_num_to_material_index,
 		level_data.polygons, level_data.sky_polygons,
 		level_data.polygons_indeces, level_data.sky_polygons_indeces,
 		level_data.curved_surfaces , level_data.curved_surfaces_vertices,
 		level_data.models,
-		level_data.models_vertices, level_data.models_normals, level_data.models_indeces );
+		level_data.models_vertices, level_data.models_normals, level_data.models_indeces,
+		draw_surfaces_map );
+
+	LoadVisibility( draw_surfaces_map, level_data.polygons.size(), level_data.visibility );
 
 	plbTransformCoordinatesFromQuakeSystem(
 		level_data.polygons, level_data.vertices,
@@ -801,3 +887,167 @@ PLB_DLL_FUNC void LoadBsp(
 	ParseEntities();
 	GetBSPLights( level_data.point_lights, level_data.cone_lights );
 }
+
+// Returns affine transformation from coordinates of original lightmap to coordinates in lightmaps atlas,
+// based on lightmap coordinates of curve grid corners.
+static bool GetCurveLightmapTransform(
+	const dsurface_t& surf,
+	const plb_CurvedSurface& curve,
+	const plb_Vertices& curves_vertices,
+	const plb_LightmapsAtlasView& primary_atlas,
+	m_Vec2 (&out_lightmap_vecs)[3],
+	m_Vec2 (&out_atlas_vecs)[3] )
+{
+	const unsigned int corners[3]=
+	{
+		0u,
+		curve.grid_size[0] - 1u,
+		( curve.grid_size[1] - 1u ) * curve.grid_size[0],
+	};
+
+	m_Vec2 lightmap_coord[3], atlas_coord[3];
+	for( unsigned int i= 0; i < 3; i++ )
+	{
+		const drawVert_t& in_vertex= drawVerts[ surf.firstVert + corners[i] ];
+		lightmap_coord[i]=
+			m_Vec2(
+				in_vertex.lightmap[0] * float(LIGHTMAP_WIDTH ) - float(surf.lightmapX),
+				in_vertex.lightmap[1] * float(LIGHTMAP_HEIGHT) - float(surf.lightmapY) );
+
+		const plb_Vertex& vertex= curves_vertices[ curve.first_vertex_number + corners[i] ];
+		atlas_coord[i]=
+			m_Vec2(
+				vertex.lightmap_coord[0] * float(primary_atlas.size[0]),
+				vertex.lightmap_coord[1] * float(primary_atlas.size[1]) );
+	}
+
+	out_lightmap_vecs[0]= lightmap_coord[0];
+	out_lightmap_vecs[1]= lightmap_coord[1] - lightmap_coord[0];
+	out_lightmap_vecs[2]= lightmap_coord[2] - lightmap_coord[0];
+	out_atlas_vecs[0]= atlas_coord[0];
+	out_atlas_vecs[1]= atlas_coord[1] - atlas_coord[0];
+	out_atlas_vecs[2]= atlas_coord[2] - atlas_coord[0];
+
+	const float det= out_lightmap_vecs[1].x * out_lightmap_vecs[2].y - out_lightmap_vecs[1].y * out_lightmap_vecs[2].x;
+	return std::abs(det) > 1e-6f;
+}
+
+PLB_DLL_FUNC bool SaveBsp(
+	const char* in_file_name,
+	const char* out_file_name,
+	const plb_Config& config,
+	const plb_LevelData& level_data,
+	const plb_LightmapsAtlasView& primary_atlas,
+	const plb_LightmapsAtlasView& secondary_atlas )
+{
+	LoadBSPFile( in_file_name );
+
+	const unsigned int lightmap_texels= LIGHTMAP_WIDTH * LIGHTMAP_HEIGHT;
+	const unsigned int lightmap_count= numLightBytes / ( lightmap_texels * 3 );
+
+	const auto write_texel=
+	[&]( const dsurface_t& surf, const unsigned int s, const unsigned int t, const m_Vec3& light )
+	{
+		byte* const dst=
+			lightBytes +
+			3u * (
+				unsigned(surf.lightmapNum) * lightmap_texels +
+				( unsigned(surf.lightmapY) + t ) * LIGHTMAP_WIDTH +
+				unsigned(surf.lightmapX) + s );
+
+		plbLightToBSPLightmapColor( config, light, dst );
+	};
+
+	unsigned int polygon_number= 0u;
+	unsigned int curve_number= 0u;
+	for( const dsurface_t* p= drawSurfaces; p < drawSurfaces + numDrawSurfaces; p++ )
+	{
+		// Select surfaces in same way, as in "BuildPolygons".
+		if( p->surfaceType == MST_PLANAR
+			&& (dshaders[p->shaderNum].surfaceFlags & (SURF_NODRAW) ) == 0
+			&& (dshaders[p->shaderNum].contentFlags & (CONTENTS_FOG) ) == 0
+			)
+		{
+			if( (dshaders[p->shaderNum].surfaceFlags & SURF_SKY) != 0 )
+				continue;
+
+			if( polygon_number >= level_data.polygons.size() )
+			{
+				std::cout << "BSP file \"" << in_file_name << "\" does not match level data" << std::endl;
+				return false;
+			}
+
+			const plb_Polygon& poly= level_data.polygons[ polygon_number ];
+			polygon_number++;
+
+			if( ( poly.flags & plb_SurfaceFlags::NoLightmap ) != 0 ||
+				p->lightmapNum < 0 || unsigned(p->lightmapNum) >= lightmap_count )
+				continue;
+
+			// Lightmap texels of Quake-III are sampled in points origin + s * vecs[0] + t * vecs[1].
+			for( unsigned int t= 0; t < (unsigned int)p->lightmapHeight; t++ )
+			for( unsigned int s= 0; s < (unsigned int)p->lightmapWidth; s++ )
+			{
+				const m_Vec3 pos=
+					plbTransformVectorFromQuakeSystem(
+						m_Vec3( p->lightmapOrigin ) +
+						m_Vec3( p->lightmapVecs[0] ) * float(s) +
+						m_Vec3( p->lightmapVecs[1] ) * float(t) );
+
+				write_texel(
+					*p, s, t,
+					plbFetchAtlasLight(
+						config,
+						primary_atlas, secondary_atlas,
+						poly.lightmap_data,
+						plbGetPolygonAtlasCoord( poly, pos ) ) );
+			}
+		}
+		else if( p->surfaceType == MST_PATCH )
+		{
+			if( curve_number >= level_data.curved_surfaces.size() )
+			{
+				std::cout << "BSP file \"" << in_file_name << "\" does not match level data" << std::endl;
+				return false;
+			}
+
+			const plb_CurvedSurface& curve= level_data.curved_surfaces[ curve_number ];
+			curve_number++;
+
+			if( ( curve.flags & plb_SurfaceFlags::NoLightmap ) != 0 ||
+				p->lightmapNum < 0 || unsigned(p->lightmapNum) >= lightmap_count )
+				continue;
+
+			m_Vec2 lightmap_vecs[3], atlas_vecs[3];
+			if( !GetCurveLightmapTransform(
+					*p, curve, level_data.curved_surfaces_vertices, primary_atlas,
+					lightmap_vecs, atlas_vecs ) )
+				continue;
+
+			const float inv_det=
+				1.0f / ( lightmap_vecs[1].x * lightmap_vecs[2].y - lightmap_vecs[1].y * lightmap_vecs[2].x );
+
+			for( unsigned int t= 0; t < (unsigned int)p->lightmapHeight; t++ )
+			for( unsigned int s= 0; s < (unsigned int)p->lightmapWidth; s++ )
+			{
+				// Express texel center via lightmap coordinates of grid corners.
+				const m_Vec2 d= m_Vec2( float(s) + 0.5f, float(t) + 0.5f ) - lightmap_vecs[0];
+				const float a= ( d.x * lightmap_vecs[2].y - d.y * lightmap_vecs[2].x ) * inv_det;
+				const float b= ( lightmap_vecs[1].x * d.y - lightmap_vecs[1].y * d.x ) * inv_det;
+
+				write_texel(
+					*p, s, t,
+					plbFetchAtlasLight(
+						config,
+						primary_atlas, secondary_atlas,
+						curve.lightmap_data,
+						atlas_vecs[0] + atlas_vecs[1] * a + atlas_vecs[2] * b ) );
+			}
+		}
+	}
+
+	WriteBSPFile( out_file_name );
+
+	std::cout << "BSP file with new lightmaps saved to \"" << out_file_name << "\"" << std::endl;
+	return true;
+}
@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "secondary_light_checkpoint.hpp"
+
+uint64_t plbHashData( const void* const data, const size_t size, uint64_t hash )
+{
+	const unsigned char* const bytes= static_cast<const unsigned char*>(data);
+	for( size_t i= 0u; i < size; i++ )
+	{
+		hash^= uint64_t(bytes[i]);
+		hash*= 1099511628211ull;
+	}
+	return hash;
+}
+
+bool plbWriteSecondaryLightCheckpoint( const char* const file_name, const plb_SecondaryLightCheckpoint& checkpoint )
+{
+	const std::string temp_file_name= std::string( file_name ) + ".tmp";
+
+	FILE* const f= std::fopen( temp_file_name.c_str(), "wb" );
+	if( f == nullptr )
+	{
+		std::cout << "Can not open file: " << temp_file_name << std::endl;
+		return false;
+	}
+
+	bool ok= true;
+	const auto write=
+	[&]( const void* data, size_t size )
+	{
+		if( ok && size > 0u && std::fwrite( data, 1, size, f ) != size )
+			ok= false;
+	};
+
+	plb_SecondaryLightCheckpointHeader header;
+	std::memset( &header, 0, sizeof(header) );
+	std::strncpy( header.id, PLB_SECONDARY_LIGHT_CHECKPOINT_FILE_ID, sizeof(header.id) );
+	header.version= PLB_SECONDARY_LIGHT_CHECKPOINT_FILE_VERSION;
+	header.complete= checkpoint.complete ? 1u : 0u;
+	header.key= checkpoint.key;
+	for( unsigned int i= 0; i < 3; i++ )
+		header.atlas_size[i]= checkpoint.atlas_size[i];
+	header.bounce= checkpoint.bounce;
+	header.items_done= checkpoint.items_done;
+	header.bounce_light_size= checkpoint.bounce_light.size();
+	header.previous_bounce_light_size= checkpoint.previous_bounce_light.size();
+	header.accumulated_light_size= checkpoint.accumulated_light.size();
+	header.first_bounce_energy= checkpoint.first_bounce_energy;
+	write( &header, sizeof(header) );
+
+	write( checkpoint.bounce_light.data(), checkpoint.bounce_light.size() * sizeof(float) );
+	write( checkpoint.previous_bounce_light.data(), checkpoint.previous_bounce_light.size() * sizeof(float) );
+	write( checkpoint.accumulated_light.data(), checkpoint.accumulated_light.size() * sizeof(float) );
+
+	if( std::fclose(f) != 0 )
+		ok= false;
+
+	if( !ok )
+	{
+		std::cout << "Error, writing file: " << temp_file_name << std::endl;
+		std::remove( temp_file_name.c_str() );
+		return false;
+	}
+
+	// Rename does not replace existing files on some systems.
+	std::remove( file_name );
+	if( std::rename( temp_file_name.c_str(), file_name ) != 0 )
+	{
+		std::cout << "Can not rename \"" << temp_file_name << "\" to \"" << file_name << "\"" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool plbReadSecondaryLightCheckpoint( const char* const file_name, plb_SecondaryLightCheckpoint& out_checkpoint )
+{
+	FILE* const f= std::fopen( file_name, "rb" );
+	if( f == nullptr )
+		return false;
+
+	bool ok= true;
+	const auto read=
+	[&]( void* data, size_t size )
+	{
+		if( ok && size > 0u && std::fread( data, 1, size, f ) != size )
+			ok= false;
+	};
+
+	plb_SecondaryLightCheckpointHeader header;
+	read( &header, sizeof(header) );
+
+	ok= ok &&
+		std::strncmp( header.id, PLB_SECONDARY_LIGHT_CHECKPOINT_FILE_ID, sizeof(header.id) ) == 0 &&
+		header.version == PLB_SECONDARY_LIGHT_CHECKPOINT_FILE_VERSION;
+
+	if( ok )
+	{
+		out_checkpoint.key= header.key;
+		for( unsigned int i= 0; i < 3; i++ )
+			out_checkpoint.atlas_size[i]= header.atlas_size[i];
+		out_checkpoint.bounce= header.bounce;
+		out_checkpoint.items_done= header.items_done;
+		out_checkpoint.complete= header.complete != 0u;
+		out_checkpoint.first_bounce_energy= header.first_bounce_energy;
+
+		// Sizes are checked by caller, but protect against huge allocations for broken files.
+		const uint64_t max_size= 4ull * header.atlas_size[0] * header.atlas_size[1] * header.atlas_size[2];
+		ok=
+			header.bounce_light_size <= max_size &&
+			header.previous_bounce_light_size <= max_size &&
+			header.accumulated_light_size <= max_size;
+	}
+	if( ok )
+	{
+		out_checkpoint.bounce_light.resize( header.bounce_light_size );
+		out_checkpoint.previous_bounce_light.resize( header.previous_bounce_light_size );
+		out_checkpoint.accumulated_light.resize( header.accumulated_light_size );
+		read( out_checkpoint.bounce_light.data(), out_checkpoint.bounce_light.size() * sizeof(float) );
+		read( out_checkpoint.previous_bounce_light.data(), out_checkpoint.previous_bounce_light.size() * sizeof(float) );
+		read( out_checkpoint.accumulated_light.data(), out_checkpoint.accumulated_light.size() * sizeof(float) );
+	}
+
+	std::fclose(f);
+
+	if( !ok )
+		std::cout << "Invalid checkpoint file: " << file_name << std::endl;
+
+	return ok;
+}
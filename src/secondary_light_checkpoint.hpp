@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Checkpoint of secondary light pass. Allows continuing of interrupted build.
+//
+// Layout:
+//   plb_SecondaryLightCheckpointHeader
+//   float[ bounce_light_size ] - light of bounce in progress (RGBA texels of secondary atlas)
+//   float[ previous_bounce_light_size ] - light of previous bounce, source of light for bounce in progress
+//   float[ accumulated_light_size ] - sum of light of finished bounces
+
+#define PLB_SECONDARY_LIGHT_CHECKPOINT_FILE_ID "PLBCKPT"
+#define PLB_SECONDARY_LIGHT_CHECKPOINT_FILE_VERSION 1u
+
+struct plb_SecondaryLightCheckpointHeader
+{
+	char id[8];
+	uint32_t version;
+	uint32_t complete; // Nonzero, if all bounces are finished. Final light is in bounce light.
+
+	uint64_t key; // Hash of level and options, which affect secondary light.
+
+	uint32_t atlas_size[3]; // width, height, layers of secondary atlas
+	uint32_t bounce; // Bounce in progress.
+	uint32_t items_done; // Finished items of bounce in progress (surfaces and vertices of models, or texels).
+	uint32_t bounce_light_size;
+	uint32_t previous_bounce_light_size;
+	uint32_t accumulated_light_size;
+
+	double first_bounce_energy;
+};
+
+struct plb_SecondaryLightCheckpoint
+{
+	uint64_t key= 0u;
+	unsigned int atlas_size[3]= { 0u, 0u, 0u };
+	unsigned int bounce= 0u;
+	unsigned int items_done= 0u;
+	bool complete= false;
+	double first_bounce_energy= 0.0;
+
+	std::vector<float> bounce_light;
+	std::vector<float> previous_bounce_light; // Empty for first bounce.
+	std::vector<float> accumulated_light; // Empty, if there is only one bounce.
+};
+
+// FNV-1a hash. Use result of previous call as initial value for hashing of several blocks of data.
+uint64_t plbHashData( const void* data, size_t size, uint64_t hash= 14695981039346656037ull );
+
+// Writes temporary file first and replaces old checkpoint only after successful writing.
+// Returns true on success.
+bool plbWriteSecondaryLightCheckpoint( const char* file_name, const plb_SecondaryLightCheckpoint& checkpoint );
+
+// Returns false, if file does not exist or is not valid checkpoint.
+bool plbReadSecondaryLightCheckpoint( const char* file_name, plb_SecondaryLightCheckpoint& out_checkpoint );
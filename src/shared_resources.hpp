@@ -0,0 +1,43 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include <glsl_program.hpp>
+
+#include "textures_manager.hpp"
+
+// Shaders of light passes of OpenGL backend.
+// Shaders depend only on few config options, so, they may be reused by builders with same options.
+struct plb_LightPassShaders
+{
+	// Options, used for shaders building.
+	unsigned int point_light_pass_batch_size;
+	unsigned int secondary_light_pass_batch_size;
+	bool use_average_texture_color_for_luminous_surfaces;
+
+	r_GLSLProgram point_light_pass_shader;
+	r_GLSLProgram surface_sample_light_pass_shader;
+	r_GLSLProgram point_light_shadowmap_shader;
+	r_GLSLProgram point_light_shadowmap_alphatested_shader;
+
+	r_GLSLProgram secondary_light_pass_shader;
+	r_GLSLProgram secondary_light_pass_luminocity_shader;
+	r_GLSLProgram secondary_light_pass_alphatested_shader;
+	r_GLSLProgram secondary_light_pass_vertex_lighted_shader;
+	r_GLSLProgram secondary_light_pass_vertex_lighted_alphatested_shader;
+
+	r_GLSLProgram shadowmap_shader; // common with cone light
+	r_GLSLProgram shadowmap_alphatested_shader; // common with cone light
+	r_GLSLProgram directional_light_sky_mark_shader;
+	r_GLSLProgram directional_light_pass_shader;
+
+	r_GLSLProgram cone_light_pass_shader;
+};
+
+// Resources, which may be shared by lightmaps builders, created one after another in one process.
+// Resources are created lazily by builders. Must be destroyed before OpenGL context.
+struct plb_SharedResources
+{
+	std::vector< std::shared_ptr<plb_LightPassShaders> > light_pass_shaders;
+	plb_TexturesCache textures_cache;
+};
@@ -1,9 +1,11 @@
-﻿#include <cstring>
+﻿#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 #include <IL/il.h>
 #include <IL/ilu.h>
 
+#include "profiler.hpp"
 #include "textures_manager.hpp"
 
 static unsigned int PowerOfTwoCeil( unsigned int x )
@@ -134,20 +136,129 @@ static std::string ReplaceExtension( const std::string& path, const char* extens
 	return result;
 }
 
-plb_TexturesManager::plb_TexturesManager(
+// Transforms image, loaded into DevIL, to RGBA image with power of two size. Deletes DevIL image.
+static std::shared_ptr<plb_TexturesCache::Image> TransformImage(
 	const plb_Config& config,
-	plb_ImageInfos& images,
+	ILuint handle,
+	const bool flip )
+{
+	if( config.source_data_type == plb_Config::SourceDataType::HalfLifeBSP )
+		handle= CorrectHLTexture( handle );
+
+	const std::shared_ptr<plb_TexturesCache::Image> image= std::make_shared<plb_TexturesCache::Image>();
+
+	image->original_size[0]= ilGetInteger( IL_IMAGE_WIDTH  );
+	image->original_size[1]= ilGetInteger( IL_IMAGE_HEIGHT );
+
+	for( unsigned int d= 0; d< 2; d++ )
+	{
+		image->size_log2[d]= PowerOfTwoCeil(image->original_size[d]);
+		if( image->size_log2[d] > config.max_textures_size_log2 )
+			image->size_log2[d]= config.max_textures_size_log2;
+		else if (image->size_log2[d] < config.min_textures_size_log2 )
+			image->size_log2[d]= config.min_textures_size_log2;
+	}
+	image->size_log2[0]= image->size_log2[1]= std::max( image->size_log2[0], image->size_log2[1] );
+
+	// kostylj dlä TGA fajlov v Quake III
+	if( flip )
+		iluFlipImage();
+
+	ilConvertImage( IL_RGBA, IL_UNSIGNED_BYTE );
+
+	if( config.textures_gamma < 0.999f || config.textures_gamma > 1.001f )
+		iluGammaCorrect( 1.0f / config.textures_gamma );
+
+	const unsigned int pix= (
+		image->original_size[0] / (1<<image->size_log2[0]) +
+		image->original_size[1] / (1<<image->size_log2[1]) ) / 2;
+	if( pix > 1 )
+		iluPixelize(pix);
+	iluImageParameter( ILU_FILTER, ILU_LINEAR );
+	iluScale( 1<<image->size_log2[0], 1<<image->size_log2[1], 1 );
+
+	const unsigned char* const data= ilGetData();
+	image->data_rgba.assign( data, data + ( 1u << ( image->size_log2[0] + image->size_log2[1] + 2u ) ) );
+
+	ilDeleteImages( 1, &handle );
+
+	return image;
+}
+
+// Returns null, if image not found.
+static std::shared_ptr<plb_TexturesCache::Image> LoadImage(
+	const plb_Config& config,
+	const std::string& image_file_name,
 	const plb_BuildInImages& build_in_images )
 {
 	static const char* const img_extensions[]=
 	{
-		"*", // Hack for buildin textures loading
 		"bmp", "pcx", "tga", "jpg", "jpeg", "wal",
 	};
 
+	ILuint handle;
+	ilGenImages( 1, &handle );
+	ilBindImage( handle );
+
+	for( const plb_BuildInImage& build_in_img : build_in_images )
+	{
+		if( build_in_img.name == image_file_name )
+		{
+			ilTexImage(
+				build_in_img.size[0], build_in_img.size[1], 1,
+				4, IL_RGBA, IL_UNSIGNED_BYTE,
+				const_cast<unsigned char*>(build_in_img.data_rgba.data() ) );
+
+			return TransformImage( config, handle, false );
+		}
+	}
+
+	for( const char* const extension : img_extensions )
+	{
+		const std::string file_name= config.textures_path + ReplaceExtension( image_file_name, extension );
+		if( ilLoadImage( file_name.c_str() ) )
+			return TransformImage( config, handle, std::strcmp(extension, "tga") == 0 );
+	}
+
+	ilDeleteImages( 1, &handle );
+	return nullptr;
+}
+
+// Key of transformed image in textures cache.
+static std::string GetImageCacheKey( const plb_Config& config, const std::string& image_file_name )
+{
+	return
+		config.textures_path + image_file_name + "|" +
+		std::to_string( config.min_textures_size_log2 ) + "|" +
+		std::to_string( config.max_textures_size_log2 ) + "|" +
+		std::to_string( config.textures_gamma ) + "|" +
+		std::to_string( int(config.source_data_type) );
+}
+
+plb_TexturesManager::plb_TexturesManager(
+	const plb_Config& config,
+	plb_ImageInfos& images,
+	const plb_BuildInImages& build_in_images,
+	plb_TexturesCache* const textures_cache )
+{
 	unsigned int textures_data_size= 0;
 
-	ilInit();
+	// CPU backend needs only average colors of textures.
+#ifdef PLB_NO_OPENGL
+	if( config.backend == plb_Config::Backend::OpenGL )
+		std::cout << "warning, textures manager is built without OpenGL, textures are not uploaded" << std::endl;
+#else
+	const bool upload_to_gpu= config.backend == plb_Config::Backend::OpenGL;
+#endif
+
+	// Library stays initialized while cache exists.
+	if( textures_cache == nullptr )
+		ilInit();
+	else if( !textures_cache->image_library_initialized )
+	{
+		ilInit();
+		textures_cache->image_library_initialized= true;
+	}
 
 	const unsigned int square_arrays_count=
 		config.max_textures_size_log2 - config.min_textures_size_log2 + 1;
@@ -157,103 +268,71 @@ plb_TexturesManager::plb_TexturesManager(
 		textures_arrays_[i].size[0]=
 		textures_arrays_[i].size[1]= 1 << (config.min_textures_size_log2 + i );
 		textures_arrays_[i].size[2]= 0;
+		textures_arrays_[i].tex_id= 0;
 	}
 
 	// Dummy texture
 	textures_arrays_[0].size[2]= 1;
 
-	std::vector<ILuint> il_textures_handles( images.size() );
+	std::vector< std::shared_ptr<const plb_TexturesCache::Image> > loaded_images( images.size() );
 
+	unsigned int cached_images_count= 0u;
 	for( plb_ImageInfo& img : images )
 	{
 		const unsigned int i= &img - images.data();
 
-		ilGenImages( 1, &il_textures_handles[i] );
-		ilBindImage( il_textures_handles[i] );
-		bool img_loaded= false;
+		const bool is_build_in=
+			std::find_if(
+				build_in_images.begin(), build_in_images.end(),
+				[&]( const plb_BuildInImage& build_in_img ) { return build_in_img.name == img.file_name; } )
+			!= build_in_images.end();
 
-		for( const char* const extension : img_extensions )
+		std::string cache_key;
+		if( textures_cache != nullptr && !is_build_in )
 		{
-			// Try load buildin image
-			if( extension[0] == '*' )
-				for( const plb_BuildInImage& build_in_img : build_in_images )
-				{
-					if( build_in_img.name == img.file_name )
-					{
-						ilTexImage(
-							build_in_img.size[0], build_in_img.size[1], 1,
-							4, IL_RGBA, IL_UNSIGNED_BYTE,
-							const_cast<unsigned char*>(build_in_img.data_rgba.data() ) );
-
-						img_loaded= true;
-						break;
-					}
-				}
-
-			if( !img_loaded )
+			cache_key= GetImageCacheKey( config, img.file_name );
+			const auto it= textures_cache->images.find( cache_key );
+			if( it != textures_cache->images.end() )
 			{
-				const std::string file_name= config.textures_path + ReplaceExtension( img.file_name, extension );
-				img_loaded= ilLoadImage( file_name.c_str() );
+				loaded_images[i]= it->second;
+				cached_images_count++;
 			}
+		}
 
-			if( img_loaded )
-			{
-				if( config.source_data_type == plb_Config::SourceDataType::HalfLifeBSP )
-					il_textures_handles[i]= CorrectHLTexture( il_textures_handles[i] );
-
-				img.original_size[0]= ilGetInteger( IL_IMAGE_WIDTH  );
-				img.original_size[1]= ilGetInteger( IL_IMAGE_HEIGHT );
-
-				for( unsigned int d= 0; d< 2; d++ )
-				{
-					img.size_log2[d]= PowerOfTwoCeil(img.original_size[d]);
-					if( img.size_log2[d] > config.max_textures_size_log2 )
-						img.size_log2[d]= config.max_textures_size_log2;
-					else if (img.size_log2[d] < config.min_textures_size_log2 )
-						img.size_log2[d]= config.min_textures_size_log2;
-				}
-				img.size_log2[0]= img.size_log2[1]= std::max( img.size_log2[0], img.size_log2[1] );
-
-				// kostylj dlä TGA fajlov v Quake III
-				if( std::strcmp(extension, "tga") == 0 )
-					iluFlipImage();
-
-				ilConvertImage( IL_RGBA, IL_UNSIGNED_BYTE );
-
-				if( config.textures_gamma < 0.999f || config.textures_gamma > 1.001f )
-					iluGammaCorrect( 1.0f / config.textures_gamma );
-
-				const unsigned int pix= (
-					img.original_size[0] / (1<<img.size_log2[0]) +
-					img.original_size[1] / (1<<img.size_log2[1]) ) / 2;
-				if( pix > 1 )
-					iluPixelize(pix);
-				iluImageParameter( ILU_FILTER, ILU_LINEAR );
-				iluScale( 1<<img.size_log2[0], 1<<img.size_log2[1], 1 );
-
-				const unsigned int array_id= img.size_log2[0] - config.min_textures_size_log2;
-				img.texture_array_id= array_id;
-				img.texture_layer_id= textures_arrays_[ array_id ].size[2];
-				textures_arrays_[ array_id ].size[2]++;
-
-				textures_data_size+= 1<<( img.size_log2[0] + img.size_log2[1] + 2);
-
-				break;
-			}// if texture loaded
-		}// for formats
+		if( loaded_images[i] == nullptr )
+		{
+			loaded_images[i]= LoadImage( config, img.file_name, build_in_images );
+			if( loaded_images[i] != nullptr && !cache_key.empty() )
+				textures_cache->images[ cache_key ]= loaded_images[i];
+		}
 
-		if (!img_loaded)
+		if( loaded_images[i] == nullptr )
 		{
 			img.original_size[0]= img.original_size[1]= 0;
 			img.texture_array_id= 0;
 			img.texture_layer_id= 0;
 
-			ilDeleteImages( 1, &il_textures_handles[i] );
 			std::cout << "warning, texture \"" << img.file_name.c_str() << "\" not found" << std::endl;
+			continue;
 		}
+
+		const plb_TexturesCache::Image& image= *loaded_images[i];
+		img.original_size[0]= image.original_size[0];
+		img.original_size[1]= image.original_size[1];
+		img.size_log2[0]= image.size_log2[0];
+		img.size_log2[1]= image.size_log2[1];
+
+		const unsigned int array_id= img.size_log2[0] - config.min_textures_size_log2;
+		img.texture_array_id= array_id;
+		img.texture_layer_id= textures_arrays_[ array_id ].size[2];
+		textures_arrays_[ array_id ].size[2]++;
+
+		textures_data_size+= 1<<( img.size_log2[0] + img.size_log2[1] + 2);
 	}// for images
 
 	std::cout << "textures data size: " << (textures_data_size>>10) << " kb" << std::endl;
+	if( textures_cache != nullptr )
+		std::cout << "textures taken from cache: " << cached_images_count << std::endl;
 
 	for( TextureArray& textures_array : textures_arrays_ )
 	{
@@ -262,15 +341,19 @@ plb_TexturesManager::plb_TexturesManager(
 
 		textures_array.textures_data.resize( textures_array.size[2] );
 
-		glGenTextures( 1, &textures_array.tex_id );
-		glBindTexture( GL_TEXTURE_2D_ARRAY, textures_array.tex_id );
-		glTexImage3D(
-			GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8,
-			textures_array.size[0], textures_array.size[1], textures_array.size[2],
-			0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+#ifndef PLB_NO_OPENGL
+		if( upload_to_gpu )
+		{
+			glGenTextures( 1, &textures_array.tex_id );
+			glBindTexture( GL_TEXTURE_2D_ARRAY, textures_array.tex_id );
+			glTexImage3D(
+				GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8,
+				textures_array.size[0], textures_array.size[1], textures_array.size[2],
+				0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+		}
 
 		// Dummy
-		if( &textures_array == &textures_arrays_.front() )
+		if( &textures_array == &textures_arrays_.front() && upload_to_gpu )
 		{
 			std::vector<unsigned char> dummy_data( 4 * textures_array.size[0] * textures_array.size[1] );
 			std::memset( dummy_data.data(), 128, sizeof(unsigned char) * dummy_data.size() );
@@ -282,64 +365,72 @@ plb_TexturesManager::plb_TexturesManager(
 				GL_RGBA,
 				GL_UNSIGNED_BYTE, dummy_data.data() );
 		}
+#endif
 
 		const unsigned int texture_array_number= &textures_array - textures_arrays_.data();
 		for( const plb_ImageInfo& img : images )
 		{
+			const unsigned int image_index= &img - images.data();
 			if(
 				img.texture_array_id == texture_array_number &&
-				img.original_size[0] > 0 && img.original_size[1] > 0 )
+				loaded_images[ image_index ] != nullptr )
 			{
-				const unsigned int image_index= &img - images.data();
-
-				ilBindImage( il_textures_handles[ image_index ] );
-				const void* const tex_data= ilGetData();
-				const unsigned int channels= ilGetInteger( IL_IMAGE_CHANNELS );
+				// Images are always converted to RGBA.
+				const unsigned char* const tex_data= loaded_images[ image_index ]->data_rgba.data();
 
 				GetAverageColor(
-					static_cast<const unsigned char*>(tex_data),
+					tex_data,
 					textures_array.size[0] * textures_array.size[1],
 					textures_array.textures_data[ img.texture_layer_id ].average_color );
 
-				GLenum format= 0;
-				if( channels == 1 ) format = GL_RED;
-				else if( channels == 2 ) format= GL_RG;
-				else if( channels == 3 ) format= GL_RGB;
-				else if( channels == 4 ) format= GL_RGBA;
-
-				glTexSubImage3D(
-					GL_TEXTURE_2D_ARRAY, 0,
-					0, 0, img.texture_layer_id,
-					textures_array.size[0], textures_array.size[1], 1,
-					format,
-					GL_UNSIGNED_BYTE, tex_data );
-
-				ilDeleteImages( 1, &il_textures_handles[ image_index ] );
+#ifndef PLB_NO_OPENGL
+				if( upload_to_gpu )
+				{
+					glTexSubImage3D(
+						GL_TEXTURE_2D_ARRAY, 0,
+						0, 0, img.texture_layer_id,
+						textures_array.size[0], textures_array.size[1], 1,
+						GL_RGBA,
+						GL_UNSIGNED_BYTE, tex_data );
+					plbProfilerAddCounter( plb_ProfilerCounter::BytesUploaded, 4u * textures_array.size[0] * textures_array.size[1] );
+				}
+#endif
 
 			}// if image in this array
 		}// for images
 
-		glGenerateMipmap( GL_TEXTURE_2D_ARRAY );
-		glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
-		glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+#ifndef PLB_NO_OPENGL
+		if( upload_to_gpu )
+		{
+			glGenerateMipmap( GL_TEXTURE_2D_ARRAY );
+			glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST );
+			glTexParameteri( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+		}
+#endif
 	}// for textures arrays
 
-	ilShutDown();
+	if( textures_cache == nullptr )
+		ilShutDown();
 }
 
 plb_TexturesManager::~plb_TexturesManager()
 {
+#ifndef PLB_NO_OPENGL
 	for( const TextureArray& textures_array : textures_arrays_ )
 	{
-		if( textures_array.size[2] == 0 )
+		if( textures_array.size[2] == 0 || textures_array.tex_id == 0 )
 			continue;
 
 		glDeleteTextures( 1, &textures_array.tex_id );
 	}
+#endif
 }
 
 void plb_TexturesManager::BindTextureArrays( const unsigned int base_unit ) const
 {
+#ifdef PLB_NO_OPENGL
+	(void)base_unit;
+#else
 	for( unsigned int i= 0; i< textures_arrays_.size(); i++ )
 	{
 		if( textures_arrays_[i].size[2] == 0 )
@@ -348,6 +439,7 @@ void plb_TexturesManager::BindTextureArrays( const unsigned int base_unit ) cons
 		glActiveTexture( GL_TEXTURE0 + base_unit + i );
 		glBindTexture( GL_TEXTURE_2D_ARRAY, textures_arrays_[i].tex_id );
 	}
+#endif
 }
 
 void plb_TexturesManager::GetTextureAverageColor(
@@ -1,16 +1,42 @@
 #pragma once
+#include <memory>
+#include <string>
+#include <unordered_map>
 
 #include "formats.hpp"
 
+// Define PLB_NO_OPENGL for builds without OpenGL. Such textures manager only calculates average colors of textures.
+#ifndef PLB_NO_OPENGL
 #include <panzer_ogl_lib.hpp>
+#endif
+
+// Cache of loaded and transformed images of textures.
+// May be shared by many textures managers, created one after another in one process.
+struct plb_TexturesCache
+{
+	struct Image
+	{
+		unsigned int size_log2[2]; // size after transforming
+		unsigned int original_size[2]; // size of original image
+		std::vector<unsigned char> data_rgba;
+	};
+
+	// Key - image file name with textures path and transformation options.
+	// Build-in images of levels are not cached.
+	std::unordered_map< std::string, std::shared_ptr<const Image> > images;
+
+	bool image_library_initialized= false;
+};
 
 class plb_TexturesManager final
 {
 public:
+	// textures_cache - optional.
 	plb_TexturesManager(
 		const plb_Config& config,
 		plb_ImageInfos& images,
-		const plb_BuildInImages& build_in_images );
+		const plb_BuildInImages& build_in_images,
+		plb_TexturesCache* textures_cache= nullptr );
 
 	~plb_TexturesManager();
 
@@ -31,7 +57,7 @@ private:
 	struct TextureArray
 	{
 		unsigned int size[3];
-		GLuint tex_id;
+		unsigned int tex_id; // OpenGL texture name, zero if not uploaded.
 
 		std::vector<TexturesArrayLayer> textures_data;
 	};
@@ -1,10 +1,20 @@
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 1 )
+#define PLB_TRACER_USE_SSE
+#include <xmmintrin.h>
+#endif
 
 #include "curves.hpp"
 #include "math_utils.hpp"
+#include "parallel_for.hpp"
 
 #include "tracer.hpp"
 
+const unsigned int plb_Tracer::c_max_packet_size;
+
 static const m_Vec3 g_axis_normals[3]=
 {
 	{ 1.0f, 0.0f, 0.0f },
@@ -16,6 +26,191 @@ const float g_length_eps= 1.0f / 8192.0f;
 const float g_square_length_eps= g_length_eps * g_length_eps;
 const float g_min_normal_length= 1.0f / ( 128.0f * 128.0f );
 
+// Deeper nodes are not splitted. Limits size of traversal stack.
+const unsigned int g_max_tree_depth= 64;
+
+// Tolerance for barycentric coordinates in triangle tests. Prevents leaks through edges between triangles.
+const float g_barycentric_eps= 1.0f / 65536.0f;
+
+const unsigned int g_packet_group_size= 4u;
+
+static m_Vec3 GetInvDir( const m_Vec3& dir )
+{
+	m_Vec3 inv_dir;
+	for( unsigned int j= 0; j < 3; j++ )
+	{
+		const float d= dir.ToArr()[j];
+		inv_dir.ToArr()[j]= std::abs(d) > 1e-30f ? 1.0f / d : 1e30f;
+	}
+	return inv_dir;
+}
+
+// Four floats, processed together. Used for tracing of segments packets.
+// Comparison operations return masks - all bits of component are set, if condition is true.
+struct PacketFloat
+{
+#ifdef PLB_TRACER_USE_SSE
+	__m128 v;
+
+	PacketFloat() {}
+	PacketFloat( const __m128 in_v ) : v(in_v) {}
+	explicit PacketFloat( const float f ) : v( _mm_set1_ps(f) ) {}
+
+	static PacketFloat Load( const float* const f ) { return _mm_loadu_ps(f); }
+
+	PacketFloat operator+( const PacketFloat& o ) const { return _mm_add_ps( v, o.v ); }
+	PacketFloat operator-( const PacketFloat& o ) const { return _mm_sub_ps( v, o.v ); }
+	PacketFloat operator*( const PacketFloat& o ) const { return _mm_mul_ps( v, o.v ); }
+	PacketFloat operator/( const PacketFloat& o ) const { return _mm_div_ps( v, o.v ); }
+	PacketFloat operator&( const PacketFloat& o ) const { return _mm_and_ps( v, o.v ); }
+
+	PacketFloat operator< ( const PacketFloat& o ) const { return _mm_cmplt_ps ( v, o.v ); }
+	PacketFloat operator<=( const PacketFloat& o ) const { return _mm_cmple_ps ( v, o.v ); }
+	PacketFloat operator>=( const PacketFloat& o ) const { return _mm_cmpge_ps ( v, o.v ); }
+	PacketFloat operator!=( const PacketFloat& o ) const { return _mm_cmpneq_ps( v, o.v ); }
+
+	friend PacketFloat Min( const PacketFloat& a, const PacketFloat& b ) { return _mm_min_ps( a.v, b.v ); }
+	friend PacketFloat Max( const PacketFloat& a, const PacketFloat& b ) { return _mm_max_ps( a.v, b.v ); }
+
+	// Returns bit per component.
+	unsigned int MaskBits() const { return static_cast<unsigned int>( _mm_movemask_ps(v) ); }
+#else
+	float v[4];
+
+	PacketFloat() {}
+	explicit PacketFloat( const float f ) { v[0]= v[1]= v[2]= v[3]= f; }
+
+	static PacketFloat Load( const float* const f )
+	{
+		PacketFloat r;
+		for( unsigned int i= 0; i < 4; i++ ) r.v[i]= f[i];
+		return r;
+	}
+
+	template<class Func>
+	PacketFloat Apply( const PacketFloat& o, const Func& func ) const
+	{
+		PacketFloat r;
+		for( unsigned int i= 0; i < 4; i++ ) r.v[i]= func( v[i], o.v[i] );
+		return r;
+	}
+
+	static float Mask( const bool b )
+	{
+		const unsigned int bits= b ? 0xFFFFFFFFu : 0u;
+		float f;
+		std::memcpy( &f, &bits, sizeof(float) );
+		return f;
+	}
+
+	static unsigned int Bits( const float f )
+	{
+		unsigned int bits;
+		std::memcpy( &bits, &f, sizeof(float) );
+		return bits;
+	}
+
+	PacketFloat operator+( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return a + b; } ); }
+	PacketFloat operator-( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return a - b; } ); }
+	PacketFloat operator*( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return a * b; } ); }
+	PacketFloat operator/( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return a / b; } ); }
+	PacketFloat operator&( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return Mask( ( Bits(a) & Bits(b) ) != 0u ); } ); }
+
+	PacketFloat operator< ( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return Mask( a <  b ); } ); }
+	PacketFloat operator<=( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return Mask( a <= b ); } ); }
+	PacketFloat operator>=( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return Mask( a >= b ); } ); }
+	PacketFloat operator!=( const PacketFloat& o ) const { return Apply( o, []( float a, float b ){ return Mask( a != b ); } ); }
+
+	// Same as SSE min/max - second operand returned, if one of operands is NaN.
+	friend PacketFloat Min( const PacketFloat& a, const PacketFloat& b ) { return a.Apply( b, []( float x, float y ){ return x < y ? x : y; } ); }
+	friend PacketFloat Max( const PacketFloat& a, const PacketFloat& b ) { return a.Apply( b, []( float x, float y ){ return x > y ? x : y; } ); }
+
+	unsigned int MaskBits() const
+	{
+		unsigned int result= 0u;
+		for( unsigned int i= 0; i < 4; i++ )
+			result|= ( Bits(v[i]) >> 31u ) << i;
+		return result;
+	}
+#endif
+};
+
+// Group of 4 segments in packet. Segment is "from + dir * t", t in range [0; 1].
+struct SegmentsGroup
+{
+	PacketFloat from[3];
+	PacketFloat dir[3];
+	PacketFloat inv_dir[3];
+	unsigned int active_mask; // Bit per segment. Segments with found intersection are inactive.
+};
+
+// Returns bit mask of active segments of group, which intersect box.
+static unsigned int GroupIntersectBox( const SegmentsGroup& group, const m_Vec3& bb_min, const m_Vec3& bb_max )
+{
+	// Slabs test. Box extended a bit, like in single segment test.
+	PacketFloat t_min( 0.0f );
+	PacketFloat t_max( 1.0f );
+	for( unsigned int j= 0; j < 3; j++ )
+	{
+		const PacketFloat t0= ( PacketFloat( bb_min.ToArr()[j] - g_length_eps ) - group.from[j] ) * group.inv_dir[j];
+		const PacketFloat t1= ( PacketFloat( bb_max.ToArr()[j] + g_length_eps ) - group.from[j] ) * group.inv_dir[j];
+
+		t_min= Max( t_min, Min( t0, t1 ) );
+		t_max= Min( t_max, Max( t0, t1 ) );
+	}
+
+	return ( t_min <= t_max ).MaskBits() & group.active_mask;
+}
+
+// Möller–Trumbore intersection test of segments group with one triangle.
+// Returns bit mask of intersected segments.
+static unsigned int GroupIntersectTriangle(
+	const SegmentsGroup& group,
+	const float* const v0, const float* const edge1, const float* const edge2 )
+{
+	const PacketFloat e1[3]= { PacketFloat(edge1[0]), PacketFloat(edge1[1]), PacketFloat(edge1[2]) };
+	const PacketFloat e2[3]= { PacketFloat(edge2[0]), PacketFloat(edge2[1]), PacketFloat(edge2[2]) };
+	const PacketFloat* const dir= group.dir;
+
+	const PacketFloat p[3]=
+	{
+		dir[1] * e2[2] - dir[2] * e2[1],
+		dir[2] * e2[0] - dir[0] * e2[2],
+		dir[0] * e2[1] - dir[1] * e2[0],
+	};
+	const PacketFloat det= e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+	const PacketFloat inv_det= PacketFloat( 1.0f ) / det;
+
+	const PacketFloat to_origin[3]=
+	{
+		group.from[0] - PacketFloat(v0[0]),
+		group.from[1] - PacketFloat(v0[1]),
+		group.from[2] - PacketFloat(v0[2]),
+	};
+	const PacketFloat u= ( to_origin[0] * p[0] + to_origin[1] * p[1] + to_origin[2] * p[2] ) * inv_det;
+
+	const PacketFloat q[3]=
+	{
+		to_origin[1] * e1[2] - to_origin[2] * e1[1],
+		to_origin[2] * e1[0] - to_origin[0] * e1[2],
+		to_origin[0] * e1[1] - to_origin[1] * e1[0],
+	};
+	const PacketFloat v= ( dir[0] * q[0] + dir[1] * q[1] + dir[2] * q[2] ) * inv_det;
+	const PacketFloat t= ( e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2] ) * inv_det;
+
+	const PacketFloat zero( 0.0f );
+	const PacketFloat min_barycentric( -g_barycentric_eps );
+	const PacketFloat hit=
+		( det != zero ) &
+		( u >= min_barycentric ) &
+		( v >= min_barycentric ) &
+		( u + v <= PacketFloat( 1.0f + g_barycentric_eps ) ) &
+		( t >= zero ) &
+		( t <= PacketFloat( 1.0f ) );
+
+	return hit.MaskBits();
+}
+
 static bool IsPointInTriangle(
 	const m_Vec3& v0, const m_Vec3& v1, const m_Vec3& v2,
 	const m_Vec3& point )
@@ -33,7 +228,40 @@ static bool IsPointInTriangle(
 	return dot[0] > 0.0f && dot[1] > 0.0f;
 }
 
-plb_Tracer::plb_Tracer( const plb_LevelData& level_data )
+static m_Vec3 GetBarycentricCoordinates(
+	const m_Vec3& v0, const m_Vec3& v1, const m_Vec3& v2,
+	const m_Vec3& point )
+{
+	const m_Vec3 side0= v1 - v0;
+	const m_Vec3 side1= v2 - v0;
+	const m_Vec3 vec_to_point= point - v0;
+
+	const float d00= side0 * side0;
+	const float d01= side0 * side1;
+	const float d11= side1 * side1;
+	const float d20= vec_to_point * side0;
+	const float d21= vec_to_point * side1;
+
+	const float denom= d00 * d11 - d01 * d01;
+	if( std::abs(denom) < g_square_length_eps * g_square_length_eps )
+		return m_Vec3( 1.0f, 0.0f, 0.0f );
+
+	const float inv_denom= 1.0f / denom;
+	const float b1= ( d11 * d20 - d01 * d21 ) * inv_denom;
+	const float b2= ( d00 * d21 - d01 * d20 ) * inv_denom;
+
+	return m_Vec3( 1.0f - b1 - b2, b1, b2 );
+}
+
+static m_Vec3 GetVertexLightmapCoord( const plb_Vertex& vertex )
+{
+	return m_Vec3(
+		vertex.lightmap_coord[0],
+		vertex.lightmap_coord[1],
+		float(vertex.tex_maps[2]) );
+}
+
+plb_Tracer::plb_Tracer( const plb_LevelData& level_data, const unsigned int threads_count )
 {	
 	// Convert input polygons to more compact format
 	surfaces_.reserve( level_data.polygons.size() );
@@ -51,9 +279,15 @@ plb_Tracer::plb_Tracer( const plb_LevelData& level_data )
 
 		const unsigned int first_vertex= vertices_.size();
 		vertices_.resize( vertices_.size() + poly.vertex_count );
+		lightmap_coords_.resize( vertices_.size() );
 		for( unsigned int v= 0; v < (unsigned int)poly.vertex_count; v++ )
-			vertices_[ first_vertex + v ]=
-				m_Vec3( level_data.vertices[ poly.first_vertex_number + v ].pos );
+		{
+			const plb_Vertex& in_vertex= level_data.vertices[ poly.first_vertex_number + v ];
+			vertices_[ first_vertex + v ]= m_Vec3( in_vertex.pos );
+			lightmap_coords_[ first_vertex + v ]= GetVertexLightmapCoord( in_vertex );
+		}
+
+		surface.material_id= poly.material_id;
 
 		surface.first_index= indeces_.size();
 		surface.index_count= poly.index_count;
@@ -107,12 +341,14 @@ plb_Tracer::plb_Tracer( const plb_LevelData& level_data )
 			Surface& surface= surfaces_.back();
 
 			surface.normal= normal / normal_length;
+			surface.material_id= curve.material_id;
 
 			const unsigned int first_index= indeces_.size();
 			indeces_.resize( indeces_.size() + 3u );
 
 			const unsigned int first_vertex= vertices_.size();
 			vertices_.resize( vertices_.size() + 3u );
+			lightmap_coords_.resize( vertices_.size() );
 
 			surface.first_index= first_index;
 			surface.index_count= 3u;
@@ -124,6 +360,7 @@ plb_Tracer::plb_Tracer( const plb_LevelData& level_data )
 			{
 				indeces_[ first_index + i ]= first_vertex + i;
 				vertices_[ first_vertex + i ]= m_Vec3( curve_vertices[ index[i] ].pos );
+				lightmap_coords_[ first_vertex + i ]= GetVertexLightmapCoord( curve_vertices[ index[i] ] );
 			}
 		} // for curve triangles
 	} // for curves
@@ -137,6 +374,7 @@ plb_Tracer::plb_Tracer( const plb_LevelData& level_data )
 		const unsigned int first_index= indeces_.size();
 
 		vertices_.resize( vertices_.size() + model.index_count );
+		lightmap_coords_.resize( vertices_.size() );
 		indeces_.resize( indeces_.size() + model.index_count );
 
 		for( unsigned int t= 0; t < model.index_count; t+= 3 )
@@ -146,6 +384,7 @@ plb_Tracer::plb_Tracer( const plb_LevelData& level_data )
 			{
 				const unsigned int in_index= level_data.models_indeces[ model.first_index + i ];
 				vertices_[ first_vertex + i ]= m_Vec3( level_data.models_vertices[ in_index ].pos );
+				lightmap_coords_[ first_vertex + i ]= GetVertexLightmapCoord( level_data.models_vertices[ in_index ] );
 				indeces_[ first_index + i ]= first_vertex + i;
 			}
 
@@ -164,11 +403,13 @@ plb_Tracer::plb_Tracer( const plb_LevelData& level_data )
 			surface.vertex_count= 3u;
 			surface.index_count= 3u;
 			surface.normal= normal / normal_length;
+			surface.material_id= model.material_id;
 		} // for model triangles
 
 	} // for models
 
-	BuildTree();
+	BuildTree( threads_count );
+	BuildTriangles();
 }
 
 plb_Tracer::~plb_Tracer()
@@ -180,6 +421,9 @@ unsigned int plb_Tracer::Trace(
 	TraceResult* out_result,
 	unsigned int max_result_count ) const
 {
+	if( tree_.empty() )
+		return 0;
+
 	const m_Vec3 dir= to - from;
 	const float dir_length= dir.Length();
 
@@ -187,41 +431,34 @@ unsigned int plb_Tracer::Trace(
 	trace_request_data.from= from;
 	trace_request_data.to= to;
 	trace_request_data.normalized_dir= dir / dir_length;
+	trace_request_data.inv_dir= GetInvDir( dir );
+	trace_request_data.max_t= 1.0f;
 	trace_request_data.max_result_count= max_result_count;
 	trace_request_data.result_count= 0;
 	trace_request_data.out_result= out_result;
 
-	const TreeNode* node= &tree_.front();
+	unsigned int stack[ g_max_tree_depth + 2u ];
+	unsigned int stack_size= 1;
+	stack[0]= 0;
 
-	unsigned int depth= 0;
-	while(1)
+	while( stack_size > 0 )
 	{
-		// No childs - return
-		if(
-			node->childs[0] == TreeNode::c_no_child &&
-			node->childs[1] == TreeNode::c_no_child )
-			break;
-
-		const m_Vec3& node_normal= g_axis_normals[ size_t(node->plane_orientation) ];
-		const float from_pos= node_normal * from - node->dist;
-		const float   to_pos= node_normal *   to - node->dist;
-
-		if( from_pos < 0.0f && to_pos < 0.0f )
-			node= tree_.data() + node->childs[0];
-		else if( from_pos >= 0.0f && to_pos >= 0.0f )
-			node= tree_.data() + node->childs[1];
-		else
-			break;
-
-		// Check this node surfaces if not last node
-		for( unsigned int i= node->first_surface; i < node->first_surface + node->surface_count; i++ )
-			CheckSurfaceCollision( trace_request_data, surfaces_[i] );
+		const TreeNode& node= tree_[ stack[ --stack_size ] ];
+		if( !SegmentIntersectNode( trace_request_data, node ) )
+			continue;
 
-		depth++;
+		if( node.surface_count > 0 )
+		{
+			for( unsigned int i= node.first; i < node.first + node.surface_count; i++ )
+				CheckSurfaceCollision( trace_request_data, surfaces_[i] );
+		}
+		else
+		{
+			stack[ stack_size++ ]= node.first + 1u;
+			stack[ stack_size++ ]= node.first;
+		}
 	}
 
-	CheckCollision_r( trace_request_data, *node );
-
 	return trace_request_data.result_count;
 }
 
@@ -239,6 +476,8 @@ unsigned int plb_Tracer::Trace(
 	trace_request_data.from= from;
 	trace_request_data.to= to;
 	trace_request_data.normalized_dir= dir / dir_length;
+	trace_request_data.inv_dir= GetInvDir( dir );
+	trace_request_data.max_t= 1.0f;
 	trace_request_data.max_result_count= max_result_count;
 	trace_request_data.result_count= 0;
 	trace_request_data.out_result= out_result;
@@ -253,6 +492,255 @@ unsigned int plb_Tracer::Trace(
 	return trace_request_data.result_count;
 }
 
+bool plb_Tracer::TraceClosest(
+	const m_Vec3& from,
+	const m_Vec3& to,
+	TraceResult& out_result,
+	const bool skip_back_faces ) const
+{
+	if( tree_.empty() )
+		return false;
+
+	const m_Vec3 dir= to - from;
+
+	TraceRequestData trace_request_data;
+	trace_request_data.from= from;
+	trace_request_data.to= to;
+	trace_request_data.inv_dir= GetInvDir( dir );
+	trace_request_data.max_t= 1.0f;
+
+	const Surface* closest_surface= nullptr;
+	unsigned int closest_triangle= 0;
+	float closest_u= 0.0f, closest_v= 0.0f;
+
+	unsigned int stack[ g_max_tree_depth + 2u ];
+	unsigned int stack_size= 1;
+	stack[0]= 0;
+
+	while( stack_size > 0 )
+	{
+		const TreeNode& node= tree_[ stack[ --stack_size ] ];
+		// Nodes beyond current closest intersection are skipped here.
+		if( !SegmentIntersectNode( trace_request_data, node ) )
+			continue;
+
+		if( node.surface_count > 0 )
+		{
+			for( unsigned int i= node.first; i < node.first + node.surface_count; i++ )
+			{
+				const Surface& surface= surfaces_[i];
+				if( skip_back_faces && surface.normal * dir >= 0.0f )
+					continue;
+
+				for( unsigned int t= 0; t < surface.index_count / 3u; t++ )
+				{
+					float hit_t, hit_u, hit_v;
+					if( SegmentIntersectTriangle( from, dir, surface.first_triangle + t, hit_t, hit_u, hit_v ) &&
+						hit_t < trace_request_data.max_t )
+					{
+						trace_request_data.max_t= hit_t;
+						closest_surface= &surface;
+						closest_triangle= t;
+						closest_u= hit_u;
+						closest_v= hit_v;
+					}
+				}
+			}
+		}
+		else
+		{
+			const unsigned int near_child= dir.ToArr()[ node.split_axis ] >= 0.0f ? 0u : 1u;
+			stack[ stack_size++ ]= node.first + ( near_child ^ 1u );
+			stack[ stack_size++ ]= node.first + near_child;
+		}
+	}
+
+	if( closest_surface == nullptr )
+		return false;
+
+	const unsigned int* const index= indeces_.data() + closest_surface->first_index + closest_triangle * 3u;
+	const m_Vec3 barycentric( 1.0f - closest_u - closest_v, closest_u, closest_v );
+
+	out_result.pos= from + dir * trace_request_data.max_t;
+	out_result.normal= closest_surface->normal;
+	out_result.material_id= closest_surface->material_id;
+	out_result.surface_index= closest_surface - surfaces_.data();
+	out_result.barycentric= barycentric;
+	out_result.lightmap_coord=
+		lightmap_coords_[ index[0] ] * barycentric.x +
+		lightmap_coords_[ index[1] ] * barycentric.y +
+		lightmap_coords_[ index[2] ] * barycentric.z;
+
+	return true;
+}
+
+bool plb_Tracer::Occluded( const m_Vec3& from, const m_Vec3& to ) const
+{
+	if( tree_.empty() )
+		return false;
+
+	const m_Vec3 dir= to - from;
+
+	TraceRequestData trace_request_data;
+	trace_request_data.from= from;
+	trace_request_data.to= to;
+	trace_request_data.inv_dir= GetInvDir( dir );
+	trace_request_data.max_t= 1.0f;
+
+	unsigned int stack[ g_max_tree_depth + 2u ];
+	unsigned int stack_size= 1;
+	stack[0]= 0;
+
+	while( stack_size > 0 )
+	{
+		const TreeNode& node= tree_[ stack[ --stack_size ] ];
+		if( !SegmentIntersectNode( trace_request_data, node ) )
+			continue;
+
+		if( node.surface_count > 0 )
+		{
+			const Surface& last_surface= surfaces_[ node.first + node.surface_count - 1u ];
+			const unsigned int triangles_begin= surfaces_[ node.first ].first_triangle;
+			const unsigned int triangles_end= last_surface.first_triangle + last_surface.index_count / 3u;
+
+			for( unsigned int t= triangles_begin; t < triangles_end; t++ )
+			{
+				float hit_t, hit_u, hit_v;
+				if( SegmentIntersectTriangle( from, dir, t, hit_t, hit_u, hit_v ) )
+					return true;
+			}
+		}
+		else
+		{
+			// First child contains surfaces with lower positions along split axis. Push far child first.
+			const unsigned int near_child= dir.ToArr()[ node.split_axis ] >= 0.0f ? 0u : 1u;
+			stack[ stack_size++ ]= node.first + ( near_child ^ 1u );
+			stack[ stack_size++ ]= node.first + near_child;
+		}
+	}
+
+	return false;
+}
+
+void plb_Tracer::OccludedPacket(
+	const m_Vec3* const from,
+	const m_Vec3* const to,
+	unsigned int count,
+	bool* const out_occluded ) const
+{
+	count= std::min( count, c_max_packet_size );
+	for( unsigned int i= 0; i < count; i++ )
+		out_occluded[i]= false;
+
+	if( tree_.empty() || count == 0 )
+		return;
+
+	if( count == 1 )
+	{
+		out_occluded[0]= Occluded( from[0], to[0] );
+		return;
+	}
+
+	// Prepare groups. Unused lanes of last group are filled with last segment, but marked inactive.
+	const unsigned int group_count= ( count + g_packet_group_size - 1u ) / g_packet_group_size;
+	SegmentsGroup groups[ c_max_packet_size / g_packet_group_size ];
+	for( unsigned int g= 0; g < group_count; g++ )
+	{
+		float lanes_from[3][ g_packet_group_size ];
+		float lanes_dir[3][ g_packet_group_size ];
+		float lanes_inv_dir[3][ g_packet_group_size ];
+		for( unsigned int lane= 0; lane < g_packet_group_size; lane++ )
+		{
+			const unsigned int i= std::min( g * g_packet_group_size + lane, count - 1u );
+			const m_Vec3 dir= to[i] - from[i];
+			const m_Vec3 inv_dir= GetInvDir( dir );
+			for( unsigned int j= 0; j < 3; j++ )
+			{
+				lanes_from[j][lane]= from[i].ToArr()[j];
+				lanes_dir[j][lane]= dir.ToArr()[j];
+				lanes_inv_dir[j][lane]= inv_dir.ToArr()[j];
+			}
+		}
+
+		SegmentsGroup& group= groups[g];
+		for( unsigned int j= 0; j < 3; j++ )
+		{
+			group.from[j]= PacketFloat::Load( lanes_from[j] );
+			group.dir[j]= PacketFloat::Load( lanes_dir[j] );
+			group.inv_dir[j]= PacketFloat::Load( lanes_inv_dir[j] );
+		}
+
+		const unsigned int lane_count= std::min( g_packet_group_size, count - g * g_packet_group_size );
+		group.active_mask= ( 1u << lane_count ) - 1u;
+	}
+
+	unsigned int active_groups= group_count;
+
+	// Order of childs visiting is selected by average direction of segments.
+	m_Vec3 average_dir( 0.0f, 0.0f, 0.0f );
+	for( unsigned int i= 0; i < count; i++ )
+		average_dir+= to[i] - from[i];
+
+	unsigned int stack[ g_max_tree_depth + 2u ];
+	unsigned int stack_size= 1;
+	stack[0]= 0;
+
+	while( stack_size > 0 && active_groups > 0 )
+	{
+		const TreeNode& node= tree_[ stack[ --stack_size ] ];
+
+		unsigned int node_masks[ c_max_packet_size / g_packet_group_size ];
+		unsigned int any_mask= 0u;
+		for( unsigned int g= 0; g < group_count; g++ )
+		{
+			node_masks[g]= GroupIntersectBox( groups[g], node.bb_min, node.bb_max );
+			any_mask|= node_masks[g];
+		}
+		if( any_mask == 0u )
+			continue;
+
+		if( node.surface_count > 0 )
+		{
+			const Surface& last_surface= surfaces_[ node.first + node.surface_count - 1u ];
+			const unsigned int triangles_begin= surfaces_[ node.first ].first_triangle;
+			const unsigned int triangles_end= last_surface.first_triangle + last_surface.index_count / 3u;
+
+			for( unsigned int t= triangles_begin; t < triangles_end && active_groups > 0; t++ )
+			{
+				const float v0[3]= { triangles_.v0[0][t], triangles_.v0[1][t], triangles_.v0[2][t] };
+				const float edge1[3]= { triangles_.edge1[0][t], triangles_.edge1[1][t], triangles_.edge1[2][t] };
+				const float edge2[3]= { triangles_.edge2[0][t], triangles_.edge2[1][t], triangles_.edge2[2][t] };
+
+				for( unsigned int g= 0; g < group_count; g++ )
+				{
+					SegmentsGroup& group= groups[g];
+					node_masks[g]&= group.active_mask;
+					if( node_masks[g] == 0u )
+						continue;
+
+					const unsigned int hit_mask= GroupIntersectTriangle( group, v0, edge1, edge2 ) & node_masks[g];
+					if( hit_mask != 0u )
+					{
+						group.active_mask&= ~hit_mask;
+						if( group.active_mask == 0u )
+							active_groups--;
+					}
+				}
+			}
+		}
+		else
+		{
+			const unsigned int near_child= average_dir.ToArr()[ node.split_axis ] >= 0.0f ? 0u : 1u;
+			stack[ stack_size++ ]= node.first + ( near_child ^ 1u );
+			stack[ stack_size++ ]= node.first + near_child;
+		}
+	}
+
+	for( unsigned int i= 0; i < count; i++ )
+		out_occluded[i]=
+			( ( groups[ i / g_packet_group_size ].active_mask >> ( i % g_packet_group_size ) ) & 1u ) == 0u;
+}
+
 void plb_Tracer::GetPolygonNeighbors(
 	const plb_Polygon& polygon,
 	const plb_Vertices& polygon_vertices,
@@ -269,35 +757,41 @@ void plb_Tracer::GetPolygonNeighbors(
 	polygon_bounding_box.max+= threshold_vec;
 	polygon_bounding_box.min-= threshold_vec;
 
-	const TreeNode* node= &tree_.front();
-	while(1)
+	if( tree_.empty() )
+		return;
+
+	unsigned int stack[ g_max_tree_depth + 2u ];
+	unsigned int stack_size= 1;
+	stack[0]= 0;
+
+	while( stack_size > 0 )
 	{
-		// No childs - return
-		if(
-			node->childs[0] == TreeNode::c_no_child &&
-			node->childs[1] == TreeNode::c_no_child )
-			break;
-
-		const m_Vec3& node_normal= g_axis_normals[ size_t(node->plane_orientation) ];
-		const float min_pos= node_normal * polygon_bounding_box.min - node->dist;
-		const float max_pos= node_normal * polygon_bounding_box.max - node->dist;
-
-		if( min_pos < 0.0f && max_pos < 0.0f )
-			node= tree_.data() + node->childs[0];
-		else if( min_pos >= 0.0f && max_pos >= 0.0f )
-			node= tree_.data() + node->childs[1];
-		else
-			break;
+		const TreeNode& node= tree_[ stack[ --stack_size ] ];
 
-		// Check this node surfaces if not last node
-		for( unsigned int i= node->first_surface; i < node->first_surface + node->surface_count; i++ )
+		bool intersects= true;
+		for( unsigned int j= 0; j < 3; j++ )
 		{
-			if( BBoxIntersectSurface( polygon_bounding_box, surfaces_[i] ) )
-				out_surfaces_list.push_back(i);
+			if( node.bb_max.ToArr()[j] < polygon_bounding_box.min.ToArr()[j] ||
+				polygon_bounding_box.max.ToArr()[j] < node.bb_min.ToArr()[j] )
+				intersects= false;
 		}
-	}
+		if( !intersects )
+			continue;
 
-	AddIntersectedSurfacesToList_r( *node, polygon_bounding_box, out_surfaces_list );
+		if( node.surface_count > 0 )
+		{
+			for( unsigned int i= node.first; i < node.first + node.surface_count; i++ )
+			{
+				if( BBoxIntersectSurface( polygon_bounding_box, surfaces_[i] ) )
+					out_surfaces_list.push_back(i);
+			}
+		}
+		else
+		{
+			stack[ stack_size++ ]= node.first + 1u;
+			stack[ stack_size++ ]= node.first;
+		}
+	}
 }
 
 void plb_Tracer::GetPlaneIntersections(
@@ -399,8 +893,23 @@ void plb_Tracer::CheckSurfaceCollision(
 
 			if( data.result_count <= data.max_result_count )
 			{
-				data.out_result[ data.result_count - 1u ].normal= surface.normal;
-				data.out_result[ data.result_count - 1u ].pos= intersection_point;
+				TraceResult& result= data.out_result[ data.result_count - 1u ];
+				result.normal= surface.normal;
+				result.pos= intersection_point;
+				result.material_id= surface.material_id;
+				result.surface_index= &surface - surfaces_.data();
+
+				const m_Vec3 barycentric=
+					GetBarycentricCoordinates(
+						vertices_[ index[0] ],
+						vertices_[ index[1] ],
+						vertices_[ index[2] ],
+						intersection_point );
+				result.barycentric= barycentric;
+				result.lightmap_coord=
+					lightmap_coords_[ index[0] ] * barycentric.x +
+					lightmap_coords_[ index[1] ] * barycentric.y +
+					lightmap_coords_[ index[2] ] * barycentric.z;
 			}
 
 			return;
@@ -409,14 +918,53 @@ void plb_Tracer::CheckSurfaceCollision(
 
 }
 
-void plb_Tracer::CheckCollision_r( TraceRequestData& data, const TreeNode& node ) const
+bool plb_Tracer::SegmentIntersectNode( const TraceRequestData& data, const TreeNode& node ) const
 {
-	for( unsigned int i= node.first_surface; i < node.first_surface + node.surface_count; i++ )
-		CheckSurfaceCollision( data, surfaces_[i] );
+	// Slabs test. Node box extended a bit, because intersections near segment ends are counted too.
+	float t_min= 0.0f;
+	float t_max= data.max_t;
+	for( unsigned int j= 0; j < 3; j++ )
+	{
+		const float from= data.from.ToArr()[j];
+		const float inv_dir= data.inv_dir.ToArr()[j];
+		const float t0= ( node.bb_min.ToArr()[j] - g_length_eps - from ) * inv_dir;
+		const float t1= ( node.bb_max.ToArr()[j] + g_length_eps - from ) * inv_dir;
 
-	for( unsigned int c= 0; c < 2; c++ )
-		if( node.childs[c] != TreeNode::c_no_child )
-			CheckCollision_r( data, tree_[ node.childs[c] ] );
+		t_min= std::max( t_min, std::min( t0, t1 ) );
+		t_max= std::min( t_max, std::max( t0, t1 ) );
+	}
+
+	return t_min <= t_max;
+}
+
+bool plb_Tracer::SegmentIntersectTriangle(
+	const m_Vec3& from, const m_Vec3& dir,
+	const unsigned int triangle_index,
+	float& out_t, float& out_u, float& out_v ) const
+{
+	const unsigned int t= triangle_index;
+	const m_Vec3 v0( triangles_.v0[0][t], triangles_.v0[1][t], triangles_.v0[2][t] );
+	const m_Vec3 edge1( triangles_.edge1[0][t], triangles_.edge1[1][t], triangles_.edge1[2][t] );
+	const m_Vec3 edge2( triangles_.edge2[0][t], triangles_.edge2[1][t], triangles_.edge2[2][t] );
+
+	const m_Vec3 p= mVec3Cross( dir, edge2 );
+	const float det= edge1 * p;
+	if( det == 0.0f )
+		return false;
+	const float inv_det= 1.0f / det;
+
+	const m_Vec3 to_origin= from - v0;
+	out_u= ( to_origin * p ) * inv_det;
+	if( !( out_u >= -g_barycentric_eps && out_u <= 1.0f + g_barycentric_eps ) )
+		return false;
+
+	const m_Vec3 q= mVec3Cross( to_origin, edge1 );
+	out_v= ( dir * q ) * inv_det;
+	if( !( out_v >= -g_barycentric_eps && out_u + out_v <= 1.0f + g_barycentric_eps ) )
+		return false;
+
+	out_t= ( edge2 * q ) * inv_det;
+	return out_t >= 0.0f && out_t <= 1.0f;
 }
 
 m_BBox3 plb_Tracer::GetSurfaceBBox( const Surface& surface ) const
@@ -444,188 +992,361 @@ bool plb_Tracer::BBoxIntersectSurface( const m_BBox3& bbox, const Surface& surfa
 	return true;
 }
 
-void plb_Tracer::AddIntersectedSurfacesToList_r(
-	const TreeNode& node,
-	const m_BBox3& bbox,
-	SurfacesList& list ) const
+void plb_Tracer::BuildTree( const unsigned int threads_count )
 {
-	for( unsigned int i= node.first_surface; i < node.first_surface + node.surface_count; i++ )
-	{
-		if( BBoxIntersectSurface( bbox, surfaces_[i] ) )
-			list.push_back(i);
-	}
+	if( surfaces_.empty() )
+		return;
 
-	for( unsigned int c= 0; c < 2; c++ )
-		if( node.childs[c] != TreeNode::c_no_child )
-			AddIntersectedSurfacesToList_r( tree_[ node.childs[c] ], bbox, list );
-}
+	const unsigned int surface_count= surfaces_.size();
 
-void plb_Tracer::BuildTree()
-{
-	GeometrySet geometry;
-	geometry.surfaces= std::move(surfaces_);
-	geometry.vertices= std::move(vertices_);
-	geometry.indeces= std::move(indeces_);
+	BuildSurfaces build_surfaces( surface_count );
+	plbParallelFor(
+		surface_count, threads_count,
+		[&]( const unsigned int begin, const unsigned int end, unsigned int )
+		{
+			for( unsigned int i= begin; i < end; i++ )
+			{
+				const m_BBox3 bbox= GetSurfaceBBox( surfaces_[i] );
+				BuildSurface& build_surface= build_surfaces[i];
+				build_surface.bb_min= bbox.min;
+				build_surface.bb_max= bbox.max;
+				build_surface.center= bbox.Center();
+				build_surface.surface_index= i;
+			}
+		} );
+
+	// Build top of tree in this thread, lower subtrees - in parallel.
+	const unsigned int c_min_surfaces_for_task= 1024;
+	const unsigned int task_max_surfaces=
+		std::max( c_min_surfaces_for_task, surface_count / ( threads_count * 8u ) );
 
+	BuildTasks tasks;
+	tree_.clear();
 	tree_.emplace_back();
+	BuildTreeNode_r(
+		0, 0, surface_count, 0,
+		build_surfaces,
+		tree_,
+		threads_count > 1u ? &tasks : nullptr, task_max_surfaces );
+
+	std::vector<Tree> subtrees( tasks.size() );
+	plbParallelFor(
+		tasks.size(), threads_count,
+		[&]( const unsigned int begin, const unsigned int end, unsigned int )
+		{
+			for( unsigned int t= begin; t < end; t++ )
+			{
+				subtrees[t].emplace_back();
+				BuildTreeNode_r(
+					0, tasks[t].begin, tasks[t].end, tasks[t].depth,
+					build_surfaces,
+					subtrees[t],
+					nullptr, 0 );
+			}
+		} );
 
-	// Calculate bounding box
-	m_BBox3 bounding_box( plb_Constants::max_vec, plb_Constants::min_vec );
+	// Attach subtrees. Root of subtree replaces task node, other nodes are appended.
+	for( unsigned int t= 0; t < tasks.size(); t++ )
+	{
+		const Tree& subtree= subtrees[t];
+		const unsigned int index_shift= tree_.size() - 1u;
 
-	for( const Vertex& vertex : geometry.vertices )
-		bounding_box+= vertex;
+		for( unsigned int i= 0; i < subtree.size(); i++ )
+		{
+			TreeNode node= subtree[i];
+			if( node.surface_count == 0 )
+				node.first+= index_shift;
 
-	// round bounding box coordinates
-	for( unsigned int i= 0; i < 3; i++ )
-	{
-		bounding_box.min.ToArr()[i]= std::ceil ( bounding_box.min.ToArr()[i] );
-		bounding_box.max.ToArr()[i]= std::floor( bounding_box.max.ToArr()[i] );
+			if( i == 0 )
+				tree_[ tasks[t].node_index ]= node;
+			else
+				tree_.push_back( node );
+		}
 	}
 
-	std::vector<unsigned int> used_surfaces_indeces( geometry.surfaces.size() );
-	for( unsigned int& index : used_surfaces_indeces )
-		index= &index - used_surfaces_indeces.data();
-
+	// Place surfaces and its vertices in order of tree leafs.
 	GeometrySet result_geometry;
+	result_geometry.surfaces.reserve( surfaces_.size() );
+	result_geometry.vertices.reserve( vertices_.size() );
+	result_geometry.lightmap_coords.reserve( lightmap_coords_.size() );
+	result_geometry.indeces.reserve( indeces_.size() );
 
-	BuildTreeNode_r(
-		0,
-		bounding_box,
-		geometry,
-		used_surfaces_indeces,
-		TreeNode::PlaneOrientation::z,
-		result_geometry,
-		tree_ );
+	for( const BuildSurface& build_surface : build_surfaces )
+	{
+		const Surface& in_surface= surfaces_[ build_surface.surface_index ];
+
+		result_geometry.surfaces.push_back( in_surface );
+		Surface& out_surface= result_geometry.surfaces.back();
+
+		out_surface.first_index= result_geometry.indeces.size();
+		out_surface.first_vertex= result_geometry.vertices.size();
+
+		for( unsigned int i= 0; i < in_surface.index_count; i++ )
+			result_geometry.indeces.push_back(
+				indeces_[ in_surface.first_index + i ] - in_surface.first_vertex + out_surface.first_vertex );
+
+		for( unsigned int v= 0; v < in_surface.vertex_count; v++ )
+		{
+			result_geometry.vertices.push_back( vertices_[ in_surface.first_vertex + v ] );
+			result_geometry.lightmap_coords.push_back( lightmap_coords_[ in_surface.first_vertex + v ] );
+		}
+	}
 
 	surfaces_= std::move( result_geometry.surfaces );
 	vertices_= std::move( result_geometry.vertices );
+	lightmap_coords_= std::move( result_geometry.lightmap_coords );
 	indeces_= std::move( result_geometry.indeces );
 }
 
+void plb_Tracer::BuildTriangles()
+{
+	unsigned int triangle_count= 0;
+	for( Surface& surface : surfaces_ )
+	{
+		surface.first_triangle= triangle_count;
+		triangle_count+= surface.index_count / 3u;
+	}
+
+	for( unsigned int j= 0; j < 3; j++ )
+	{
+		triangles_.v0[j].resize( triangle_count );
+		triangles_.edge1[j].resize( triangle_count );
+		triangles_.edge2[j].resize( triangle_count );
+	}
+
+	for( const Surface& surface : surfaces_ )
+	{
+		for( unsigned int i= 0; i < surface.index_count / 3u; i++ )
+		{
+			const unsigned int* const index= indeces_.data() + surface.first_index + i * 3u;
+			const unsigned int t= surface.first_triangle + i;
+
+			const m_Vec3& v0= vertices_[ index[0] ];
+			const m_Vec3 edge1= vertices_[ index[1] ] - v0;
+			const m_Vec3 edge2= vertices_[ index[2] ] - v0;
+
+			for( unsigned int j= 0; j < 3; j++ )
+			{
+				triangles_.v0[j][t]= v0.ToArr()[j];
+				triangles_.edge1[j][t]= edge1.ToArr()[j];
+				triangles_.edge2[j][t]= edge2.ToArr()[j];
+			}
+		}
+	}
+}
+
 void plb_Tracer::BuildTreeNode_r(
-	unsigned int node_index,
-	const m_BBox3& node_bounding_box,
-	const GeometrySet& in_geometry,
-	std::vector<unsigned int>& used_surfaces_indeces,
-	TreeNode::PlaneOrientation plane_orientation,
-	GeometrySet& out_geometry,
-	Tree& out_tree ) const
+	const unsigned int node_index,
+	const unsigned int begin, const unsigned int end,
+	const unsigned int depth,
+	BuildSurfaces& build_surfaces,
+	Tree& out_tree,
+	BuildTasks* const out_tasks,
+	const unsigned int task_max_surfaces ) const
 {
-	// TODO - profile this
-	const unsigned int c_min_surfaces_for_node= 16;
+	const unsigned int c_bin_count= 16;
+	const unsigned int c_max_leaf_surfaces= 8;
+	// Cost of node traversal relative to cost of surface check.
+	const float c_traversal_cost= 1.0f;
 
-	auto insert_surface=
-	[&]( const Surface& in_surface ) mutable -> void
+	struct Bounds
 	{
-		out_geometry.surfaces.emplace_back();
-		Surface& out_surface= out_geometry.surfaces.back();
+		float min[3];
+		float max[3];
 
-		out_surface.normal= in_surface.normal;
-		out_surface.index_count= in_surface.index_count;
-		out_surface.vertex_count= in_surface.vertex_count;
+		void Reset()
+		{
+			min[0]= min[1]= min[2]= plb_Constants::max_float;
+			max[0]= max[1]= max[2]= plb_Constants::min_float;
+		}
 
-		const unsigned int first_index= out_geometry.indeces.size();
-		const unsigned int first_vertex= out_geometry.vertices.size();
-		out_geometry.indeces.resize( first_index + out_surface.index_count );
-		out_geometry.vertices.resize( first_vertex + out_surface.vertex_count );
+		void Add( const m_Vec3& bb_min, const m_Vec3& bb_max )
+		{
+			for( unsigned int j= 0; j < 3; j++ )
+			{
+				min[j]= std::min( min[j], bb_min.ToArr()[j] );
+				max[j]= std::max( max[j], bb_max.ToArr()[j] );
+			}
+		}
 
-		for( unsigned int i= 0; i < out_surface.index_count; i++ )
-			out_geometry.indeces[ first_index + i ]=
-				in_geometry.indeces[ in_surface.first_index + i ] -
-				in_surface.first_vertex + first_vertex;
+		void Add( const Bounds& other )
+		{
+			for( unsigned int j= 0; j < 3; j++ )
+			{
+				min[j]= std::min( min[j], other.min[j] );
+				max[j]= std::max( max[j], other.max[j] );
+			}
+		}
 
-		for( unsigned int v= 0; v < out_surface.vertex_count; v++ )
-			out_geometry.vertices[ first_vertex + v ]=
-				in_geometry.vertices[ in_surface.first_vertex + v ];
+		float HalfArea() const
+		{
+			const float size[3]= { max[0] - min[0], max[1] - min[1], max[2] - min[2] };
+			return size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+		}
+	};
 
-		out_surface.first_index= first_index;
-		out_surface.first_vertex= first_vertex;
+	struct Bin
+	{
+		Bounds bounds;
+		unsigned int count;
 	};
 
-	TreeNode* node= out_tree.data() + node_index;
+	const unsigned int count= end - begin;
+
+	Bounds bounds, centers_bounds;
+	bounds.Reset();
+	centers_bounds.Reset();
+	for( unsigned int i= begin; i < end; i++ )
+	{
+		const BuildSurface& surface= build_surfaces[i];
+		bounds.Add( surface.bb_min, surface.bb_max );
+		centers_bounds.Add( surface.center, surface.center );
+	}
 
-	const m_Vec3& node_plane_normal= g_axis_normals[ size_t(plane_orientation) ];
+	TreeNode& node= out_tree[ node_index ];
+	node.bb_min= m_Vec3( bounds.min );
+	node.bb_max= m_Vec3( bounds.max );
+	node.first= begin;
+	node.surface_count= count;
+	node.split_axis= 0;
 
-	node->plane_orientation= plane_orientation;
-	node->dist= node_plane_normal * node_bounding_box.Center();
+	if( count <= 1u || depth >= g_max_tree_depth )
+		return;
 
-	// Leaf
-	if( used_surfaces_indeces.size() < c_min_surfaces_for_node )
+	// Find best split, using surface area heuristic with binning by surface centers.
+	// Small nodes use less bins - there is no sense to have more bins, than surfaces.
+	const unsigned int bin_count= std::min( c_bin_count, count );
+	float bin_scale[3];
+	for( unsigned int axis= 0; axis < 3; axis++ )
 	{
-		node->childs[0]= node->childs[1]= TreeNode::c_no_child;
-		node->first_surface= out_geometry.surfaces.size();
-		node->surface_count= used_surfaces_indeces.size();
+		const float extent= centers_bounds.max[axis] - centers_bounds.min[axis];
+		bin_scale[axis]= extent > 0.0f ? float(bin_count) / extent : 0.0f;
+	}
 
-		for( unsigned int i= 0; i < node->surface_count; i++ )
-			insert_surface( in_geometry.surfaces[ used_surfaces_indeces[i] ] );
+	const auto get_bin=
+	[&]( const BuildSurface& surface, const unsigned int axis ) -> unsigned int
+	{
+		const float pos= ( surface.center.ToArr()[axis] - centers_bounds.min[axis] ) * bin_scale[axis];
+		return std::min( static_cast<unsigned int>( pos ), bin_count - 1u );
+	};
+
+	Bin bins[3][ c_bin_count ];
+	for( unsigned int axis= 0; axis < 3; axis++ )
+	for( unsigned int b= 0; b < bin_count; b++ )
+	{
+		bins[axis][b].bounds.Reset();
+		bins[axis][b].count= 0;
 	}
-	else // Node
+
+	for( unsigned int i= begin; i < end; i++ )
 	{
-		std::vector<unsigned int> child_surfaces_indeces[2];
+		const BuildSurface& surface= build_surfaces[i];
+		for( unsigned int axis= 0; axis < 3; axis++ )
+		{
+			Bin& bin= bins[axis][ get_bin( surface, axis ) ];
+			bin.bounds.Add( surface.bb_min, surface.bb_max );
+			bin.count++;
+		}
+	}
 
-		node->first_surface= out_geometry.surfaces.size();
-		node->surface_count= 0;
-		node->childs[0]= out_tree.size();
-		node->childs[1]= out_tree.size() + 1;
+	float best_cost= plb_Constants::max_float;
+	unsigned int best_axis= 3;
+	unsigned int best_split= 0; // First bin of right part.
 
-		out_tree.resize( out_tree.size() + 2 );
-		// Update pointer after vector resize.
-		node= out_tree.data() + node_index;
+	for( unsigned int axis= 0; axis < 3; axis++ )
+	{
+		if( bin_scale[axis] == 0.0f )
+			continue;
 
-		for( const unsigned int in_surface_index : used_surfaces_indeces )
+		// Sweep from right to left, calculate cost of right parts.
+		float right_cost[ c_bin_count ];
+		Bounds right_bounds;
+		right_bounds.Reset();
+		unsigned int right_count= 0;
+		for( unsigned int b= bin_count - 1u; b > 0u; b-- )
 		{
-			unsigned int minus_vertex_count= 0;
-			unsigned int plus_vertex_count= 0;
+			const Bin& bin= bins[axis][b];
+			if( bin.count > 0 )
+			{
+				right_bounds.Add( bin.bounds );
+				right_count+= bin.count;
+			}
+			right_cost[b]= right_count > 0 ? float(right_count) * right_bounds.HalfArea() : -1.0f;
+		}
 
-			const Surface& surface= in_geometry.surfaces[ in_surface_index ];
-			for( unsigned int i= 0; i < surface.index_count; i++ )
+		Bounds left_bounds;
+		left_bounds.Reset();
+		unsigned int left_count= 0;
+		for( unsigned int b= 1; b < bin_count; b++ )
+		{
+			const Bin& bin= bins[axis][ b - 1u ];
+			if( bin.count > 0 )
 			{
-				const Vertex& vertex=
-					in_geometry.vertices[ in_geometry.indeces[ surface.first_index + i ] ];
+				left_bounds.Add( bin.bounds );
+				left_count+= bin.count;
+			}
+			if( left_count == 0 || right_cost[b] < 0.0f )
+				continue;
 
-				const float signed_distance_to_node_plane=
-					vertex * node_plane_normal - node->dist;
+			const float cost= float(left_count) * left_bounds.HalfArea() + right_cost[b];
+			if( cost < best_cost )
+			{
+				best_cost= cost;
+				best_axis= axis;
+				best_split= b;
+			}
+		}
+	} // for axis
 
-				if( signed_distance_to_node_plane < 0.0f )
-					minus_vertex_count++;
-				else
-					plus_vertex_count++;
+	if( best_axis == 3 )
+		return; // All centers are same - can not split.
 
-			} // for surface indeces
+	const float node_area= bounds.HalfArea();
+	const float split_cost=
+		c_traversal_cost + ( node_area > 0.0f ? best_cost / node_area : float(count) );
+	if( count <= c_max_leaf_surfaces && split_cost >= float(count) )
+		return;
 
-			if( minus_vertex_count == surface.index_count )
-				child_surfaces_indeces[0].push_back( in_surface_index );
-			else if( plus_vertex_count == surface.index_count )
-				child_surfaces_indeces[1].push_back( in_surface_index );
-			else
+	const unsigned int middle=
+		std::partition(
+			build_surfaces.begin() + begin,
+			build_surfaces.begin() + end,
+			[&]( const BuildSurface& surface )
 			{
-				// Surface splitted by node plane - place it in this node.
-				insert_surface( surface );
-				node->surface_count++;
-			}
+				return get_bin( surface, best_axis ) < best_split;
+			} ) - build_surfaces.begin();
 
-		} // for input surfaces
+	const unsigned int first_child= out_tree.size();
+	out_tree.resize( out_tree.size() + 2u );
 
-		const TreeNode::PlaneOrientation child_planes_orientation=
-			TreeNode::PlaneOrientation( ( size_t(plane_orientation) + 1u ) % 3 );
+	// Reference may be invalidated after resize.
+	TreeNode& inner_node= out_tree[ node_index ];
+	inner_node.first= first_child;
+	inner_node.surface_count= 0;
+	inner_node.split_axis= best_axis;
 
-		for( unsigned int i= 0; i < 2; i++ )
-		{
-			m_BBox3 child_box= node_bounding_box;
-			( i == 0 ? child_box.max : child_box.min )
-				.ToArr()[ size_t(plane_orientation) ]= node->dist;
+	const unsigned int child_ranges[2][2]= { { begin, middle }, { middle, end } };
+	for( unsigned int c= 0; c < 2; c++ )
+	{
+		const unsigned int child_begin= child_ranges[c][0];
+		const unsigned int child_end= child_ranges[c][1];
 
+		if( out_tasks != nullptr && child_end - child_begin <= task_max_surfaces )
+		{
+			BuildTask task;
+			task.node_index= first_child + c;
+			task.begin= child_begin;
+			task.end= child_end;
+			task.depth= depth + 1u;
+			out_tasks->push_back( task );
+		}
+		else
 			BuildTreeNode_r(
-				node->childs[i],
-				child_box,
-				in_geometry,
-				child_surfaces_indeces[i],
-				child_planes_orientation,
-				out_geometry,
-				out_tree );
-
-			// Update pointer after recursive call
-			node= out_tree.data() + node_index;
-		} // for childs
-	} // if node
+				first_child + c,
+				child_begin, child_end,
+				depth + 1u,
+				build_surfaces,
+				out_tree,
+				out_tasks, task_max_surfaces );
+	}
 }
@@ -13,6 +13,13 @@ public:
 	{
 		m_Vec3 pos;
 		m_Vec3 normal;
+		// Interpolated lightmap atlas coordinates of intersection point: u, v, atlas layer.
+		m_Vec3 lightmap_coord;
+		unsigned int material_id;
+		// Index of surface in tracer surfaces list.
+		unsigned int surface_index;
+		// Barycentric coordinates of intersection point inside intersected triangle of surface.
+		m_Vec3 barycentric;
 	};
 
 	typedef std::vector<unsigned int> SurfacesList;
@@ -25,7 +32,11 @@ public:
 
 	typedef std::vector<LineSegment> LineSegments;
 
-	explicit plb_Tracer( const plb_LevelData& level_data );
+	// Maximum number of segments in one packet query.
+	static const unsigned int c_max_packet_size= 16u;
+
+	// threads_count - number of threads for building of tree.
+	plb_Tracer( const plb_LevelData& level_data, unsigned int threads_count );
 	~plb_Tracer();
 
 	// Found intersections between line segment and level geometry.
@@ -44,6 +55,29 @@ public:
 		TraceResult* out_result= nullptr,
 		unsigned int max_result_count= 0 ) const;
 
+	// Finds nearest intersection of line segment with level geometry.
+	// If "skip_back_faces" is true, surfaces, facing in direction of segment, are ignored.
+	// Returns false, if there is no intersection.
+	bool TraceClosest(
+		const m_Vec3& from,
+		const m_Vec3& to,
+		TraceResult& out_result,
+		bool skip_back_faces= false ) const;
+
+	// Checks, if line segment is blocked by level geometry.
+	// Stops at first found intersection, tree nodes are visited in front-to-back order.
+	bool Occluded( const m_Vec3& from, const m_Vec3& to ) const;
+
+	// Checks, if line segments are blocked by level geometry.
+	// Segments are traced together, in groups of 4, using SIMD instructions (if available).
+	// Tracing of each segment stops at first found intersection.
+	// "count" must be not greater, than c_max_packet_size.
+	void OccludedPacket(
+		const m_Vec3* from,
+		const m_Vec3* to,
+		unsigned int count,
+		bool* out_occluded ) const;
+
 	void GetPolygonNeighbors(
 		const plb_Polygon& polygon,
 		const plb_Vertices& polygon_vertices,
@@ -61,11 +95,15 @@ private:
 	{
 		m_Vec3 normal;
 
+		unsigned int material_id;
+
 		unsigned int first_index;
 		unsigned int first_vertex;
 
 		unsigned short index_count;
 		unsigned short vertex_count;
+
+		unsigned int first_triangle; // Triangle count is index_count / 3.
 	};
 
 	typedef std::vector<Surface> Surfaces;
@@ -74,39 +112,69 @@ private:
 	typedef std::vector<Vertex> Vertices;
 	typedef std::vector<unsigned int> Indeces;
 
+	// u, v, atlas layer. One per vertex.
+	typedef m_Vec3 LightmapCoord;
+	typedef std::vector<LightmapCoord> LightmapCoords;
+
 	struct GeometrySet
 	{
 		Surfaces surfaces;
 		Vertices vertices;
+		LightmapCoords lightmap_coords;
 		Indeces indeces;
 	};
 
+	// Node of bounding volume hierarchy.
+	// Childs of inner node are placed together, nodes are stored in flat array in depth-first order.
 	struct TreeNode
 	{
-		enum class PlaneOrientation
-		{
-			x, y, z
-		};
+		m_Vec3 bb_min;
+		// Inner node - index of first child, second child is next. Leaf - index of first surface.
+		unsigned int first;
+		m_Vec3 bb_max;
+		unsigned int surface_count : 30; // Zero for inner nodes.
+		unsigned int split_axis : 2; // Axis of childs separation, for inner nodes.
+	};
 
-		static constexpr unsigned short c_no_child= 0xFFFF;
+	typedef std::vector<TreeNode> Tree;
 
-		unsigned int first_surface;
-		unsigned int surface_count;
+	struct BuildSurface
+	{
+		m_Vec3 bb_min;
+		m_Vec3 bb_max;
+		m_Vec3 center;
+		unsigned int surface_index;
+	};
 
-		// 0 - minus, 1 - plus
-		unsigned short childs[2];
+	typedef std::vector<BuildSurface> BuildSurfaces;
 
-		PlaneOrientation plane_orientation;
-		float dist; // distance to coordinate system center.
+	// Subtree, which is built in separate thread.
+	struct BuildTask
+	{
+		unsigned int node_index;
+		unsigned int begin;
+		unsigned int end;
+		unsigned int depth;
 	};
 
-	typedef std::vector<TreeNode> Tree;
+	typedef std::vector<BuildTask> BuildTasks;
+
+	// Surfaces triangles, prepared for fast intersection tests. Structure of arrays.
+	// First vertex and two edges from it for each triangle. Triangles are placed in order of surfaces.
+	struct Triangles
+	{
+		std::vector<float> v0[3];
+		std::vector<float> edge1[3];
+		std::vector<float> edge2[3];
+	};
 
 	struct TraceRequestData
 	{
 		m_Vec3 from;
 		m_Vec3 to;
 		m_Vec3 normalized_dir;
+		m_Vec3 inv_dir; // 1 / ( to - from )
+		float max_t; // Nodes beyond "from + ( to - from ) * max_t" are skipped.
 
 		unsigned int result_count;
 		unsigned int max_result_count;
@@ -118,31 +186,39 @@ private:
 		TraceRequestData& data,
 		const Surface& surface ) const;
 
-	void CheckCollision_r( TraceRequestData& data, const TreeNode& node ) const;
+	bool SegmentIntersectNode( const TraceRequestData& data, const TreeNode& node ) const;
+
+	// Möller–Trumbore test. Segment is "from + dir * t", t in range [0; 1].
+	// Returns segment parameter and barycentric coordinates of intersection point.
+	bool SegmentIntersectTriangle(
+		const m_Vec3& from, const m_Vec3& dir,
+		unsigned int triangle_index,
+		float& out_t, float& out_u, float& out_v ) const;
 
 	m_BBox3 GetSurfaceBBox( const Surface& surface ) const;
 	bool BBoxIntersectSurface( const m_BBox3& bbox, const Surface& surface ) const;
 
-	void AddIntersectedSurfacesToList_r(
-		const TreeNode& node,
-		const m_BBox3& bbox,
-		SurfacesList& list ) const;
-
-	void BuildTree();
+	void BuildTree( unsigned int threads_count );
+	void BuildTriangles();
 
+	// Builds subtree for surfaces in range [begin; end) of "build_surfaces". Reorders surfaces in this range.
+	// If "out_tasks" is not null, subtrees with no more, than "task_max_surfaces" surfaces, are not built,
+	// but added to tasks list.
 	void BuildTreeNode_r(
 		unsigned int node_index,
-		const m_BBox3& node_bounding_box,
-		const GeometrySet& in_geometry,
-		std::vector<unsigned int>& used_surfaces_indeces,
-		TreeNode::PlaneOrientation plane_orientation,
-		GeometrySet& out_geometry,
-		Tree& out_tree ) const;
+		unsigned int begin, unsigned int end,
+		unsigned int depth,
+		BuildSurfaces& build_surfaces,
+		Tree& out_tree,
+		BuildTasks* out_tasks,
+		unsigned int task_max_surfaces ) const;
 
 private:
 	Surfaces surfaces_;
 	Vertices vertices_;
+	LightmapCoords lightmap_coords_;
 	Indeces indeces_;
 
 	Tree tree_;
+	Triangles triangles_;
 };
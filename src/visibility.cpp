@@ -0,0 +1,50 @@
+#include "visibility.hpp"
+
+int plbGetPointCluster( const plb_VisibilityData& visibility, const m_Vec3& pos )
+{
+	if( visibility.nodes.empty() )
+		return -1;
+
+	int node_index= 0;
+	while( node_index >= 0 )
+	{
+		const plb_VisibilityData::Node& node= visibility.nodes[ node_index ];
+		const float dist= pos.x * node.plane[0] + pos.y * node.plane[1] + pos.z * node.plane[2] - node.plane[3];
+		node_index= node.children[ dist > 0.0f ? 0 : 1 ];
+	}
+
+	const unsigned int leaf= static_cast<unsigned int>( -1 - node_index );
+	if( leaf >= visibility.leafs_clusters.size() )
+		return -1;
+
+	return visibility.leafs_clusters[ leaf ];
+}
+
+bool plbGetVisibleClustersMask(
+	const plb_VisibilityData& visibility,
+	const m_Vec3* const points,
+	const unsigned int point_count,
+	std::vector<unsigned char>& out_mask )
+{
+	if( visibility.cluster_count == 0u )
+		return false;
+
+	out_mask.assign( visibility.cluster_row_size, 0u );
+
+	for( unsigned int i= 0; i < point_count; i++ )
+	{
+		const int cluster= plbGetPointCluster( visibility, points[i] );
+		if( cluster < 0 )
+			return false;
+
+		const unsigned char* const row=
+			visibility.clusters_visibility.data() + static_cast<unsigned int>(cluster) * visibility.cluster_row_size;
+		for( unsigned int j= 0; j < visibility.cluster_row_size; j++ )
+			out_mask[j]|= row[j];
+
+		// Cluster is always visible from itself, even if visibility data says something else.
+		out_mask[ cluster >> 3 ]|= 1u << ( cluster & 7 );
+	}
+
+	return true;
+}
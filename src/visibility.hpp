@@ -0,0 +1,18 @@
+#pragma once
+#include <vector>
+
+#include <vec.hpp>
+
+#include "formats.hpp"
+
+// Returns cluster of point, or -1, if there is no visibility data or point is outside of level.
+int plbGetPointCluster( const plb_VisibilityData& visibility, const m_Vec3& pos );
+
+// Writes to out_mask bits of clusters, potentially visible from any of given points.
+// Returns false, if visibility can not be calculated (no visibility data, one of points outside of level).
+// In such case everything should be treated as visible.
+bool plbGetVisibleClustersMask(
+	const plb_VisibilityData& visibility,
+	const m_Vec3* points,
+	unsigned int point_count,
+	std::vector<unsigned char>& out_mask );
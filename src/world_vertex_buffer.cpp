@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
 #include "curves.hpp"
+#include "profiler.hpp"
 
 #include "world_vertex_buffer.hpp"
 
@@ -48,6 +50,8 @@ plb_WorldVertexBuffer::plb_WorldVertexBuffer( const plb_LevelData& level_data )
 	PrepareLuminousPolygons( level_data, combined_vertices, normals, index_buffer );
 	PrepareNoShadowLuminousPolygons( level_data, combined_vertices, normals, index_buffer );
 
+	PrepareClusteredPolygonGroups( level_data, index_buffer );
+
 	// Load to GPU
 	polygon_buffer_.VertexData(
 		combined_vertices.data(),
@@ -69,6 +73,12 @@ plb_WorldVertexBuffer::plb_WorldVertexBuffer( const plb_LevelData& level_data )
 	glBindBuffer( GL_ARRAY_BUFFER, normals_buffer_id_ );
 	glBufferData( GL_ARRAY_BUFFER, normals.size() * sizeof(plb_Normal), normals.data(), GL_STATIC_DRAW );
 
+	plbProfilerAddCounter(
+		plb_ProfilerCounter::BytesUploaded,
+		combined_vertices.size() * sizeof(plb_Vertex) +
+		index_buffer.size() * sizeof(unsigned int) +
+		normals.size() * sizeof(plb_Normal) );
+
 	glEnableVertexAttribArray( Attrib::Normal );
 	glVertexAttribPointer( Attrib::Normal, 3, GL_BYTE, true, sizeof(plb_Normal), NULL );
 
@@ -80,35 +90,184 @@ plb_WorldVertexBuffer::~plb_WorldVertexBuffer()
 	glDeleteBuffers( 1, &normals_buffer_id_ );
 }
 
-void plb_WorldVertexBuffer::Draw( PolygonType type ) const
+void plb_WorldVertexBuffer::Draw( PolygonType type, const unsigned char* const visible_clusters_mask ) const
 {
-	Draw( 1u << static_cast<unsigned int>(type) );
+	Draw( 1u << static_cast<unsigned int>(type), visible_clusters_mask );
 }
 
-void plb_WorldVertexBuffer::Draw( const std::initializer_list<PolygonType>& types ) const
+void plb_WorldVertexBuffer::Draw( const std::initializer_list<PolygonType>& types, const unsigned char* const visible_clusters_mask ) const
 {
 	unsigned int mask= 0;
 	for( PolygonType type : types )
 		mask|= 1u << static_cast<unsigned int>( type );
 
-	Draw( mask );
+	Draw( mask, visible_clusters_mask );
 }
 
-void plb_WorldVertexBuffer::Draw( const unsigned int polygon_types_flags ) const
+void plb_WorldVertexBuffer::Draw( const unsigned int polygon_types_flags, const unsigned char* const visible_clusters_mask ) const
 {
 	polygon_buffer_.Bind();
 
 	for( unsigned int i= 0; i < static_cast<unsigned int>(PolygonType::NumTypes); i++ )
 	{
-		if( polygon_types_flags & ( 1 << i ) )
+		if( ( polygon_types_flags & ( 1 << i ) ) == 0 )
+			continue;
+
+		const ClusteredPolygonGroup& clustered_group= clustered_polygon_groups_[i];
+		if( visible_clusters_mask == nullptr || clustered_group.clusters_offsets.empty() )
+		{
+			DrawIndeces( polygon_groups_[i].offset, polygon_groups_[i].size );
+			continue;
+		}
+
+		DrawIndeces( clustered_group.unclustered.offset, clustered_group.unclustered.size );
+
+		// Indeces of clusters are placed sequentially, so, draw consecutive visible clusters together.
+		unsigned int c= 0;
+		while( c < cluster_count_ )
+		{
+			if( ( visible_clusters_mask[ c >> 3 ] & ( 1 << ( c & 7 ) ) ) == 0 )
+			{
+				c++;
+				continue;
+			}
+
+			const unsigned int first_cluster= c;
+			while( c < cluster_count_ && ( visible_clusters_mask[ c >> 3 ] & ( 1 << ( c & 7 ) ) ) != 0 )
+				c++;
+
+			DrawIndeces(
+				clustered_group.clusters_offsets[ first_cluster ],
+				clustered_group.clusters_offsets[c] - clustered_group.clusters_offsets[ first_cluster ] );
+		}
+	}
+}
+
+void plb_WorldVertexBuffer::DrawIndeces( const unsigned int first_index, const unsigned int index_count ) const
+{
+	if( index_count == 0u )
+		return;
+
+	glDrawElements(
+		GL_TRIANGLES,
+		index_count,
+		GL_UNSIGNED_INT,
+		reinterpret_cast<GLvoid*>( first_index * sizeof(unsigned int) ) );
+
+	plbProfilerAddCounter( plb_ProfilerCounter::TrianglesDrawn, index_count / 3u );
+}
+
+void plb_WorldVertexBuffer::AddSurfaceIndeces(
+	const unsigned int surface,
+	const PolygonType group,
+	const unsigned int first_index,
+	const unsigned int index_count )
+{
+	SurfaceIndeces surface_indeces;
+	surface_indeces.surface= surface;
+	surface_indeces.group= static_cast<unsigned int>(group);
+	surface_indeces.first_index= first_index;
+	surface_indeces.index_count= index_count;
+	surfaces_indeces_.push_back( surface_indeces );
+}
+
+void plb_WorldVertexBuffer::PrepareClusteredPolygonGroups(
+	const plb_LevelData& level_data,
+	std::vector<unsigned int>& indeces )
+{
+	const plb_VisibilityData& visibility= level_data.visibility;
+	if( visibility.cluster_count == 0u || visibility.clusters_surfaces.empty() )
+	{
+		surfaces_indeces_.clear();
+		return;
+	}
+
+	cluster_count_= visibility.cluster_count;
+
+	const unsigned int surface_count= level_data.polygons.size() + level_data.curved_surfaces.size();
+
+	std::vector<bool> surface_is_clustered( surface_count, false );
+	for( const unsigned int surface : visibility.clusters_surfaces )
+		surface_is_clustered[ surface ]= true;
+
+	// Sort surfaces ranges by surface, but keep order of ranges of each surface.
+	std::vector<unsigned int> surfaces_ranges_offsets( surface_count + 1u, 0u );
+	for( const SurfaceIndeces& surface_indeces : surfaces_indeces_ )
+		surfaces_ranges_offsets[ surface_indeces.surface + 1u ]++;
+	for( unsigned int s= 0; s < surface_count; s++ )
+		surfaces_ranges_offsets[ s + 1u ]+= surfaces_ranges_offsets[s];
+
+	std::vector<unsigned int> surfaces_ranges( surfaces_indeces_.size() );
+	{
+		std::vector<unsigned int> surfaces_ranges_counters( surfaces_ranges_offsets.begin(), surfaces_ranges_offsets.end() - 1 );
+		for( unsigned int i= 0; i < surfaces_indeces_.size(); i++ )
+			surfaces_ranges[ surfaces_ranges_counters[ surfaces_indeces_[i].surface ]++ ]= i;
+	}
+
+	// Source indeces are already in buffer, so, copy them after resizing.
+	const auto copy_indeces=
+	[&]( const unsigned int first_index, const unsigned int index_count )
+	{
+		const unsigned int dst= indeces.size();
+		indeces.resize( dst + index_count );
+		std::copy(
+			indeces.begin() + first_index,
+			indeces.begin() + first_index + index_count,
+			indeces.begin() + dst );
+	};
+
+	for( unsigned int g= 0; g < static_cast<unsigned int>(PolygonType::NumTypes); g++ )
+	{
+		const PolygonGroup& group= polygon_groups_[g];
+		ClusteredPolygonGroup& clustered_group= clustered_polygon_groups_[g];
+
+		bool has_clustered_surfaces= false;
+		for( const SurfaceIndeces& surface_indeces : surfaces_indeces_ )
+			if( surface_indeces.group == g && surface_is_clustered[ surface_indeces.surface ] )
+			{
+				has_clustered_surfaces= true;
+				break;
+			}
+		if( !has_clustered_surfaces )
+			continue;
+
+		// Copy all group indeces, except indeces of clustered surfaces.
+		// Surfaces ranges of each group are sorted by first index.
+		clustered_group.unclustered.offset= indeces.size();
+		unsigned int current_index= group.offset;
+		for( const SurfaceIndeces& surface_indeces : surfaces_indeces_ )
 		{
-			glDrawElements(
-				GL_TRIANGLES,
-				polygon_groups_[i].size,
-				GL_UNSIGNED_INT,
-				reinterpret_cast<GLvoid*>( polygon_groups_[i].offset * sizeof(unsigned int) ) );
+			if( surface_indeces.group != g || !surface_is_clustered[ surface_indeces.surface ] )
+				continue;
+
+			copy_indeces( current_index, surface_indeces.first_index - current_index );
+			current_index= surface_indeces.first_index + surface_indeces.index_count;
 		}
+		copy_indeces( current_index, group.offset + group.size - current_index );
+		clustered_group.unclustered.size= indeces.size() - clustered_group.unclustered.offset;
+
+		// Copy indeces of surfaces of each cluster.
+		clustered_group.clusters_offsets.resize( visibility.cluster_count + 1u );
+		for( unsigned int c= 0; c < visibility.cluster_count; c++ )
+		{
+			clustered_group.clusters_offsets[c]= indeces.size();
+
+			for( unsigned int i= visibility.clusters_surfaces_offsets[c]; i < visibility.clusters_surfaces_offsets[ c + 1u ]; i++ )
+			{
+				const unsigned int surface= visibility.clusters_surfaces[i];
+				for( unsigned int r= surfaces_ranges_offsets[ surface ]; r < surfaces_ranges_offsets[ surface + 1u ]; r++ )
+				{
+					const SurfaceIndeces& surface_indeces= surfaces_indeces_[ surfaces_ranges[r] ];
+					if( surface_indeces.group == g )
+						copy_indeces( surface_indeces.first_index, surface_indeces.index_count );
+				}
+			}
+		}
+		clustered_group.clusters_offsets[ visibility.cluster_count ]= indeces.size();
 	}
+
+	surfaces_indeces_.clear();
+	surfaces_indeces_.shrink_to_fit();
 }
 
 
@@ -135,10 +294,13 @@ void plb_WorldVertexBuffer::PrepareWorldCommonPolygons(
 		if( material.cast_alpha_shadow )
 			continue;
 
+		const unsigned int first_index= indeces.size();
 		indeces.insert(
 			indeces.end(),
 			level_data.polygons_indeces.begin() + poly.first_index,
 			level_data.polygons_indeces.begin() + poly.first_index + poly.index_count );
+
+		AddSurfaceIndeces( &poly - level_data.polygons.data(), PolygonType::WorldCommon, first_index, poly.index_count );
 	} // for polygons
 
 	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
@@ -150,7 +312,12 @@ void plb_WorldVertexBuffer::PrepareWorldCommonPolygons(
 		if( material.cast_alpha_shadow )
 			continue;
 
+		const unsigned int first_index= indeces.size();
 		GenCurveMesh( curve, level_data.curved_surfaces_vertices, vertices, indeces, normals );
+
+		AddSurfaceIndeces(
+			level_data.polygons.size() + ( &curve - level_data.curved_surfaces.data() ), PolygonType::WorldCommon,
+			first_index, indeces.size() - first_index );
 	} // for curves
 
 	polygon_groups_[ int(PolygonType::WorldCommon) ].size= indeces.size() - index_cout_before;
@@ -229,10 +396,13 @@ void plb_WorldVertexBuffer::PrepareNoShadowPolygons(
 			( material.luminosity > 0.0f && !material.split_to_point_lights ) )
 			continue;
 
+		const unsigned int first_index= indeces.size();
 		indeces.insert(
 			indeces.end(),
 			level_data.polygons_indeces.begin() + poly.first_index,
 			level_data.polygons_indeces.begin() + poly.first_index + poly.index_count );
+
+		AddSurfaceIndeces( &poly - level_data.polygons.data(), PolygonType::NoShadow, first_index, poly.index_count );
 	} // for polygons
 
 	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
@@ -244,7 +414,12 @@ void plb_WorldVertexBuffer::PrepareNoShadowPolygons(
 		if( material.cast_alpha_shadow || material.luminosity > 0.0f )
 			continue;
 
+		const unsigned int first_index= indeces.size();
 		GenCurveMesh( curve, level_data.curved_surfaces_vertices, vertices, indeces, normals );
+
+		AddSurfaceIndeces(
+			level_data.polygons.size() + ( &curve - level_data.curved_surfaces.data() ), PolygonType::NoShadow,
+			first_index, indeces.size() - first_index );
 	} // for curves
 
 	PrepareModelsPolygons(
@@ -279,10 +454,13 @@ void plb_WorldVertexBuffer::PrepareAlphaShadowPolygons(
 		if( !material.cast_alpha_shadow )
 			continue;
 
+		const unsigned int first_index= indeces.size();
 		indeces.insert(
 			indeces.end(),
 			level_data.polygons_indeces.begin() + poly.first_index,
 			level_data.polygons_indeces.begin() + poly.first_index + poly.index_count );
+
+		AddSurfaceIndeces( &poly - level_data.polygons.data(), PolygonType::AlphaShadow, first_index, poly.index_count );
 	} // for polygons
 
 	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
@@ -291,7 +469,12 @@ void plb_WorldVertexBuffer::PrepareAlphaShadowPolygons(
 		if( !material.cast_alpha_shadow )
 			continue;
 
+		const unsigned int first_index= indeces.size();
 		GenCurveMesh( curve, level_data.curved_surfaces_vertices, vertices, indeces, normals );
+
+		AddSurfaceIndeces(
+			level_data.polygons.size() + ( &curve - level_data.curved_surfaces.data() ), PolygonType::AlphaShadow,
+			first_index, indeces.size() - first_index );
 	} // for curves
 
 	PrepareModelsPolygons(
@@ -393,6 +576,8 @@ void plb_WorldVertexBuffer::PrepareLuminousPolygons(
 				( level_data.polygons_indeces[ poly.first_index + i ] - poly.first_vertex_number ) +
 				first_vertex;
 		}
+
+		AddSurfaceIndeces( &poly - level_data.polygons.data(), PolygonType::Luminous, indeces.size() - poly.index_count, poly.index_count );
 	} // for polygons
 
 	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
@@ -407,8 +592,13 @@ void plb_WorldVertexBuffer::PrepareLuminousPolygons(
 		const plb_ImageInfo& texture= level_data.textures[ material.light_texture_number ];
 
 		const unsigned int vertices_before= vertices.size();
+		const unsigned int first_index= indeces.size();
 		GenCurveMesh( curve, level_data.curved_surfaces_vertices, vertices, indeces, normals );
 
+		AddSurfaceIndeces(
+			level_data.polygons.size() + ( &curve - level_data.curved_surfaces.data() ), PolygonType::Luminous,
+			first_index, indeces.size() - first_index );
+
 		for( unsigned int v= vertices_before; v < vertices.size(); v++ )
 		{
 			plb_Vertex& vertex= vertices[v];
@@ -490,6 +680,8 @@ void plb_WorldVertexBuffer::PrepareNoShadowLuminousPolygons(
 				( level_data.polygons_indeces[ poly.first_index + i ] - poly.first_vertex_number ) +
 				first_vertex;
 		}
+
+		AddSurfaceIndeces( &poly - level_data.polygons.data(), PolygonType::NoShadowLuminous, indeces.size() - poly.index_count, poly.index_count );
 	} // for polygons
 
 	for( const plb_CurvedSurface& curve : level_data.curved_surfaces )
@@ -504,8 +696,13 @@ void plb_WorldVertexBuffer::PrepareNoShadowLuminousPolygons(
 		const plb_ImageInfo& texture= level_data.textures[ material.light_texture_number ];
 
 		const unsigned int vertices_before= vertices.size();
+		const unsigned int first_index= indeces.size();
 		GenCurveMesh( curve, level_data.curved_surfaces_vertices, vertices, indeces, normals );
 
+		AddSurfaceIndeces(
+			level_data.polygons.size() + ( &curve - level_data.curved_surfaces.data() ), PolygonType::NoShadowLuminous,
+			first_index, indeces.size() - first_index );
+
 		for( unsigned int v= vertices_before; v < vertices.size(); v++ )
 		{
 			plb_Vertex& vertex= vertices[v];
@@ -1,5 +1,6 @@
 #pragma once
 #include <functional>
+#include <vector>
 
 #include <glsl_program.hpp>
 #include <polygon_buffer.hpp>
@@ -51,9 +52,13 @@ public:
 
 	~plb_WorldVertexBuffer();
 
-	void Draw( PolygonType type ) const;
-	void Draw( const std::initializer_list<PolygonType>& types ) const;
-	void Draw( unsigned int polygon_types_flags ) const;
+	// visible_clusters_mask - bits of visibility clusters, which surfaces must be drawn.
+	// Surfaces outside of clusters are drawn always. Null mask - draw everything.
+	// Surfaces, which belong to several visible clusters, may be drawn more than once,
+	// so, masked drawing is correct only for passes without blending.
+	void Draw( PolygonType type, const unsigned char* visible_clusters_mask= nullptr ) const;
+	void Draw( const std::initializer_list<PolygonType>& types, const unsigned char* visible_clusters_mask= nullptr ) const;
+	void Draw( unsigned int polygon_types_flags, const unsigned char* visible_clusters_mask= nullptr ) const;
 
 private:
 	struct PolygonGroup
@@ -62,9 +67,32 @@ private:
 		unsigned int size;
 	};
 
+	// Copy of polygon group indeces, splitted by visibility clusters.
+	struct ClusteredPolygonGroup
+	{
+		PolygonGroup unclustered;
+		std::vector<unsigned int> clusters_offsets; // Size is cluster count + 1. Empty, if there are no clusters.
+	};
+
+	// Range of indeces of one surface (polygon or curve) inside polygon group.
+	struct SurfaceIndeces
+	{
+		unsigned int surface; // polygon index or "polygons count + curve index"
+		unsigned int group;
+		unsigned int first_index;
+		unsigned int index_count;
+	};
+
 	typedef std::function<bool( const plb_LevelModel& model )> ModelAcceptFunction;
 
 private:
+	void AddSurfaceIndeces( unsigned int surface, PolygonType group, unsigned int first_index, unsigned int index_count );
+
+	void PrepareClusteredPolygonGroups(
+		const plb_LevelData& level_data,
+		std::vector<unsigned int>& indeces );
+
+	void DrawIndeces( unsigned int first_index, unsigned int index_count ) const;
 
 	void PrepareWorldCommonPolygons(
 		const plb_LevelData& level_data,
@@ -126,4 +154,9 @@ private:
 	GLuint normals_buffer_id_;
 
 	PolygonGroup polygon_groups_[ static_cast<size_t>(PolygonType::NumTypes) ];
+	ClusteredPolygonGroup clustered_polygon_groups_[ static_cast<size_t>(PolygonType::NumTypes) ];
+	unsigned int cluster_count_= 0;
+
+	// Used only during preparation.
+	std::vector<SurfaceIndeces> surfaces_indeces_;
 };